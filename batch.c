@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "batch.h"
+#include "queue.h"
+
+// Function/type comments for the public interface are in batch.h
+
+// Lines in the pipeline at once, for each worker
+int const batchLinesPerWorker = 4;
+// Progress is reported this often (seconds)
+double const batchReportSeconds = 10.0;
+
+// A line in the pipeline
+typedef struct BatchItem {
+    char line[batchLineSize];
+    char result[batchLineSize];
+    // Set once the result is ready to write (lock held)
+    bool done;
+} BatchItem;
+
+typedef struct Batch {
+    BatchFn fn;
+    // Items for the workers, then a NULL for each to stop
+    BoundedQueue* work;
+    // The window of lines, line n being in items[n % window]
+    BatchItem* items;
+    int window;
+    // Items not in the pipeline, the reader waits for one before reading
+    sem_t freeItems;
+    pthread_mutex_t lock;
+    pthread_cond_t itemDone;
+    // Lines read so far, and whether that is all of them (lock held)
+    long numRead;
+    bool readAll;
+    FILE* out;
+    FILE* report;
+    // Lines written so far (writer thread only), and when writing started
+    long numWritten;
+    double startTime;
+} Batch;
+
+// A worker thread's batch and data
+typedef struct BatchWorker {
+    Batch* batch;
+    void* data;
+} BatchWorker;
+
+/**
+ * @brief Get the time from the monotonic clock
+ *
+ * @return seconds since some fixed point
+ */
+double batch_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Read a line, cutting it short if it doesn't fit
+ *
+ * @param in file to read
+ * @param line write the line here without its newline (batchLineSize chars)
+ * @return true if read, false at the end of the file
+ */
+bool read_line(FILE* in, char* line)
+{
+    if (!fgets(line, batchLineSize, in)) {
+        return false;
+    }
+    size_t len = strlen(line);
+    if (len && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+        return true;
+    }
+    // Skip the rest of a long line
+    int c;
+    while ((c = getc(in)) != EOF && c != '\n') {
+    }
+    return true;
+}
+
+/**
+ * @brief Open the output file to append to, dropping any partly written last
+ * line left by an interrupted run
+ *
+ * @param path file to open, created if it doesn't exist
+ * @param numLines write the number of whole lines already in it here
+ * @return the file, NULL if it couldn't be opened
+ */
+FILE* open_output(const char* path, long* numLines)
+{
+    FILE* out = fopen(path, "a+");
+    if (!out) {
+        return NULL;
+    }
+    rewind(out);
+    long lineEnd = 0;
+    long offset = 0;
+    *numLines = 0;
+    int c;
+    while ((c = getc(out)) != EOF) {
+        offset++;
+        if (c == '\n') {
+            (*numLines)++;
+            lineEnd = offset;
+        }
+    }
+    if (lineEnd < offset && ftruncate(fileno(out), lineEnd) == -1) {
+        fclose(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * @brief Worker thread: runs the batch's function on items until given NULL
+ *
+ * @param data BatchWorker* - the worker
+ * @return unused
+ */
+void* batch_worker_thread(void* data)
+{
+    BatchWorker* worker = (BatchWorker*)data;
+    Batch* batch = worker->batch;
+    BatchItem* item;
+    while ((item = (BatchItem*)queue_pop(batch->work))) {
+        batch->fn(item->line, item->result, worker->data);
+        pthread_mutex_lock(&batch->lock);
+        item->done = true;
+        pthread_cond_broadcast(&batch->itemDone);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Report how many positions have been done and how fast
+ *
+ * @param batch batch to report on
+ * @param finished whether the batch is finished
+ */
+void batch_report(Batch* batch, bool finished)
+{
+    double seconds = batch_now() - batch->startTime;
+    fprintf(batch->report,
+            "uqchessserver: analysed %ld positions%s in %.1f seconds "
+            "(%.1f positions/sec)\n",
+            batch->numWritten, finished ? "" : " so far", seconds,
+            seconds > 0 ? batch->numWritten / seconds : 0.0);
+    fflush(batch->report);
+}
+
+/**
+ * @brief Writer thread: writes results in the order their lines were read,
+ * each as soon as it and every line before it are done
+ *
+ * @param data Batch* - the batch
+ * @return unused
+ */
+void* batch_writer_thread(void* data)
+{
+    Batch* batch = (Batch*)data;
+    double lastReport = batch->startTime;
+    while (true) {
+        BatchItem* item = &batch->items[batch->numWritten % batch->window];
+        pthread_mutex_lock(&batch->lock);
+        while (!item->done
+                && !(batch->readAll && batch->numWritten == batch->numRead)) {
+            pthread_cond_wait(&batch->itemDone, &batch->lock);
+        }
+        bool done = item->done;
+        item->done = false;
+        pthread_mutex_unlock(&batch->lock);
+        if (!done) {
+            return NULL; // every line is written
+        }
+        fprintf(batch->out, "%s\n", item->result);
+        fflush(batch->out);
+        batch->numWritten++;
+        sem_post(&batch->freeItems);
+        if (batch_now() - lastReport >= batchReportSeconds) {
+            lastReport = batch_now();
+            batch_report(batch, false);
+        }
+    }
+}
+
+/**
+ * @brief Read every line into the pipeline, waiting for room in the window
+ * for each, then tell the workers and writer there are no more
+ *
+ * @param batch batch to read for
+ * @param in file to read
+ * @param numWorkers number of worker threads
+ */
+void batch_read(Batch* batch, FILE* in, int numWorkers)
+{
+    while (true) {
+        sem_wait(&batch->freeItems);
+        BatchItem* item = &batch->items[batch->numRead % batch->window];
+        if (!read_line(in, item->line)) {
+            break;
+        }
+        queue_push(batch->work, item);
+        pthread_mutex_lock(&batch->lock);
+        batch->numRead++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+    pthread_mutex_lock(&batch->lock);
+    batch->readAll = true;
+    pthread_cond_broadcast(&batch->itemDone);
+    pthread_mutex_unlock(&batch->lock);
+    for (int i = 0; i < numWorkers; i++) {
+        queue_push(batch->work, NULL);
+    }
+}
+
+/**
+ * @brief Set up a batch with an empty pipeline
+ *
+ * @param fn function run on each line
+ * @param numWorkers number of worker threads
+ * @param out output file
+ * @param report where to report progress
+ * @return the batch
+ */
+Batch* batch_create(BatchFn fn, int numWorkers, FILE* out, FILE* report)
+{
+    Batch* batch = (Batch*)calloc(1, sizeof(Batch));
+    batch->fn = fn;
+    batch->window = numWorkers * batchLinesPerWorker;
+    // Room for every line in the window and a NULL for each worker
+    batch->work = queue_create((size_t)(batch->window + numWorkers));
+    batch->items = (BatchItem*)calloc(batch->window, sizeof(BatchItem));
+    sem_init(&batch->freeItems, 0, (unsigned)batch->window);
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->itemDone, NULL);
+    batch->out = out;
+    batch->report = report;
+    batch->startTime = batch_now();
+    return batch;
+}
+
+BatchStatus batch_run(const char* inPath, const char* outPath, BatchFn fn,
+        void** workers, int numWorkers, FILE* report)
+{
+    FILE* in = fopen(inPath, "r");
+    if (!in) {
+        return BATCH_CANT_READ;
+    }
+    long numDone;
+    FILE* out = open_output(outPath, &numDone);
+    if (!out) {
+        fclose(in);
+        return BATCH_CANT_WRITE;
+    }
+    char skipped[batchLineSize];
+    long numSkipped = 0;
+    while (numSkipped < numDone && read_line(in, skipped)) {
+        numSkipped++;
+    }
+    if (numSkipped) {
+        fprintf(report, "uqchessserver: resuming after %ld positions\n",
+                numSkipped);
+        fflush(report);
+    }
+    Batch* batch = batch_create(fn, numWorkers, out, report);
+    pthread_t writer;
+    pthread_create(&writer, NULL, batch_writer_thread, batch);
+    pthread_t threads[numWorkers];
+    BatchWorker batchWorkers[numWorkers];
+    for (int i = 0; i < numWorkers; i++) {
+        batchWorkers[i].batch = batch;
+        batchWorkers[i].data = workers[i];
+        pthread_create(&threads[i], NULL, batch_worker_thread,
+                &batchWorkers[i]);
+    }
+    batch_read(batch, in, numWorkers);
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_join(writer, NULL);
+    batch_report(batch, true);
+    fclose(in);
+    fclose(out);
+    return BATCH_DONE;
+}
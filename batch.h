@@ -0,0 +1,47 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+// Runs each line of a file of positions through a function on several worker
+// threads, writing the results to another file in the same order: a reader,
+// the workers and a writer, each on its own thread. Only a fixed window of
+// lines is in the pipeline at once (read, being worked on or waiting to be
+// written), so memory use doesn't depend on the size of the file. Output is
+// flushed a line at a time, so a run that is interrupted can be resumed:
+// lines already in the output file are skipped.
+
+// Longest line read or written, including the terminating null. Longer input
+// lines are cut short.
+enum { batchLineSize = 4096 };
+
+// Outcome of a batch
+typedef enum {
+    BATCH_DONE,
+    BATCH_CANT_READ,
+    BATCH_CANT_WRITE
+} BatchStatus;
+
+// Works out the output line for an input line (neither has a newline), on a
+// worker thread, given that worker's data. The result buffer is batchLineSize
+// chars.
+typedef void (*BatchFn)(const char* line, char* result, void* worker);
+
+/**
+ * @brief Run every line of a file through a function, appending the results
+ * to the output file after any lines a previous run left there. Reports
+ * progress and the positions done per second to the given stream.
+ *
+ * @param inPath file to read
+ * @param outPath file to write, created if it doesn't exist
+ * @param fn function run on each line
+ * @param workers data of each worker thread, passed to fn
+ * @param numWorkers number of worker threads
+ * @param report where to report progress
+ * @return BATCH_DONE once every line is written, or which file couldn't be
+ * opened
+ */
+BatchStatus batch_run(const char* inPath, const char* outPath, BatchFn fn,
+        void** workers, int numWorkers, FILE* report);
+
+#endif
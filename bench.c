@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "bench.h"
+
+// Function/type comments for the public interface are in bench.h
+
+char const* const benchKindNames[NUM_BENCH_KINDS]
+        = {"start", "move", "hint", "ping"};
+// Percentiles reported
+int const benchPercentiles[] = {50, 90, 99};
+int const numBenchPercentiles = 3;
+long const nanosPerSecond = 1000000000;
+double const nanosPerMilli = 1e6;
+
+// A timed command sent but not yet answered
+typedef struct Pending {
+    int game;
+    BenchKind kind;
+    long sentAt;
+    struct Pending* next;
+} Pending;
+
+// Latencies measured for one kind of command
+typedef struct {
+    long* nanos;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+struct Bench {
+    pthread_mutex_t lock;
+    // Commands waiting for replies, oldest first
+    Pending* first;
+    Pending* last;
+    Samples samples[NUM_BENCH_KINDS];
+};
+
+Bench* bench_create(void)
+{
+    Bench* bench = (Bench*)calloc(1, sizeof(Bench));
+    pthread_mutex_init(&bench->lock, NULL);
+    return bench;
+}
+
+/**
+ * @brief Get the time from the monotonic clock
+ *
+ * @return nanoseconds since some fixed point
+ */
+long bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)now.tv_sec * nanosPerSecond + now.tv_nsec;
+}
+
+void bench_sent(Bench* bench, int game, BenchKind kind)
+{
+    if (!bench) {
+        return;
+    }
+    Pending* pending = (Pending*)malloc(sizeof(Pending));
+    pending->game = game;
+    pending->kind = kind;
+    pending->next = NULL;
+    pthread_mutex_lock(&bench->lock);
+    pending->sentAt = bench_now();
+    if (bench->last) {
+        bench->last->next = pending;
+    } else {
+        bench->first = pending;
+    }
+    bench->last = pending;
+    pthread_mutex_unlock(&bench->lock);
+}
+
+/**
+ * @brief Add a latency to a kind of command's samples
+ *
+ * @param samples samples to add to
+ * @param nanos latency
+ */
+void add_sample(Samples* samples, long nanos)
+{
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+        samples->nanos = (long*)realloc(
+                samples->nanos, samples->capacity * sizeof(long));
+    }
+    samples->nanos[samples->count++] = nanos;
+}
+
+void bench_answered(Bench* bench, int game, unsigned kinds)
+{
+    if (!bench) {
+        return;
+    }
+    pthread_mutex_lock(&bench->lock);
+    long now = bench_now();
+    Pending** link = &bench->first;
+    Pending* previous = NULL;
+    while (*link
+            && ((*link)->game != game || !(kinds & (1u << (*link)->kind)))) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    Pending* answered = *link;
+    if (answered) {
+        *link = answered->next;
+        if (bench->last == answered) {
+            bench->last = previous;
+        }
+        add_sample(&bench->samples[answered->kind], now - answered->sentAt);
+        free(answered);
+    }
+    pthread_mutex_unlock(&bench->lock);
+}
+
+/**
+ * @brief Compare latencies, for qsort()
+ *
+ * @param a first latency
+ * @param b second latency
+ * @return negative, 0 or positive as a is less than, equal to or greater
+ * than b
+ */
+int compare_nanos(const void* a, const void* b)
+{
+    long first = *(const long*)a;
+    long second = *(const long*)b;
+    return (first > second) - (first < second);
+}
+
+void bench_report(Bench* bench, FILE* stream)
+{
+    if (!bench) {
+        return;
+    }
+    pthread_mutex_lock(&bench->lock);
+    for (int kind = 0; kind < NUM_BENCH_KINDS; kind++) {
+        Samples* samples = &bench->samples[kind];
+        if (samples->count == 0) {
+            continue;
+        }
+        qsort(samples->nanos, samples->count, sizeof(long), compare_nanos);
+        fprintf(stream, "bench %s: %zu", benchKindNames[kind], samples->count);
+        for (int i = 0; i < numBenchPercentiles; i++) {
+            // Nearest rank: the smallest latency at least p% are within
+            size_t rank = (samples->count * benchPercentiles[i] + 99) / 100;
+            fprintf(stream, " p%d %.3fms", benchPercentiles[i],
+                    samples->nanos[rank - 1] / nanosPerMilli);
+        }
+        fprintf(stream, " max %.3fms\n",
+                samples->nanos[samples->count - 1] / nanosPerMilli);
+    }
+    fflush(stream);
+    pthread_mutex_unlock(&bench->lock);
+}
@@ -0,0 +1,57 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+// Round-trip latency of the client's commands, from the user's point of view:
+// the time from a command being sent to the reply answering it being read.
+// Safe to use from both client threads.
+
+// Kinds of commands timed
+typedef enum {
+    BENCH_START,
+    BENCH_MOVE,
+    BENCH_HINT,
+    BENCH_PING,
+    NUM_BENCH_KINDS
+} BenchKind;
+
+typedef struct Bench Bench;
+
+/**
+ * @brief Create a bench with nothing timed yet
+ *
+ * @return the bench
+ */
+Bench* bench_create(void);
+
+/**
+ * @brief Note that a command is about to be sent. Call before sending, so
+ * the reply can't be read first.
+ *
+ * @param bench bench to time with, NULL if not timing (does nothing)
+ * @param game index of the game the command is for
+ * @param kind kind of command
+ */
+void bench_sent(Bench* bench, int game, BenchKind kind);
+
+/**
+ * @brief Note that a reply was read, timing the oldest command of the game
+ * it answers. Replies to commands not timed are ignored.
+ *
+ * @param bench bench to time with, NULL if not timing (does nothing)
+ * @param game index of the game the reply is for
+ * @param kinds kinds of command the reply can answer, a bit (1 << kind) for
+ * each
+ */
+void bench_answered(Bench* bench, int game, unsigned kinds);
+
+/**
+ * @brief Print each kind of command's latency percentiles
+ *
+ * @param bench bench to report, NULL if not timing (does nothing)
+ * @param stream where to print
+ */
+void bench_report(Bench* bench, FILE* stream);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "budget.h"
+#include "prefork.h"
+
+// Function/type comments for the public interface are in budget.h
+
+// An engine in the budget, a free place if its weight is 0
+typedef struct BudgetEngine {
+    int shard;
+    int weight;
+} BudgetEngine;
+
+struct EngineBudget {
+    pthread_mutex_t lock;
+    int hashMb;
+    int threads;
+    unsigned long generation;
+    // Whether having more engines than threads has been reported
+    bool overcommitReported;
+    int maxEngines;
+    BudgetEngine engines[];
+};
+
+EngineBudget* budget_create(
+        int hashMb, int threads, int maxEngines, bool processes)
+{
+    size_t size = sizeof(EngineBudget) + maxEngines * sizeof(BudgetEngine);
+    EngineBudget* budget = (EngineBudget*)(processes ? shared_alloc(size)
+                                                     : calloc(1, size));
+    if (!budget) {
+        return NULL;
+    }
+    if (processes) {
+        shared_mutex_init(&budget->lock);
+    } else {
+        pthread_mutex_init(&budget->lock, NULL);
+    }
+    budget->hashMb = hashMb;
+    budget->threads = threads;
+    budget->generation = 1;
+    budget->maxEngines = maxEngines;
+    return budget;
+}
+
+int budget_add(EngineBudget* budget, int shard, int weight)
+{
+    shared_mutex_lock(&budget->lock);
+    int engine = 0;
+    while (engine < budget->maxEngines && budget->engines[engine].weight) {
+        engine++;
+    }
+    if (engine == budget->maxEngines) {
+        pthread_mutex_unlock(&budget->lock);
+        return -1;
+    }
+    budget->engines[engine].shard = shard;
+    budget->engines[engine].weight = weight;
+    budget->generation++;
+    pthread_mutex_unlock(&budget->lock);
+    return engine;
+}
+
+void budget_clear_shard(EngineBudget* budget, int shard)
+{
+    shared_mutex_lock(&budget->lock);
+    for (int engine = 0; engine < budget->maxEngines; engine++) {
+        if (budget->engines[engine].shard == shard) {
+            budget->engines[engine].weight = 0;
+        }
+    }
+    budget->generation++;
+    pthread_mutex_unlock(&budget->lock);
+}
+
+/**
+ * @brief Count the engines in a budget and add up their weights
+ *
+ * @param budget budget to count
+ * @param totalWeight write the sum of the weights here
+ * @return number of engines
+ */
+int count_engines(EngineBudget* budget, long* totalWeight)
+{
+    int numEngines = 0;
+    *totalWeight = 0;
+    for (int engine = 0; engine < budget->maxEngines; engine++) {
+        if (budget->engines[engine].weight) {
+            numEngines++;
+            *totalWeight += budget->engines[engine].weight;
+        }
+    }
+    return numEngines;
+}
+
+bool budget_check_overcommit(EngineBudget* budget)
+{
+    shared_mutex_lock(&budget->lock);
+    long totalWeight;
+    bool overcommitted = budget->threads
+            && count_engines(budget, &totalWeight) > budget->threads;
+    bool report = overcommitted && !budget->overcommitReported;
+    budget->overcommitReported |= overcommitted;
+    pthread_mutex_unlock(&budget->lock);
+    return report;
+}
+
+/**
+ * @brief Work out an engine's share of a total: 1, plus its weight's share of
+ * what is left once every engine has 1, rounded so the shares add up to the
+ * total (largest remainders, ties to the lower numbered engine, get the
+ * units left over after rounding down)
+ *
+ * @param budget budget the engine is in
+ * @param total total to share, 0 if not limited
+ * @param engine engine's number in the budget
+ * @return the share, 0 if the total isn't limited
+ */
+int share_of(EngineBudget* budget, int total, int engine)
+{
+    long totalWeight;
+    int numEngines = count_engines(budget, &totalWeight);
+    if (total == 0 || numEngines >= total) {
+        return total ? 1 : 0; // no more than 1 each to give
+    }
+    long spare = total - numEngines;
+    long leftOver = spare;
+    long remainder = spare * budget->engines[engine].weight % totalWeight;
+    int ahead = 0; // engines whose remainder comes before this one's
+    for (int other = 0; other < budget->maxEngines; other++) {
+        long weighted = spare * budget->engines[other].weight;
+        if (!budget->engines[other].weight) {
+            continue;
+        }
+        leftOver -= weighted / totalWeight;
+        if (weighted % totalWeight > remainder
+                || (weighted % totalWeight == remainder && other < engine)) {
+            ahead++;
+        }
+    }
+    long share = 1 + spare * budget->engines[engine].weight / totalWeight;
+    return (int)(ahead < leftOver ? share + 1 : share);
+}
+
+unsigned long budget_share(
+        EngineBudget* budget, int engine, int* hashMb, int* threads)
+{
+    shared_mutex_lock(&budget->lock);
+    *hashMb = share_of(budget, budget->hashMb, engine);
+    *threads = share_of(budget, budget->threads, engine);
+    unsigned long generation = budget->generation;
+    pthread_mutex_unlock(&budget->lock);
+    return generation;
+}
+
+unsigned long budget_generation(EngineBudget* budget)
+{
+    shared_mutex_lock(&budget->lock);
+    unsigned long generation = budget->generation;
+    pthread_mutex_unlock(&budget->lock);
+    return generation;
+}
@@ -0,0 +1,81 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stdbool.h>
+
+// A total of engine hash memory and search threads, split between the running
+// engines in proportion to their weights. Every engine needs at least 1 thread
+// and 1 MB, so each gets that and the rest is split by weight, the whole units
+// left over going to the engines with the largest remainders: the shares add
+// up to the total, unless there are more engines than it has units. Every time
+// an engine joins or leaves, the split changes and the budget's generation
+// goes up, so engines can tell when to pick up their new share. Can be in
+// shared memory, for engines in several worker processes.
+
+typedef struct EngineBudget EngineBudget;
+
+/**
+ * @brief Create a budget with no engines
+ *
+ * @param hashMb total hash memory in MB, 0 to leave it to the engines
+ * @param threads total search threads, 0 to leave it to the engines
+ * @param maxEngines most engines that can be in the budget at once
+ * @param processes true if shards are processes, so the budget must be in
+ * shared memory
+ * @return the budget, NULL if shared memory couldn't be allocated
+ */
+EngineBudget* budget_create(
+        int hashMb, int threads, int maxEngines, bool processes);
+
+/**
+ * @brief Add an engine to the budget
+ *
+ * @param budget budget to join
+ * @param shard shard the engine belongs to
+ * @param weight engine's weight, at least 1
+ * @return the engine's number in the budget, -1 if the budget already has
+ * maxEngines engines
+ */
+int budget_add(EngineBudget* budget, int shard, int weight);
+
+/**
+ * @brief Check whether the budget has more engines than threads, so some
+ * threads are shared by engines. Only true the first time it is checked once
+ * that has happened, so it can be reported once.
+ *
+ * @param budget budget to check
+ * @return true if it has just become overcommitted
+ */
+bool budget_check_overcommit(EngineBudget* budget);
+
+/**
+ * @brief Take every engine of a shard out of the budget (they've exited)
+ *
+ * @param budget budget to leave
+ * @param shard shard whose engines are gone
+ */
+void budget_clear_shard(EngineBudget* budget, int shard);
+
+/**
+ * @brief Get an engine's share of the budget
+ *
+ * @param budget budget to share
+ * @param engine engine's number in the budget
+ * @param hashMb write the engine's hash memory here (MB, at least 1), 0 if
+ * the budget doesn't limit memory
+ * @param threads write the engine's threads here (at least 1), 0 if the
+ * budget doesn't limit threads
+ * @return the budget's generation the share is for
+ */
+unsigned long budget_share(
+        EngineBudget* budget, int engine, int* hashMb, int* threads);
+
+/**
+ * @brief Get the budget's generation, which changes whenever the shares do
+ *
+ * @param budget budget to check
+ * @return the generation, never 0
+ */
+unsigned long budget_generation(EngineBudget* budget);
+
+#endif
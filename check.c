@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+
+// Function/type comments for the public interface are in check.h
+
+static int numChecks = 0;
+static int numFailed = 0;
+
+void check(bool passed, const char* what)
+{
+    numChecks++;
+    if (!passed) {
+        numFailed++;
+        fprintf(stderr, "FAILED: %s\n", what);
+    }
+}
+
+int check_report(const char* name)
+{
+    printf("%s: %d of %d checks passed\n", name, numChecks - numFailed,
+            numChecks);
+    return numFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
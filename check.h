@@ -0,0 +1,25 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+
+// Tiny unit check helpers for the test_* programs run by "make check"
+
+/**
+ * @brief Count a check, printing what was checked if it failed
+ *
+ * @param passed whether the check passed
+ * @param what what was checked, e.g. "e7e8q is e8=Q"
+ */
+void check(bool passed, const char* what);
+
+/**
+ * @brief Print how many of the checks passed
+ *
+ * @param name name of the module checked
+ * @return exit status for main: EXIT_SUCCESS if every check passed,
+ * EXIT_FAILURE otherwise
+ */
+int check_report(const char* name);
+
+#endif
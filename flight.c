@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+#include "flight.h"
+
+// Function/type comments for the public interface are in flight.h
+
+// Queries kept at once
+enum { flightSlotBits = 6, numFlightSlots = 1 << flightSlotBits };
+
+// A query's result, empty if result is NULL
+typedef struct FlightSlot {
+    const void* source;
+    uint64_t query;
+    void* result;
+    size_t size;
+    // Last ticket handed out when the result was answered
+    unsigned long answeredAt;
+} FlightSlot;
+
+struct Flights {
+    const unsigned long* tickets;
+    FlightSlot slots[numFlightSlots];
+};
+
+Flights* flights_create(const unsigned long* tickets)
+{
+    Flights* flights = (Flights*)calloc(1, sizeof(Flights));
+    flights->tickets = tickets;
+    return flights;
+}
+
+/**
+ * @brief Get the slot a query goes in
+ *
+ * @param flights queries the slot is in
+ * @param source what answers the query
+ * @param query key of the query
+ * @return the slot
+ */
+FlightSlot* flight_slot(Flights* flights, const void* source, uint64_t query)
+{
+    // Fibonacci hashing mixes the key's bits into the top ones
+    uint64_t hash = (query ^ (uintptr_t)source) * 11400714819323198485ULL;
+    return &flights->slots[hash >> (64 - flightSlotBits)];
+}
+
+bool flights_join(Flights* flights, const void* source, uint64_t query,
+        unsigned long ticket, void* result, size_t size)
+{
+    FlightSlot* slot = flight_slot(flights, source, query);
+    if (!ticket || !slot->result || ticket > slot->answeredAt
+            || slot->source != source || slot->query != query
+            || slot->size != size) {
+        return false;
+    }
+    memcpy(result, slot->result, size);
+    return true;
+}
+
+void flights_land(Flights* flights, const void* source, uint64_t query,
+        const void* result, size_t size)
+{
+    FlightSlot* slot = flight_slot(flights, source, query);
+    if (slot->size != size) {
+        free(slot->result);
+        slot->result = malloc(size);
+        slot->size = size;
+    }
+    slot->query = query;
+    slot->source = source;
+    memcpy(slot->result, result, size);
+    slot->answeredAt = __atomic_load_n(flights->tickets, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,61 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Results of engine queries, shared by the requests that were waiting while
+// the query ran. A shard's engine answers one request at a time, so when many
+// players ask about the same position their requests queue up behind the
+// first and would each send the engine the same query. Requests get tickets
+// (counting up from 1) as they start waiting. A result is kept with the last
+// ticket handed out when it was answered: a request with a ticket no later
+// than that was already waiting, so it shares the result instead of asking
+// again. Requests that come later ask the engine themselves, so a result is
+// never used after the requests waiting for it are done.
+// Queries are looked up by 64-bit keys (e.g. the position's Zobrist hash
+// combined with what is asked about it) and kept in a fixed number of slots,
+// a new query replacing an older one in the same slot. Like an engine's
+// transposition table, queries with the same key are taken to be the same
+// query: with 64 bits, a clash is far too unlikely to be worth comparing
+// anything else. Not thread safe: use under the owner's lock.
+
+typedef struct Flights Flights;
+
+/**
+ * @brief Create an empty set of queries
+ *
+ * @param tickets ticket counter requests are given tickets from, read when a
+ * result is answered
+ * @return the queries
+ */
+Flights* flights_create(const unsigned long* tickets);
+
+/**
+ * @brief Get the result of a query answered while a request was waiting
+ *
+ * @param flights queries to look in
+ * @param source what answers the query (e.g. an engine)
+ * @param query key of the query
+ * @param ticket ticket of the request, 0 if it wasn't waiting (never shares)
+ * @param result copy the result here
+ * @param size size of the result
+ * @return true if copied, false if the request must ask itself
+ */
+bool flights_join(Flights* flights, const void* source, uint64_t query,
+        unsigned long ticket, void* result, size_t size);
+
+/**
+ * @brief Keep the result of a query for the requests waiting for it
+ *
+ * @param flights queries to keep it in
+ * @param source what answered the query
+ * @param query key of the query answered
+ * @param result result to copy
+ * @param size size of the result
+ */
+void flights_land(Flights* flights, const void* source, uint64_t query,
+        const void* result, size_t size);
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include "idmap.h"
+
+// Function/type comments for the public interface are in idmap.h
+
+// A slot of the table, empty if value is NULL
+typedef struct IdMapSlot {
+    long id;
+    void* value;
+} IdMapSlot;
+
+// Open addressing table with linear probing, capacity a power of 2
+struct IdMap {
+    IdMapSlot* slots;
+    size_t capacity;
+    size_t count;
+};
+
+size_t const initialIdMapCapacity = 64;
+
+/**
+ * @brief Get the slot an id would ideally go in
+ *
+ * @param map map the id is for
+ * @param id id to hash
+ * @return slot index
+ */
+size_t idmap_home(IdMap* map, long id)
+{
+    // Fibonacci hashing spreads sequential ids over the table
+    unsigned long hash = (unsigned long)id * 11400714819323198485UL;
+    return (size_t)(hash >> 32) & (map->capacity - 1);
+}
+
+/**
+ * @brief Find the slot holding an id, or the empty slot it would go in
+ *
+ * @param map map to look in
+ * @param id id to find
+ * @return slot index
+ */
+size_t idmap_find(IdMap* map, long id)
+{
+    size_t i = idmap_home(map, id);
+    while (map->slots[i].value && map->slots[i].id != id) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+}
+
+IdMap* idmap_create(void)
+{
+    IdMap* map = (IdMap*)malloc(sizeof(IdMap));
+    map->capacity = initialIdMapCapacity;
+    map->count = 0;
+    map->slots = (IdMapSlot*)calloc(map->capacity, sizeof(IdMapSlot));
+    return map;
+}
+
+/**
+ * @brief Double the size of a map's table
+ *
+ * @param map map to grow
+ */
+void idmap_grow(IdMap* map)
+{
+    IdMapSlot* oldSlots = map->slots;
+    size_t oldCapacity = map->capacity;
+    map->capacity *= 2;
+    map->slots = (IdMapSlot*)calloc(map->capacity, sizeof(IdMapSlot));
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i].value) {
+            map->slots[idmap_find(map, oldSlots[i].id)] = oldSlots[i];
+        }
+    }
+    free(oldSlots);
+}
+
+void idmap_put(IdMap* map, long id, void* value)
+{
+    // Kept at most half full so probes stay short
+    if (2 * (map->count + 1) > map->capacity) {
+        idmap_grow(map);
+    }
+    IdMapSlot* slot = &map->slots[idmap_find(map, id)];
+    if (!slot->value) {
+        map->count++;
+    }
+    slot->id = id;
+    slot->value = value;
+}
+
+void* idmap_get(IdMap* map, long id)
+{
+    return map->slots[idmap_find(map, id)].value;
+}
+
+void* idmap_remove(IdMap* map, long id)
+{
+    size_t i = idmap_find(map, id);
+    void* value = map->slots[i].value;
+    if (!value) {
+        return NULL;
+    }
+    map->slots[i].value = NULL;
+    map->count--;
+    // Move later entries of the probe run back into the gap, so lookups that
+    // passed through it still find them
+    size_t gap = i;
+    for (size_t j = (i + 1) & (map->capacity - 1); map->slots[j].value;
+            j = (j + 1) & (map->capacity - 1)) {
+        size_t home = idmap_home(map, map->slots[j].id);
+        // Entry at j can fill the gap unless its home lies in (gap, j]
+        bool homeAfterGap = gap <= j ? (home > gap && home <= j)
+                                     : (home > gap || home <= j);
+        if (!homeAfterGap) {
+            map->slots[gap] = map->slots[j];
+            map->slots[j].value = NULL;
+            gap = j;
+        }
+    }
+    return value;
+}
+
+void idmap_for_each(
+        IdMap* map, void (*fn)(long id, void* value, void* data), void* data)
+{
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->slots[i].value) {
+            fn(map->slots[i].id, map->slots[i].value, data);
+        }
+    }
+}
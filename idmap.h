@@ -0,0 +1,55 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <stdbool.h>
+
+// Hash map from non-negative ids to pointers. Not thread safe, callers lock.
+
+typedef struct IdMap IdMap;
+
+/**
+ * @brief Create an empty map
+ *
+ * @return the map
+ */
+IdMap* idmap_create(void);
+
+/**
+ * @brief Add an id to the map, or replace its value if it is already there
+ *
+ * @param map map to add to
+ * @param id id to add, not negative
+ * @param value value for the id, not NULL
+ */
+void idmap_put(IdMap* map, long id, void* value);
+
+/**
+ * @brief Look up an id
+ *
+ * @param map map to look in
+ * @param id id to find
+ * @return the id's value, or NULL if it isn't in the map
+ */
+void* idmap_get(IdMap* map, long id);
+
+/**
+ * @brief Remove an id from the map
+ *
+ * @param map map to remove from
+ * @param id id to remove
+ * @return the id's value, or NULL if it wasn't in the map
+ */
+void* idmap_remove(IdMap* map, long id);
+
+/**
+ * @brief Call a function for every entry of the map. The function mustn't
+ * change the map.
+ *
+ * @param map map to go through
+ * @param fn function to call with each id and value
+ * @param data passed to fn
+ */
+void idmap_for_each(
+        IdMap* map, void (*fn)(long id, void* value, void* data), void* data);
+
+#endif
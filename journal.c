@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "journal.h"
+
+// Function/type comments for the public interface are in journal.h
+
+// Header of a record in the journal file, followed by length bytes of payload
+typedef struct JournalHeader {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t length;
+    // Game array index of the game
+    uint32_t slot;
+    uint32_t gameId;
+    // Checksum of the payload, to detect torn/corrupt records
+    uint32_t checksum;
+} JournalHeader;
+
+struct Journal {
+    int fd;
+    pthread_mutex_t lock;
+    // Signalled when records are appended
+    pthread_cond_t appended;
+    // Signalled when a batch of records has been synced to disk
+    pthread_cond_t synced;
+    // Records appended but not yet taken by the writer thread
+    char* pending;
+    size_t pendingLen;
+    size_t pendingCapacity;
+    // Total bytes appended/synced since the journal was opened
+    unsigned long appendedBytes;
+    unsigned long syncedBytes;
+    // Set once a write or sync fails, nothing more is written
+    bool failed;
+    // Set once closed, the writer thread then stops
+    bool closed;
+    // Cleared by the writer thread as it stops. Whichever of it and
+    // journal_close() comes last frees the journal.
+    bool writerRunning;
+};
+
+size_t const initialPendingCapacity = 4096;
+
+// FNV-1a hash constants
+uint32_t const fnvOffsetBasis = 2166136261u;
+uint32_t const fnvPrime = 16777619u;
+
+/**
+ * @brief Checksum (32 bit FNV-1a hash) of a record's payload
+ *
+ * @param data payload
+ * @param len length of payload
+ * @return the checksum
+ */
+uint32_t journal_checksum(const char* data, size_t len)
+{
+    uint32_t hash = fnvOffsetBasis;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= fnvPrime;
+    }
+    return hash;
+}
+
+long journal_replay(const char* path, JournalReplayFn apply, void* data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    JournalHeader header;
+    char payload[UINT16_MAX + 1];
+    long numRecords = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (fread(payload, 1, header.length, file) != header.length
+                || journal_checksum(payload, header.length) != header.checksum
+                || header.type < JOURNAL_START || header.type > JOURNAL_SEAT) {
+            // Torn or corrupt record, nothing after it can be trusted
+            break;
+        }
+        payload[header.length] = '\0';
+        apply((JournalRecordType)header.type, header.slot, header.gameId,
+                header.flags, payload, data);
+        numRecords++;
+    }
+    fclose(file);
+    return numRecords;
+}
+
+/**
+ * @brief Write all of a buffer to a file descriptor, retrying partial writes
+ *
+ * @param fd file descriptor to write to
+ * @param buffer bytes to write
+ * @param len number of bytes
+ * @return 0 on success, -1 on error
+ */
+int write_all(int fd, const char* buffer, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buffer, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write a batch of records to a journal's file and sync it to disk
+ *
+ * @param journal journal to write to
+ * @param batch records to write
+ * @param len number of bytes of records
+ * @return true if written and synced, false on error
+ */
+bool journal_write_batch(Journal* journal, const char* batch, size_t len)
+{
+    if (write_all(journal->fd, batch, len) == -1
+            || fdatasync(journal->fd) == -1) {
+        fprintf(stderr, "uqchessserver: can't write journal\n");
+        fflush(stderr);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Close a journal's file and free it
+ *
+ * @param journal journal to free
+ */
+void journal_free(Journal* journal)
+{
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->appended);
+    pthread_cond_destroy(&journal->synced);
+    free(journal->pending);
+    free(journal);
+}
+
+/**
+ * @brief Journal writer thread. Repeatedly takes every pending record, writes
+ * them and syncs them to disk with one fdatasync (group commit). Stops
+ * journalling once a write or sync fails, as the file's contents are then
+ * unknown, or once the journal is closed.
+ *
+ * @param data Journal* - journal to write
+ * @return NULL
+ */
+void* journal_writer_thread(void* data)
+{
+    Journal* journal = (Journal*)data;
+    char* batch = (char*)malloc(initialPendingCapacity);
+    size_t batchCapacity = initialPendingCapacity;
+    pthread_mutex_lock(&journal->lock);
+    while (!journal->failed && !journal->closed) {
+        if (journal->pendingLen == 0) {
+            pthread_cond_wait(&journal->appended, &journal->lock);
+            continue;
+        }
+        // Swap buffers so appending can continue while this batch is written
+        char* toWrite = journal->pending;
+        size_t toWriteLen = journal->pendingLen;
+        size_t toWriteCapacity = journal->pendingCapacity;
+        journal->pending = batch;
+        journal->pendingCapacity = batchCapacity;
+        journal->pendingLen = 0;
+        batch = toWrite;
+        batchCapacity = toWriteCapacity;
+        unsigned long batchEnd = journal->appendedBytes;
+        pthread_mutex_unlock(&journal->lock);
+
+        bool written = journal_write_batch(journal, batch, toWriteLen);
+
+        pthread_mutex_lock(&journal->lock);
+        if (written) {
+            journal->syncedBytes = batchEnd;
+        } else {
+            journal->failed = true;
+        }
+        pthread_cond_broadcast(&journal->synced);
+    }
+    journal->writerRunning = false;
+    bool closed = journal->closed;
+    pthread_mutex_unlock(&journal->lock);
+    free(batch);
+    if (closed) {
+        journal_free(journal);
+    }
+    return NULL;
+}
+
+Journal* journal_open(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    Journal* journal = (Journal*)malloc(sizeof(Journal));
+    journal->fd = fd;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->appended, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    journal->pending = (char*)malloc(initialPendingCapacity);
+    journal->pendingLen = 0;
+    journal->pendingCapacity = initialPendingCapacity;
+    journal->appendedBytes = 0;
+    journal->syncedBytes = 0;
+    journal->failed = false;
+    journal->closed = false;
+    journal->writerRunning = true;
+
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, journal_writer_thread, journal)) {
+        journal_free(journal);
+        return NULL;
+    }
+    pthread_detach(threadId);
+    return journal;
+}
+
+void journal_append(Journal* journal, JournalRecordType type, uint32_t slot,
+        uint32_t gameId, uint8_t flags, const char* payload)
+{
+    size_t payloadLen = payload ? strlen(payload) : 0;
+    if (payloadLen > UINT16_MAX) {
+        payloadLen = UINT16_MAX;
+    }
+    JournalHeader header = {.type = (uint8_t)type,
+            .flags = flags,
+            .length = (uint16_t)payloadLen,
+            .slot = slot,
+            .gameId = gameId,
+            .checksum = journal_checksum(payload, payloadLen)};
+    size_t recordLen = sizeof(header) + payloadLen;
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed) {
+        pthread_mutex_unlock(&journal->lock);
+        return; // nothing more is written
+    }
+    if (journal->pendingLen + recordLen > journal->pendingCapacity) {
+        while (journal->pendingLen + recordLen > journal->pendingCapacity) {
+            journal->pendingCapacity *= 2;
+        }
+        journal->pending
+                = (char*)realloc(journal->pending, journal->pendingCapacity);
+    }
+    memcpy(journal->pending + journal->pendingLen, &header, sizeof(header));
+    if (payloadLen > 0) {
+        memcpy(journal->pending + journal->pendingLen + sizeof(header),
+                payload, payloadLen);
+    }
+    journal->pendingLen += recordLen;
+    journal->appendedBytes += recordLen;
+    pthread_cond_signal(&journal->appended);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+int journal_sync(Journal* journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    unsigned long target = journal->appendedBytes;
+    while (journal->syncedBytes < target && !journal->failed) {
+        pthread_cond_wait(&journal->synced, &journal->lock);
+    }
+    bool synced = journal->syncedBytes >= target;
+    pthread_mutex_unlock(&journal->lock);
+    return synced ? 0 : -1;
+}
+
+int journal_rename(const char* from, const char* to)
+{
+    if (rename(from, to) == -1) {
+        return -1;
+    }
+    // dirname() may modify its argument
+    char dir[strlen(to) + 1];
+    strcpy(dir, to);
+    int dirFd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0) {
+        return -1;
+    }
+    int result = fsync(dirFd);
+    close(dirFd);
+    return result;
+}
+
+void journal_close(Journal* journal)
+{
+    pthread_mutex_lock(&journal->lock);
+    journal->closed = true;
+    bool writerRunning = journal->writerRunning;
+    pthread_cond_signal(&journal->appended);
+    pthread_mutex_unlock(&journal->lock);
+    if (!writerRunning) {
+        journal_free(journal);
+    }
+}
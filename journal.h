@@ -0,0 +1,93 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+// Append-only binary journal of game lifecycle events, used by the server to
+// restore games in progress after a restart. Records are written by a
+// background thread which syncs each batch of records to disk together (group
+// commit), so appending a record never waits for the disk.
+
+// Kinds of journal record
+typedef enum {
+    // Game started, payload is the starting FEN
+    JOURNAL_START = 1,
+    // Move made, payload is "<uci> <fen> <san>": the move in UCI and SAN and
+    // the FEN after it, or "-" for the FEN if it was left out (compaction
+    // keeps only the last move's FEN)
+    JOURNAL_MOVE = 2,
+    // Game ended, no payload
+    JOURNAL_END = 3,
+    // Session token of a human seat's player, flags is the seat and payload
+    // is "<token> <rating>"
+    JOURNAL_SEAT = 4
+} JournalRecordType;
+
+// A journal open for appending
+typedef struct Journal Journal;
+
+// Function applied to each record read when replaying a journal
+typedef void (*JournalReplayFn)(JournalRecordType type, uint32_t slot,
+        uint32_t gameId, uint8_t flags, char* payload, void* data);
+
+/**
+ * @brief Read every complete, intact record of a journal file in order and
+ * apply a function to it. Reading stops at the first torn or corrupt record
+ * (e.g. one partly written when the server died).
+ *
+ * @param path journal file to read
+ * @param apply function applied to each record
+ * @param data passed to apply
+ * @return number of records applied, or -1 if the file couldn't be opened
+ */
+long journal_replay(const char* path, JournalReplayFn apply, void* data);
+
+/**
+ * @brief Create (truncating) a journal file and start its writer thread.
+ *
+ * @param path journal file to create
+ * @return the journal, or NULL if the file or thread couldn't be created
+ */
+Journal* journal_open(const char* path);
+
+/**
+ * @brief Queue a record to be written to the journal. Doesn't block on disk
+ * I/O. Once a write has failed, records are thrown away.
+ *
+ * @param journal journal to write to
+ * @param type kind of record
+ * @param slot game array index of the game the record is for
+ * @param gameId id of the game the record is for
+ * @param flags record-specific flags
+ * @param payload null-terminated payload, or NULL for none
+ */
+void journal_append(Journal* journal, JournalRecordType type, uint32_t slot,
+        uint32_t gameId, uint8_t flags, const char* payload);
+
+/**
+ * @brief Wait until every record appended so far has been synced to disk.
+ *
+ * @param journal journal to wait for
+ * @return 0 if synced, -1 if writing the journal failed (journalling stops)
+ */
+int journal_sync(Journal* journal);
+
+/**
+ * @brief Stop journalling and free a journal. Records not yet written are
+ * thrown away (e.g. the journal has been replaced by a compacted one).
+ *
+ * @param journal journal to close, not to be used again
+ */
+void journal_close(Journal* journal);
+
+/**
+ * @brief Rename a (synced) journal file over another, then sync the directory
+ * so the rename itself survives a crash.
+ *
+ * @param from journal file to rename
+ * @param to name to give it
+ * @return 0 on success, -1 on error
+ */
+int journal_rename(const char* from, const char* to);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "lobby.h"
+
+// Function/type comments for the public interface are in lobby.h
+
+int const lobbyDefaultRating = 1500;
+// Most a rating changes after one game, and the rating difference at which
+// the higher rated player is expected to score ten times as much
+int const eloK = 32;
+double const eloScale = 400.0;
+enum { bitsPerWord = 64, lobbyWords = lobbyRatings / bitsPerWord };
+
+// One side's queues
+typedef struct {
+    LobbyEntry* heads[lobbyRatings];
+    LobbyEntry* tails[lobbyRatings];
+    // Bit r is set if anyone with rating r is waiting
+    uint64_t waiting[lobbyWords];
+} LobbySide;
+
+struct Lobby {
+    int numSides;
+    LobbySide sides[];
+};
+
+Lobby* lobby_create(int numSides)
+{
+    Lobby* lobby = (Lobby*)calloc(
+            1, sizeof(Lobby) + numSides * sizeof(LobbySide));
+    lobby->numSides = numSides;
+    return lobby;
+}
+
+void lobby_entry_init(LobbyEntry* entry, void* data)
+{
+    entry->queued = false;
+    entry->data = data;
+}
+
+/**
+ * @brief Get the rating a player is queued at
+ *
+ * @param rating player's rating
+ * @return the nearest rating indexed
+ */
+int queued_rating(int rating)
+{
+    if (rating < 0) {
+        return 0;
+    }
+    return rating < lobbyRatings ? rating : lobbyRatings - 1;
+}
+
+void lobby_add(
+        Lobby* lobby, LobbyEntry* entry, int side, int rating, long order)
+{
+    LobbySide* queues = &lobby->sides[side];
+    int queue = queued_rating(rating);
+    entry->side = side;
+    entry->rating = queue;
+    entry->order = order;
+    entry->queued = true;
+    entry->next = NULL;
+    entry->prev = queues->tails[queue];
+    if (entry->prev) {
+        entry->prev->next = entry;
+    } else {
+        queues->heads[queue] = entry;
+        queues->waiting[queue / bitsPerWord] |= 1ull << (queue % bitsPerWord);
+    }
+    queues->tails[queue] = entry;
+}
+
+void lobby_remove(Lobby* lobby, LobbyEntry* entry)
+{
+    if (!entry->queued) {
+        return;
+    }
+    LobbySide* queues = &lobby->sides[entry->side];
+    int queue = entry->rating;
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        queues->heads[queue] = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        queues->tails[queue] = entry->prev;
+    }
+    if (!queues->heads[queue]) {
+        queues->waiting[queue / bitsPerWord]
+                &= ~(1ull << (queue % bitsPerWord));
+    }
+    entry->queued = false;
+}
+
+/**
+ * @brief Find the lowest rating from a rating up to a limit with anyone
+ * waiting on a side
+ *
+ * @param queues side to look on
+ * @param from lowest rating to look at
+ * @param last highest rating to look at
+ * @return the rating, -1 if there is none
+ */
+int next_waiting(const LobbySide* queues, int from, int last)
+{
+    for (int word = from / bitsPerWord; from <= last; word++) {
+        uint64_t bits = queues->waiting[word] & (~0ull << (from % bitsPerWord));
+        if (bits) {
+            int found = word * bitsPerWord + __builtin_ctzll(bits);
+            return found <= last ? found : -1;
+        }
+        from = (word + 1) * bitsPerWord;
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the highest rating from a rating down to a limit with anyone
+ * waiting on a side
+ *
+ * @param queues side to look on
+ * @param from highest rating to look at
+ * @param last lowest rating to look at
+ * @return the rating, -1 if there is none
+ */
+int previous_waiting(const LobbySide* queues, int from, int last)
+{
+    for (int word = from / bitsPerWord; from >= last; word--) {
+        int shift = bitsPerWord - 1 - from % bitsPerWord;
+        uint64_t bits = queues->waiting[word] & (~0ull >> shift);
+        if (bits) {
+            int found = word * bitsPerWord + bitsPerWord - 1
+                    - __builtin_clzll(bits);
+            return found >= last ? found : -1;
+        }
+        from = word * bitsPerWord - 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Get the first entry queued at a rating, skipping one
+ *
+ * @param queues side the rating is on
+ * @param rating rating to look at
+ * @param exclude entry to skip, or NULL
+ * @return the entry, NULL if only the skipped one is queued
+ */
+LobbyEntry* first_waiting(
+        const LobbySide* queues, int rating, const LobbyEntry* exclude)
+{
+    LobbyEntry* entry = queues->heads[rating];
+    return entry == exclude ? entry->next : entry;
+}
+
+/**
+ * @brief Keep the better of the best entry so far and a candidate: the one
+ * rated nearer, or that joined first if they are as near
+ *
+ * @param best best entry so far, may point at NULL
+ * @param candidate entry to compare, may be NULL
+ * @param rating rating looked near
+ */
+void keep_nearer(LobbyEntry** best, LobbyEntry* candidate, int rating)
+{
+    if (!candidate) {
+        return;
+    }
+    if (*best) {
+        int bestDistance = abs((*best)->rating - rating);
+        int distance = abs(candidate->rating - rating);
+        if (distance > bestDistance
+                || (distance == bestDistance
+                        && candidate->order > (*best)->order)) {
+            return;
+        }
+    }
+    *best = candidate;
+}
+
+/**
+ * @brief Find the nearest waiting entry on one side, going one way from a
+ * rating
+ *
+ * @param queues side to look on
+ * @param from rating to start at
+ * @param last rating to stop at
+ * @param exclude entry not to find, or NULL
+ * @return the entry, NULL if there is none
+ */
+LobbyEntry* nearest_one_way(
+        const LobbySide* queues, int from, int last, const LobbyEntry* exclude)
+{
+    bool up = last >= from;
+    while (up ? from <= last : from >= last) {
+        int rating = up ? next_waiting(queues, from, last)
+                        : previous_waiting(queues, from, last);
+        if (rating < 0) {
+            return NULL;
+        }
+        LobbyEntry* entry = first_waiting(queues, rating, exclude);
+        if (entry) {
+            return entry;
+        }
+        from = up ? rating + 1 : rating - 1;
+    }
+    return NULL;
+}
+
+void* lobby_find(Lobby* lobby, int rating, int window, unsigned sides,
+        const LobbyEntry* exclude)
+{
+    rating = queued_rating(rating);
+    int lowest = queued_rating(rating - window);
+    int highest = queued_rating(rating + window);
+    LobbyEntry* best = NULL;
+    for (int side = 0; side < lobby->numSides; side++) {
+        if (!(sides & (1u << side))) {
+            continue;
+        }
+        const LobbySide* queues = &lobby->sides[side];
+        keep_nearer(&best, nearest_one_way(queues, rating, highest, exclude),
+                rating);
+        if (rating > lowest) {
+            keep_nearer(&best,
+                    nearest_one_way(queues, rating - 1, lowest, exclude),
+                    rating);
+        }
+    }
+    return best ? best->data : NULL;
+}
+
+int lobby_rating_change(int rating, int opponentRating, double score)
+{
+    double expected
+            = 1.0 / (1.0 + pow(10.0, (opponentRating - rating) / eloScale));
+    return (int)lround(eloK * (score - expected));
+}
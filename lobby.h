@@ -0,0 +1,94 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include <stdbool.h>
+
+// Players waiting for an opponent, indexed by rating. Each side (e.g. the
+// colour a player wants) has a queue for every rating, in the order players
+// joined, and a bitmap of the ratings with anyone waiting, so the nearest
+// rated player is found a word of ratings at a time however many are waiting.
+// Not thread safe: use under the owner's lock.
+
+// Ratings indexed, lower or higher ratings are queued as the nearest of these
+enum { lobbyRatings = 4096 };
+
+// Elo rating players start with
+extern int const lobbyDefaultRating;
+
+// A place in the lobby, kept in whatever waits. Fields are only used by the
+// lobby.
+typedef struct LobbyEntry {
+    struct LobbyEntry* prev;
+    struct LobbyEntry* next;
+    bool queued;
+    int side;
+    int rating;
+    long order;
+    void* data;
+} LobbyEntry;
+
+typedef struct Lobby Lobby;
+
+/**
+ * @brief Create an empty lobby
+ *
+ * @param numSides number of sides players can wait on (at most 32)
+ * @return the lobby
+ */
+Lobby* lobby_create(int numSides);
+
+/**
+ * @brief Set up an entry that isn't waiting
+ *
+ * @param entry entry to set up
+ * @param data what waits, returned by lobby_find()
+ */
+void lobby_entry_init(LobbyEntry* entry, void* data);
+
+/**
+ * @brief Start waiting in the lobby, behind everyone waiting with the same
+ * side and rating
+ *
+ * @param lobby lobby to wait in
+ * @param entry entry of what waits, not already waiting
+ * @param side side waited on
+ * @param rating rating of the player
+ * @param order when the player joined, earlier players having lower orders;
+ * breaks ties between equally near players
+ */
+void lobby_add(
+        Lobby* lobby, LobbyEntry* entry, int side, int rating, long order);
+
+/**
+ * @brief Stop waiting in the lobby, if waiting
+ *
+ * @param lobby lobby waited in
+ * @param entry entry of what waits
+ */
+void lobby_remove(Lobby* lobby, LobbyEntry* entry);
+
+/**
+ * @brief Find the waiting player rated nearest a rating, the earliest to join
+ * if several are as near
+ *
+ * @param lobby lobby to look in
+ * @param rating rating to look near
+ * @param window furthest the player's rating can be from rating
+ * @param sides sides to look on, a bit (1 << side) for each
+ * @param exclude entry not to find (the one looking, if waiting), or NULL
+ * @return data of the player's entry, NULL if nobody is near enough
+ */
+void* lobby_find(Lobby* lobby, int rating, int window, unsigned sides,
+        const LobbyEntry* exclude);
+
+/**
+ * @brief Work out how much a game changes a player's Elo rating
+ *
+ * @param rating player's rating
+ * @param opponentRating opponent's rating
+ * @param score 1 if the player won, 0.5 for a draw, 0 if they lost
+ * @return change to the player's rating
+ */
+int lobby_rating_change(int rating, int opponentRating, double score);
+
+#endif
@@ -0,0 +1,725 @@
+// accept4()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "net.h"
+
+// Function/type comments for the public interface are in net.h
+
+// Lines longer than this (including the terminator) are discarded
+enum { lineBufferSize = 10000 };
+// Lines up to this long (including the terminator) are assembled in the
+// reader itself, so reading a typical command never allocates
+enum { inlineLineSize = 64 };
+
+// Line being assembled from what has been read from a connection. A line too
+// long for the inline buffer gets a heap buffer, only as big as it needs and
+// freed once the line is done.
+typedef struct LineReader {
+    // inlineBuffer, or the heap buffer of a long line
+    char* buffer;
+    size_t len;
+    size_t capacity;
+    // Set while skipping the rest of a line that is too long or has a NUL
+    bool discarding;
+    char inlineBuffer[inlineLineSize];
+} LineReader;
+
+// A connection being read by a backend
+typedef struct NetConnection {
+    int fd;
+    // Server's context for the connection
+    void* context;
+    LineReader reader;
+} NetConnection;
+
+// Threads backend: accepted sockets waiting for a reader thread. Reader
+// threads are kept once started, and only started when every one is busy.
+typedef struct ReaderPool {
+    NetHandlers* handlers;
+    // Attributes reader threads are started with (stack size)
+    pthread_attr_t threadAttr;
+    pthread_mutex_t lock;
+    pthread_cond_t socketsWaiting;
+    // Ring buffer of sockets, the oldest at index head
+    int* sockets;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    // Reader threads not reading a connection
+    int numFree;
+} ReaderPool;
+
+// An io_uring instance and its mapped rings
+typedef struct Uring {
+    int fd;
+    // Submission ring, tail is only published to the kernel on submit
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned localTail;
+    struct io_uring_sqe* sqes;
+    // Completion ring
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    // Receive buffers provided to the kernel, numUringBuffers of
+    // readChunkSize bytes
+    char* buffers;
+} Uring;
+
+// Size of each read (and of each io_uring provided buffer)
+enum { readChunkSize = 4096 };
+// Max connections the threads backend accepts before handing them out
+enum { acceptBatchSize = 64 };
+size_t const initialReaderQueueCapacity = 64;
+int const maxEpollEvents = 256;
+unsigned const uringEntries = 1024;
+// Completion ring is bigger as multishot requests complete many times
+unsigned const uringCompletionEntries = 8192;
+int const numUringBuffers = 1024;
+int const uringBufferGroup = 1;
+// user_data of requests that aren't for a connection
+unsigned long long const acceptUserData = 0;
+unsigned long long const provideUserData = 1;
+
+int net_parse_backend(const char* name, NetBackend* backend)
+{
+    if (!strcmp(name, "threads")) {
+        *backend = NET_THREADS;
+    } else if (!strcmp(name, "epoll")) {
+        *backend = NET_EPOLL;
+    } else if (!strcmp(name, "uring")) {
+        *backend = NET_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Make sure a line reader's buffer can hold a number of bytes
+ *
+ * @param reader reader to grow
+ * @param size bytes needed, at most lineBufferSize
+ */
+void line_reader_reserve(LineReader* reader, size_t size)
+{
+    if (size <= reader->capacity) {
+        return;
+    }
+    size_t capacity = reader->capacity;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    capacity = capacity < lineBufferSize ? capacity : lineBufferSize;
+    if (reader->buffer == reader->inlineBuffer) {
+        reader->buffer = (char*)malloc(capacity);
+        memcpy(reader->buffer, reader->inlineBuffer, reader->len);
+    } else {
+        reader->buffer = (char*)realloc(reader->buffer, capacity);
+    }
+    reader->capacity = capacity;
+}
+
+/**
+ * @brief Give the server the line a connection's reader has finished, or an
+ * empty line (which isn't a valid command) if it was discarded
+ *
+ * @param connection connection the line was read from
+ * @param handlers callbacks to give the line to
+ */
+void line_reader_finish(NetConnection* connection, NetHandlers* handlers)
+{
+    LineReader* reader = &connection->reader;
+    char* line = (char*)"\n";
+    if (!reader->discarding) {
+        reader->buffer[reader->len] = '\0';
+        line = reader->buffer;
+    }
+    reader->len = 0;
+    reader->discarding = false;
+    handlers->line(connection->context, line, handlers->data);
+}
+
+/**
+ * @brief Add bytes read from a connection to its line, giving the server each
+ * line completed
+ *
+ * @param connection connection read from
+ * @param data bytes read
+ * @param len number of bytes read
+ * @param handlers callbacks to give lines to
+ */
+void net_feed(NetConnection* connection, const char* data, size_t len,
+        NetHandlers* handlers)
+{
+    LineReader* reader = &connection->reader;
+    while (len > 0) {
+        size_t take = lineBufferSize - 1 - reader->len;
+        take = len < take ? len : take;
+        const char* newline = (const char*)memchr(data, '\n', take);
+        if (newline) {
+            take = newline - data + 1;
+        }
+        if (memchr(data, '\0', take)) {
+            reader->discarding = true; // can't be given on as a string
+        }
+        if (!reader->discarding) {
+            line_reader_reserve(reader, reader->len + take + 1);
+            memcpy(reader->buffer + reader->len, data, take);
+            reader->len += take;
+        }
+        data += take;
+        len -= take;
+        if (newline) {
+            line_reader_finish(connection, handlers);
+        } else if (reader->len == lineBufferSize - 1) {
+            reader->len = 0;
+            reader->discarding = true; // too long, skip to its newline
+        }
+    }
+    if (reader->len == 0 && reader->buffer != reader->inlineBuffer) {
+        // Idle connections hold no heap buffer
+        free(reader->buffer);
+        reader->buffer = reader->inlineBuffer;
+        reader->capacity = inlineLineSize;
+    }
+}
+
+/**
+ * @brief Start reading an accepted connection
+ *
+ * @param fd accepted socket
+ * @param handlers callbacks to make
+ * @return the connection
+ */
+NetConnection* net_open(int fd, NetHandlers* handlers)
+{
+    NetConnection* connection = (NetConnection*)malloc(sizeof(NetConnection));
+    connection->fd = fd;
+    connection->reader.buffer = connection->reader.inlineBuffer;
+    connection->reader.len = 0;
+    connection->reader.capacity = inlineLineSize;
+    connection->reader.discarding = false;
+    connection->context = handlers->opened(fd, handlers->data);
+    return connection;
+}
+
+/**
+ * @brief Stop reading a connection, telling the server, and close it. Any
+ * partial line read is ignored.
+ *
+ * @param connection connection to close
+ * @param handlers callbacks to make
+ */
+void net_close(NetConnection* connection, NetHandlers* handlers)
+{
+    handlers->closed(connection->context, handlers->data);
+    close(connection->fd);
+    if (connection->reader.buffer != connection->reader.inlineBuffer) {
+        free(connection->reader.buffer);
+    }
+    free(connection);
+}
+
+/**
+ * @brief Read a connection until it closes, then close it
+ *
+ * @param connection connection to read
+ * @param handlers callbacks to make
+ */
+void read_connection(NetConnection* connection, NetHandlers* handlers)
+{
+    char buffer[readChunkSize];
+    ssize_t numRead;
+    while ((numRead = read(connection->fd, buffer, readChunkSize)) > 0
+            || (numRead < 0 && errno == EINTR)) {
+        if (numRead > 0) {
+            net_feed(connection, buffer, numRead, handlers);
+        }
+    }
+    net_close(connection, handlers);
+}
+
+/**
+ * @brief Wait for an accepted socket to read
+ *
+ * @param pool reader pool
+ * @param finished true if the calling thread just finished a connection
+ * @return the socket
+ */
+int reader_pool_take(ReaderPool* pool, bool finished)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (finished) {
+        pool->numFree++;
+    }
+    while (pool->count == 0) {
+        pthread_cond_wait(&pool->socketsWaiting, &pool->lock);
+    }
+    int fd = pool->sockets[pool->head];
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+    pool->numFree--;
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+/**
+ * @brief Threads backend thread reading one connection at a time, forever
+ *
+ * @param data ReaderPool* - pool to take connections from
+ * @return unused, never returns
+ */
+void* reader_thread(void* data)
+{
+    ReaderPool* pool = (ReaderPool*)data;
+    bool finished = false;
+    while (1) {
+        int fd = reader_pool_take(pool, finished);
+        read_connection(net_open(fd, pool->handlers), pool->handlers);
+        finished = true;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start reader threads for a pool. Each is counted as free (the caller
+ * holds the pool's lock or the pool isn't shared yet).
+ *
+ * @param pool pool the threads read for
+ * @param numThreads number of threads to start
+ */
+void reader_pool_spawn(ReaderPool* pool, int numThreads)
+{
+    for (int i = 0; i < numThreads; i++) {
+        pthread_t threadId;
+        if (pthread_create(&threadId, &pool->threadAttr, reader_thread, pool)
+                == 0) {
+            pthread_detach(threadId);
+            pool->numFree++;
+        }
+    }
+}
+
+/**
+ * @brief Create a threads backend reader pool, starting its first threads
+ *
+ * @param options number of threads to start now and their stack size
+ * @param handlers callbacks the threads make
+ * @return the pool
+ */
+ReaderPool* reader_pool_create(NetOptions* options, NetHandlers* handlers)
+{
+    ReaderPool* pool = (ReaderPool*)malloc(sizeof(ReaderPool));
+    pool->handlers = handlers;
+    pthread_attr_init(&pool->threadAttr);
+    if (options->stackSize) {
+        pthread_attr_setstacksize(&pool->threadAttr, options->stackSize);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->socketsWaiting, NULL);
+    pool->capacity = initialReaderQueueCapacity;
+    pool->sockets = (int*)malloc(pool->capacity * sizeof(int));
+    pool->head = 0;
+    pool->count = 0;
+    pool->numFree = 0;
+    reader_pool_spawn(pool, options->numReaders);
+    return pool;
+}
+
+/**
+ * @brief Queue accepted sockets for the reader threads, starting more threads
+ * if there aren't enough free ones
+ *
+ * @param pool reader pool
+ * @param fds sockets to queue
+ * @param numFds number of sockets
+ */
+void reader_pool_add(ReaderPool* pool, const int* fds, int numFds)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count + numFds > pool->capacity) {
+        size_t capacity = 2 * (pool->count + numFds);
+        int* sockets = (int*)malloc(capacity * sizeof(int));
+        for (size_t i = 0; i < pool->count; i++) {
+            sockets[i] = pool->sockets[(pool->head + i) % pool->capacity];
+        }
+        free(pool->sockets);
+        pool->sockets = sockets;
+        pool->capacity = capacity;
+        pool->head = 0;
+    }
+    for (int i = 0; i < numFds; i++) {
+        pool->sockets[(pool->head + pool->count++) % pool->capacity] = fds[i];
+    }
+    if ((long)pool->count > pool->numFree) {
+        reader_pool_spawn(pool, (int)pool->count - pool->numFree);
+    }
+    pthread_cond_broadcast(&pool->socketsWaiting);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Threads backend: accept connections in batches, each read by a
+ * thread from a pool that grows to the number of open connections
+ *
+ * @param listenFd listening socket
+ * @param options reader threads to start before accepting, and their stack
+ * size
+ * @param handlers callbacks to make
+ * @return -1 if the listening socket couldn't be made non-blocking, otherwise
+ * never returns
+ */
+int serve_threads(int listenFd, NetOptions* options, NetHandlers* handlers)
+{
+    int flags = fcntl(listenFd, F_GETFL);
+    if (flags == -1 || fcntl(listenFd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    ReaderPool* pool = reader_pool_create(options, handlers);
+    struct pollfd listenPoll = {.fd = listenFd, .events = POLLIN};
+    while (1) {
+        if (poll(&listenPoll, 1, -1) < 0) {
+            continue; // interrupted
+        }
+        // Take every connection waiting (up to a batch), so a burst of them
+        // is accepted and handed out together
+        int fds[acceptBatchSize];
+        int numFds = 0;
+        int fd;
+        while (numFds < acceptBatchSize
+                && (fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+            fds[numFds++] = fd;
+        }
+        // Errors accepting connections are skipped
+        if (numFds > 0) {
+            reader_pool_add(pool, fds, numFds);
+        }
+    }
+}
+
+/**
+ * @brief Accept every pending connection and add them to the epoll set
+ *
+ * @param epollFd epoll instance
+ * @param listenFd listening socket (non-blocking)
+ * @param handlers callbacks to make
+ */
+void epoll_accept(int epollFd, int listenFd, NetHandlers* handlers)
+{
+    int fd;
+    // Sockets stay blocking as the server's writes share them, reads use
+    // MSG_DONTWAIT instead
+    while ((fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = net_open(fd, handlers);
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+/**
+ * @brief Read what is available from a connection epoll reported readable,
+ * closing it on end of file or error. Reads once per event so a busy
+ * connection can't starve the others.
+ *
+ * @param epollFd epoll instance
+ * @param connection connection to read
+ * @param handlers callbacks to make
+ */
+void epoll_read(int epollFd, NetConnection* connection, NetHandlers* handlers)
+{
+    char buffer[readChunkSize];
+    ssize_t numRead = recv(connection->fd, buffer, readChunkSize, MSG_DONTWAIT);
+    if (numRead > 0) {
+        net_feed(connection, buffer, numRead, handlers);
+    } else if (numRead == 0 || (errno != EAGAIN && errno != EINTR)) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+        net_close(connection, handlers);
+    }
+}
+
+/**
+ * @brief Epoll backend: wait for connections and input on every socket from
+ * one thread
+ *
+ * @param listenFd listening socket
+ * @param handlers callbacks to make
+ * @return -1 if epoll couldn't be set up, otherwise never returns
+ */
+int serve_epoll(int listenFd, NetHandlers* handlers)
+{
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0
+            || fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK)
+                    == -1) {
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) == -1) {
+        return -1;
+    }
+    struct epoll_event events[maxEpollEvents];
+    while (1) {
+        int numEvents = epoll_wait(epollFd, events, maxEpollEvents, -1);
+        for (int i = 0; i < numEvents; i++) {
+            if (events[i].data.ptr) {
+                epoll_read(epollFd, (NetConnection*)events[i].data.ptr,
+                        handlers);
+            } else {
+                epoll_accept(epollFd, listenFd, handlers);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Create an io_uring instance and map its rings
+ *
+ * @param ring ring to set up
+ * @return 0 on success, -1 if io_uring isn't available
+ */
+int uring_setup(Uring* ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = uringCompletionEntries;
+    ring->fd = (int)syscall(__NR_io_uring_setup, uringEntries, &params);
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        return -1;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe);
+    char* rings = (char*)mmap(NULL, sqSize > cqSize ? sqSize : cqSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL,
+            params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQES);
+    if (rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sqHead = (unsigned*)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(rings + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->localTail = *ring->sqTail;
+    ring->cqHead = (unsigned*)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Submit every queued request, then wait for at least minComplete
+ * completions
+ *
+ * @param ring ring to submit to
+ * @param minComplete completions to wait for
+ */
+void uring_submit(Uring* ring, unsigned minComplete)
+{
+    unsigned toSubmit = ring->localTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->localTail, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete,
+                   minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0)
+                    < 0
+            && errno == EINTR) {
+        toSubmit = 0;
+    }
+}
+
+/**
+ * @brief Get an empty submission queue entry, submitting queued ones first if
+ * the queue is full
+ *
+ * @param ring ring to get the entry from
+ * @param userData value the request's completions will carry
+ * @return the entry, queued to be submitted
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* ring, unsigned long long userData)
+{
+    if (ring->localTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)
+            == ring->sqEntries) {
+        uring_submit(ring, 0);
+    }
+    unsigned index = ring->localTail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    ring->localTail++;
+    return sqe;
+}
+
+/**
+ * @brief Queue a multishot accept on the listening socket
+ *
+ * @param ring ring to queue on
+ * @param listenFd listening socket
+ */
+void uring_accept(Uring* ring, int listenFd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, acceptUserData);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * @brief Queue a multishot receive on a connection, into provided buffers
+ *
+ * @param ring ring to queue on
+ * @param connection connection to receive from
+ */
+void uring_recv(Uring* ring, NetConnection* connection)
+{
+    struct io_uring_sqe* sqe
+            = uring_get_sqe(ring, (unsigned long long)(uintptr_t)connection);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uringBufferGroup;
+}
+
+/**
+ * @brief Queue giving receive buffers (back) to the kernel
+ *
+ * @param ring ring the buffers belong to
+ * @param firstId id of the first buffer
+ * @param count number of consecutive buffers
+ */
+void uring_provide(Uring* ring, int firstId, int count)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, provideUserData);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (unsigned long long)(uintptr_t)(ring->buffers
+            + (size_t)firstId * readChunkSize);
+    sqe->len = readChunkSize;
+    sqe->off = firstId;
+    sqe->buf_group = uringBufferGroup;
+}
+
+/**
+ * @brief Act on a completed receive: pass on what was read and give the
+ * buffer back, re-arm the receive if it stopped, or close the connection
+ *
+ * @param ring ring the receive was on
+ * @param cqe completion
+ * @param handlers callbacks to make
+ */
+void uring_received(Uring* ring, struct io_uring_cqe* cqe,
+        NetHandlers* handlers)
+{
+    NetConnection* connection = (NetConnection*)(uintptr_t)cqe->user_data;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bufferId = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0) {
+            net_feed(connection,
+                    ring->buffers + (size_t)bufferId * readChunkSize,
+                    cqe->res, handlers);
+        }
+        uring_provide(ring, bufferId, 1);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return; // receive still armed
+    }
+    if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+        uring_recv(ring, connection);
+    } else {
+        net_close(connection, handlers);
+    }
+}
+
+/**
+ * @brief Io_uring backend: multishot accept and receive into provided
+ * buffers, with every request made while handling a batch of completions
+ * submitted by one system call
+ *
+ * @param listenFd listening socket
+ * @param handlers callbacks to make
+ * @return -1 if io_uring couldn't be set up, otherwise never returns
+ */
+int serve_uring(int listenFd, NetHandlers* handlers)
+{
+    Uring ring;
+    if (uring_setup(&ring) == -1) {
+        return -1;
+    }
+    ring.buffers = (char*)malloc((size_t)numUringBuffers * readChunkSize);
+    uring_provide(&ring, 0, numUringBuffers);
+    uring_accept(&ring, listenFd);
+    while (1) {
+        uring_submit(&ring, 1);
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+            if (cqe->user_data == acceptUserData) {
+                if (cqe->res == -EINVAL) {
+                    return -1; // kernel has no multishot accept
+                }
+                if (cqe->res >= 0) {
+                    uring_recv(&ring, net_open(cqe->res, handlers));
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    uring_accept(&ring, listenFd);
+                }
+            } else if (cqe->user_data != provideUserData) {
+                uring_received(&ring, cqe, handlers);
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+int net_serve(int listenFd, NetOptions* options, NetHandlers* handlers)
+{
+    switch (options->backend) {
+    case NET_EPOLL:
+        return serve_epoll(listenFd, handlers);
+    case NET_URING:
+        return serve_uring(listenFd, handlers);
+    default:
+        return serve_threads(listenFd, options, handlers);
+    }
+}
+
+size_t net_connection_footprint(NetOptions* options)
+{
+    // Long lines' buffers are freed while idle, io_uring receive buffers are
+    // shared
+    size_t footprint = sizeof(NetConnection);
+    if (options->backend == NET_THREADS) {
+        footprint += options->stackSize;
+    }
+    return footprint;
+}
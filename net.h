@@ -0,0 +1,77 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+
+// Network backends: accept connections on a listening socket, read from them
+// and split what is read into lines for the server. Writing is done by the
+// server itself (see outbox.h).
+
+// How connections are accepted and read
+typedef enum NetBackend {
+    // A thread per connection, blocking reads. Threads are started ahead and
+    // reused for later connections.
+    NET_THREADS,
+    // One thread waiting on every connection with epoll
+    NET_EPOLL,
+    // One thread using io_uring multishot accept and receive, with buffers
+    // provided to the kernel
+    NET_URING
+} NetBackend;
+
+// How connections are served
+typedef struct NetOptions {
+    NetBackend backend;
+    // Threads backend: reader threads started before any connection arrives
+    int numReaders;
+    // Threads backend: stack size of reader threads, 0 for the default
+    size_t stackSize;
+} NetOptions;
+
+// Callbacks made by a backend. None of them should block for long, as the
+// epoll and io_uring backends make them from their only thread.
+typedef struct NetHandlers {
+    // A connection was accepted on socket fd. The socket is closed by the
+    // backend after closed() is called, so dup() it to keep it longer. Returns
+    // the connection's context, given to the other callbacks.
+    void* (*opened)(int fd, void* data);
+    // A newline-terminated line was read. A line too long for the read buffer
+    // or containing a NUL byte is discarded and given as an empty line ("\n").
+    void (*line)(void* context, char* line, void* data);
+    // The connection closed or failed, no more lines will be read from it
+    void (*closed)(void* context, void* data);
+    // Passed to every callback
+    void* data;
+} NetHandlers;
+
+/**
+ * @brief Get the backend with the given name (threads, epoll or uring)
+ *
+ * @param name backend name
+ * @param backend set to the backend
+ * @return 0 on success, -1 if the name isn't a backend
+ */
+int net_parse_backend(const char* name, NetBackend* backend);
+
+/**
+ * @brief Accept and read connections on a listening socket forever. Every
+ * backend accepts all the connections waiting each time it is woken.
+ *
+ * @param listenFd listening socket
+ * @param options backend to use and its settings
+ * @param handlers callbacks to make
+ * @return -1 if the backend couldn't be started, otherwise never returns
+ */
+int net_serve(int listenFd, NetOptions* options, NetHandlers* handlers);
+
+/**
+ * @brief Get the memory a backend uses for each idle connection, not counting
+ * the server's context or the kernel's
+ *
+ * @param options backend and its settings, a thread's stack is counted as
+ * options' stack size
+ * @return bytes per idle connection
+ */
+size_t net_connection_footprint(NetOptions* options);
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "outbox.h"
+
+// Function/type comments for the public interface are in outbox.h
+
+// Size of a "game <tag> " prefix buffer
+enum { tagPrefixSize = 32 };
+
+struct Message {
+    int refs;
+    size_t len;
+    char text[];
+};
+
+// A message waiting in an outbox
+typedef struct OutboxEntry {
+    struct OutboxEntry* next;
+    Message* message;
+    // "game <tag> " prefix, empty if untagged
+    char prefix[tagPrefixSize];
+    size_t prefixLen;
+} OutboxEntry;
+
+struct Outbox {
+    int fd;
+    const OutboxOptions* options;
+    pthread_mutex_t lock;
+    // Signalled when a message is queued or the outbox is closed
+    pthread_cond_t changed;
+    // Messages waiting to be sent, oldest first
+    OutboxEntry* head;
+    OutboxEntry* tail;
+    // Set once closing, the sender thread exits when the outbox is empty
+    bool closing;
+    // Set once a write fails, nothing more is sent
+    bool failed;
+    // Whether a sender thread is running (or starting)
+    bool senderRunning;
+    // Bytes of messages queued or being written
+    size_t queuedBytes;
+};
+
+// Max number of messages written by one writev (each is a prefix and text)
+int const maxBatchMessages = 64;
+// How long an on-demand sender waits for more messages before exiting, so a
+// burst of output spread over a few pushes is sent by one thread
+long const senderLingerNs = 50 * 1000 * 1000;
+
+Message* message_create(const char* text)
+{
+    size_t len = strlen(text);
+    Message* message = (Message*)malloc(sizeof(Message) + len + 1);
+    message->refs = 1;
+    message->len = len;
+    memcpy(message->text, text, len + 1);
+    return message;
+}
+
+const char* message_text(Message* message)
+{
+    return message->text;
+}
+
+Message* message_ref(Message* message)
+{
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+    return message;
+}
+
+void message_unref(Message* message)
+{
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(message);
+    }
+}
+
+/**
+ * @brief Write every byte described by an iovec array, retrying partial
+ * writes. A closed socket is an error rather than a SIGPIPE.
+ *
+ * @param fd file descriptor to write to
+ * @param iov buffers to write, adjusted as they are written
+ * @param iovCount number of buffers
+ * @return 0 on success, -1 on error
+ */
+int writev_all(int fd, struct iovec* iov, int iovCount)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while (iovCount > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+        ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovCount > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the number of bytes an entry sends
+ *
+ * @param entry entry to size
+ * @return prefix and message length
+ */
+size_t entry_size(OutboxEntry* entry)
+{
+    return entry->prefixLen + entry->message->len;
+}
+
+/**
+ * @brief Write a list of entries to the outbox's socket, a batch of messages
+ * per system call, then free the entries
+ *
+ * @param outbox outbox the entries were taken from
+ * @param entries entries to send, oldest first
+ * @return 0 on success, -1 if a write failed
+ */
+int outbox_send_entries(Outbox* outbox, OutboxEntry* entries)
+{
+    struct iovec iov[2 * maxBatchMessages];
+    int result = 0;
+    while (entries) {
+        int iovCount = 0;
+        OutboxEntry* batchEnd = entries;
+        for (int i = 0; batchEnd && i < maxBatchMessages; i++) {
+            iov[iovCount].iov_base = batchEnd->prefix;
+            iov[iovCount++].iov_len = batchEnd->prefixLen;
+            iov[iovCount].iov_base = batchEnd->message->text;
+            iov[iovCount++].iov_len = batchEnd->message->len;
+            batchEnd = batchEnd->next;
+        }
+        if (result == 0 && writev_all(outbox->fd, iov, iovCount) == -1) {
+            result = -1; // still free the rest
+        }
+        while (entries != batchEnd) {
+            OutboxEntry* next = entries->next;
+            message_unref(entries->message);
+            free(entries);
+            entries = next;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Wait a little while for a message to be queued (or the outbox to be
+ * closed) before an on-demand sender exits. Called holding the outbox's lock.
+ *
+ * @param outbox outbox to wait on
+ * @return true if there is something to do, false if the sender should exit
+ */
+bool outbox_linger(Outbox* outbox)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += senderLingerNs;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!outbox->head && !outbox->closing) {
+        if (pthread_cond_timedwait(&outbox->changed, &outbox->lock, &deadline)
+                == ETIMEDOUT) {
+            break;
+        }
+    }
+    return outbox->head || outbox->closing;
+}
+
+/**
+ * @brief Run an outbox's sender. Repeatedly takes every queued message and
+ * writes them to the socket, until the outbox is closed and empty, then frees
+ * the outbox. An on-demand sender returns early once there is nothing to send.
+ *
+ * @param outbox outbox to send from
+ * @param linger whether an on-demand sender waits a little for more messages
+ * before returning (only worth it in a thread of its own)
+ */
+void outbox_run_sender(Outbox* outbox, bool linger)
+{
+    pthread_mutex_lock(&outbox->lock);
+    while (1) {
+        while (!outbox->head && !outbox->closing) {
+            if (outbox->options->senderOnDemand
+                    && !(linger && outbox_linger(outbox))) {
+                // Nothing to send, the next push starts another sender
+                outbox->senderRunning = false;
+                pthread_mutex_unlock(&outbox->lock);
+                return;
+            }
+            pthread_cond_wait(&outbox->changed, &outbox->lock);
+        }
+        if (!outbox->head) {
+            break; // closing and nothing left to send
+        }
+        OutboxEntry* entries = outbox->head;
+        outbox->head = NULL;
+        outbox->tail = NULL;
+        pthread_mutex_unlock(&outbox->lock);
+
+        size_t sentBytes = 0;
+        for (OutboxEntry* entry = entries; entry; entry = entry->next) {
+            sentBytes += entry_size(entry);
+        }
+        int result = outbox_send_entries(outbox, entries);
+
+        pthread_mutex_lock(&outbox->lock);
+        outbox->queuedBytes -= sentBytes;
+        if (result == -1 && !outbox->failed) {
+            outbox->failed = true;
+            // Wake the connection's reading thread so it removes the client
+            shutdown(outbox->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+
+    close(outbox->fd);
+    pthread_mutex_destroy(&outbox->lock);
+    pthread_cond_destroy(&outbox->changed);
+    free(outbox);
+}
+
+/**
+ * @brief Outbox sender thread
+ *
+ * @param data Outbox* - outbox to send from
+ * @return NULL
+ */
+void* outbox_sender_thread(void* data)
+{
+    outbox_run_sender((Outbox*)data, true);
+    return NULL;
+}
+
+/**
+ * @brief Start an outbox's sender thread. If no thread can be started, an
+ * on-demand (or closing) outbox's messages are sent by the caller instead, as
+ * its sender returns once there is nothing left to send. A dedicated sender
+ * never returns, so its outbox gives up on the socket.
+ *
+ * @param outbox outbox to send from
+ */
+void outbox_start_sender(Outbox* outbox)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (outbox->options->stackSize) {
+        pthread_attr_setstacksize(&attr, outbox->options->stackSize);
+    }
+    pthread_t threadId;
+    int error = pthread_create(&threadId, &attr, outbox_sender_thread, outbox);
+    pthread_attr_destroy(&attr);
+    if (!error) {
+        return;
+    }
+    pthread_mutex_lock(&outbox->lock);
+    bool sendHere = outbox->options->senderOnDemand || outbox->closing;
+    if (!sendHere) {
+        outbox->senderRunning = false; // closing the outbox tries again
+        if (!outbox->failed) {
+            outbox->failed = true;
+            // Wake the connection's reading thread so it removes the client
+            shutdown(outbox->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    if (sendHere) {
+        outbox_run_sender(outbox, false);
+    }
+}
+
+Outbox* outbox_create(int fd, const OutboxOptions* options)
+{
+    Outbox* outbox = (Outbox*)malloc(sizeof(Outbox));
+    outbox->fd = fd;
+    outbox->options = options;
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_cond_init(&outbox->changed, NULL);
+    outbox->head = NULL;
+    outbox->tail = NULL;
+    outbox->closing = false;
+    outbox->failed = false;
+    outbox->senderRunning = !options->senderOnDemand;
+    outbox->queuedBytes = 0;
+    if (outbox->senderRunning) {
+        outbox_start_sender(outbox);
+    }
+    return outbox;
+}
+
+int outbox_push(Outbox* outbox, long tag, Message* message)
+{
+    OutboxEntry* entry = (OutboxEntry*)malloc(sizeof(OutboxEntry));
+    entry->next = NULL;
+    entry->message = message_ref(message);
+    entry->prefixLen = 0;
+    if (tag >= 0) {
+        entry->prefixLen = (size_t)snprintf(
+                entry->prefix, tagPrefixSize, "game %ld ", tag);
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    size_t size = entry_size(entry);
+    size_t limit = outbox->options->maxQueuedBytes;
+    bool overflow = limit && outbox->queuedBytes + size > limit;
+    if (overflow && !outbox->failed
+            && outbox->options->overflow == OUTBOX_DISCONNECT) {
+        outbox->failed = true;
+        // Wake the connection's reading thread so it removes the client
+        shutdown(outbox->fd, SHUT_RDWR);
+    }
+    bool failed = outbox->failed;
+    bool queued = !overflow && !failed;
+    bool startSender = false;
+    if (queued) {
+        outbox->queuedBytes += size;
+        if (outbox->tail) {
+            outbox->tail->next = entry;
+        } else {
+            outbox->head = entry;
+        }
+        outbox->tail = entry;
+        pthread_cond_signal(&outbox->changed);
+        startSender = !outbox->senderRunning;
+        outbox->senderRunning = true;
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    if (startSender) {
+        outbox_start_sender(outbox);
+    }
+
+    if (!queued) {
+        message_unref(message);
+        free(entry);
+    }
+    return failed ? -1 : 0;
+}
+
+void outbox_disconnect(Outbox* outbox)
+{
+    pthread_mutex_lock(&outbox->lock);
+    if (!outbox->failed) {
+        outbox->failed = true;
+        shutdown(outbox->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+void outbox_close(Outbox* outbox)
+{
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closing = true;
+    pthread_cond_signal(&outbox->changed);
+    // A sender is needed to free the outbox even if there is nothing to send
+    bool startSender = !outbox->senderRunning;
+    outbox->senderRunning = true;
+    pthread_mutex_unlock(&outbox->lock);
+    if (startSender) {
+        outbox_start_sender(outbox);
+    }
+}
+
+size_t outbox_footprint(const OutboxOptions* options)
+{
+    return sizeof(Outbox) + (options->senderOnDemand ? 0 : options->stackSize);
+}
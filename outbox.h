@@ -0,0 +1,121 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Messages are formatted once and shared (by reference count) between every
+// connection they are sent to. Each connection's outgoing messages wait in its
+// outbox until the outbox's sender thread writes them to the socket, so
+// threads sending messages never wait on the network.
+
+// Immutable, reference counted message text
+typedef struct Message Message;
+
+/**
+ * @brief Create a message with one reference (held by the caller)
+ *
+ * @param text message text, usually newline-terminated
+ * @return the message
+ */
+Message* message_create(const char* text);
+
+/**
+ * @brief Get a message's text
+ *
+ * @param message message to read
+ * @return the text
+ */
+const char* message_text(Message* message);
+
+/**
+ * @brief Add a reference to a message
+ *
+ * @param message message to reference
+ * @return the message
+ */
+Message* message_ref(Message* message);
+
+/**
+ * @brief Drop a reference to a message, freeing it once nobody references it
+ *
+ * @param message message to drop a reference to
+ */
+void message_unref(Message* message);
+
+// Queue of messages waiting to be written to one socket
+typedef struct Outbox Outbox;
+
+// What to do with a message that would take an outbox over its limit
+typedef enum OutboxOverflow {
+    // Give up on the socket, as if a write had failed
+    OUTBOX_DISCONNECT,
+    // Throw the message away, the socket may catch up later
+    OUTBOX_DROP
+} OutboxOverflow;
+
+// How outboxes run their sender threads
+typedef struct OutboxOptions {
+    // Stack size of sender threads, 0 for the default
+    size_t stackSize;
+    // Only run a sender thread while there is something to send (and briefly
+    // after, for the rest of a burst), so idle connections have no thread
+    bool senderOnDemand;
+    // Most bytes waiting to be sent (queued or being written) per outbox, 0
+    // for no limit
+    size_t maxQueuedBytes;
+    OutboxOverflow overflow;
+} OutboxOptions;
+
+/**
+ * @brief Create an outbox, starting its sender thread unless it is started on
+ * demand
+ *
+ * @param fd socket to write to, owned (and closed) by the outbox
+ * @param options how to run the sender, must outlive the outbox
+ * @return the outbox
+ */
+Outbox* outbox_create(int fd, const OutboxOptions* options);
+
+/**
+ * @brief Queue a message to be sent, never waits for the network. If it
+ * doesn't fit within the outbox's limit it is dropped, or the outbox is
+ * disconnected, as its options say.
+ *
+ * @param outbox outbox to send through
+ * @param tag game tag to prefix the message with ("game <tag> "), or negative
+ * for no prefix
+ * @param message message to send, the outbox takes its own reference
+ * @return 0 if queued (or dropped), -1 if the socket has failed or was
+ * disconnected for being too far behind (message not queued)
+ */
+int outbox_push(Outbox* outbox, long tag, Message* message);
+
+/**
+ * @brief Give up on an outbox's socket: nothing more is sent and the socket is
+ * shut down, so whatever reads it sees end of file. The outbox must still be
+ * closed.
+ *
+ * @param outbox outbox to disconnect
+ */
+void outbox_disconnect(Outbox* outbox);
+
+/**
+ * @brief Close an outbox. Never waits: the sender thread sends every message
+ * already queued, then closes the socket and frees the outbox. Nothing may be
+ * pushed once this is called.
+ *
+ * @param outbox outbox to close
+ */
+void outbox_close(Outbox* outbox);
+
+/**
+ * @brief Get the memory an outbox with nothing to send uses
+ *
+ * @param options how its sender is run, a thread's stack is counted as
+ * options' stack size
+ * @return bytes per idle outbox
+ */
+size_t outbox_footprint(const OutboxOptions* options);
+
+#endif
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pgn.h"
+#include "queue.h"
+
+// Function/type comments for the public interface are in pgn.h
+
+enum { boardSize = 8 };
+// Size of buffers for short tokens (dates, move numbers)
+enum { pgnTokenSize = 32 };
+
+// PGN export format keeps lines under 80 chars
+int const maxPgnLineLen = 79;
+long const gamesPerArchiveFile = 1000;
+// Max number of finished games waiting to be written
+size_t const archiveQueueCapacity = 1024;
+size_t const archiveBufferSize = 1 << 16;
+size_t const initialPgnCapacity = 1024;
+int const maxArchiveFiles = 100000;
+
+struct Archive {
+    BoundedQueue* queue;
+    // Prefix of archive files, NULL if writing to a stream
+    const char* prefix;
+    // Number of the current archive file, and games written to it so far
+    int fileNum;
+    long gamesInFile;
+    FILE* file;
+};
+
+// PGN text being built
+typedef struct PgnText {
+    char* text;
+    size_t len;
+    size_t capacity;
+    // Length of the current line of movetext
+    int lineLen;
+} PgnText;
+
+/**
+ * @brief Fill board with the pieces in a FEN string, '.' for empty squares.
+ * Row 0 is rank 8, column 0 is file a.
+ *
+ * @param board board to fill
+ * @param fen FEN string
+ */
+void fen_to_board(char board[boardSize][boardSize], const char* fen)
+{
+    memset(board, '.', boardSize * boardSize);
+    int row = 0;
+    int col = 0;
+    for (; *fen != '\0' && *fen != ' ' && row < boardSize; fen++) {
+        if (*fen == '/') {
+            row++;
+            col = 0;
+        } else if (isdigit((unsigned char)*fen)) {
+            col += *fen - '0';
+        } else if (col < boardSize) {
+            board[row][col++] = *fen;
+        }
+    }
+}
+
+/**
+ * @brief Check if a string starts with a square name (e.g. "e4")
+ *
+ * @param square string to check
+ * @return true if the first two chars are a square name
+ */
+bool is_square(const char* square)
+{
+    return square[0] >= 'a' && square[0] <= 'h' && square[1] >= '1'
+            && square[1] <= '8';
+}
+
+/**
+ * @brief Get the piece on a square of the board
+ *
+ * @param board board to look at
+ * @param square square name (e.g. "e4")
+ * @return piece letter from the FEN, '.' if empty
+ */
+char piece_on(char board[boardSize][boardSize], const char* square)
+{
+    return board['8' - square[1]][square[0] - 'a'];
+}
+
+/**
+ * @brief Write the file and/or rank needed to tell a piece move apart from
+ * moves of other pieces of the same type to the same square
+ *
+ * @param dest write the disambiguation here (0-2 chars, not terminated)
+ * @param board board before the move
+ * @param move move in UCI notation
+ * @param legalMoves legal moves in the position, NULL if not known
+ * @return number of chars written
+ */
+int san_disambiguation(char* dest, char board[boardSize][boardSize],
+        const char* move, const UciMoves* legalMoves)
+{
+    bool ambiguous = false;
+    bool sameFile = false;
+    bool sameRank = false;
+    for (int i = 0; legalMoves && i < legalMoves->numMoves; i++) {
+        const char* other = legalMoves->moves[i];
+        if (strncmp(other + 2, move + 2, 2) || !strncmp(other, move, 2)
+                || !is_square(other)
+                || piece_on(board, other) != piece_on(board, move)) {
+            continue;
+        }
+        ambiguous = true;
+        sameFile |= other[0] == move[0];
+        sameRank |= other[1] == move[1];
+    }
+    if (!ambiguous) {
+        return 0;
+    }
+    if (!sameFile) {
+        dest[0] = move[0];
+        return 1;
+    }
+    if (!sameRank) {
+        dest[0] = move[1];
+        return 1;
+    }
+    dest[0] = move[0];
+    dest[1] = move[1];
+    return 2;
+}
+
+void uci_to_san(char* dest, const char* fen, const char* move,
+        const UciMoves* legalMoves, bool check, bool mate)
+{
+    size_t moveLen = strlen(move);
+    if (moveLen < 4 || moveLen >= uciMoveSize || !is_square(move)
+            || !is_square(move + 2)) {
+        snprintf(dest, sanMoveSize, "%s", move); // not a move we understand
+        return;
+    }
+    char board[boardSize][boardSize];
+    fen_to_board(board, fen);
+    char piece = (char)toupper((unsigned char)piece_on(board, move));
+    bool capture = piece_on(board, move + 2) != '.';
+    int len = 0;
+    if (piece == 'K' && abs(move[2] - move[0]) == 2) {
+        len = sprintf(dest, move[2] > move[0] ? "O-O" : "O-O-O");
+    } else if (piece == 'P' || piece == '.') {
+        if (move[0] != move[2]) {
+            // Pawns only change file when capturing (possibly en passant)
+            len = sprintf(dest, "%cx", move[0]);
+        }
+        len += sprintf(dest + len, "%.2s", move + 2);
+        if (moveLen == uciMoveSize - 1) {
+            len += sprintf(dest + len, "=%c", toupper((unsigned char)move[4]));
+        }
+    } else {
+        dest[len++] = piece;
+        len += san_disambiguation(dest + len, board, move, legalMoves);
+        if (capture) {
+            dest[len++] = 'x';
+        }
+        len += sprintf(dest + len, "%.2s", move + 2);
+    }
+    if (mate) {
+        dest[len++] = '#';
+    } else if (check) {
+        dest[len++] = '+';
+    }
+    dest[len] = '\0';
+}
+
+/**
+ * @brief Append formatted text to PGN text, growing it as needed
+ *
+ * @param pgn PGN text to append to
+ * @param format printf-style format
+ */
+void pgn_append(PgnText* pgn, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (pgn->len + len + 1 > pgn->capacity) {
+        while (pgn->len + len + 1 > pgn->capacity) {
+            pgn->capacity *= 2;
+        }
+        pgn->text = (char*)realloc(pgn->text, pgn->capacity);
+    }
+    va_start(args, format);
+    vsnprintf(pgn->text + pgn->len, len + 1, format, args);
+    va_end(args);
+    pgn->len += len;
+}
+
+/**
+ * @brief Append a movetext token (move number, move or result), starting a new
+ * line if it wouldn't fit on the current one
+ *
+ * @param pgn PGN text to append to
+ * @param token token to append
+ */
+void pgn_token(PgnText* pgn, const char* token)
+{
+    int tokenLen = (int)strlen(token);
+    if (pgn->lineLen > 0 && pgn->lineLen + 1 + tokenLen > maxPgnLineLen) {
+        pgn_append(pgn, "\n");
+        pgn->lineLen = 0;
+    } else if (pgn->lineLen > 0) {
+        pgn_append(pgn, " ");
+        pgn->lineLen++;
+    }
+    pgn_append(pgn, "%s", token);
+    pgn->lineLen += tokenLen;
+}
+
+/**
+ * @brief Append the tag pairs of a game
+ *
+ * @param pgn PGN text to append to
+ * @param header tag values
+ */
+void pgn_tags(PgnText* pgn, PgnHeader* header)
+{
+    char date[pgnTokenSize];
+    time_t now = time(NULL);
+    struct tm localNow;
+    localtime_r(&now, &localNow);
+    strftime(date, sizeof(date), "%Y.%m.%d", &localNow);
+    pgn_append(pgn,
+            "[Event \"uqchessserver game\"]\n[Site \"uqchessserver\"]\n"
+            "[Date \"%s\"]\n[Round \"-\"]\n[White \"%s\"]\n[Black \"%s\"]\n"
+            "[Result \"%s\"]\n[GameId \"%ld\"]\n[Termination \"%s\"]\n",
+            date, header->white, header->black, header->result,
+            header->gameId, header->termination);
+    if (header->startFen) {
+        pgn_append(pgn, "[SetUp \"1\"]\n[FEN \"%s\"]\n", header->startFen);
+    }
+    pgn_append(pgn, "\n");
+}
+
+char* pgn_format(PgnHeader* header, PgnMove* moves, int numMoves)
+{
+    PgnText pgn = {.text = NULL,
+            .len = 0,
+            .capacity = initialPgnCapacity,
+            .lineLen = 0};
+    pgn.text = (char*)malloc(pgn.capacity);
+    pgn_tags(&pgn, header);
+
+    // Move numbers continue from the start position's full move number
+    char sideToMove = 'w';
+    int moveNumber = 1;
+    if (header->startFen) {
+        sscanf(header->startFen, "%*s %c %*s %*s %*d %d", &sideToMove,
+                &moveNumber);
+    }
+    char token[pgnTokenSize];
+    for (int i = 0; i < numMoves; i++) {
+        if (sideToMove == 'w') {
+            snprintf(token, sizeof(token), "%d.", moveNumber);
+            pgn_token(&pgn, token);
+        } else if (i == 0) {
+            snprintf(token, sizeof(token), "%d...", moveNumber);
+            pgn_token(&pgn, token);
+        }
+        pgn_token(&pgn, moves[i].san);
+        if (sideToMove == 'b') {
+            moveNumber++;
+        }
+        sideToMove = sideToMove == 'w' ? 'b' : 'w';
+    }
+    pgn_token(&pgn, header->result);
+    pgn_append(&pgn, "\n\n");
+    return pgn.text;
+}
+
+/**
+ * @brief Close the current archive file (if any) and open the next unused one
+ *
+ * @param archive archive to move to the next file of
+ * @return 0 on success, -1 if no file could be opened
+ */
+int archive_next_file(Archive* archive)
+{
+    if (archive->file) {
+        fclose(archive->file);
+        archive->file = NULL;
+    }
+    char path[strlen(archive->prefix) + pgnTokenSize];
+    // Skip over files left by previous runs rather than overwrite them
+    do {
+        archive->fileNum++;
+        sprintf(path, "%s-%04d.pgn", archive->prefix, archive->fileNum);
+    } while (access(path, F_OK) == 0 && archive->fileNum < maxArchiveFiles);
+    archive->file = fopen(path, "w");
+    if (!archive->file) {
+        return -1;
+    }
+    setvbuf(archive->file, NULL, _IOFBF, archiveBufferSize);
+    archive->gamesInFile = 0;
+    return 0;
+}
+
+/**
+ * @brief Archive writer thread. Writes queued games to the archive file,
+ * flushing whenever it runs out of games to write (after every game if writing
+ * to a stream).
+ *
+ * @param data Archive* - archive to write
+ * @return unused, never returns
+ */
+void* archive_writer_thread(void* data)
+{
+    Archive* archive = (Archive*)data;
+    while (1) {
+        char* pgn = (char*)queue_try_pop(archive->queue);
+        if (!pgn) {
+            if (archive->file) {
+                fflush(archive->file);
+            }
+            pgn = (char*)queue_pop(archive->queue);
+        }
+        if (archive->prefix && archive->gamesInFile == gamesPerArchiveFile) {
+            if (archive_next_file(archive) == -1) {
+                fprintf(stderr, "uqchessserver: can't open archive file\n");
+                fflush(stderr);
+            }
+        }
+        if (archive->file) {
+            fputs(pgn, archive->file);
+            archive->gamesInFile++;
+            if (!archive->prefix) {
+                fflush(archive->file);
+            }
+        }
+        free(pgn);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Create an archive's queue and start its writer thread
+ *
+ * @param archive archive with its file (or stream) set up
+ */
+void archive_start(Archive* archive)
+{
+    archive->queue = queue_create(archiveQueueCapacity);
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, archive_writer_thread, archive);
+    pthread_detach(threadId);
+}
+
+Archive* archive_open(const char* prefix)
+{
+    Archive* archive = (Archive*)malloc(sizeof(Archive));
+    archive->prefix = prefix;
+    archive->fileNum = 0;
+    archive->file = NULL;
+    if (archive_next_file(archive) == -1) {
+        free(archive);
+        return NULL;
+    }
+    archive_start(archive);
+    return archive;
+}
+
+Archive* archive_stream(FILE* stream)
+{
+    Archive* archive = (Archive*)malloc(sizeof(Archive));
+    archive->prefix = NULL;
+    archive->fileNum = 0;
+    archive->gamesInFile = 0;
+    archive->file = stream;
+    archive_start(archive);
+    return archive;
+}
+
+bool archive_add(Archive* archive, char* pgn)
+{
+    return queue_try_push(archive->queue, pgn);
+}
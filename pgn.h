@@ -0,0 +1,92 @@
+#ifndef PGN_H
+#define PGN_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "uci.h"
+
+// Size of a SAN move string, including the null terminator. The longest SAN
+// moves are like "exd8=Q#" or "Qh4xe1+".
+enum { sanMoveSize = 8 };
+
+// A move made in a game, in both UCI (e2e4) and SAN (e4) notation
+typedef struct PgnMove {
+    char uci[uciMoveSize];
+    char san[sanMoveSize];
+} PgnMove;
+
+// Tag values for a game written as PGN
+typedef struct PgnHeader {
+    long gameId;
+    // Who played each side (e.g. "human", "computer")
+    const char* white;
+    const char* black;
+    // FEN the game started from, NULL if it was the standard start position
+    const char* startFen;
+    // "1-0", "0-1", "1/2-1/2" or "*"
+    const char* result;
+    // How the game ended (e.g. "checkmate")
+    const char* termination;
+} PgnHeader;
+
+/**
+ * @brief Convert a move from UCI notation to SAN (standard algebraic
+ * notation), as used in PGN
+ *
+ * @param dest write the SAN move here (at least sanMoveSize chars)
+ * @param fen FEN of the position the move was made from
+ * @param move move in UCI notation, e.g. e7e8q
+ * @param legalMoves legal moves (UCI) in the position, used to tell apart
+ * pieces of the same type moving to the same square. NULL if not known.
+ * @param check whether the move gives check
+ * @param mate whether the move gives checkmate
+ */
+void uci_to_san(char* dest, const char* fen, const char* move,
+        const UciMoves* legalMoves, bool check, bool mate);
+
+/**
+ * @brief Format a game as PGN (tag pairs then movetext wrapped to under 80
+ * columns)
+ *
+ * @param header tag values for the game
+ * @param moves moves made in the game, in order
+ * @param numMoves number of moves
+ * @return malloc'd PGN text, ending with a blank line
+ */
+char* pgn_format(PgnHeader* header, PgnMove* moves, int numMoves);
+
+// Rotating set of PGN archive files (or a stream) written by a background
+// thread
+typedef struct Archive Archive;
+
+/**
+ * @brief Open the first unused archive file with the given prefix and start
+ * the archive's writer thread. Files are named <prefix>-<n>.pgn and a new one
+ * is started every gamesPerArchiveFile games.
+ *
+ * @param prefix path prefix of archive files
+ * @return the archive, or NULL if an archive file couldn't be opened
+ */
+Archive* archive_open(const char* prefix);
+
+/**
+ * @brief Start an archive writing to an open stream (stdout, say) instead of
+ * files. The stream is flushed after every game, so it gets whole games at a
+ * time even if other processes write games to it too.
+ *
+ * @param stream stream to write to, left open
+ * @return the archive
+ */
+Archive* archive_stream(FILE* stream);
+
+/**
+ * @brief Queue a game's PGN to be written to the archive. Never waits - if the
+ * writer thread has fallen too far behind the game is dropped.
+ *
+ * @param archive archive to write to
+ * @param pgn malloc'd PGN text, owned (and freed) by the archive if added
+ * @return true if queued, false if dropped (pgn not freed)
+ */
+bool archive_add(Archive* archive, char* pgn);
+
+#endif
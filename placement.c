@@ -0,0 +1,261 @@
+// CPU_SET() and friends
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "placement.h"
+
+// Function/type comments for the public interface are in placement.h
+
+// Most NUMA nodes looked for, and digits needed for a node's number
+int const maxNodes = 64;
+enum { nodeNumberSize = 4 };
+char const onlineCoresPath[] = "/sys/devices/system/cpu/online";
+char const nodeCoresPathFormat[] = "/sys/devices/system/node/node%d/cpulist";
+char const nodePrefix[] = "node";
+// Longest core list read from a file
+int const maxCoreListLen = 4096;
+
+/**
+ * @brief Parse a core number
+ *
+ * @param str digits
+ * @param end write where the number ends here
+ * @return the core, or -1 if there is no number or it's too big
+ */
+int parse_core(const char* str, char** end)
+{
+    if (!isdigit((unsigned char)*str)) {
+        return -1;
+    }
+    long core = strtol(str, end, 10);
+    return core < CPU_SETSIZE ? (int)core : -1;
+}
+
+/**
+ * @brief Add a core or range of cores (e.g. "4" or "2-5") to a set
+ *
+ * @param item core or range
+ * @param cores set to add to
+ * @return 0 if valid, -1 if not
+ */
+int add_core_range(const char* item, cpu_set_t* cores)
+{
+    char* end;
+    int first = parse_core(item, &end);
+    int last = first;
+    if (first >= 0 && *end == '-') {
+        last = parse_core(end + 1, &end);
+    }
+    if (first < 0 || last < first || *end != '\0') {
+        return -1;
+    }
+    for (int core = first; core <= last; core++) {
+        CPU_SET(core, cores);
+    }
+    return 0;
+}
+
+int node_cores(int node, cpu_set_t* cores);
+
+/**
+ * @brief Parse a comma-separated list of cores and ranges of cores
+ *
+ * @param list list to parse
+ * @param allowNodes whether the list may name NUMA nodes (e.g. "node1")
+ * @param cores write the cores here
+ * @return 0 if valid, -1 if not
+ */
+int parse_core_list(const char* list, bool allowNodes, cpu_set_t* cores)
+{
+    CPU_ZERO(cores);
+    char* copy = strdup(list);
+    char* save = NULL;
+    int result = 0;
+    for (char* item = strtok_r(copy, ",\n", &save); item && result == 0;
+            item = strtok_r(NULL, ",\n", &save)) {
+        if (allowNodes && !strncmp(item, nodePrefix, strlen(nodePrefix))) {
+            char* end;
+            int node = parse_core(item + strlen(nodePrefix), &end);
+            cpu_set_t nodeSet;
+            if (node < 0 || *end != '\0' || node_cores(node, &nodeSet) == -1) {
+                result = -1;
+            } else {
+                CPU_OR(cores, cores, &nodeSet);
+            }
+        } else {
+            result = add_core_range(item, cores);
+        }
+    }
+    free(copy);
+    return result;
+}
+
+/**
+ * @brief Read a list of cores from a file (as in /sys)
+ *
+ * @param path file to read
+ * @param cores write the cores here
+ * @return 0 if read, -1 if the file couldn't be read or isn't a list
+ */
+int read_core_list(const char* path, cpu_set_t* cores)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char list[maxCoreListLen];
+    bool read = fgets(list, maxCoreListLen, file) != NULL;
+    fclose(file);
+    return read ? parse_core_list(list, false, cores) : -1;
+}
+
+/**
+ * @brief Get the cores of a NUMA node
+ *
+ * @param node node number
+ * @param cores write the cores here
+ * @return 0 if the node exists, -1 if not
+ */
+int node_cores(int node, cpu_set_t* cores)
+{
+    char path[sizeof(nodeCoresPathFormat) + nodeNumberSize];
+    snprintf(path, sizeof(path), nodeCoresPathFormat, node);
+    return read_core_list(path, cores);
+}
+
+/**
+ * @brief Count the NUMA nodes
+ *
+ * @return number of nodes, 1 if the machine has none (isn't NUMA)
+ */
+int count_nodes(void)
+{
+    cpu_set_t cores;
+    int numNodes = 0;
+    while (numNodes < maxNodes && node_cores(numNodes, &cores) == 0) {
+        numNodes++;
+    }
+    return numNodes > 0 ? numNodes : 1;
+}
+
+/**
+ * @brief Get the online cores
+ *
+ * @param cores write the cores here
+ */
+void online_cores(cpu_set_t* cores)
+{
+    if (read_core_list(onlineCoresPath, cores) == 0) {
+        return;
+    }
+    CPU_ZERO(cores);
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long core = 0; core < numCores && core < CPU_SETSIZE; core++) {
+        CPU_SET(core, cores);
+    }
+}
+
+int placement_parse_cores(const char* list, cpu_set_t* cores)
+{
+    cpu_set_t online;
+    online_cores(&online);
+    if (parse_core_list(list, true, cores) == -1) {
+        return -1;
+    }
+    CPU_AND(cores, cores, &online);
+    return CPU_COUNT(cores) > 0 ? 0 : -1;
+}
+
+void placement_other_cores(const cpu_set_t* cores, cpu_set_t* others)
+{
+    online_cores(others);
+    for (int core = 0; core < CPU_SETSIZE; core++) {
+        if (CPU_ISSET(core, cores)) {
+            CPU_CLR(core, others);
+        }
+    }
+}
+
+/**
+ * @brief Get one of a number of shares of a set of cores: blocks of about
+ * equal size, or single cores used by several shares if there are fewer cores
+ * than shares
+ *
+ * @param cores cores to share out, not empty
+ * @param index which share
+ * @param count number of shares
+ * @param share write the share's cores here
+ */
+void share_cores(
+        const cpu_set_t* cores, int index, int count, cpu_set_t* share)
+{
+    int numCores = CPU_COUNT(cores);
+    int first = numCores >= count ? index * numCores / count : index % numCores;
+    int end = numCores >= count ? (index + 1) * numCores / count : first + 1;
+    CPU_ZERO(share);
+    int n = 0;
+    for (int core = 0; core < CPU_SETSIZE && n < end; core++) {
+        if (CPU_ISSET(core, cores)) {
+            if (n >= first) {
+                CPU_SET(core, share);
+            }
+            n++;
+        }
+    }
+}
+
+void placement_for_shard(const cpu_set_t* engineCores,
+        const cpu_set_t* serverCores, int shard, int numShards,
+        Placement* placement)
+{
+    cpu_set_t engineOnNode = *engineCores;
+    cpu_set_t serverOnNode = *serverCores;
+    int index = shard;
+    int count = numShards;
+    int numNodes = count_nodes();
+    int node = shard % numNodes;
+    cpu_set_t nodeSet;
+    placement->node = -1;
+    if (numNodes > 1 && node_cores(node, &nodeSet) == 0) {
+        CPU_AND(&engineOnNode, engineCores, &nodeSet);
+        CPU_AND(&serverOnNode, serverCores, &nodeSet);
+        if (CPU_COUNT(&engineOnNode) && CPU_COUNT(&serverOnNode)) {
+            // Shards go round the nodes, node n having shards n, n +
+            // numNodes, ...
+            placement->node = node;
+            index = shard / numNodes;
+            count = (numShards - node + numNodes - 1) / numNodes;
+        } else {
+            // Cores given aren't on the node, place without regard to nodes
+            engineOnNode = *engineCores;
+            serverOnNode = *serverCores;
+        }
+    }
+    share_cores(&engineOnNode, index, count, &placement->engineCores);
+    share_cores(&serverOnNode, index, count, &placement->serverCores);
+}
+
+void placement_format(char* dest, size_t size, const cpu_set_t* cores)
+{
+    size_t len = 0;
+    dest[0] = '\0';
+    for (int core = 0; core < CPU_SETSIZE && len < size; core++) {
+        if (!CPU_ISSET(core, cores)) {
+            continue;
+        }
+        int last = core;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cores)) {
+            last++;
+        }
+        const char* separator = len ? "," : "";
+        len += (size_t)(last > core
+                        ? snprintf(dest + len, size - len, "%s%d-%d",
+                                separator, core, last)
+                        : snprintf(dest + len, size - len, "%s%d", separator,
+                                core));
+        core = last;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sched.h>
+
+// Which cores engines and server threads run on. Cores are given as lists
+// like "0-3,8,node1", "nodeN" being the cores of NUMA node N. Shards share
+// out the cores, each shard's cores on one node where there is more than one.
+
+// Where one shard's processes and threads run
+typedef struct Placement {
+    // Cores for the shard's engines
+    cpu_set_t engineCores;
+    // Cores for the shard's connection, sender and worker threads
+    cpu_set_t serverCores;
+    // NUMA node the shard was placed on, -1 if none (only one node)
+    int node;
+} Placement;
+
+/**
+ * @brief Parse a list of cores
+ *
+ * @param list comma-separated cores, ranges of cores (e.g. 2-5) and NUMA
+ * nodes (e.g. node0)
+ * @param cores write the cores here
+ * @return 0 if valid, -1 if the list isn't valid or has no online cores
+ */
+int placement_parse_cores(const char* list, cpu_set_t* cores);
+
+/**
+ * @brief Get the online cores not in a set
+ *
+ * @param cores cores to leave out
+ * @param others write the other online cores here
+ */
+void placement_other_cores(const cpu_set_t* cores, cpu_set_t* others);
+
+/**
+ * @brief Work out where a shard runs, from the cores given for every shard's
+ * engines and server threads
+ *
+ * @param engineCores cores for all engines
+ * @param serverCores cores for all server threads
+ * @param shard which shard
+ * @param numShards number of shards
+ * @param placement write the shard's placement here
+ */
+void placement_for_shard(const cpu_set_t* engineCores,
+        const cpu_set_t* serverCores, int shard, int numShards,
+        Placement* placement);
+
+/**
+ * @brief Write a set of cores as a list, e.g. "0-3,8"
+ *
+ * @param dest write the list here
+ * @param size size of dest
+ * @param cores cores to write
+ */
+void placement_format(char* dest, size_t size, const cpu_set_t* cores);
+
+#endif
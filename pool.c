@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+// Function/type comments for the public interface are in pool.h
+
+// A task waiting to run
+typedef struct Task {
+    TaskFn fn;
+    void* arg;
+    struct Task* next; // next task in a strand
+} Task;
+
+// Double-ended queue of tasks. The owning worker pushes and pops at the
+// bottom, thieves take from the top.
+typedef struct TaskDeque {
+    pthread_mutex_t lock;
+    // Ring buffer, the top (oldest) task is at index top
+    Task** tasks;
+    size_t capacity;
+    size_t top;
+    size_t count;
+} TaskDeque;
+
+struct WorkPool {
+    int numWorkers;
+    TaskDeque* deques;
+    // Deque the next task submitted from outside the pool goes on
+    unsigned int nextDeque;
+    // Tasks submitted and not yet taken by a worker, workers sleep while 0
+    pthread_mutex_t idleLock;
+    pthread_cond_t workAvailable;
+    long pendingTasks;
+};
+
+// Data passed to a worker thread
+typedef struct WorkerData {
+    WorkPool* pool;
+    int index;
+} WorkerData;
+
+struct Strand {
+    WorkPool* pool;
+    pthread_mutex_t lock;
+    // Tasks waiting to run, oldest first
+    Task* head;
+    Task* tail;
+    // Whether a pool task is running (or queued to run) the strand's tasks
+    bool scheduled;
+    // Set once closed, the strand is freed when it runs out of tasks
+    bool closing;
+};
+
+size_t const initialDequeCapacity = 64;
+// Max tasks a strand runs before letting other work use the worker
+int const strandBatchSize = 16;
+
+// Pool and deque index of the worker running on this thread (NULL if not a
+// worker)
+static __thread WorkPool* currentPool = NULL;
+static __thread int currentWorker = 0;
+
+int pool_num_cores(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/**
+ * @brief Push a task on a deque, growing it if full
+ *
+ * @param deque deque to push on
+ * @param task task to push
+ * @param top true to push it as the oldest task (run after every other task
+ * of the owner), false as the newest
+ */
+void deque_push(TaskDeque* deque, Task* task, bool top)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        Task** tasks = (Task**)malloc(2 * deque->capacity * sizeof(Task*));
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity *= 2;
+        deque->top = 0;
+    }
+    if (top) {
+        deque->top = (deque->top + deque->capacity - 1) % deque->capacity;
+        deque->tasks[deque->top] = task;
+    } else {
+        deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+    }
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * @brief Take a task from the bottom (owner) or top (thief) of a deque
+ *
+ * @param deque deque to take from
+ * @param bottom true to take the newest task, false for the oldest
+ * @return the task, or NULL if the deque is empty
+ */
+Task* deque_take(TaskDeque* deque, bool bottom)
+{
+    Task* task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        if (bottom) {
+            task = deque->tasks[(deque->top + deque->count) % deque->capacity];
+        } else {
+            task = deque->tasks[deque->top];
+            deque->top = (deque->top + 1) % deque->capacity;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/**
+ * @brief Find a task for a worker: its own newest task, else the oldest task
+ * of another worker
+ *
+ * @param pool pool the worker belongs to
+ * @param index worker's deque index
+ * @return the task, or NULL if none was found
+ */
+Task* find_task(WorkPool* pool, int index)
+{
+    Task* task = deque_take(&pool->deques[index], true);
+    for (int i = 1; !task && i < pool->numWorkers; i++) {
+        task = deque_take(&pool->deques[(index + i) % pool->numWorkers], false);
+    }
+    return task;
+}
+
+/**
+ * @brief Worker thread. Runs tasks, sleeping while there are none.
+ *
+ * @param data WorkerData* - pool and index of the worker
+ * @return unused, never returns
+ */
+void* worker_thread(void* data)
+{
+    WorkerData workerData = *(WorkerData*)data;
+    free(data);
+    WorkPool* pool = workerData.pool;
+    currentPool = pool;
+    currentWorker = workerData.index;
+    while (1) {
+        Task* task = find_task(pool, workerData.index);
+        if (!task) {
+            pthread_mutex_lock(&pool->idleLock);
+            while (pool->pendingTasks == 0) {
+                pthread_cond_wait(&pool->workAvailable, &pool->idleLock);
+            }
+            pthread_mutex_unlock(&pool->idleLock);
+            continue;
+        }
+        __atomic_sub_fetch(&pool->pendingTasks, 1, __ATOMIC_ACQ_REL);
+        task->fn(task->arg);
+        free(task);
+    }
+    return NULL;
+}
+
+WorkPool* pool_create(int numWorkers)
+{
+    WorkPool* pool = (WorkPool*)malloc(sizeof(WorkPool));
+    pool->numWorkers = numWorkers;
+    pool->nextDeque = 0;
+    pool->pendingTasks = 0;
+    pthread_mutex_init(&pool->idleLock, NULL);
+    pthread_cond_init(&pool->workAvailable, NULL);
+    pool->deques = (TaskDeque*)malloc(numWorkers * sizeof(TaskDeque));
+    for (int i = 0; i < numWorkers; i++) {
+        TaskDeque* deque = &pool->deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->tasks = (Task**)malloc(initialDequeCapacity * sizeof(Task*));
+        deque->capacity = initialDequeCapacity;
+        deque->top = 0;
+        deque->count = 0;
+    }
+    for (int i = 0; i < numWorkers; i++) {
+        WorkerData* data = (WorkerData*)malloc(sizeof(WorkerData));
+        data->pool = pool;
+        data->index = i;
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, worker_thread, data);
+        pthread_detach(threadId);
+    }
+    return pool;
+}
+
+/**
+ * @brief Submit a task to a pool
+ *
+ * @param pool pool to run the task
+ * @param fn task function
+ * @param arg argument to call fn with
+ * @param last true to run it after the other tasks of the submitting worker,
+ * rather than before
+ */
+void pool_push(WorkPool* pool, TaskFn fn, void* arg, bool last)
+{
+    Task* task = (Task*)malloc(sizeof(Task));
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+    int index;
+    if (currentPool == pool) {
+        index = currentWorker;
+    } else {
+        index = (int)(__atomic_fetch_add(&pool->nextDeque, 1, __ATOMIC_RELAXED)
+                % pool->numWorkers);
+    }
+    // Counted before it can be taken, so the count never drops below the
+    // number of tasks in the deques (which would let workers sleep on work)
+    __atomic_add_fetch(&pool->pendingTasks, 1, __ATOMIC_ACQ_REL);
+    deque_push(&pool->deques[index], task, last);
+
+    pthread_mutex_lock(&pool->idleLock);
+    pthread_cond_signal(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+void pool_submit(WorkPool* pool, TaskFn fn, void* arg)
+{
+    pool_push(pool, fn, arg, false);
+}
+
+void pool_submit_last(WorkPool* pool, TaskFn fn, void* arg)
+{
+    pool_push(pool, fn, arg, true);
+}
+
+Strand* strand_create(WorkPool* pool)
+{
+    Strand* strand = (Strand*)malloc(sizeof(Strand));
+    strand->pool = pool;
+    pthread_mutex_init(&strand->lock, NULL);
+    strand->head = NULL;
+    strand->tail = NULL;
+    strand->scheduled = false;
+    strand->closing = false;
+    return strand;
+}
+
+/**
+ * @brief Free a strand with no tasks left
+ *
+ * @param strand strand to free
+ */
+void strand_free(Strand* strand)
+{
+    pthread_mutex_destroy(&strand->lock);
+    free(strand);
+}
+
+/**
+ * @brief Pool task that runs a batch of a strand's tasks in order, then
+ * resubmits itself if the strand has more
+ *
+ * @param data Strand* - strand to run
+ */
+void strand_run(void* data)
+{
+    Strand* strand = (Strand*)data;
+    for (int i = 0; i < strandBatchSize; i++) {
+        pthread_mutex_lock(&strand->lock);
+        Task* task = strand->head;
+        if (!task) {
+            strand->scheduled = false;
+            bool closing = strand->closing;
+            pthread_mutex_unlock(&strand->lock);
+            if (closing) {
+                strand_free(strand);
+            }
+            return;
+        }
+        strand->head = task->next;
+        if (!strand->head) {
+            strand->tail = NULL;
+        }
+        pthread_mutex_unlock(&strand->lock);
+        task->fn(task->arg);
+        free(task);
+    }
+    // Still scheduled, let other tasks run before the rest of this strand
+    // (queued behind them, so one busy connection can't starve the others)
+    pool_submit_last(strand->pool, strand_run, strand);
+}
+
+void strand_submit(Strand* strand, TaskFn fn, void* arg)
+{
+    Task* task = (Task*)malloc(sizeof(Task));
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+    pthread_mutex_lock(&strand->lock);
+    if (strand->tail) {
+        strand->tail->next = task;
+    } else {
+        strand->head = task;
+    }
+    strand->tail = task;
+    bool schedule = !strand->scheduled;
+    strand->scheduled = true;
+    pthread_mutex_unlock(&strand->lock);
+    if (schedule) {
+        pool_submit(strand->pool, strand_run, strand);
+    }
+}
+
+void strand_close(Strand* strand)
+{
+    pthread_mutex_lock(&strand->lock);
+    strand->closing = true;
+    bool idle = !strand->scheduled;
+    pthread_mutex_unlock(&strand->lock);
+    if (idle) {
+        strand_free(strand);
+    }
+}
+
+size_t strand_footprint(void)
+{
+    return sizeof(Strand);
+}
@@ -0,0 +1,86 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Fixed-size pool of worker threads that run tasks. Each worker has its own
+// deque of tasks: it takes its newest task first, and workers with nothing to
+// do steal the oldest tasks from others.
+
+// A task, run by calling it with the argument it was submitted with
+typedef void (*TaskFn)(void* arg);
+
+typedef struct WorkPool WorkPool;
+
+/**
+ * @brief Get the number of online CPU cores
+ *
+ * @return number of cores, at least 1
+ */
+int pool_num_cores(void);
+
+/**
+ * @brief Create a pool and start its worker threads
+ *
+ * @param numWorkers number of worker threads
+ * @return the pool
+ */
+WorkPool* pool_create(int numWorkers);
+
+/**
+ * @brief Queue a task to be run by one of the pool's workers. Tasks submitted
+ * from a worker go on that worker's own deque.
+ *
+ * @param pool pool to run the task
+ * @param fn task function
+ * @param arg argument to call fn with
+ */
+void pool_submit(WorkPool* pool, TaskFn fn, void* arg);
+
+/**
+ * @brief Queue a task like pool_submit(), but behind the submitting worker's
+ * other tasks rather than ahead of them, so a task that keeps submitting
+ * itself again lets the others run in between
+ *
+ * @param pool pool to run the task
+ * @param fn task function
+ * @param arg argument to call fn with
+ */
+void pool_submit_last(WorkPool* pool, TaskFn fn, void* arg);
+
+// Sequence of tasks run by a pool one at a time, in the order submitted
+typedef struct Strand Strand;
+
+/**
+ * @brief Create an empty strand
+ *
+ * @param pool pool to run the strand's tasks
+ * @return the strand
+ */
+Strand* strand_create(WorkPool* pool);
+
+/**
+ * @brief Queue a task to run after every task already submitted to the strand
+ *
+ * @param strand strand to add to
+ * @param fn task function
+ * @param arg argument to call fn with
+ */
+void strand_submit(Strand* strand, TaskFn fn, void* arg);
+
+/**
+ * @brief Free a strand once every task already submitted to it has run. Never
+ * waits. Nothing may be submitted to the strand once this is called.
+ *
+ * @param strand strand to close
+ */
+void strand_close(Strand* strand);
+
+/**
+ * @brief Get the memory a strand with no tasks uses
+ *
+ * @return bytes per idle strand
+ */
+size_t strand_footprint(void);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "position.h"
+
+// Function/type comments for the public interface are in position.h
+
+enum { boardSize = 8, numSquares = 64 };
+// Castling rights, as bits of Position.castling (in the order of
+// castlingLetters)
+enum {
+    castleWhiteKing = 1,
+    castleWhiteQueen = 2,
+    castleBlackKing = 4,
+    castleBlackQueen = 8
+};
+// Where each kind of Zobrist number starts: one per piece on each square,
+// then black to play, then each castling right, then each en passant file
+enum {
+    numPieceKinds = 12,
+    blackToPlayKey = numPieceKinds * numSquares,
+    castlingKeys = blackToPlayKey + 1,
+    enPassantKeys = castlingKeys + 4
+};
+char const zobristPieces[] = "PNBRQKpnbrqk";
+char const castlingLetters[] = "KQkq";
+
+/**
+ * @brief Get one of the random numbers Zobrist keys are made from. They are
+ * the splitmix64 sequence, so every run (and process) has the same ones.
+ *
+ * @param index which number
+ * @return the number
+ */
+uint64_t zobrist(int index)
+{
+    uint64_t z = (uint64_t)(index + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Get the Zobrist number of a piece on a square
+ *
+ * @param piece piece letter, '.' for none
+ * @param square square, 0 (a8) to 63 (h1)
+ * @return the number, 0 for no piece
+ */
+uint64_t piece_key(char piece, int square)
+{
+    const char* kind = piece == '.' ? NULL : strchr(zobristPieces, piece);
+    if (!kind || !*kind) {
+        return 0;
+    }
+    return zobrist((int)(kind - zobristPieces) * numSquares + square);
+}
+
+/**
+ * @brief Get the Zobrist numbers of a set of castling rights, combined
+ *
+ * @param castling castling rights
+ * @return the numbers XORed together
+ */
+uint64_t castling_key(unsigned castling)
+{
+    uint64_t key = 0;
+    for (int right = 0; right < 4; right++) {
+        if (castling & (1u << right)) {
+            key ^= zobrist(castlingKeys + right);
+        }
+    }
+    return key;
+}
+
+/**
+ * @brief Get the square a square name (e.g. "e4") is
+ *
+ * @param name square name
+ * @return the square, 0 (a8) to 63 (h1)
+ */
+int square_named(const char* name)
+{
+    return ('8' - name[1]) * boardSize + (name[0] - 'a');
+}
+
+/**
+ * @brief Check whether the side to move has a pawn beside a pawn that has
+ * just moved two squares, so could capture it en passant. En passant only
+ * changes the position (and its key) when it could be played.
+ *
+ * @param position position after the pawn moved
+ * @param square square the pawn moved to
+ * @return true if it could be captured
+ */
+bool can_capture_en_passant(const Position* position, int square)
+{
+    char capturer = position->whiteToPlay ? 'P' : 'p';
+    int file = square % boardSize;
+    bool left = file > 0 && position->board[square - 1] == capturer;
+    bool right = file < boardSize - 1
+            && position->board[square + 1] == capturer;
+    return left || right;
+}
+
+void position_from_fen(Position* position, const char* fen)
+{
+    memset(position->board, '.', numSquares);
+    for (int square = 0; *fen && *fen != ' ' && square < numSquares; fen++) {
+        if (isdigit((unsigned char)*fen)) {
+            square += *fen - '0';
+        } else if (*fen != '/') {
+            position->board[square++] = *fen;
+        }
+    }
+    char side[2] = "w";
+    char castling[5] = "-";
+    char enPassant[3] = "-";
+    position->halfMoves = 0;
+    sscanf(fen, " %1s %4s %2s %d", side, castling, enPassant,
+            &position->halfMoves);
+    position->whiteToPlay = side[0] != 'b';
+    position->castling = 0;
+    for (int right = 0; right < 4; right++) {
+        if (strchr(castling, castlingLetters[right])) {
+            position->castling |= 1u << right;
+        }
+    }
+    position->enPassantFile = -1;
+    if (enPassant[0] >= 'a' && enPassant[0] <= 'h'
+            && (enPassant[1] == '3' || enPassant[1] == '6')) {
+        // The pawn is a square past the one it passed over
+        int passed = square_named(enPassant);
+        int pawn = passed + (position->whiteToPlay ? boardSize : -boardSize);
+        if (can_capture_en_passant(position, pawn)) {
+            position->enPassantFile = pawn % boardSize;
+        }
+    }
+    position->key = position->whiteToPlay ? 0 : zobrist(blackToPlayKey);
+    for (int square = 0; square < numSquares; square++) {
+        position->key ^= piece_key(position->board[square], square);
+    }
+    position->key ^= castling_key(position->castling);
+    if (position->enPassantFile >= 0) {
+        position->key ^= zobrist(enPassantKeys + position->enPassantFile);
+    }
+}
+
+/**
+ * @brief Move a piece from one square to another (capturing whatever is
+ * there), updating the key
+ *
+ * @param position position to move in
+ * @param from square moved from
+ * @param to square moved to
+ * @param placed piece that ends up on the square (differs if promoting)
+ */
+void move_piece(Position* position, int from, int to, char placed)
+{
+    position->key ^= piece_key(position->board[from], from)
+            ^ piece_key(position->board[to], to) ^ piece_key(placed, to);
+    position->board[from] = '.';
+    position->board[to] = placed;
+}
+
+/**
+ * @brief Get the castling rights lost when a piece moves from or to a square
+ * (a king or rook moving, or a rook being captured)
+ *
+ * @param square square moved from or to
+ * @return rights lost
+ */
+unsigned castling_lost(int square)
+{
+    switch (square) {
+    case 0: // a8
+        return castleBlackQueen;
+    case 4: // e8
+        return castleBlackKing | castleBlackQueen;
+    case 7: // h8
+        return castleBlackKing;
+    case 56: // a1
+        return castleWhiteQueen;
+    case 60: // e1
+        return castleWhiteKing | castleWhiteQueen;
+    case 63: // h1
+        return castleWhiteKing;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Make the parts of a move besides moving the piece: the rook's move
+ * when castling, and the pawn taken when capturing en passant
+ *
+ * @param position position being moved in, the piece not moved yet
+ * @param from square moved from
+ * @param to square moved to
+ */
+void move_extras(Position* position, int from, int to)
+{
+    char piece = (char)tolower((unsigned char)position->board[from]);
+    int rank = from - from % boardSize;
+    if (piece == 'k' && abs(to - from) == 2) {
+        if (to > from) {
+            move_piece(position, rank + boardSize - 1, to - 1,
+                    position->board[rank + boardSize - 1]);
+        } else {
+            move_piece(position, rank, to + 1, position->board[rank]);
+        }
+    } else if (piece == 'p' && from % boardSize != to % boardSize
+            && position->board[to] == '.') {
+        // The pawn taken is beside the one taking it
+        int taken = rank + to % boardSize;
+        position->key ^= piece_key(position->board[taken], taken);
+        position->board[taken] = '.';
+    }
+}
+
+void position_move(Position* position, const char* move)
+{
+    int from = square_named(move);
+    int to = square_named(move + 2);
+    char piece = position->board[from];
+    bool resetsClock = tolower((unsigned char)piece) == 'p'
+            || position->board[to] != '.';
+    if (position->enPassantFile >= 0) {
+        position->key ^= zobrist(enPassantKeys + position->enPassantFile);
+        position->enPassantFile = -1;
+    }
+    move_extras(position, from, to);
+    char placed = piece;
+    if (move[4]) {
+        // Promotion piece, in the mover's case
+        char promoted = (char)tolower((unsigned char)move[4]);
+        placed = position->whiteToPlay ? (char)toupper(promoted) : promoted;
+    }
+    move_piece(position, from, to, placed);
+    unsigned castling = position->castling & ~castling_lost(from)
+            & ~castling_lost(to);
+    position->key ^= castling_key(position->castling) ^ castling_key(castling);
+    position->castling = castling;
+    position->whiteToPlay = !position->whiteToPlay;
+    position->key ^= zobrist(blackToPlayKey);
+    if (tolower((unsigned char)piece) == 'p'
+            && abs(to - from) == 2 * boardSize
+            && can_capture_en_passant(position, to)) {
+        position->enPassantFile = to % boardSize;
+        position->key ^= zobrist(enPassantKeys + position->enPassantFile);
+    }
+    position->halfMoves = resetsClock ? 0 : position->halfMoves + 1;
+}
+
+bool position_insufficient_material(const Position* position)
+{
+    int minorPieces = 0;
+    bool knights = false;
+    // Bit 0 set for a bishop on a light square, bit 1 for a dark square
+    unsigned bishopColours = 0;
+    for (int square = 0; square < numSquares; square++) {
+        char piece = (char)tolower((unsigned char)position->board[square]);
+        if (piece == 'p' || piece == 'r' || piece == 'q') {
+            return false;
+        }
+        if (piece == 'n') {
+            knights = true;
+            minorPieces++;
+        } else if (piece == 'b') {
+            minorPieces++;
+            int colour = (square / boardSize + square % boardSize) % 2;
+            bishopColours |= 1u << colour;
+        }
+    }
+    return minorPieces <= 1 || (!knights && bishopColours != 3);
+}
+
+int position_repetitions(const uint64_t* keys, int numKeys, int halfMoves)
+{
+    int count = 1;
+    // Only positions with the same side to play can be the same
+    int earliest = numKeys - 1 - halfMoves;
+    for (int i = numKeys - 3; i >= 0 && i >= earliest; i -= 2) {
+        if (keys[i] == keys[numKeys - 1]) {
+            count++;
+        }
+    }
+    return count;
+}
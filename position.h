@@ -0,0 +1,69 @@
+#ifndef POSITION_H
+#define POSITION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A game's position, kept up to date move by move, with its Zobrist hash: a
+// 64-bit key made by XORing a fixed random number for each piece on each
+// square, the side to move, each castling right and the en passant file. A
+// move only changes the few numbers for what it changed, so the key is kept
+// up to date without looking at the rest of the board. Positions that are the
+// same for the rules of repetition (whatever the move counters) have the same
+// key, so it also serves as a cheap key for caching positions.
+
+// Halfmove clock (moves since the last capture or pawn move) at which the
+// fifty-move rule draws a game
+enum { fiftyMoveHalfMoves = 100 };
+
+typedef struct Position {
+    // Piece letters as in FEN, '.' if empty. Square 0 is a8, 63 is h1.
+    char board[64];
+    bool whiteToPlay;
+    // Castling rights: bits for K, Q, k and q
+    unsigned castling;
+    // File a pawn can be captured on en passant, -1 if none
+    int enPassantFile;
+    int halfMoves;
+    // Zobrist hash
+    uint64_t key;
+} Position;
+
+/**
+ * @brief Set up a position from a FEN string
+ *
+ * @param position write the position here
+ * @param fen FEN string (the move counters may be left out)
+ */
+void position_from_fen(Position* position, const char* fen);
+
+/**
+ * @brief Make a move, updating the hash for just what the move changes
+ *
+ * @param position position to move in
+ * @param move legal move in UCI notation, e.g. e7e8q
+ */
+void position_move(Position* position, const char* move);
+
+/**
+ * @brief Check whether neither side has enough material left to checkmate:
+ * kings with at most one knight or bishop between them, or with only bishops
+ * all on the same colour of square
+ *
+ * @param position position to check
+ * @return true if it is a dead draw
+ */
+bool position_insufficient_material(const Position* position);
+
+/**
+ * @brief Count how many times the latest position of a game has occurred,
+ * looking back only as far as the last capture or pawn move
+ *
+ * @param keys key of every position of the game in order, the latest last
+ * @param numKeys number of positions
+ * @param halfMoves halfmove clock of the latest position
+ * @return times the latest position has occurred, including itself
+ */
+int position_repetitions(const uint64_t* keys, int numKeys, int halfMoves);
+
+#endif
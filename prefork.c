@@ -0,0 +1,205 @@
+// pipe2()
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "prefork.h"
+
+// Function/type comments for the public interface are in prefork.h
+
+struct Prefork {
+    int numWorkers;
+    // Socket pair per worker: the worker receives on [0], anyone sends on [1]
+    int (*channels)[2];
+    // Master only: process id, number of starts and time of last start of
+    // each worker
+    pid_t* pids;
+    int* starts;
+    time_t* startTimes;
+    // Workers write a byte here once started, the first time only
+    int readyPipe[2];
+    // Worker only: which worker this is, and its number of restarts
+    int self;
+    int restarts;
+};
+
+// Workers that exit within this many seconds of starting are restarted after
+// this long, so a worker that can't run doesn't spin
+int const restartDelaySeconds = 1;
+// How often the master checks for workers dying while starting (ms)
+int const startupPollMs = 100;
+
+void* shared_alloc(size_t size)
+{
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+void shared_mutex_init(pthread_mutex_t* mutex)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void shared_mutex_lock(pthread_mutex_t* mutex)
+{
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        // Owner died part way through an update, carry on with what it left
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+Prefork* prefork_create(int numWorkers)
+{
+    Prefork* prefork = (Prefork*)malloc(sizeof(Prefork));
+    prefork->numWorkers = numWorkers;
+    prefork->channels = (int(*)[2])malloc(numWorkers * sizeof(int[2]));
+    prefork->pids = (pid_t*)calloc(numWorkers, sizeof(pid_t));
+    prefork->starts = (int*)calloc(numWorkers, sizeof(int));
+    prefork->startTimes = (time_t*)calloc(numWorkers, sizeof(time_t));
+    prefork->self = -1;
+    prefork->restarts = 0;
+    // Close-on-exec so processes the workers run (the engine) don't get them
+    if (pipe2(prefork->readyPipe, O_CLOEXEC) == -1) {
+        return NULL;
+    }
+    for (int i = 0; i < numWorkers; i++) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0,
+                    prefork->channels[i])
+                == -1) {
+            return NULL;
+        }
+    }
+    return prefork;
+}
+
+/**
+ * @brief Fork a worker
+ *
+ * @param prefork prefork state
+ * @param worker index of the worker
+ * @return 0 in the worker, its process id in the master
+ */
+pid_t fork_worker(Prefork* prefork, int worker)
+{
+    pid_t masterPid = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Workers don't outlive the master
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != masterPid) {
+            _exit(EXIT_FAILURE); // master died before prctl()
+        }
+        prefork->self = worker;
+        prefork->restarts = prefork->starts[worker];
+        return 0;
+    }
+    prefork->pids[worker] = pid;
+    prefork->starts[worker]++;
+    prefork->startTimes[worker] = time(NULL);
+    return pid;
+}
+
+/**
+ * @brief Wait for every worker to be ready. Exits with a worker's exit status
+ * if it exits first.
+ *
+ * @param prefork prefork state
+ */
+void wait_until_ready(Prefork* prefork)
+{
+    int numReady = 0;
+    struct pollfd readyPoll = {.fd = prefork->readyPipe[0], .events = POLLIN};
+    while (numReady < prefork->numWorkers) {
+        if (poll(&readyPoll, 1, startupPollMs) > 0) {
+            char bytes[prefork->numWorkers];
+            ssize_t numRead = read(prefork->readyPipe[0], bytes,
+                    prefork->numWorkers - numReady);
+            numReady += numRead > 0 ? (int)numRead : 0;
+        }
+        int status;
+        if (waitpid(-1, &status, WNOHANG) > 0) {
+            for (int i = 0; i < prefork->numWorkers; i++) {
+                kill(prefork->pids[i], SIGKILL);
+            }
+            exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+        }
+    }
+    // Restarted workers don't report being ready
+    close(prefork->readyPipe[0]);
+    close(prefork->readyPipe[1]);
+}
+
+int prefork_run(Prefork* prefork, PreforkHandlers* handlers)
+{
+    for (int i = 0; i < prefork->numWorkers; i++) {
+        if (fork_worker(prefork, i) == 0) {
+            return i;
+        }
+    }
+    wait_until_ready(prefork);
+    handlers->started(handlers->data);
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        int worker = 0;
+        while (worker < prefork->numWorkers && prefork->pids[worker] != pid) {
+            worker++;
+        }
+        if (pid < 0 || worker == prefork->numWorkers) {
+            continue;
+        }
+        if (time(NULL) - prefork->startTimes[worker] < restartDelaySeconds) {
+            sleep(restartDelaySeconds);
+        }
+        handlers->restarting(worker, handlers->data);
+        if (fork_worker(prefork, worker) == 0) {
+            return worker;
+        }
+    }
+}
+
+void prefork_ready(Prefork* prefork)
+{
+    if (prefork->restarts == 0) {
+        char byte = 0;
+        write(prefork->readyPipe[1], &byte, 1);
+    }
+}
+
+int prefork_restarts(Prefork* prefork)
+{
+    return prefork->restarts;
+}
+
+int prefork_send(Prefork* prefork, int worker, const void* buf, size_t len)
+{
+    ssize_t sent;
+    do {
+        sent = send(prefork->channels[worker][1], buf, len, 0);
+    } while (sent < 0 && errno == EINTR);
+    return sent < 0 ? -1 : 0;
+}
+
+ssize_t prefork_receive(Prefork* prefork, void* buf, size_t size)
+{
+    ssize_t received;
+    do {
+        received = recv(prefork->channels[prefork->self][0], buf, size, 0);
+    } while (received < 0 && errno == EINTR);
+    return received;
+}
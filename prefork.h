@@ -0,0 +1,104 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Prefork mode: a master process forks worker processes and restarts any that
+// exit, so a crash only takes down one worker. Workers share memory allocated
+// before they were forked, and can send each other messages.
+
+/**
+ * @brief Allocate zeroed memory shared by every process forked after this
+ *
+ * @param size number of bytes
+ * @return the memory, or NULL if it couldn't be allocated
+ */
+void* shared_alloc(size_t size);
+
+/**
+ * @brief Initialise a mutex in shared memory, usable from every process. If
+ * a process dies holding it, the next process to lock it gets it.
+ *
+ * @param mutex mutex to initialise
+ */
+void shared_mutex_init(pthread_mutex_t* mutex);
+
+/**
+ * @brief Lock a mutex, taking it over if its owner died holding it. Also works
+ * for ordinary mutexes.
+ *
+ * @param mutex mutex to lock
+ */
+void shared_mutex_lock(pthread_mutex_t* mutex);
+
+typedef struct Prefork Prefork;
+
+// Callbacks made in the master process
+typedef struct PreforkHandlers {
+    // Every worker has called prefork_ready() for the first time
+    void (*started)(void* data);
+    // A worker exited and is about to be restarted
+    void (*restarting)(int worker, void* data);
+    // Passed to every callback
+    void* data;
+} PreforkHandlers;
+
+/**
+ * @brief Set up prefork mode, before forking anything
+ *
+ * @param numWorkers number of worker processes
+ * @return the prefork state, or NULL if it couldn't be set up
+ */
+Prefork* prefork_create(int numWorkers);
+
+/**
+ * @brief Fork the workers, then supervise them from the master: each worker
+ * that exits is forked again. If a worker exits before it is ready, the
+ * master exits with its exit status.
+ *
+ * @param prefork prefork state
+ * @param handlers callbacks to make in the master
+ * @return the index of the worker, only returns in worker processes
+ */
+int prefork_run(Prefork* prefork, PreforkHandlers* handlers);
+
+/**
+ * @brief Tell the master this worker has finished starting up
+ *
+ * @param prefork prefork state
+ */
+void prefork_ready(Prefork* prefork);
+
+/**
+ * @brief Get how many times this worker was restarted before this start
+ *
+ * @param prefork prefork state
+ * @return 0 for the first start of the worker
+ */
+int prefork_restarts(Prefork* prefork);
+
+/**
+ * @brief Send a message to a worker. Messages from one thread arrive in the
+ * order sent.
+ *
+ * @param prefork prefork state
+ * @param worker worker to send to
+ * @param buf message
+ * @param len message length
+ * @return 0 on success, -1 on error
+ */
+int prefork_send(Prefork* prefork, int worker, const void* buf, size_t len);
+
+/**
+ * @brief Wait for a message sent to this worker
+ *
+ * @param prefork prefork state
+ * @param buf write the message here
+ * @param size size of buf
+ * @return message length, or -1 on error
+ */
+ssize_t prefork_receive(Prefork* prefork, void* buf, size_t size);
+
+#endif
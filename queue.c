@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "queue.h"
+
+// Function comments are in queue.h
+
+struct BoundedQueue {
+    pthread_mutex_t lock;
+    // Signalled when an item is added/removed
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    // Ring buffer of items, front is at index head
+    void** items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+BoundedQueue* queue_create(size_t capacity)
+{
+    BoundedQueue* queue = (BoundedQueue*)malloc(sizeof(BoundedQueue));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+    queue->items = (void**)malloc(capacity * sizeof(void*));
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    return queue;
+}
+
+/**
+ * @brief Add an item to the back of a queue known to have space. Queue must be
+ * locked.
+ *
+ * @param queue queue to add to
+ * @param item item to add
+ */
+void queue_add_locked(BoundedQueue* queue, void* item)
+{
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+}
+
+/**
+ * @brief Remove the item at the front of a queue known to be non-empty. Queue
+ * must be locked.
+ *
+ * @param queue queue to remove from
+ * @return the item removed
+ */
+void* queue_remove_locked(BoundedQueue* queue)
+{
+    void* item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+    return item;
+}
+
+void queue_push(BoundedQueue* queue, void* item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+    }
+    queue_add_locked(queue, item);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+bool queue_try_push(BoundedQueue* queue, void* item)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool added = queue->count < queue->capacity;
+    if (added) {
+        queue_add_locked(queue, item);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return added;
+}
+
+void* queue_pop(BoundedQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+    void* item = queue_remove_locked(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+void* queue_try_pop(BoundedQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    void* item = queue->count > 0 ? queue_remove_locked(queue) : NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
@@ -0,0 +1,53 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed-capacity FIFO queue of pointers, safe to share between threads.
+
+typedef struct BoundedQueue BoundedQueue;
+
+/**
+ * @brief Create an empty queue
+ *
+ * @param capacity max number of items the queue can hold
+ * @return the queue
+ */
+BoundedQueue* queue_create(size_t capacity);
+
+/**
+ * @brief Add an item to the back of the queue, waiting for space if it is full
+ *
+ * @param queue queue to add to
+ * @param item item to add
+ */
+void queue_push(BoundedQueue* queue, void* item);
+
+/**
+ * @brief Add an item to the back of the queue if there is space, never waits
+ *
+ * @param queue queue to add to
+ * @param item item to add
+ * @return true if added, false if the queue was full
+ */
+bool queue_try_push(BoundedQueue* queue, void* item);
+
+/**
+ * @brief Remove the item at the front of the queue, waiting for one if the
+ * queue is empty
+ *
+ * @param queue queue to remove from
+ * @return the item removed
+ */
+void* queue_pop(BoundedQueue* queue);
+
+/**
+ * @brief Remove the item at the front of the queue if there is one, never waits
+ *
+ * @param queue queue to remove from
+ * @return the item removed, or NULL if the queue was empty
+ */
+void* queue_try_pop(BoundedQueue* queue);
+
+#endif
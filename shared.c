@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <unistd.h>
 #include "shared.h"
 
 // Function/constant comments are in shared.h
@@ -13,6 +14,9 @@ int const smallerBufferSize = 100;
 size_t const minMoveLen = 4;
 size_t const maxMoveLen = 5;
 
+long const untaggedGame = -1;
+size_t const maxNumberDigits = 9;
+
 // Number of fields that can be in valid instruction lines
 int const shortLine = 1;
 int const mediumLine = 2;
@@ -72,12 +76,16 @@ int get_socket_fd(char* port)
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
         // error creating socket
+        freeaddrinfo(ai);
         return -1;
     }
     if (connect(fd, ai->ai_addr, sizeof(struct sockaddr))) {
         // Error connecting
+        close(fd);
+        freeaddrinfo(ai);
         return -1;
     }
+    freeaddrinfo(ai);
     return fd;
 }
 
@@ -139,15 +147,32 @@ int try_to_write(FILE* stream, char* text)
     return 0;
 }
 
+long parse_number(char* str)
+{
+    size_t len = strlen(str);
+    if (len == 0 || len > maxNumberDigits) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)str[i])) {
+            return -1;
+        }
+    }
+    return strtol(str, NULL, 10);
+}
+
 int validate_line(char* line)
 {
     if (strlen(line) == 0) {
         warn_bug((char*)"this line length code should be unreachable\n");
     }
+    // Check tokens while the newline is still there (has_valid_tokens()
+    // expects it)
+    bool validTokens = has_valid_tokens(line);
     if (remove_newline(line) == -1) {
         warn_bug((char*)"Line should end with newline\n");
     }
-    if (!has_valid_tokens(line)) {
+    if (!validTokens) {
         // msg is invalid
         return -1;
     }
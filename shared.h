@@ -12,6 +12,11 @@ extern int const smallerBufferSize;
 extern size_t const maxMoveLen;
 extern size_t const minMoveLen;
 
+// Tag of a connection's default game (commands without a "game <tag>" prefix)
+extern long const untaggedGame;
+// Max number of digits in a number (e.g. game tag) in a command/response
+extern size_t const maxNumberDigits;
+
 // Number of fields that can be in valid instruction lines
 extern int const shortLine;
 extern int const mediumLine;
@@ -122,6 +127,15 @@ int remove_newline(char* str);
  */
 int try_to_write(FILE* stream, char* text);
 
+/**
+ * @brief Parse a non-negative number given in a command/response, e.g. the tag
+ * of a "game <tag> ..." command or a game id.
+ *
+ * @param str number string, must be all digits (at most maxNumberDigits)
+ * @return the number, or -1 if str isn't a valid number
+ */
+long parse_number(char* str);
+
 /**
  * @brief Ensure line is not blank and ends with newline. Removes newline. Check
  * if it has valid tokens
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "check.h"
+#include "idmap.h"
+
+// Unit checks of the id map, above all that removing an id (which moves
+// later entries of its probe run back) leaves every other id findable
+
+// Ids used by the churn check, few enough that probe runs collide and wrap
+// around the table
+enum { numChurnIds = 200 };
+int const numChurnSteps = 20000;
+// Ids put by the growth check (many more than the table starts with), and the
+// gap between them
+long const numGrowIds = 1000;
+long const growIdStep = 64;
+
+/**
+ * @brief idmap_for_each callback counting the entries
+ *
+ * @param id unused
+ * @param value unused
+ * @param data long* - count to add to
+ */
+void count_entry(long id, void* value, void* data)
+{
+    (void)id;
+    (void)value;
+    (*(long*)data)++;
+}
+
+/**
+ * @brief Check a map holds exactly the ids marked present
+ *
+ * @param map map to check
+ * @param present which ids should be in the map
+ * @param values each id's value
+ * @return true if the map matches
+ */
+bool map_matches(IdMap* map, const bool* present, int* values)
+{
+    long expected = 0;
+    for (int id = 0; id < numChurnIds; id++) {
+        if (idmap_get(map, id) != (present[id] ? &values[id] : NULL)) {
+            return false;
+        }
+        expected += present[id];
+    }
+    long count = 0;
+    idmap_for_each(map, count_entry, &count);
+    return count == expected;
+}
+
+/**
+ * @brief Put and remove ids at random, checking after each step that every
+ * id still in the map is found and no removed one is
+ */
+void check_churn(void)
+{
+    IdMap* map = idmap_create();
+    bool present[numChurnIds] = {false};
+    int values[numChurnIds];
+    bool matched = true;
+    srandom(1);
+    for (int step = 0; step < numChurnSteps && matched; step++) {
+        int id = (int)(random() % numChurnIds);
+        if (random() % 2) {
+            idmap_put(map, id, &values[id]);
+            present[id] = true;
+        } else {
+            void* expected = present[id] ? &values[id] : NULL;
+            matched = idmap_remove(map, id) == expected;
+            present[id] = false;
+        }
+        matched = matched && map_matches(map, present, values);
+    }
+    check(matched, "ids found after random puts and removes");
+}
+
+int main(void)
+{
+    IdMap* map = idmap_create();
+    int a, b;
+    check(idmap_get(map, 1) == NULL, "empty map has no id 1");
+    idmap_put(map, 1, &a);
+    idmap_put(map, 1, &b);
+    check(idmap_get(map, 1) == &b, "put replaces the value");
+    check(idmap_remove(map, 2) == NULL, "removing a missing id gives NULL");
+    check(idmap_remove(map, 1) == &b, "remove gives the value");
+    check(idmap_get(map, 1) == NULL, "removed id is gone");
+    for (long id = 0; id < numGrowIds; id++) {
+        idmap_put(map, id * growIdStep, &a);
+    }
+    bool found = true;
+    for (long id = 0; id < numGrowIds; id += 2) {
+        found = found && idmap_remove(map, id * growIdStep) == &a;
+    }
+    for (long id = 1; id < numGrowIds; id += 2) {
+        found = found && idmap_get(map, id * growIdStep) == &a;
+    }
+    check(found, "odd ids found after growing and removing even ones");
+    check_churn();
+    return check_report("idmap");
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include "check.h"
+#include "lobby.h"
+
+// Unit checks of finding an opponent in the lobby: how far the window
+// reaches, and which of several players is found
+
+enum { numSides = 2, maxPlayers = 8 };
+unsigned const bothSides = (1u << numSides) - 1;
+
+// Players waiting, named by their data
+typedef struct Waiting {
+    Lobby* lobby;
+    LobbyEntry entries[maxPlayers];
+    const char* names[maxPlayers];
+    int numPlayers;
+    long nextOrder;
+} Waiting;
+
+/**
+ * @brief Start an empty lobby
+ *
+ * @param waiting put the lobby and (no) players here
+ */
+void start_waiting(Waiting* waiting)
+{
+    waiting->lobby = lobby_create(numSides);
+    waiting->numPlayers = 0;
+    waiting->nextOrder = 0;
+}
+
+/**
+ * @brief Add a player to the lobby, after everyone added before
+ *
+ * @param waiting lobby to add to
+ * @param name player's name, what lobby_find() gives back for them
+ * @param side side the player waits on
+ * @param rating player's rating
+ * @return the player's entry
+ */
+LobbyEntry* wait_for_game(
+        Waiting* waiting, const char* name, int side, int rating)
+{
+    int player = waiting->numPlayers++;
+    waiting->names[player] = name;
+    LobbyEntry* entry = &waiting->entries[player];
+    lobby_entry_init(entry, (void*)waiting->names[player]);
+    lobby_add(waiting->lobby, entry, side, rating, waiting->nextOrder++);
+    return entry;
+}
+
+/**
+ * @brief Check who lobby_find() finds
+ *
+ * @param waiting lobby to look in
+ * @param rating rating to look near
+ * @param window furthest from rating to look
+ * @param sides sides to look on
+ * @param expected name of the player that should be found, NULL for none
+ * @param what what is checked
+ */
+void check_find(Waiting* waiting, int rating, int window, unsigned sides,
+        const char* expected, const char* what)
+{
+    const char* found
+            = (const char*)lobby_find(waiting->lobby, rating, window, sides,
+                    NULL);
+    check(found == expected || (found && expected && !strcmp(found, expected)),
+            what);
+}
+
+/**
+ * @brief Check the window: players exactly at its edge are found, players
+ * just past it aren't, and ratings outside those indexed are queued at the
+ * nearest one indexed
+ */
+void check_window(void)
+{
+    Waiting waiting;
+    start_waiting(&waiting);
+    check_find(&waiting, 1500, 100, bothSides, NULL, "empty lobby");
+    wait_for_game(&waiting, "low", 0, 1400);
+    check_find(&waiting, 1500, 99, bothSides, NULL, "1 past window below");
+    check_find(&waiting, 1500, 100, bothSides, "low", "edge of window below");
+    wait_for_game(&waiting, "far", 1, 1700);
+    check_find(&waiting, 1600, 99, 1u << 1, NULL, "1 past window above");
+    check_find(&waiting, 1600, 100, 1u << 1, "far", "edge of window above");
+    check_find(&waiting, 1600, 100, 1u << 0, NULL, "other side not looked at");
+    // Across a word of the bitmap of ratings
+    check_find(&waiting, 1700 - 64 * 3, 64 * 3, 1u << 1, "far",
+            "three words away");
+    wait_for_game(&waiting, "top", 0, lobbyRatings + 1000);
+    check_find(&waiting, lobbyRatings - 1, 0, bothSides, "top",
+            "rating above those indexed queued at the top");
+    wait_for_game(&waiting, "bottom", 1, -50);
+    check_find(&waiting, 0, 0, bothSides, "bottom",
+            "rating below those indexed queued at 0");
+}
+
+/**
+ * @brief Check who is found among several players: the nearest, and of those
+ * as near the earliest to join, whichever side and direction they are
+ */
+void check_tie_break(void)
+{
+    Waiting waiting;
+    start_waiting(&waiting);
+    wait_for_game(&waiting, "above", 0, 1530);
+    LobbyEntry* below = wait_for_game(&waiting, "below", 1, 1470);
+    wait_for_game(&waiting, "near", 1, 1520);
+    check_find(&waiting, 1500, 100, bothSides, "near", "nearest found");
+    check_find(&waiting, 1500, 100, 1u << 0, "above", "nearest on a side");
+    check_find(&waiting, 1500, 10, bothSides, NULL, "nobody in window");
+    check_find(&waiting, 1500, 30, 1u << 1, "near", "nearer one on a side");
+    check_find(&waiting, 1550, 80, bothSides, "above", "nearest from above");
+    // "above" and "below" are as near 1500, "above" joined first
+    lobby_remove(waiting.lobby, &waiting.entries[2]);
+    check_find(
+            &waiting, 1500, 30, bothSides, "above", "earlier of two as near");
+    lobby_remove(waiting.lobby, &waiting.entries[0]);
+    check_find(&waiting, 1500, 30, bothSides, "below", "after removing one");
+    // Same rating and side: first come, first found
+    wait_for_game(&waiting, "second", 1, 1470);
+    check_find(&waiting, 1470, 0, bothSides, "below", "first of a rating");
+    const char* found
+            = (const char*)lobby_find(waiting.lobby, 1470, 0, bothSides, below);
+    check(found && !strcmp(found, "second"), "excluded player skipped");
+}
+
+int main(void)
+{
+    check_window();
+    check_tie_break();
+    check(lobby_rating_change(1500, 1500, 1.0) == 16, "win against equal");
+    check(lobby_rating_change(1500, 1500, 0.5) == 0, "draw against equal");
+    check(lobby_rating_change(1900, 1500, 0.0) == -29, "upset loss");
+    return check_report("lobby");
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+#include "check.h"
+#include "pgn.h"
+
+// Unit checks of UCI to SAN conversion (uci_to_san)
+
+// Size of the description of a check
+enum { whatSize = 80 };
+
+char const startFen[]
+        = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+// Both sides can castle either way
+char const castlingFen[] = "r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1";
+// White pawns about to promote, one able to capture on e8 as well
+char const promotionFen[] = "4n2k/P2P4/8/8/8/8/8/4K3 w - - 0 1";
+// Two white knights (b1, f3) can reach d2 and two rooks on the a file can
+// reach a4
+char const twinsFen[] = "4k3/8/R7/8/8/5N2/8/RN2K2R w - - 0 1";
+
+/**
+ * @brief Check that a move converts to the expected SAN
+ *
+ * @param fen position moved in
+ * @param move move in UCI
+ * @param legal space-separated legal moves in the position (those that
+ * matter for disambiguation), "" if not known
+ * @param givesCheck whether the move gives check
+ * @param expected SAN the move should convert to
+ */
+void check_san(const char* fen, const char* move, const char* legal,
+        bool givesCheck, const char* expected)
+{
+    UciMoves moves = {.numMoves = 0};
+    char copy[strlen(legal) + 1];
+    strcpy(copy, legal);
+    for (char* token = strtok(copy, " "); token; token = strtok(NULL, " ")) {
+        strcpy(moves.moves[moves.numMoves++], token);
+    }
+    char san[sanMoveSize];
+    uci_to_san(san, fen, move, *legal ? &moves : NULL, givesCheck,
+            false);
+    char what[whatSize];
+    snprintf(what, whatSize, "%s is %s, not %s", move, expected, san);
+    check(!strcmp(san, expected), what);
+}
+
+int main(void)
+{
+    check_san(startFen, "e2e4", "", false, "e4");
+    check_san(startFen, "g1f3", "g1f3 g1h3 b1c3 b1a3", false, "Nf3");
+    // Castling
+    check_san(castlingFen, "e1g1", "", false, "O-O");
+    check_san(castlingFen, "e1c1", "", false, "O-O-O");
+    check_san(castlingFen, "e1c1", "", true, "O-O-O+");
+    // Promotion, with and without capture
+    check_san(promotionFen, "a7a8q", "", false, "a8=Q");
+    check_san(promotionFen, "a7a8n", "", false, "a8=N");
+    check_san(promotionFen, "d7e8q", "", true, "dxe8=Q+");
+    // Disambiguation, by file, by rank, and not when only one piece can move
+    check_san(twinsFen, "b1d2", "b1d2 f3d2", false, "Nbd2");
+    check_san(twinsFen, "f3d2", "b1d2 f3d2", false, "Nfd2");
+    check_san(twinsFen, "a6a4", "a6a4 a1a4", false, "R6a4");
+    check_san(twinsFen, "a1a4", "a6a4 a1a4", false, "R1a4");
+    check_san(twinsFen, "h1f1", "h1f1 h1g1", false, "Rf1");
+    check_san(twinsFen, "f3e5", "f3e5", false, "Ne5");
+    return check_report("pgn");
+}
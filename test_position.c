@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include "check.h"
+#include "position.h"
+
+// Unit checks of the rules positions are drawn by: repetition, the
+// fifty-move rule and insufficient material
+
+char const startFen[]
+        = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+// Knights out and back, by both sides, repeating the start position
+char const* const knightShuffle[] = {"g1f3", "g8f6", "f3g1", "f6g8"};
+enum { shuffleLength = 4, maxKeys = 32 };
+
+// A game's positions, as the server keeps their keys
+typedef struct Game {
+    Position position;
+    uint64_t keys[maxKeys];
+    int numKeys;
+} Game;
+
+/**
+ * @brief Start a game
+ *
+ * @param game game to start
+ * @param fen position it starts from
+ */
+void start_game(Game* game, const char* fen)
+{
+    position_from_fen(&game->position, fen);
+    game->keys[0] = game->position.key;
+    game->numKeys = 1;
+}
+
+/**
+ * @brief Make a move in a game
+ *
+ * @param game game to move in
+ * @param move move in UCI notation
+ * @return times the position reached has occurred
+ */
+int play(Game* game, const char* move)
+{
+    position_move(&game->position, move);
+    game->keys[game->numKeys++] = game->position.key;
+    return position_repetitions(
+            game->keys, game->numKeys, game->position.halfMoves);
+}
+
+/**
+ * @brief Check repetitions are counted, and only back to the last pawn move
+ */
+void check_repetition(void)
+{
+    Game game;
+    start_game(&game, startFen);
+    int times = 0;
+    for (int i = 0; i < shuffleLength; i++) {
+        times = play(&game, knightShuffle[i]);
+    }
+    check(times == 2, "start position twice");
+    check(play(&game, knightShuffle[0]) == 2, "knight out twice");
+    for (int i = 1; i < shuffleLength; i++) {
+        times = play(&game, knightShuffle[i]);
+    }
+    check(times == 3, "start position three times");
+    Position fromFen;
+    position_from_fen(&fromFen,
+            "rnbqkbnr/pppppppp/8/8/8/5N2/PPPPPPPP/RNBQKB1R b KQkq - 1 1");
+    play(&game, knightShuffle[0]);
+    check(game.position.key == fromFen.key, "key kept up to date move by move");
+    start_game(&game, startFen);
+    play(&game, "e2e4");
+    play(&game, "e7e5");
+    for (int i = 0; i < shuffleLength; i++) {
+        times = play(&game, knightShuffle[i]);
+    }
+    check(times == 2, "repeated after pawn moves");
+    // Same placement, other side to move: not a repetition
+    Position white;
+    Position black;
+    position_from_fen(&white, "4k3/8/8/8/8/8/8/4K3 w - - 0 1");
+    position_from_fen(&black, "4k3/8/8/8/8/8/8/4K3 b - - 0 1");
+    check(white.key != black.key, "side to move in key");
+    position_from_fen(&black, "4k3/8/8/8/8/8/8/4K3 w - - 37 60");
+    check(white.key == black.key, "move counters not in key");
+}
+
+/**
+ * @brief Check the halfmove clock counts quiet moves, is reset by captures
+ * and pawn moves, and reaches the fifty-move rule's count
+ */
+void check_fifty_moves(void)
+{
+    Position position;
+    position_from_fen(&position, "4k3/8/3p4/8/8/8/8/R3K3 w - - 97 80");
+    position_move(&position, "a1a2");
+    position_move(&position, "e8e7");
+    check(position.halfMoves == 99, "quiet moves counted");
+    position_move(&position, "a2a3");
+    check(position.halfMoves == fiftyMoveHalfMoves, "fifty moves reached");
+    position_move(&position, "d6d5");
+    check(position.halfMoves == 0, "pawn move resets the clock");
+    position_move(&position, "a3a5");
+    position_move(&position, "e7d6");
+    position_move(&position, "a5d5");
+    check(position.halfMoves == 0, "capture resets the clock");
+    position_from_fen(&position, "4k3/8/8/8/8/8/8/4K3 w - -");
+    check(position.halfMoves == 0, "clock left out of the FEN");
+}
+
+/**
+ * @brief Check whether a position has insufficient material
+ *
+ * @param fen position to check
+ * @param expected whether it should be a dead draw
+ * @param what what is checked
+ */
+void check_material(const char* fen, bool expected, const char* what)
+{
+    Position position;
+    position_from_fen(&position, fen);
+    check(position_insufficient_material(&position) == expected, what);
+}
+
+int main(void)
+{
+    check_repetition();
+    check_fifty_moves();
+    check_material("4k3/8/8/8/8/8/8/4K3 w - - 0 1", true, "kings only");
+    check_material("4k3/8/8/8/8/8/8/4KN2 w - - 0 1", true, "one knight");
+    check_material("4kb2/8/8/8/8/8/8/4K3 w - - 0 1", true, "one bishop");
+    check_material("2b1k3/8/8/8/8/8/8/4KB2 w - - 0 1", true,
+            "bishops on the same colour");
+    check_material("4kb2/8/8/8/8/8/8/4KB2 w - - 0 1", false,
+            "bishops on different colours");
+    check_material("4k3/8/8/8/8/8/8/3NKN2 w - - 0 1", false, "two knights");
+    check_material("4kn2/8/8/8/8/8/8/4KB2 w - - 0 1", false,
+            "knight and bishop");
+    check_material("4k3/8/8/8/8/8/4P3/4K3 w - - 0 1", false, "a pawn");
+    check_material("4k3/8/8/8/8/8/8/R3K3 w - - 0 1", false, "a rook");
+    check_material(startFen, false, "start position");
+    return check_report("position");
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include "check.h"
+#include "timerwheel.h"
+
+// Unit checks of the timer wheel: timers far enough off to start in a coarse
+// wheel must cascade down and expire on the right tick
+
+// Not in timerwheel.h, the wheel's thread calls it once a tick. Here the
+// wheel's ticks are too long for its thread to get to one, and the checks
+// tick it by hand instead.
+void timer_wheel_tick(TimerWheel* wheel);
+
+long const handTickedMs = 3600000;
+// Size of the description of a check
+enum { whatSize = 80 };
+// Furthest off a timer can expire, the last wheel's reach. Timers started for
+// longer expire then.
+unsigned long const maxTicks = (1UL << 24) - 1;
+// Ticks the checks start timers for: either side of each wheel's reach, and
+// past the last wheel's
+unsigned long const checkedTicks[] = {1, 2, 63, 64, 65, 4095, 4096, 4097,
+        262143, 262144, 262145, 16777215, 16777300};
+enum { numChecked = sizeof(checkedTicks) / sizeof(checkedTicks[0]) };
+// How often the repeating timer expires
+unsigned long const repeatTicks = 100;
+int const numRepeats = 50;
+
+// Ticks run so far
+unsigned long ticksRun = 0;
+
+/**
+ * @brief Timer function noting the tick a timer expired on
+ *
+ * @param timer unused
+ * @param data unsigned long* - where to note the tick
+ * @return 0, not to run again
+ */
+unsigned long note_expiry(Timer* timer, void* data)
+{
+    (void)timer;
+    *(unsigned long*)data = ticksRun;
+    return 0;
+}
+
+/**
+ * @brief Timer function counting its expiries, restarting every repeatTicks
+ * until it has expired numRepeats times
+ *
+ * @param timer unused
+ * @param data int* - expiries so far
+ * @return ticks until it should expire again, 0 once done
+ */
+unsigned long repeat(Timer* timer, void* data)
+{
+    (void)timer;
+    int* count = (int*)data;
+    (*count)++;
+    return *count < numRepeats ? repeatTicks : 0;
+}
+
+/**
+ * @brief Tick a wheel by hand
+ *
+ * @param wheel wheel to advance
+ * @param ticks number of ticks
+ */
+void run_ticks(TimerWheel* wheel, unsigned long ticks)
+{
+    for (unsigned long i = 0; i < ticks; i++) {
+        ticksRun++;
+        timer_wheel_tick(wheel);
+    }
+}
+
+/**
+ * @brief Check timers started part way through a wheel's turn expire a tick
+ * after their time is up (on the tick processing it), not early or late
+ *
+ * @param wheel wheel to check, ticked only by hand
+ * @param offset ticks to run before starting the timers
+ */
+void check_expiry(TimerWheel* wheel, unsigned long offset)
+{
+    run_ticks(wheel, offset);
+    unsigned long started = ticksRun;
+    Timer timers[numChecked];
+    unsigned long expiredOn[numChecked] = {0};
+    for (int i = 0; i < numChecked; i++) {
+        timer_init(&timers[i], note_expiry, &expiredOn[i]);
+        timer_start(wheel, &timers[i], checkedTicks[i]);
+    }
+    run_ticks(wheel, checkedTicks[numChecked - 1] + 1);
+    for (int i = 0; i < numChecked; i++) {
+        char what[whatSize];
+        snprintf(what, whatSize,
+                "timer of %lu ticks started after %lu expired after %lu",
+                checkedTicks[i], offset, expiredOn[i] - started);
+        unsigned long ticks
+                = checkedTicks[i] < maxTicks ? checkedTicks[i] : maxTicks;
+        check(expiredOn[i] - started == ticks + 1, what);
+    }
+}
+
+int main(void)
+{
+    TimerWheel* wheel = timer_wheel_create(handTickedMs);
+    check_expiry(wheel, 0);
+    check_expiry(wheel, 37);
+    unsigned long expiredOn = 0;
+    Timer stopped;
+    timer_init(&stopped, note_expiry, &expiredOn);
+    timer_start(wheel, &stopped, checkedTicks[numChecked - 1]);
+    run_ticks(wheel, repeatTicks);
+    timer_stop(wheel, &stopped);
+    run_ticks(wheel, maxTicks + 1);
+    check(expiredOn == 0, "stopped timer doesn't expire");
+    int count = 0;
+    Timer repeating;
+    timer_init(&repeating, repeat, &count);
+    timer_start(wheel, &repeating, repeatTicks);
+    run_ticks(wheel, repeatTicks * numRepeats);
+    check(count == numRepeats - 1, "repeating timer not done early");
+    run_ticks(wheel, repeatTicks);
+    check(count == numRepeats, "repeating timer expired every time");
+    return check_report("timerwheel");
+}
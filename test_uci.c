@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "check.h"
+#include "uci.h"
+
+// Unit checks of the UCI reply parsers, fed Stockfish-like output through a
+// pipe
+
+// Longest line the reader keeps whole (uciReaderSize in uci.c)
+enum { readerLineLimit = 4096 };
+
+char const positionOutput[]
+        = "\n"
+          " +---+---+---+---+---+---+---+---+\n"
+          " | r | n | b | q | k | b | n | r | 8\n"
+          " +---+---+---+---+---+---+---+---+\n"
+          "   a   b   c   d   e   f   g   h\n"
+          "\n"
+          "Fen: rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 2\n"
+          "Key: 0B4B4E5C8C2A1E2F\n"
+          "Checkers: \n";
+char const checkedOutput[]
+        = "Fen: 4k3/8/8/8/8/8/8/4K2r w - - 0 1\n"
+          "Checkers: h1 \n";
+char const perftOutput[] = "info string NNUE evaluation enabled\n"
+                           "a2a3: 1\n"
+                           "e7e8q: 1\n"
+                           "g1f3: 1\n"
+                           "\n"
+                           "Nodes searched: 3\n"
+                           "\n"
+                           "bestmove g1f3\n";
+char const searchOutput[]
+        = "info string NNUE evaluation enabled\n"
+          "info depth 1 seldepth 1 multipv 1 score cp 20 nodes 20 pv e2e4\n"
+          "info depth 1 seldepth 1 multipv 2 score cp 5 nodes 20 pv a2a3\n"
+          "info depth 9 seldepth 12 multipv 1 score cp 35 lowerbound pv d2d4\n"
+          "info depth 9 seldepth 12 multipv 2 score mate -3 pv h2h4 e7e5\n"
+          "info depth 9 currmove b1c3 currmovenumber 7\n"
+          "bestmove d2d4 ponder d7d5\n";
+
+/**
+ * @brief Make a reader of canned engine output
+ *
+ * @param output what the engine wrote before its output ended
+ * @return reader of a pipe holding the output
+ */
+UciReader* reader_of(const char* output)
+{
+    int fds[2];
+    if (pipe(fds) == -1
+            || write(fds[1], output, strlen(output))
+                    != (ssize_t)strlen(output)) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    return uci_reader_create(fds[0]);
+}
+
+/**
+ * @brief Check uci_wait_for, including lines too long to keep whole
+ */
+void check_wait_for(void)
+{
+    UciReader* reader = reader_of("id name Stockfish\nuciok\nreadyok\n");
+    check(uci_wait_for(reader, "readyok") == 0, "readyok found");
+    check(uci_wait_for(reader, "readyok") == -1, "no readyok after the end");
+    // The tail of a line cut short isn't a line of its own
+    char longLine[readerLineLimit + sizeof("readyok\nuciok\n")];
+    memset(longLine, 'x', readerLineLimit);
+    strcpy(longLine + readerLineLimit, "readyok\nuciok\n");
+    reader = reader_of(longLine);
+    check(uci_wait_for(reader, "readyok") == -1, "long line's tail skipped");
+    reader = reader_of(longLine);
+    check(uci_wait_for(reader, "uciok") == 0, "line after a long line read");
+}
+
+/**
+ * @brief Check uci_read_position with and without check
+ */
+void check_position(void)
+{
+    UciPosition position;
+    UciReader* reader = reader_of(positionOutput);
+    check(uci_read_position(reader, &position) == 0, "position read");
+    check(!strcmp(position.fen,
+                  "rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - "
+                  "0 2"),
+            "position FEN");
+    check(!position.whiteToPlay && !position.inCheck, "black, not in check");
+    check(strstr(position.board, "| r | n |") && !strstr(position.board, "Fen"),
+            "board drawing kept, FEN left out of it");
+    reader = reader_of(checkedOutput);
+    check(uci_read_position(reader, &position) == 0
+                    && position.whiteToPlay && position.inCheck,
+            "white in check");
+    reader = reader_of("Fen: 8/8/8/8/8/8/8/8 w - - 0 1\n");
+    check(uci_read_position(reader, &position) == -1,
+            "position without Checkers line");
+}
+
+/**
+ * @brief Check uci_read_perft, and that it reads no further than its output
+ */
+void check_perft(void)
+{
+    UciMoves moves;
+    UciSearch search;
+    UciReader* reader = reader_of(perftOutput);
+    check(uci_read_perft(reader, &moves) == 0, "perft read");
+    check(moves.numMoves == 3 && !strcmp(moves.moves[0], "a2a3")
+                    && !strcmp(moves.moves[1], "e7e8q")
+                    && !strcmp(moves.moves[2], "g1f3"),
+            "perft moves");
+    check(uci_read_bestmove(reader, &search) == 0
+                    && !strcmp(search.bestMove, "g1f3"),
+            "output after perft left to read");
+    reader = reader_of("a2a3: 1\n");
+    check(uci_read_perft(reader, &moves) == -1, "perft cut short");
+}
+
+/**
+ * @brief Check uci_read_bestmove with several variations
+ */
+void check_search(void)
+{
+    UciSearch search;
+    UciReader* reader = reader_of(searchOutput);
+    check(uci_read_bestmove(reader, &search) == 0, "search read");
+    check(!strcmp(search.bestMove, "d2d4"), "best move");
+    check(search.numPvs == 2, "two variations");
+    check(search.pvs[0].depth == 9 && search.pvs[0].score == 35
+                    && !search.pvs[0].mate
+                    && !strcmp(search.pvs[0].move, "d2d4"),
+            "first variation is its last info");
+    check(search.pvs[1].mate && search.pvs[1].score == -3
+                    && !strcmp(search.pvs[1].move, "h2h4"),
+            "second variation mated in 3");
+    reader = reader_of("info depth 0 score mate 0\nbestmove (none)\n");
+    check(uci_read_bestmove(reader, &search) == 0 && !search.bestMove[0]
+                    && search.numPvs == 0,
+            "no move");
+    reader = reader_of("info depth 1 score cp 3 pv e2e4\n");
+    check(uci_read_bestmove(reader, &search) == -1, "search cut short");
+}
+
+int main(void)
+{
+    check_wait_for();
+    check_position();
+    check_perft();
+    check_search();
+    return check_report("uci");
+}
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "timerwheel.h"
+
+// Function/type comments for the public interface are in timerwheel.h
+
+// Each wheel has 2^wheelBits slots, a slot of wheel n covering
+// 2^(n * wheelBits) ticks. Timers further off than the last wheel reaches
+// wait there until it does.
+enum { wheelBits = 6, wheelSlots = 1 << wheelBits, numWheels = 4 };
+unsigned long const slotMask = wheelSlots - 1;
+unsigned long const maxTimerTicks = (1UL << (numWheels * wheelBits)) - 1;
+long const nsPerMs = 1000000;
+long const nsPerSecond = 1000000000;
+
+struct TimerWheel {
+    pthread_mutex_t lock;
+    // Lists of timers in each slot of each wheel
+    Timer* slots[numWheels][wheelSlots];
+    // Next tick to be processed
+    unsigned long now;
+    long tickMs;
+};
+
+/**
+ * @brief Put a running timer in the slot for its expiry time. Caller holds the
+ * lock.
+ *
+ * @param wheel wheel to add to
+ * @param timer timer to add, expires not before wheel->now
+ */
+void timer_wheel_insert(TimerWheel* wheel, Timer* timer)
+{
+    unsigned long delta = timer->expires - wheel->now;
+    int wheelIndex = 0;
+    while (wheelIndex < numWheels - 1
+            && delta >= 1UL << ((wheelIndex + 1) * wheelBits)) {
+        wheelIndex++;
+    }
+    unsigned long slot
+            = (timer->expires >> (wheelIndex * wheelBits)) & slotMask;
+    Timer** head = &wheel->slots[wheelIndex][slot];
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+/**
+ * @brief Take a slot's list of timers, leaving the slot empty
+ *
+ * @param slot slot to empty
+ * @return the timers that were in it
+ */
+Timer* timer_wheel_take(Timer** slot)
+{
+    Timer* timers = *slot;
+    *slot = NULL;
+    return timers;
+}
+
+/**
+ * @brief Move the timers in a slot of a coarse wheel down to finer wheels, as
+ * the ticks the slot covers are about to start
+ *
+ * @param wheel timer wheel
+ * @param wheelIndex coarse wheel
+ * @param slot slot of the coarse wheel
+ */
+void timer_wheel_cascade(TimerWheel* wheel, int wheelIndex, unsigned long slot)
+{
+    Timer* timer = timer_wheel_take(&wheel->slots[wheelIndex][slot]);
+    while (timer) {
+        Timer* next = timer->next;
+        timer_wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * @brief Process one tick: cascade coarse wheels when the finer ones wrap
+ * around, then expire the tick's timers. Caller holds the lock.
+ *
+ * @param wheel wheel to advance
+ */
+void timer_wheel_tick(TimerWheel* wheel)
+{
+    unsigned long index = wheel->now & slotMask;
+    unsigned long cascadeIndex = index;
+    for (int i = 1; cascadeIndex == 0 && i < numWheels; i++) {
+        cascadeIndex = (wheel->now >> (i * wheelBits)) & slotMask;
+        timer_wheel_cascade(wheel, i, cascadeIndex);
+    }
+    Timer* timer = timer_wheel_take(&wheel->slots[0][index]);
+    wheel->now++;
+    while (timer) {
+        Timer* next = timer->next;
+        timer->running = false;
+        unsigned long ticks = timer->fn(timer, timer->data);
+        if (ticks) {
+            timer->running = true;
+            timer->expires = wheel->now
+                    + (ticks < maxTimerTicks ? ticks : maxTimerTicks);
+            timer_wheel_insert(wheel, timer);
+        }
+        timer = next;
+    }
+}
+
+/**
+ * @brief Thread advancing a wheel once a tick
+ *
+ * @param data TimerWheel* - wheel to advance
+ * @return unused, never returns
+ */
+void* timer_wheel_thread(void* data)
+{
+    TimerWheel* wheel = (TimerWheel*)data;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        next.tv_nsec += wheel->tickMs * nsPerMs;
+        next.tv_sec += next.tv_nsec / nsPerSecond;
+        next.tv_nsec %= nsPerSecond;
+        int err;
+        do {
+            err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        } while (err == EINTR);
+        pthread_mutex_lock(&wheel->lock);
+        timer_wheel_tick(wheel);
+        pthread_mutex_unlock(&wheel->lock);
+    }
+    return NULL;
+}
+
+TimerWheel* timer_wheel_create(long tickMs)
+{
+    TimerWheel* wheel = (TimerWheel*)calloc(1, sizeof(TimerWheel));
+    pthread_mutex_init(&wheel->lock, NULL);
+    wheel->now = 0;
+    wheel->tickMs = tickMs;
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, timer_wheel_thread, wheel);
+    pthread_detach(threadId);
+    return wheel;
+}
+
+void timer_init(Timer* timer, TimerFn fn, void* data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->running = false;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/**
+ * @brief Take a running timer out of its slot. Caller holds the lock.
+ *
+ * @param timer timer to remove
+ */
+void timer_unlink(Timer* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->running = false;
+}
+
+void timer_start(TimerWheel* wheel, Timer* timer, unsigned long ticks)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->running) {
+        timer_unlink(timer);
+    }
+    timer->running = true;
+    timer->expires
+            = wheel->now + (ticks < maxTimerTicks ? ticks : maxTimerTicks);
+    timer_wheel_insert(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_stop(TimerWheel* wheel, Timer* timer)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->running) {
+        timer_unlink(timer);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
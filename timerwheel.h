@@ -0,0 +1,65 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+
+// Hierarchical timer wheel: timers wait in slots of wheels with ever coarser
+// ticks, and move to finer wheels as they get close, so starting, stopping
+// and expiring a timer cost O(1) however many there are. The wheel's own
+// thread advances it once a tick and calls expired timers' functions.
+
+typedef struct TimerWheel TimerWheel;
+typedef struct Timer Timer;
+
+// Called when a timer expires, by the wheel's thread with the wheel locked, so
+// it mustn't block or start or stop timers. Returns the number of ticks until
+// the timer should expire again, or 0 to leave it stopped.
+typedef unsigned long (*TimerFn)(Timer* timer, void* data);
+
+// A timer, kept in whatever it times. Fields are only used by the wheel.
+struct Timer {
+    struct Timer* next;
+    // Link pointing at this timer (slot head or previous timer's next)
+    struct Timer** pprev;
+    unsigned long expires;
+    bool running;
+    TimerFn fn;
+    void* data;
+};
+
+/**
+ * @brief Create a timer wheel and start its thread
+ *
+ * @param tickMs length of a tick in milliseconds
+ * @return the wheel
+ */
+TimerWheel* timer_wheel_create(long tickMs);
+
+/**
+ * @brief Set up a stopped timer
+ *
+ * @param timer timer to set up
+ * @param fn function to call when it expires
+ * @param data passed to fn
+ */
+void timer_init(Timer* timer, TimerFn fn, void* data);
+
+/**
+ * @brief Start (or restart) a timer
+ *
+ * @param wheel wheel to run the timer on
+ * @param timer timer to start
+ * @param ticks ticks until it expires, it expires up to a tick later
+ */
+void timer_start(TimerWheel* wheel, Timer* timer, unsigned long ticks);
+
+/**
+ * @brief Stop a timer if it is running. Once this returns its function isn't
+ * running and won't be called, so the timer can be freed.
+ *
+ * @param wheel wheel the timer was started on
+ * @param timer timer to stop
+ */
+void timer_stop(TimerWheel* wheel, Timer* timer);
+
+#endif
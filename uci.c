@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "uci.h"
+
+// Function/type comments for the public interface are in uci.h
+
+// Longest line kept whole, longer lines are cut short
+enum { uciReaderSize = 4096 };
+
+struct UciReader {
+    int fd;
+    // Bytes read from the engine: [start, end) not yet returned as lines.
+    // One spare byte so a full buffer can still be terminated.
+    char buffer[uciReaderSize + 1];
+    size_t start;
+    size_t end;
+    // Set when a line was cut short, the rest of it is skipped
+    bool skipping;
+};
+
+UciReader* uci_reader_create(int fd)
+{
+    UciReader* reader = (UciReader*)malloc(sizeof(UciReader));
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->skipping = false;
+    return reader;
+}
+
+/**
+ * @brief Read more of the engine's output, first moving unread bytes to the
+ * front of the buffer
+ *
+ * @param reader reader to fill
+ * @return 0 if something was read, -1 at end of output or on error
+ */
+int uci_fill(UciReader* reader)
+{
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    ssize_t numRead;
+    do {
+        numRead = read(reader->fd, reader->buffer + reader->end,
+                uciReaderSize - reader->end);
+    } while (numRead < 0 && errno == EINTR);
+    if (numRead <= 0) {
+        return -1;
+    }
+    reader->end += (size_t)numRead;
+    return 0;
+}
+
+/**
+ * @brief Read the next line. It stays valid until the reader is used again.
+ *
+ * @param reader engine output
+ * @return the line, without its newline, or NULL at end of output
+ */
+char* uci_read_line(UciReader* reader)
+{
+    while (1) {
+        char* line = reader->buffer + reader->start;
+        char* newline = (char*)memchr(line, '\n', reader->end - reader->start);
+        if (newline) {
+            *newline = '\0';
+            reader->start = (size_t)(newline + 1 - reader->buffer);
+            if (!reader->skipping) {
+                return line;
+            }
+            reader->skipping = false; // tail of a line already cut short
+            continue;
+        }
+        if (reader->start == 0 && reader->end == uciReaderSize) {
+            // No newline in a full buffer: hand back what there is
+            reader->buffer[reader->end] = '\0';
+            reader->start = reader->end = 0;
+            if (!reader->skipping) {
+                reader->skipping = true;
+                return line;
+            }
+        }
+        if (uci_fill(reader) == -1) {
+            return NULL;
+        }
+    }
+}
+
+int uci_wait_for(UciReader* reader, const char* response)
+{
+    char* line;
+    while ((line = uci_read_line(reader))) {
+        if (!strcmp(line, response)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Check whether a line starts with a word
+ *
+ * @param line line to check
+ * @param prefix word and anything after it to match, e.g. "Fen: "
+ * @return true if it does
+ */
+bool starts_with(const char* line, const char* prefix)
+{
+    return !strncmp(line, prefix, strlen(prefix));
+}
+
+int uci_read_position(UciReader* reader, UciPosition* position)
+{
+    size_t boardLen = 0;
+    position->board[0] = '\0';
+    position->fen[0] = '\0';
+    bool fenFound = false;
+    char* line;
+    while ((line = uci_read_line(reader))) {
+        if (starts_with(line, "Fen: ")) {
+            snprintf(position->fen, uciFenSize, "%s", line + strlen("Fen: "));
+            position->whiteToPlay = strstr(position->fen, " w ") != NULL;
+            fenFound = true;
+        } else if (starts_with(line, "Checkers:")) {
+            // Last line of the output, listing the squares giving check
+            char* checkers = line + strlen("Checkers:");
+            position->inCheck = checkers[strspn(checkers, " ")] != '\0';
+            return fenFound ? 0 : -1;
+        } else if (!fenFound && boardLen < uciBoardSize) {
+            boardLen += (size_t)snprintf(position->board + boardLen,
+                    uciBoardSize - boardLen, "%s\n", line);
+        }
+    }
+    return -1;
+}
+
+int uci_read_perft(UciReader* reader, UciMoves* moves)
+{
+    moves->numMoves = 0;
+    char* line;
+    while ((line = uci_read_line(reader))) {
+        if (starts_with(line, "Nodes searched")) {
+            // Followed by an empty line
+            return uci_read_line(reader) ? 0 : -1;
+        }
+        // Each move is listed as "e2e4: 1"
+        char* colon = strchr(line, ':');
+        if (colon && colon > line && colon - line < uciMoveSize
+                && moves->numMoves < uciMaxMoves) {
+            *colon = '\0';
+            strcpy(moves->moves[moves->numMoves++], line);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Copy a move, or the empty string if it's too long to be one
+ *
+ * @param dest write the move here (uciMoveSize chars)
+ * @param move move to copy, NULL for none
+ */
+void copy_move(char* dest, const char* move)
+{
+    if (move && strlen(move) < uciMoveSize) {
+        strcpy(dest, move);
+    } else {
+        dest[0] = '\0';
+    }
+}
+
+/**
+ * @brief Parse an "info" line, keeping it if it reports a variation's score
+ * and moves
+ *
+ * @param line info line, after "info", split up by this
+ * @param search search the line is from
+ */
+void parse_info(char* line, UciSearch* search)
+{
+    UciPv pv = {.depth = 0, .score = 0, .mate = false, .move = ""};
+    int index = 0;
+    bool scored = false;
+    char* save = NULL;
+    // Values are numbers or moves, so only keywords ever match below
+    for (char* word = strtok_r(line, " ", &save); word;
+            word = strtok_r(NULL, " ", &save)) {
+        if (!strcmp(word, "string")) {
+            return; // free text
+        }
+        if (!strcmp(word, "depth")) {
+            char* depth = strtok_r(NULL, " ", &save);
+            pv.depth = depth ? atoi(depth) : 0;
+        } else if (!strcmp(word, "multipv")) {
+            char* multipv = strtok_r(NULL, " ", &save);
+            index = multipv ? atoi(multipv) - 1 : 0;
+        } else if (!strcmp(word, "score")) {
+            // "score cp <n>" or "score mate <n>"
+            char* kind = strtok_r(NULL, " ", &save);
+            char* score = strtok_r(NULL, " ", &save);
+            pv.mate = kind && !strcmp(kind, "mate");
+            pv.score = score ? atoi(score) : 0;
+            scored = score != NULL;
+        } else if (!strcmp(word, "pv")) {
+            copy_move(pv.move, strtok_r(NULL, " ", &save));
+            break;
+        }
+    }
+    if (!scored || !pv.move[0] || index < 0 || index >= uciMaxPvs) {
+        return;
+    }
+    search->pvs[index] = pv;
+    if (index >= search->numPvs) {
+        search->numPvs = index + 1;
+    }
+}
+
+int uci_read_bestmove(UciReader* reader, UciSearch* search)
+{
+    search->bestMove[0] = '\0';
+    search->numPvs = 0;
+    memset(search->pvs, 0, sizeof(search->pvs));
+    char* line;
+    while ((line = uci_read_line(reader))) {
+        if (starts_with(line, "info ")) {
+            parse_info(line + strlen("info "), search);
+        } else if (starts_with(line, "bestmove ")) {
+            char* save = NULL;
+            copy_move(search->bestMove,
+                    strtok_r(line + strlen("bestmove "), " ", &save));
+            return 0;
+        }
+    }
+    return -1;
+}
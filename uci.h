@@ -0,0 +1,105 @@
+#ifndef UCI_H
+#define UCI_H
+
+#include <stdbool.h>
+
+// Incremental parser for a UCI engine's replies, read straight from the
+// engine's output pipe. Lines are split in place in the reader's own buffer
+// and replies are parsed into the caller's structs, so reading a reply
+// allocates nothing.
+
+// Size of a UCI move string (e.g. e7e8q), including the null terminator.
+// Limits on what a reply is parsed into: a position has at most 218 legal
+// moves, and "info" lines are kept for up to uciMaxPvs principal variations.
+enum {
+    uciMoveSize = 6,
+    uciMaxMoves = 256,
+    uciMaxPvs = 8,
+    uciFenSize = 128,
+    uciBoardSize = 2048
+};
+
+typedef struct UciReader UciReader;
+
+// Legal moves, as listed by "go perft 1"
+typedef struct UciMoves {
+    int numMoves;
+    char moves[uciMaxMoves][uciMoveSize];
+} UciMoves;
+
+// Position, as shown by "d"
+typedef struct UciPosition {
+    // Board drawing, every line before the FEN
+    char board[uciBoardSize];
+    char fen[uciFenSize];
+    bool whiteToPlay;
+    // Whether the side to move is in check
+    bool inCheck;
+} UciPosition;
+
+// Last "info" line of one principal variation of a search
+typedef struct UciPv {
+    int depth;
+    // Score in centipawns, or if mate, moves until mate (negative if the side
+    // to move is getting mated)
+    int score;
+    bool mate;
+    // First move of the variation
+    char move[uciMoveSize];
+} UciPv;
+
+// Result of a "go" search
+typedef struct UciSearch {
+    // Empty if the engine has no move
+    char bestMove[uciMoveSize];
+    // Variations reported, pvs[i] being "multipv i + 1"
+    int numPvs;
+    UciPv pvs[uciMaxPvs];
+} UciSearch;
+
+/**
+ * @brief Create a reader for an engine's output
+ *
+ * @param fd read end of the engine's output pipe, now owned by the reader
+ * @return the reader
+ */
+UciReader* uci_reader_create(int fd);
+
+/**
+ * @brief Read lines until one is exactly the response wanted (e.g. "readyok")
+ *
+ * @param reader engine output
+ * @param response line to wait for, without newline
+ * @return 0 once it is read, -1 if the engine's output ended first
+ */
+int uci_wait_for(UciReader* reader, const char* response);
+
+/**
+ * @brief Read the output of "d"
+ *
+ * @param reader engine output
+ * @param position fill in the position shown here
+ * @return 0 if read, -1 if the engine's output ended first
+ */
+int uci_read_position(UciReader* reader, UciPosition* position);
+
+/**
+ * @brief Read the output of "go perft 1"
+ *
+ * @param reader engine output
+ * @param moves fill in the moves listed here
+ * @return 0 if read, -1 if the engine's output ended first
+ */
+int uci_read_perft(UciReader* reader, UciMoves* moves);
+
+/**
+ * @brief Read the output of "go" up to and including its "bestmove" line
+ *
+ * @param reader engine output
+ * @param search fill in the best move and the last info of each variation
+ * here
+ * @return 0 if read, -1 if the engine's output ended first
+ */
+int uci_read_bestmove(UciReader* reader, UciSearch* search);
+
+#endif
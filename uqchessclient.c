@@ -5,13 +5,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include <csse2310a4.h>
 #include "shared.h"
+#include "bench.h"
 
 int const invalidArgsExitCode = 13;
 int const socketConnectExitCode = 11;
 int const serverGoneExitCode = 8;
+int const scriptOpenExitCode = 14;
+
+// Max number of games that can be played at once with --games
+long const maxGames = 1000;
+// Max computer difficulty level for --level
+long const maxLevel = 4;
+// If the connection drops, try this many times to connect again, this many
+// seconds apart, before giving up
+int const reconnectAttempts = 10;
+unsigned int const reconnectDelaySeconds = 1;
+// Longest session token kept (with its terminating null)
+enum { sessionTokenSize = 32 };
 
 // Client command-line arguments
 typedef struct {
@@ -21,6 +37,15 @@ typedef struct {
     Opponent opponent;
     // Colour playing as
     Colour colour;
+    // Number of tagged games to play at once, or 0 to play one untagged game
+    int numGames;
+    // Difficulty level of the computer, or 0 for the server's default
+    int level;
+    // File of commands to run as a script ("-" for stdin), or NULL to read
+    // commands interactively
+    char* scriptPath;
+    // Whether to time commands and report their latencies on exit
+    bool bench;
 } Args;
 
 // State of a game (for client), booleans used to avoid invalid reads
@@ -31,12 +56,45 @@ typedef struct {
     bool isClientTurn;
     // Is client playing as white?
     bool isClientWhite;
+    // Has a start (or resume) msg been sent that the server hasn't answered
+    // yet?
+    bool isStarting;
+    // Id the server gave the game, 0 if not known
+    long gameId;
 } GameState;
 
+// Game states, shared by the stdin and server threads
+typedef struct {
+    // State of each game, index 0 is the untagged game and index n is the game
+    // tagged n (when playing with --games)
+    GameState* states;
+    int numGames;
+    // Held to read or change the states
+    pthread_mutex_t lock;
+    // Signalled when the server thread changes a state
+    pthread_cond_t changed;
+    // Set once a script has sent its last command, so the server closing the
+    // connection is expected
+    bool scriptDone;
+    // Times commands with --bench, NULL if not timing
+    Bench* bench;
+    // Server port, connected to again if the connection drops
+    char* port;
+    // Socket streams, both on the one fd that reconnecting replaces
+    FILE* readSocket;
+    FILE* writeSocket;
+    // Token to resume games with after reconnecting, empty if not given yet
+    char sessionToken[sessionTokenSize];
+    // Index of the game last started, whose id follows
+    int lastStarted;
+} Games;
+
 // Data passed to stdin thread
 typedef struct {
     Args args;
-    GameState* gameState;
+    Games* games;
+    // Where commands are read from, stdin or the script
+    FILE* input;
     FILE* readSocket;
     FILE* writeSocket;
 } ThreadData;
@@ -48,7 +106,7 @@ void warn_invalid_args(void)
 {
     fprintf(stderr,
             "Usage: uqchessclient portnum [--versus computer|human] [--colour "
-            "black|white]\n");
+            "black|white] [--games n] [--level n] [--script file] [--bench]\n");
     fflush(stderr);
     exit(invalidArgsExitCode);
 }
@@ -65,6 +123,50 @@ void warn_socket_connect_error(char* port)
     exit(socketConnectExitCode);
 }
 
+/**
+ * @brief Print can't open script message and exit with code
+ * scriptOpenExitCode.
+ *
+ * @param path path of the script
+ */
+void warn_script_open_error(char* path)
+{
+    fprintf(stderr, "uqchessclient: can't open script \"%s\"\n", path);
+    fflush(stderr);
+    exit(scriptOpenExitCode);
+}
+
+/**
+ * @brief Process a command-line option taking a number (--games, --level)
+ *
+ * @param option the option given on the command-line
+ * @param nextArg the option's value
+ * @param args pointer to command-line args
+ * @return -1 if option was invalid, 1 if valid
+ */
+int check_number_option(char* option, char* nextArg, Args* args)
+{
+    long value = parse_number(nextArg);
+    int* field;
+    long max;
+    if (!strcmp(option, "--games")) {
+        field = &args->numGames;
+        max = maxGames;
+    } else if (!strcmp(option, "--level")) {
+        field = &args->level;
+        max = maxLevel;
+    } else {
+        // Option wasn't opponent, colour, script, games or level, hence invalid
+        return -1;
+    }
+    if (*field != 0 || value < 1 || value > max) {
+        // Already given or not a valid value
+        return -1;
+    }
+    *field = (int)value;
+    return 1;
+}
+
 /**
  * @brief Process a command-line option (starts with --) and update the given
  * args struct accordingly.
@@ -107,8 +209,15 @@ int check_cl_option(char* option, char* nextArg, Args* args)
         }
         return -1;
     }
-    // Option wasn't opponent or colour, hence invalid
-    return -1;
+    if (!strcmp(option, "--script")) {
+        if (args->scriptPath || strlen(nextArg) == 0) {
+            // Script already given or empty
+            return -1;
+        }
+        args->scriptPath = nextArg;
+        return 1;
+    }
+    return check_number_option(option, nextArg, args);
 }
 
 /**
@@ -139,7 +248,11 @@ Args get_args(int argc, char** argv)
 {
     Args args = {.port = NULL,
             .opponent = OPPONENT_UNSPECIFIED,
-            .colour = COLOUR_UNSPECIFIED};
+            .colour = COLOUR_UNSPECIFIED,
+            .numGames = 0,
+            .level = 0,
+            .scriptPath = NULL,
+            .bench = false};
     if (argc == 1) {
         // Not enough arguments
         warn_invalid_args();
@@ -158,6 +271,14 @@ Args get_args(int argc, char** argv)
         if (strlen(arg) == 0) {
             warn_invalid_args();
         }
+        if (!strcmp(arg, "--bench")) {
+            // The only option without a value
+            if (args.bench) {
+                warn_invalid_args();
+            }
+            args.bench = true;
+            continue;
+        }
         if (!is_option(arg) // doesn't start with --
                 || i + 1 == argc // no option value after
         ) {
@@ -173,49 +294,156 @@ Args get_args(int argc, char** argv)
     }
 
     set_default_args(&args);
+    if (args.level && args.opponent != OPPONENT_COM) {
+        warn_invalid_args(); // only the computer has a level
+    }
     return args;
 }
 
+/**
+ * @brief Get the tag of the game at the given index of the game state array
+ *
+ * @param gameIndex index of the game, 0 for the untagged game
+ * @return the game's tag, or untaggedGame
+ */
+long game_tag(int gameIndex)
+{
+    return gameIndex == 0 ? untaggedGame : gameIndex;
+}
+
+/**
+ * @brief Get the index in the game state array of the game with the given tag
+ *
+ * @param tag the game's tag, or untaggedGame
+ * @return index of the game, 0 for the untagged game
+ */
+int game_index(long tag)
+{
+    return tag == untaggedGame ? 0 : (int)tag;
+}
+
+/**
+ * @brief Write the "game <tag> " prefix of a msg to server, if the msg is for
+ * a tagged game. Call holding the socket's lock (flockfile) until the msg is
+ * written, as the stdin and server reading threads both write msgs.
+ *
+ * @param socket server socket to write to
+ * @param tag tag of the game the msg is for, or untaggedGame
+ */
+void send_tag(FILE* socket, long tag)
+{
+    if (tag != untaggedGame) {
+        fprintf(socket, "game %ld ", tag);
+    }
+}
+
 /**
  * @brief Send start msg to server.
  *
  * @param socket server socket to write to
- * @param opponent opponent type chosen
- * @param colour colour playing as
+ * @param bench bench timing commands, NULL if not timing
+ * @param tag tag of game to start, or untaggedGame
+ * @param args command-line args giving the opponent, colour and level
  */
-void send_start(FILE* socket, Opponent opponent, Colour colour)
+void send_start(FILE* socket, Bench* bench, long tag, const Args* args)
 {
     char opponentName[maxBufferSize];
     char colourName[maxBufferSize];
-    get_opponent_name(opponentName, opponent);
-    get_colour_name(colourName, colour);
-    fflush(socket); // todo delete
-    fprintf(socket, "start %s %s\n", opponentName, colourName);
+    get_opponent_name(opponentName, args->opponent);
+    get_colour_name(colourName, args->colour);
+    bench_sent(bench, game_index(tag), BENCH_START);
+    flockfile(socket);
+    send_tag(socket, tag);
+    fprintf(socket, "start %s %s", opponentName, colourName);
+    if (args->level) {
+        fprintf(socket, " %d", args->level);
+    }
+    fprintf(socket, "\n");
     fflush(socket);
+    funlockfile(socket);
 }
 
 /**
  * @brief Send hint msg to server
  *
  * @param socket server socket to write to
+ * @param bench bench timing commands, NULL if not timing
+ * @param tag tag of game the hint is for, or untaggedGame
  * @param all send "hint all" if true, "hint best" if false
  */
-void send_hint(FILE* socket, bool all)
+void send_hint(FILE* socket, Bench* bench, long tag, bool all)
 {
+    bench_sent(bench, game_index(tag), BENCH_HINT);
+    flockfile(socket);
+    send_tag(socket, tag);
     fprintf(socket, "hint %s\n", all ? "all" : "best");
     fflush(socket);
+    funlockfile(socket);
+}
+
+/**
+ * @brief Send msg asking server for its best few moves
+ *
+ * @param socket server socket to write to
+ * @param bench bench timing commands, NULL if not timing
+ * @param tag tag of game the hint is for, or untaggedGame
+ * @param count number of moves wanted
+ */
+void send_hint_top(FILE* socket, Bench* bench, long tag, long count)
+{
+    bench_sent(bench, game_index(tag), BENCH_HINT);
+    flockfile(socket);
+    send_tag(socket, tag);
+    fprintf(socket, "hint top %ld\n", count);
+    fflush(socket);
+    funlockfile(socket);
 }
 
 /**
  * @brief Send move msg to server
  *
  * @param socket server socket to write to
+ * @param bench bench timing commands, NULL if not timing
+ * @param tag tag of game to move in, or untaggedGame
  * @param move move to send (alphanumeric string)
  */
-void send_move(FILE* socket, char* move)
+void send_move(FILE* socket, Bench* bench, long tag, char* move)
 {
+    bench_sent(bench, game_index(tag), BENCH_MOVE);
+    flockfile(socket);
+    send_tag(socket, tag);
     fprintf(socket, "move %s\n", move);
     fflush(socket);
+    funlockfile(socket);
+}
+
+/**
+ * @brief Send ping msg to server, which answers it at once with "pong"
+ *
+ * @param socket server socket to write to
+ * @param bench bench timing commands, NULL if not timing
+ */
+void send_ping(FILE* socket, Bench* bench)
+{
+    bench_sent(bench, 0, BENCH_PING);
+    fprintf(socket, "ping\n");
+    fflush(socket);
+}
+
+/**
+ * @brief Send a one word msg (e.g. "board", "resign") to server
+ *
+ * @param socket server socket to write to
+ * @param tag tag of game the msg is for, or untaggedGame
+ * @param cmd msg to send, without newline
+ */
+void send_command(FILE* socket, long tag, char* cmd)
+{
+    flockfile(socket);
+    send_tag(socket, tag);
+    fprintf(socket, "%s\n", cmd);
+    fflush(socket);
+    funlockfile(socket);
 }
 
 /**
@@ -278,39 +506,183 @@ bool check_is_client_turn(GameState* gameState)
     return true;
 }
 
+/**
+ * @brief Check whether commands are sent without waiting for the server's
+ * answers to earlier ones. A script playing the computer needn't wait, as the
+ * server answers each connection's commands in order and the computer moves
+ * before the next command is read.
+ *
+ * @param threadData data passed into thread
+ * @return true if commands are pipelined
+ */
+bool is_pipelined(ThreadData* threadData)
+{
+    return threadData->args.scriptPath
+            && threadData->args.opponent != OPPONENT_HUMAN;
+}
+
+/**
+ * @brief Wait while a scripted game hasn't started yet or, if the turn is
+ * wanted, while it's the opponent's turn. Call holding the games lock.
+ *
+ * @param threadData data passed into thread
+ * @param gameState game to wait for
+ * @param turn whether to wait for the client's turn
+ */
+void wait_for_game(ThreadData* threadData, GameState* gameState, bool turn)
+{
+    Games* games = threadData->games;
+    while (threadData->args.scriptPath
+            && (gameState->isStarting
+                    || (turn && gameState->isGameInProgress
+                            && !gameState->isClientTurn))) {
+        pthread_cond_wait(&games->changed, &games->lock);
+    }
+}
+
+/**
+ * @brief Check a game is in progress before sending a command for it, first
+ * waiting for it to start if running a script. Prints an error if it isn't.
+ *
+ * @param threadData data passed into thread
+ * @param gameIndex index of the game
+ * @return true if the command can be sent
+ */
+bool ready_in_game(ThreadData* threadData, int gameIndex)
+{
+    if (is_pipelined(threadData)) {
+        return true; // the server checks
+    }
+    Games* games = threadData->games;
+    pthread_mutex_lock(&games->lock);
+    wait_for_game(threadData, &games->states[gameIndex], false);
+    bool ready = check_game_in_progress(&games->states[gameIndex]);
+    pthread_mutex_unlock(&games->lock);
+    return ready;
+}
+
+/**
+ * @brief Check it's the client's turn before sending a command for a game,
+ * first waiting for it if running a script. Prints an error if it isn't.
+ *
+ * @param threadData data passed into thread
+ * @param gameIndex index of the game
+ * @param moving whether the command is a move, so the turn passes once sent
+ * @return true if the command can be sent
+ */
+bool ready_for_turn(ThreadData* threadData, int gameIndex, bool moving)
+{
+    if (is_pipelined(threadData)) {
+        return true; // the server checks
+    }
+    Games* games = threadData->games;
+    GameState* gameState = &games->states[gameIndex];
+    pthread_mutex_lock(&games->lock);
+    wait_for_game(threadData, gameState, true);
+    bool ready = check_is_client_turn(gameState);
+    if (ready && moving && threadData->args.scriptPath) {
+        // Don't send the script's next move until the opponent has moved
+        gameState->isClientTurn = false;
+    }
+    pthread_mutex_unlock(&games->lock);
+    return ready;
+}
+
+/**
+ * @brief Send start msg to server, noting the game is starting
+ *
+ * @param threadData data passed into thread
+ * @param gameIndex index of the game to start
+ */
+void start_game(ThreadData* threadData, int gameIndex)
+{
+    Games* games = threadData->games;
+    pthread_mutex_lock(&games->lock);
+    games->states[gameIndex].isStarting = true;
+    pthread_mutex_unlock(&games->lock);
+    send_start(threadData->writeSocket, threadData->games->bench,
+            game_tag(gameIndex), &threadData->args);
+}
+
+/**
+ * @brief Resign every game in progress, as the server would hold them for
+ * the session to resume otherwise
+ *
+ * @param threadData data passed into thread
+ */
+void resign_all(ThreadData* threadData)
+{
+    Games* games = threadData->games;
+    pthread_mutex_lock(&games->lock);
+    if (games->sessionToken[0]) {
+        for (int i = 0; i <= games->numGames; i++) {
+            if (games->states[i].isGameInProgress) {
+                send_command(threadData->writeSocket, game_tag(i),
+                        (char*)"resign");
+            }
+        }
+    }
+    pthread_mutex_unlock(&games->lock);
+}
+
+/**
+ * @brief Finish reading commands. Interactively, the client resigns its games
+ * and exits at once. A script's connection is shut down for writing instead,
+ * so the client exits once the server has answered everything and closed it.
+ *
+ * @param threadData data passed into thread
+ */
+void finish_input(ThreadData* threadData)
+{
+    Games* games = threadData->games;
+    if (!threadData->args.scriptPath) {
+        resign_all(threadData);
+        bench_report(games->bench, stderr);
+        exit(EXIT_SUCCESS); // exit immediately, no free
+    }
+    pthread_mutex_lock(&games->lock);
+    games->scriptDone = true;
+    pthread_mutex_unlock(&games->lock);
+    fflush(threadData->writeSocket);
+    shutdown(fileno(threadData->writeSocket), SHUT_WR);
+    pthread_exit(NULL);
+}
+
 /**
  * @brief Act on one field (word) input from stdin
  *
  * @param threadData data passed into thread
+ * @param gameIndex index of the game the input is for
  * @param cmd the field given
  * @return whether the field is valid (recognised)
  */
-bool stdin_one_field(ThreadData threadData, char* cmd)
+bool stdin_one_field(ThreadData* threadData, int gameIndex, char* cmd)
 {
-    Args args = threadData.args;
-    GameState* gameState = threadData.gameState;
+    FILE* socket = threadData->writeSocket;
+    Bench* bench = threadData->games->bench;
+    long tag = game_tag(gameIndex);
     if (!strcmp(cmd, "newgame")) {
-        send_start(threadData.writeSocket, args.opponent, args.colour);
+        start_game(threadData, gameIndex);
     } else if (!strcmp(cmd, "print")) {
-        if (check_game_in_progress(gameState)) {
-            fprintf(threadData.writeSocket, "board\n");
-            fflush(threadData.writeSocket);
+        if (ready_in_game(threadData, gameIndex)) {
+            send_command(socket, tag, (char*)"board");
         }
     } else if (!strcmp(cmd, "hint")) {
-        if (check_is_client_turn(gameState)) {
-            send_hint(threadData.writeSocket, false);
+        if (ready_for_turn(threadData, gameIndex, false)) {
+            send_hint(socket, bench, tag, false);
         }
     } else if (!strcmp(cmd, "possible")) {
-        if (check_is_client_turn(gameState)) {
-            send_hint(threadData.writeSocket, true);
+        if (ready_for_turn(threadData, gameIndex, false)) {
+            send_hint(socket, bench, tag, true);
         }
     } else if (!strcmp(cmd, "resign")) {
-        if (check_game_in_progress(gameState)) {
-            fprintf(threadData.writeSocket, "resign\n");
-            fflush(threadData.writeSocket);
+        if (ready_in_game(threadData, gameIndex)) {
+            send_command(socket, tag, (char*)"resign");
         }
+    } else if (!strcmp(cmd, "ping")) {
+        send_ping(socket, bench);
     } else if (!strcmp(cmd, "quit")) {
-        exit(EXIT_SUCCESS); // exit immediately, no free
+        finish_input(threadData);
     } else {
         return false;
     }
@@ -318,8 +690,118 @@ bool stdin_one_field(ThreadData threadData, char* cmd)
 }
 
 /**
- * @brief Read from stdin and send messages to server accordingly. To be
- * executed in a thread
+ * @brief Send a "resume" or "watch" command typed on stdin. Seats are only
+ * held for a session token, so resume gives the session's token if there is
+ * one.
+ *
+ * @param threadData data passed into thread
+ * @param gameIndex index of the game the command is for
+ * @param cmd "resume" or "watch"
+ * @param idStr game id typed
+ */
+void send_resume_or_watch(
+        ThreadData* threadData, int gameIndex, char* cmd, char* idStr)
+{
+    Games* games = threadData->games;
+    FILE* socket = threadData->writeSocket;
+    pthread_mutex_lock(&games->lock);
+    flockfile(socket);
+    send_tag(socket, game_tag(gameIndex));
+    if (!strcmp(cmd, "resume") && games->sessionToken[0]) {
+        fprintf(socket, "resume %s %s\n", idStr, games->sessionToken);
+    } else {
+        fprintf(socket, "%s %s\n", cmd, idStr);
+    }
+    fflush(socket);
+    funlockfile(socket);
+    pthread_mutex_unlock(&games->lock);
+}
+
+/**
+ * @brief Act on a command from stdin for one game
+ *
+ * @param threadData data passed into thread
+ * @param gameIndex index of the game the command is for
+ * @param fields fields of the command
+ * @param numFields number of fields
+ * @return whether the command is valid (recognised)
+ */
+bool stdin_command(
+        ThreadData* threadData, int gameIndex, char** fields, int numFields)
+{
+    if (numFields == shortLine) {
+        return stdin_one_field(threadData, gameIndex, fields[0]);
+    }
+    if (numFields == mediumLine
+            && (!strcmp(fields[0], "resume") || !strcmp(fields[0], "watch"))) {
+        // "resume <gameid>" or "watch <gameid>"
+        if (parse_number(fields[1]) < 0) {
+            return false;
+        }
+        send_resume_or_watch(threadData, gameIndex, fields[0], fields[1]);
+        return true;
+    }
+    if (numFields == mediumLine && !strcmp(fields[0], "hint")) {
+        // "hint <n>" for the best n moves
+        long count = parse_number(fields[1]);
+        if (count < 1) {
+            return false;
+        }
+        if (ready_for_turn(threadData, gameIndex, false)) {
+            send_hint_top(threadData->writeSocket, threadData->games->bench,
+                    game_tag(gameIndex), count);
+        }
+        return true;
+    }
+    if (numFields != mediumLine || strcmp(fields[0], "move")) {
+        return false;
+    }
+    char* moveChosen = fields[1];
+    bool validMove = (valid_move_length(strlen(moveChosen))
+            && str_is_alnum(moveChosen));
+    if (!validMove) {
+        warn_command_not_valid();
+    } else if (ready_for_turn(threadData, gameIndex, true)) {
+        send_move(threadData->writeSocket, threadData->games->bench,
+                game_tag(gameIndex), moveChosen);
+    }
+    return true;
+}
+
+/**
+ * @brief Act on a line of input from stdin. When playing several games, every
+ * command except quit and ping must start with "game <n>" to say which game it
+ * is for.
+ *
+ * @param threadData data passed into thread
+ * @param fields fields of the line
+ * @param numFields number of fields
+ * @return whether the line is valid (recognised)
+ */
+bool stdin_line(ThreadData* threadData, char** fields, int numFields)
+{
+    int numGames = threadData->args.numGames;
+    if (numGames == 0) {
+        return stdin_command(threadData, 0, fields, numFields);
+    }
+    if (numFields == shortLine
+            && (!strcmp(fields[0], "quit") || !strcmp(fields[0], "ping"))) {
+        return stdin_one_field(threadData, 0, fields[0]);
+    }
+    if (numFields <= mediumLine || strcmp(fields[0], "game")) {
+        return false;
+    }
+    long tag = parse_number(fields[1]);
+    if (tag < 1 || tag > numGames) {
+        return false;
+    }
+    return stdin_command(threadData, (int)tag, fields + mediumLine,
+            numFields - mediumLine);
+}
+
+/**
+ * @brief Read commands from stdin (or the script) and send messages to server
+ * accordingly. To be executed in a thread
  *
  * @param data ThreadData* - ptr to struct containing game state, cl args
  * @return unused, will never return
@@ -327,51 +809,35 @@ bool stdin_one_field(ThreadData threadData, char* cmd)
 void* thread_read_stdin(void* data)
 {
     ThreadData threadData = *(ThreadData*)data;
-    GameState* gameState = threadData.gameState;
     free(data);
 
     // Read from stdin
     char buffer[maxBufferSize];
     char* readResult;
-    while (readResult = fgets(buffer, maxBufferSize, stdin),
+    while (readResult = fgets(buffer, maxBufferSize, threadData.input),
             readResult != NULL) {
-        if (feof(stdin)) {
+        if (feof(threadData.input)) {
             // stdin closed, ignore partial command entered
             break;
         }
+        if (threadData.args.scriptPath
+                && (buffer[0] == '#' || !strcmp(buffer, "\n"))) {
+            continue; // comment or blank line in a script
+        }
         if (validate_line(buffer) == -1) {
             warn_command_not_valid();
             continue;
         }
         char** fields = split_by_char(buffer, ' ', 0);
-        char* cmd = fields[0];
-        int numFields = count_fields(fields);
-        bool valid = true;
-        if (numFields == 1) {
-            valid = stdin_one_field(threadData, cmd);
-        } else if (numFields == 2) {
-            if (!strcmp(cmd, "move")) {
-                char* moveChosen = fields[1];
-                bool validMove = (valid_move_length(strlen(moveChosen))
-                        && str_is_alnum(moveChosen));
-                if (!validMove) {
-                    warn_command_not_valid();
-                } else if (check_is_client_turn(gameState)) {
-                    send_move(threadData.writeSocket, moveChosen);
-                }
-            } else {
-                valid = false;
-            }
-        } else {
-            valid = false;
-        }
+        bool valid = stdin_line(&threadData, fields, count_fields(fields));
         free(fields);
         if (!valid) {
             warn_command_not_valid();
         }
     }
 
-    exit(EXIT_SUCCESS);
+    finish_input(&threadData);
+    return NULL;
 }
 
 /**
@@ -379,12 +845,25 @@ void* thread_read_stdin(void* data)
  *
  * @param cmd first field of input
  * @param secondField second field of input
+ * @param thirdField third field of input, NULL if only 2 fields
  * @param gameState current game state
  */
-void server_long_input(char* cmd, char* secondField, GameState* gameState)
+void server_long_input(
+        char* cmd, char* secondField, char* thirdField, GameState* gameState)
 {
-    if (!strcmp(cmd, "started")) {
+    if (!strcmp(cmd, "resumed") && thirdField) {
+        // "resumed <our colour> <colour to move>"
+        gameState->isGameInProgress = true;
+        gameState->isStarting = false;
+        gameState->isClientWhite = !strcmp(secondField, "white");
+        gameState->isClientTurn = !strcmp(secondField, thirdField);
+    } else if (!strcmp(cmd, "watching")) {
+        // Spectating, moves/check/gameover that follow aren't ours
+        gameState->isGameInProgress = false;
+        gameState->isClientTurn = false;
+    } else if (!strcmp(cmd, "started")) {
         gameState->isGameInProgress = true;
+        gameState->isStarting = false;
         char* colourGiven = secondField;
         if (!strcmp(colourGiven, "white")) {
             gameState->isClientWhite = true;
@@ -394,28 +873,236 @@ void server_long_input(char* cmd, char* secondField, GameState* gameState)
             gameState->isClientTurn = false;
         }
     }
-    // do nothing for "error _", "moves ..."
+    // do nothing for "moves ..."
     else if (!strcmp(cmd, "moved")) {
-        gameState->isClientTurn = !(gameState->isClientTurn);
+        gameState->isClientTurn = true;
+    } else if (!strcmp(cmd, "error")) {
+        // Resuming after reconnecting failed if it was waited on (game gone)
+        gameState->isStarting = false;
+        if (!strcmp(secondField, "move")) {
+            // Move rejected, still our turn
+            gameState->isClientTurn = true;
+        }
     } else if (!strcmp(cmd, "gameover")) {
         gameState->isGameInProgress = false;
     }
 }
 
 /**
- * @brief Thread that reads commands sent from server
+ * @brief Check if a line from server is a startboard/endboard marker (which
+ * aren't printed), ignoring any "game <tag>" prefix
+ *
+ * @param line line from server, newline-terminated
+ * @return true if line is a startboard/endboard marker
+ */
+bool is_board_marker(char* line)
+{
+    if (!strncmp(line, "game ", strlen("game "))) {
+        char* tagEnd = strchr(line + strlen("game "), ' ');
+        if (tagEnd) {
+            line = tagEnd + 1;
+        }
+    }
+    return !strcmp(line, "startboard\n") || !strcmp(line, "endboard\n");
+}
+
+/**
+ * @brief Get the kinds of timed command a msg from server can be the reply to
+ *
+ * @param cmd first field of the msg
+ * @return a bit (1 << kind) for each kind of command, 0 if none
+ */
+unsigned reply_answers(char* cmd)
+{
+    if (!strcmp(cmd, "started")) {
+        return 1u << BENCH_START;
+    }
+    if (!strcmp(cmd, "ok")) {
+        return 1u << BENCH_MOVE;
+    }
+    if (!strcmp(cmd, "moves")) {
+        return 1u << BENCH_HINT;
+    }
+    if (!strcmp(cmd, "pong")) {
+        return 1u << BENCH_PING;
+    }
+    if (!strcmp(cmd, "error")) {
+        return (1u << BENCH_MOVE) | (1u << BENCH_HINT);
+    }
+    return 0; // not a reply, or to a command not timed
+}
+
+/**
+ * @brief Act on a (split) line from server, updating the state of the game it
+ * is for. Call holding the games lock.
+ *
+ * @param fields fields of the line
+ * @param games state of each game
+ */
+void server_line(char** fields, Games* games)
+{
+    int gameIndex = 0;
+    int numFields = count_fields(fields);
+    if (games->numGames > 0 && numFields > mediumLine
+            && !strcmp(fields[0], "game")) {
+        long tag = parse_number(fields[1]);
+        if (tag >= 1 && tag <= games->numGames) {
+            gameIndex = (int)tag;
+            fields += mediumLine;
+            numFields -= mediumLine;
+        }
+    }
+    GameState* gameState = &games->states[gameIndex];
+    char* cmd = fields[0];
+    bench_answered(games->bench, gameIndex, reply_answers(cmd));
+    if (numFields == mediumLine && !strcmp(cmd, "gameid")) {
+        // Never tagged, it follows the "started" of the game it's for
+        games->states[games->lastStarted].gameId = parse_number(fields[1]);
+        return;
+    }
+    if (!strcmp(cmd, "started")) {
+        games->lastStarted = gameIndex;
+    }
+    if (numFields == shortLine) {
+        if (!strcmp(cmd, "ok")) {
+            gameState->isClientTurn = false;
+        }
+        // do nothing for startboard/endboard, check
+    } else if (numFields == mediumLine || numFields == longLine) {
+        server_long_input(cmd, fields[1], fields[2], gameState);
+    }
+}
+
+/**
+ * @brief Keep the session token if a line from server gives it (such lines
+ * aren't printed)
  *
- * @param socket socket connected to server to read from
- * @param gameState current game state for client
+ * @param games game states, to keep the token in
+ * @param line line from server, newline-terminated
+ * @return true if the line gave the token
  */
-void thread_read_server(FILE* socket, GameState* gameState)
+bool read_session_token(Games* games, char* line)
 {
+    if (strncmp(line, "session ", strlen("session "))) {
+        return false;
+    }
+    char* token = line + strlen("session ");
+    size_t len = strcspn(token, "\n");
+    if (len < sessionTokenSize) {
+        pthread_mutex_lock(&games->lock);
+        memcpy(games->sessionToken, token, len);
+        games->sessionToken[len] = '\0';
+        pthread_mutex_unlock(&games->lock);
+    }
+    return true;
+}
+
+/**
+ * @brief Check whether any game can be resumed after reconnecting
+ *
+ * @param games game states
+ * @return true if there is a session token and a game in progress with a
+ * known id
+ */
+bool can_resume(Games* games)
+{
+    if (!games->sessionToken[0]) {
+        return false;
+    }
+    for (int i = 0; i <= games->numGames; i++) {
+        if (games->states[i].isGameInProgress && games->states[i].gameId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Connect to the server again after the connection dropped, then ask
+ * to resume each game in progress with the session token. The new socket
+ * takes the old one's fd, so both socket streams carry on with it. Call
+ * holding the games lock.
+ *
+ * @param games game states and connection
+ * @return 0 if reconnected, -1 if there is no game to resume or the server
+ * couldn't be reached
+ */
+int reconnect(Games* games)
+{
+    if (!can_resume(games)) {
+        return -1;
+    }
+    int fd = get_socket_fd(games->port);
+    for (int attempt = 1; attempt < reconnectAttempts && fd == -1; attempt++) {
+        sleep(reconnectDelaySeconds);
+        fd = get_socket_fd(games->port);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    // Msgs being sent go wholly to the old socket or the new one
+    flockfile(games->writeSocket);
+    dup2(fd, fileno(games->readSocket));
+    close(fd);
+    clearerr(games->readSocket);
+    clearerr(games->writeSocket);
+    for (int i = 0; i <= games->numGames; i++) {
+        GameState* gameState = &games->states[i];
+        if (gameState->isGameInProgress && gameState->gameId) {
+            // In progress again once "resumed"
+            gameState->isGameInProgress = false;
+            gameState->isStarting = true;
+            send_tag(games->writeSocket, game_tag(i));
+            fprintf(games->writeSocket, "resume %ld %s\n", gameState->gameId,
+                    games->sessionToken);
+        }
+    }
+    fprintf(games->writeSocket, "session\n");
+    fflush(games->writeSocket);
+    funlockfile(games->writeSocket);
+    return 0;
+}
+
+/**
+ * @brief Handle the server closing the connection: exit successfully if a
+ * script had finished, as the server has then answered everything, or else
+ * reconnect, exiting if that fails
+ *
+ * @param games game states
+ */
+void server_closed(Games* games)
+{
+    pthread_mutex_lock(&games->lock);
+    bool scriptDone = games->scriptDone;
+    int reconnected = scriptDone ? -1 : reconnect(games);
+    pthread_mutex_unlock(&games->lock);
+    if (reconnected == 0) {
+        return;
+    }
+    bench_report(games->bench, stderr);
+    if (scriptDone) {
+        exit(EXIT_SUCCESS);
+    }
+    fprintf(stderr, "uqchessclient: server has gone away\n");
+    fflush(stderr);
+    exit(serverGoneExitCode);
+}
+
+/**
+ * @brief Read and act on commands sent from server until the connection
+ * closes
+ *
+ * @param games current state of each game for client, and the connection
+ */
+void read_server(Games* games)
+{
+    FILE* socket = games->readSocket;
     // Assuming a null char is never read from the socket
     char buffer[maxBufferSize];
     char* readResult;
     while (readResult = fgets(buffer, maxBufferSize, socket),
             readResult != NULL) {
-        if (!strcmp(buffer, "startboard\n") || !strcmp(buffer, "endboard\n")) {
+        if (is_board_marker(buffer) || read_session_token(games, buffer)) {
             // no need to process or print these
             continue;
         }
@@ -431,28 +1118,51 @@ void thread_read_server(FILE* socket, GameState* gameState)
             continue;
         }
         char** fields = split_by_char(buffer, ' ', 0);
-        char* cmd = fields[0];
-        int numFields = count_fields(fields);
-        if (numFields == shortLine) {
-            if (!strcmp(cmd, "ok")) {
-                gameState->isClientTurn = !(gameState->isClientTurn);
-            }
-            // do nothing for startboard/endboard, check
-        } else if (numFields == mediumLine || numFields == longLine) {
-            server_long_input(cmd, fields[1], gameState);
-        }
+        pthread_mutex_lock(&games->lock);
+        server_line(fields, games);
+        pthread_cond_broadcast(&games->changed);
+        pthread_mutex_unlock(&games->lock);
         free(fields);
     }
+}
 
-    fprintf(stderr, "uqchessclient: server has gone away\n");
-    fflush(stderr);
-    exit(serverGoneExitCode);
+/**
+ * @brief Thread that reads commands sent from server, reconnecting whenever
+ * the connection drops
+ *
+ * @param games current state of each game for client, and the connection
+ */
+void thread_read_server(Games* games)
+{
+    while (1) {
+        read_server(games);
+        server_closed(games);
+    }
+}
+
+/**
+ * @brief Open where commands are read from: the script if given, else stdin
+ *
+ * @param args command-line args
+ * @return the stream to read commands from
+ */
+FILE* open_input(const Args* args)
+{
+    if (!args->scriptPath || !strcmp(args->scriptPath, "-")) {
+        return stdin;
+    }
+    FILE* input = fopen(args->scriptPath, "r");
+    if (!input) {
+        warn_script_open_error(args->scriptPath);
+    }
+    return input;
 }
 
 int main(int argc, char** argv)
 {
     // Get args
     Args args = get_args(argc, argv);
+    FILE* input = open_input(&args);
 
     // Connect to server
     int socketFd = get_socket_fd(args.port);
@@ -462,25 +1172,46 @@ int main(int argc, char** argv)
     FILE* readSocket = fdopen(socketFd, "r");
     FILE* writeSocket = fdopen(socketFd, "w");
 
-    // Initial messages to stdout and server
-    printf("Welcome to UQChessClient - written by s4800658\n");
-    fflush(stdout);
-    send_start(writeSocket, args.opponent, args.colour);
-
-    // Set up data
-    GameState* gameState = (GameState*)malloc(sizeof(GameState));
-    memset(gameState, 0, sizeof(*gameState));
-    gameState->isGameInProgress = false;
+    // Set up data, all games start not in progress
+    Games games = {.states = (GameState*)calloc(
+                           args.numGames + 1, sizeof(GameState)),
+            .numGames = args.numGames,
+            .scriptDone = false,
+            .bench = args.bench ? bench_create() : NULL,
+            .port = args.port,
+            .readSocket = readSocket,
+            .writeSocket = writeSocket,
+            .sessionToken = "",
+            .lastStarted = 0};
+    pthread_mutex_init(&games.lock, NULL);
+    pthread_cond_init(&games.changed, NULL);
     ThreadData* threadData = (ThreadData*)malloc(sizeof(ThreadData));
     threadData->args = args;
-    threadData->gameState = gameState;
+    threadData->games = &games;
+    threadData->input = input;
     threadData->readSocket = readSocket;
     threadData->writeSocket = writeSocket;
 
+    // Initial messages to stdout and server. Interactively, ask for a session
+    // token after the games start, so they can be resumed if the connection
+    // drops (writes to it then fail rather than killing the client).
+    printf("Welcome to UQChessClient - written by s4800658\n");
+    fflush(stdout);
+    if (args.numGames == 0) {
+        start_game(threadData, 0);
+    }
+    for (int tag = 1; tag <= args.numGames; tag++) {
+        start_game(threadData, tag);
+    }
+    if (!args.scriptPath) {
+        signal(SIGPIPE, SIG_IGN);
+        send_command(writeSocket, untaggedGame, (char*)"session");
+    }
+
     // thread id of process reading stdin
     pthread_t stdinThreadId;
     pthread_create(&stdinThreadId, NULL, thread_read_stdin, threadData);
-    thread_read_server(readSocket, gameState);
+    thread_read_server(&games);
     // Either thread will just exit, never return, so no need to join/detach
 
     return EXIT_SUCCESS;
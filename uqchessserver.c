@@ -5,16 +5,22 @@
 
 // REF: entire file very similar to lecture server-multithreaded.c
 
+#define _GNU_SOURCE // for pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/random.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -23,29 +29,155 @@
 
 #include <csse2310a4.h>
 #include "shared.h"
+#include "journal.h"
+#include "pgn.h"
+#include "uci.h"
+#include "outbox.h"
+#include "pool.h"
+#include "net.h"
+#include "prefork.h"
+#include "idmap.h"
+#include "timerwheel.h"
+#include "placement.h"
+#include "budget.h"
+#include "lobby.h"
+#include "batch.h"
+#include "flight.h"
+#include "position.h"
 
 int const errorCommand = -1;
 int const errorGame = -2;
 int const errorTurn = -3;
 
-int const numArgsDefaultPort = 1;
-int const numArgsGivenPort = 3;
-
 int const numPlayers = 2;
 
-int const queueLength = 10;
+// Listen backlog and threads backend reader threads, unless given with
+// --backlog and --readers
+int const defaultBacklog = SOMAXCONN;
+int const defaultReaders = 16;
+// Max backlog or reader threads that can be given
+long const maxBacklog = 65535;
+long const maxReaders = 65535;
+// Stack size of per-connection threads in low memory mode
+size_t const lowMemoryStackSize = 64 * 1024;
+// Most bytes waiting to be sent to one connection, unless given with
+// --outqueue, and the most that can be given
+long const defaultOutputQueueBytes = 1024 * 1024;
+long const maxOutputQueueBytes = 1024 * 1024 * 1024;
+// Longest idle timeout that can be given with --idle (seconds)
+long const maxIdleSeconds = 7 * 24 * 60 * 60;
+// Idle timeouts are checked once a tick (ms)
+long const idleTickMs = 1000;
+// How long a dropped player's seat is held for them to reconnect, unless
+// given with --grace, and the longest that can be given (seconds)
+int const defaultGraceSeconds = 60;
+long const maxGraceSeconds = 24 * 60 * 60;
+// Session tokens are written as this many hex digits, made up of two halves
+// if made from random()
+enum { sessionTokenDigits = 16 };
+int const sessionTokenBase = 16;
+int const sessionTokenHalfBits = 32;
+// Humans are matched if their ratings are at most this far apart, the window
+// widening this much each time a waiting player has waited this long (rating
+// points, rating points, seconds)
+int const matchWindow = 100;
+int const matchWidening = 100;
+int const matchWideningSeconds = 5;
+// TCP keepalive: probe a connection silent this long, then this often, and
+// give up after this many unanswered probes (seconds, seconds, probes)
+int const keepAliveIdle = 60;
+int const keepAliveInterval = 10;
+int const keepAliveProbes = 5;
+
+// Max number of games (tags) one connection can play at once
+int const maxTagsPerConnection = 1000;
+// Client slots of a shard only a new connection's untagged client can take,
+// so connections playing many tags can't fill the shard for everyone else
+int const reservedClientSlots = 1000;
+// Most self-play games that can be given with --selfplay, and the most moves
+// (by both sides) a self-play game can last before it is adjudicated a draw
+long const maxSelfPlayGames = 1000;
+int const maxSelfPlayMoves = 400;
+// Self-play games open with this many random moves (by both sides), so they
+// don't all play out the same
+int const selfPlayRandomMoves = 2;
+
+// Max number of shards given with --shards (or workers given with --prefork)
+long const maxShards = 256;
+// Limits of --engineMemory (MB) and --engineThreads
+long const maxEngineMemoryMb = 1 << 22;
+long const maxEngineThreads = 1024;
+// Largest message prefork workers send each other
+enum { peerBufferSize = 65536 };
+// Ids a prefork worker hands connections off with start at its number of
+// restarts shifted left this much, so they differ from ids used before
+int const peerIdRestartShift = 32;
+// Number of colours a client can ask for (white, black, either)
+enum { numColours = COLOUR_UNSPECIFIED + 1 };
 
 int const invalidArgsExitCode = 8;
 int const cantStartListeningExitCode = 20;
 int const cantStartCommsExitCode = 4;
+int const cantOpenJournalExitCode = 21;
+int const cantOpenArchiveExitCode = 22;
+int const cantStartNetworkExitCode = 23;
+int const cantStartWorkersExitCode = 24;
+int const cantOpenAnalysisExitCode = 25;
 
 char const goPerft1[] = "go perft 1\n";
+char const goSearch[] = "go movetime 500 depth 15\n";
 char const zero[] = "0";
+char const initialFen[]
+        = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+char const journalTmpSuffix[] = ".tmp";
+// The journal is compacted while running once the records of games that have
+// ended are at least this many, and at least half of its records
+long const journalCompactMinRecords = 10000;
 
 // Server cmd line args
 typedef struct Args {
     // Serv name/port num given on command line, NULL if not given yet
     char* portFromCmdLine;
+    // File to journal games to (and restore them from), NULL if not given
+    char* journalFile;
+    // Path prefix of PGN archive files, NULL if not archiving
+    char* archivePrefix;
+    // How connections are accepted and read
+    NetOptions net;
+    // Max connections waiting to be accepted, per listening socket
+    int backlog;
+    // How connections' outboxes send
+    OutboxOptions outbox;
+    // Whether to use as little memory per connection as possible (--memory)
+    bool lowMemory;
+    // Disconnect connections that send no line for this many seconds, 0 if
+    // not given (never)
+    int idleSeconds;
+    // Hold the seats of players with session tokens who disconnect for this
+    // many seconds, 0 to resign their games at once
+    int graceSeconds;
+    // Number of shards (listener, tables, engine and workers) to run, 0 if
+    // not given (one shard, not pinned to a core)
+    int numShards;
+    // Number of worker processes to prefork, each running one shard, 0 if not
+    // given (no separate processes)
+    int numWorkers;
+    // Whether engines and server threads are kept to their own cores, which
+    // shards share out (--engineCores, --serverCores)
+    bool placeCores;
+    cpu_set_t engineCores;
+    cpu_set_t serverCores;
+    // Total hash memory (MB) and threads shared by every engine, 0 if not
+    // given (each engine uses its own settings)
+    int engineMemoryMb;
+    int engineThreads;
+    // Number of computer vs computer games to keep playing, their PGN
+    // written to stdout, 0 if not given
+    int selfPlayGames;
+    // EPD file of positions to find best moves for, and the EPD file to write
+    // them to, instead of serving (--analyse, --out), NULL if not given
+    char* analyseFile;
+    char* analyseOut;
 } Args;
 
 /**
@@ -54,11 +186,30 @@ typedef struct Args {
  */
 void warn_invalid_args(void)
 {
-    fprintf(stderr, "Usage: ./uqchessserver [--listenOn portno]\n");
+    fprintf(stderr,
+            "Usage: ./uqchessserver [--listenOn portno] [--journal file] "
+            "[--archive prefix] [--net threads|epoll|uring] "
+            "[--shards n | --prefork n] [--backlog n] [--readers n] "
+            "[--memory normal|low] [--idle seconds] [--outqueue bytes] "
+            "[--overflow disconnect|drop] [--engineCores list] "
+            "[--serverCores list] [--engineMemory mb] [--engineThreads n] "
+            "[--grace seconds] [--selfplay n] [--analyse file --out file]\n");
     fflush(stderr);
     exit(invalidArgsExitCode);
 }
 
+/**
+ * @brief Print can't open journal and exit with code cantOpenJournalExitCode.
+ *
+ * @param path journal file used in the error msg
+ */
+void warn_cant_open_journal(char* path)
+{
+    fprintf(stderr, "uqchessserver: can't open journal \"%s\"\n", path);
+    fflush(stderr);
+    exit(cantOpenJournalExitCode);
+}
+
 /**
  * @brief Print can't start listening and exit with code
  * cantStartListeningExitCode.
@@ -73,6 +224,253 @@ void warn_cant_start_listening(char* port)
     exit(cantStartListeningExitCode);
 }
 
+/**
+ * @brief Print can't open archive and exit with code cantOpenArchiveExitCode.
+ *
+ * @param prefix archive prefix used in the error msg
+ */
+void warn_cant_open_archive(char* prefix)
+{
+    fprintf(stderr, "uqchessserver: can't open archive \"%s\"\n", prefix);
+    fflush(stderr);
+    exit(cantOpenArchiveExitCode);
+}
+
+/**
+ * @brief Print can't open analysis file and exit with code
+ * cantOpenAnalysisExitCode.
+ *
+ * @param path file used in the error msg
+ */
+void warn_cant_open_analysis(const char* path)
+{
+    fprintf(stderr, "uqchessserver: can't open analysis file \"%s\"\n", path);
+    fflush(stderr);
+    exit(cantOpenAnalysisExitCode);
+}
+
+/**
+ * @brief Print can't start worker processes and exit with code
+ * cantStartWorkersExitCode.
+ */
+void warn_cant_start_workers(void)
+{
+    fprintf(stderr, "uqchessserver: can't start worker processes\n");
+    fflush(stderr);
+    exit(cantStartWorkersExitCode);
+}
+
+/**
+ * @brief Print can't start network backend and exit with code
+ * cantStartNetworkExitCode.
+ */
+void warn_cant_start_network(void)
+{
+    fprintf(stderr, "uqchessserver: can't start network backend\n");
+    fflush(stderr);
+    exit(cantStartNetworkExitCode);
+}
+
+/**
+ * @brief Print that there are more engines than engine threads (each engine
+ * still uses one)
+ */
+void warn_engines_overcommitted(void)
+{
+    fprintf(stderr,
+            "uqchessserver: more engines than engine threads, some threads "
+            "are shared\n");
+    fflush(stderr);
+}
+
+/**
+ * @brief Parse a count (of shards, workers etc.) given on the command line,
+ * exiting if it isn't valid
+ *
+ * @param str count given
+ * @param max largest count allowed
+ * @return the count
+ */
+int parse_count(char* str, long max)
+{
+    long count = parse_number(str);
+    if (count < 1 || count > max) {
+        warn_invalid_args();
+    }
+    return (int)count;
+}
+
+/**
+ * @brief Set the memory mode given on the command line, exiting if it isn't
+ * valid. Low memory mode gives per-connection threads small stacks and only
+ * runs outbox senders while they have something to send.
+ *
+ * @param args arguments to set the mode in
+ * @param mode mode given (normal or low)
+ */
+void parse_memory_mode(Args* args, char* mode)
+{
+    if (!strcmp(mode, "low")) {
+        args->lowMemory = true;
+        args->net.stackSize = lowMemoryStackSize;
+        args->outbox.stackSize = lowMemoryStackSize;
+        args->outbox.senderOnDemand = true;
+    } else if (strcmp(mode, "normal")) {
+        warn_invalid_args();
+    }
+}
+
+/**
+ * @brief Set what happens to a connection that falls too far behind in
+ * reading, exiting if the policy given isn't valid
+ *
+ * @param args arguments to set the policy in
+ * @param policy policy given (disconnect or drop)
+ */
+void parse_overflow_policy(Args* args, char* policy)
+{
+    if (!strcmp(policy, "disconnect")) {
+        args->outbox.overflow = OUTBOX_DISCONNECT;
+    } else if (!strcmp(policy, "drop")) {
+        args->outbox.overflow = OUTBOX_DROP;
+    } else {
+        warn_invalid_args();
+    }
+}
+
+// Command-line options, each given as "--option value"
+typedef enum Option {
+    OPT_LISTEN_ON,
+    OPT_JOURNAL,
+    OPT_ARCHIVE,
+    OPT_NET,
+    OPT_SHARDS,
+    OPT_PREFORK,
+    OPT_BACKLOG,
+    OPT_READERS,
+    OPT_MEMORY,
+    OPT_IDLE,
+    OPT_OUTQUEUE,
+    OPT_OVERFLOW,
+    OPT_ENGINE_CORES,
+    OPT_SERVER_CORES,
+    OPT_ENGINE_MEMORY,
+    OPT_ENGINE_THREADS,
+    OPT_GRACE,
+    OPT_SELFPLAY,
+    OPT_ANALYSE,
+    OPT_OUT,
+    NUM_OPTIONS
+} Option;
+
+// Names of the options, in the order of Option
+char const* const optionNames[NUM_OPTIONS] = {"--listenOn", "--journal",
+        "--archive", "--net", "--shards", "--prefork", "--backlog",
+        "--readers", "--memory", "--idle", "--outqueue", "--overflow",
+        "--engineCores", "--serverCores", "--engineMemory", "--engineThreads",
+        "--grace", "--selfplay", "--analyse", "--out"};
+
+/**
+ * @brief Read the "--option value" pairs of the command line, exiting if an
+ * option isn't known, has no value or is given twice
+ *
+ * @param argc number of arguments
+ * @param argv array of arguments
+ * @param values write each option's value here, NULL if not given
+ */
+void read_option_values(int argc, char** argv, char** values)
+{
+    for (int option = 0; option < NUM_OPTIONS; option++) {
+        values[option] = NULL;
+    }
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 == argc || strlen(argv[i + 1]) == 0) {
+            warn_invalid_args();
+        }
+        int option = 0;
+        while (option < NUM_OPTIONS && strcmp(argv[i], optionNames[option])) {
+            option++;
+        }
+        if (option == NUM_OPTIONS || values[option]) {
+            warn_invalid_args();
+        }
+        values[option] = argv[i + 1];
+    }
+}
+
+/**
+ * @brief Set the arguments about how connections are handled from the option
+ * values given, exiting if any isn't valid
+ *
+ * @param args arguments to set
+ * @param values each option's value, NULL if not given
+ */
+void set_connection_args(Args* args, char** values)
+{
+    if (values[OPT_NET]
+            && net_parse_backend(values[OPT_NET], &args->net.backend) == -1) {
+        warn_invalid_args();
+    }
+    if (values[OPT_BACKLOG]) {
+        args->backlog = parse_count(values[OPT_BACKLOG], maxBacklog);
+    }
+    if (values[OPT_READERS]) {
+        args->net.numReaders = parse_count(values[OPT_READERS], maxReaders);
+    }
+    if (values[OPT_MEMORY]) {
+        parse_memory_mode(args, values[OPT_MEMORY]);
+    }
+    if (values[OPT_IDLE]) {
+        args->idleSeconds = parse_count(values[OPT_IDLE], maxIdleSeconds);
+    }
+    if (values[OPT_OUTQUEUE]) {
+        args->outbox.maxQueuedBytes
+                = parse_count(values[OPT_OUTQUEUE], maxOutputQueueBytes);
+    }
+    if (values[OPT_OVERFLOW]) {
+        parse_overflow_policy(args, values[OPT_OVERFLOW]);
+    }
+    if (values[OPT_GRACE]) {
+        long grace = parse_number(values[OPT_GRACE]);
+        if (grace < 0 || grace > maxGraceSeconds) {
+            warn_invalid_args();
+        }
+        args->graceSeconds = (int)grace;
+    }
+}
+
+/**
+ * @brief Set which cores engines and server threads run on from the option
+ * values given, exiting if a core list isn't valid. If only one is given, the
+ * other gets every other core.
+ *
+ * @param args arguments to set
+ * @param values each option's value, NULL if not given
+ */
+void set_placement_args(Args* args, char** values)
+{
+    char* engineList = values[OPT_ENGINE_CORES];
+    char* serverList = values[OPT_SERVER_CORES];
+    args->placeCores = engineList || serverList;
+    if ((engineList
+                && placement_parse_cores(engineList, &args->engineCores) == -1)
+            || (serverList
+                    && placement_parse_cores(serverList, &args->serverCores)
+                            == -1)) {
+        warn_invalid_args();
+    }
+    if (engineList && !serverList) {
+        placement_other_cores(&args->engineCores, &args->serverCores);
+    } else if (serverList && !engineList) {
+        placement_other_cores(&args->serverCores, &args->engineCores);
+    }
+    if (args->placeCores
+            && (!CPU_COUNT(&args->engineCores)
+                    || !CPU_COUNT(&args->serverCores))) {
+        warn_invalid_args(); // no cores left for the other
+    }
+}
+
 /**
  * @brief Process command-line arguments and returns an Args struct containing
  * info about the arguments.
@@ -83,17 +481,49 @@ void warn_cant_start_listening(char* port)
  */
 Args get_args(int argc, char** argv)
 {
-    Args args = {.portFromCmdLine = NULL};
+    Args args = {.net = {.backend = NET_THREADS,
+                         .numReaders = defaultReaders,
+                         .stackSize = 0},
+            .backlog = defaultBacklog,
+            .outbox = {.stackSize = 0,
+                    .senderOnDemand = false,
+                    .maxQueuedBytes = defaultOutputQueueBytes,
+                    .overflow = OUTBOX_DISCONNECT},
+            .lowMemory = false,
+            .idleSeconds = 0,
+            .graceSeconds = defaultGraceSeconds};
+    char* values[NUM_OPTIONS];
+    read_option_values(argc, argv, values);
 
-    if (argc == numArgsDefaultPort) {
-        args.portFromCmdLine = (char*)zero;
-    } else if (argc == numArgsGivenPort) {
-        if (strcmp(argv[1], "--listenOn") != 0 || strlen(argv[2]) == 0) {
-            warn_invalid_args();
-        }
-        args.portFromCmdLine = argv[2];
-    } else {
-        warn_invalid_args();
+    args.portFromCmdLine
+            = values[OPT_LISTEN_ON] ? values[OPT_LISTEN_ON] : (char*)zero;
+    args.journalFile = values[OPT_JOURNAL];
+    args.archivePrefix = values[OPT_ARCHIVE];
+    args.numShards = values[OPT_SHARDS]
+            ? parse_count(values[OPT_SHARDS], maxShards)
+            : 0;
+    args.numWorkers = values[OPT_PREFORK]
+            ? parse_count(values[OPT_PREFORK], maxShards)
+            : 0;
+    if (args.numShards && args.numWorkers) {
+        warn_invalid_args(); // shards and workers are alternatives
+    }
+    set_connection_args(&args, values);
+    set_placement_args(&args, values);
+    args.engineMemoryMb = values[OPT_ENGINE_MEMORY]
+            ? parse_count(values[OPT_ENGINE_MEMORY], maxEngineMemoryMb)
+            : 0;
+    args.engineThreads = values[OPT_ENGINE_THREADS]
+            ? parse_count(values[OPT_ENGINE_THREADS], maxEngineThreads)
+            : 0;
+    args.selfPlayGames = values[OPT_SELFPLAY]
+            ? parse_count(values[OPT_SELFPLAY], maxSelfPlayGames)
+            : 0;
+    args.analyseFile = values[OPT_ANALYSE];
+    args.analyseOut = values[OPT_OUT];
+    if (!args.analyseFile != !args.analyseOut
+            || (args.analyseFile && args.numWorkers)) {
+        warn_invalid_args(); // analysis needs both files, and no workers
     }
 
     return args;
@@ -127,11 +557,14 @@ int get_ip_addr_info(struct addrinfo** addrInfo, const char* portName)
  * @brief Listens on given port. Gets listening socket
  *
  * @param portName serv name/port num
+ * @param reusePort true to let other sockets (shards) listen on the same port
+ * @param backlog max connections waiting to be accepted
  * @param listenFd write the socket listening fd here
  * @param portNum write the received port num here
  * @return 0 if successful, -1 if not
  */
-int open_listen(const char* portName, int* listenFd, uint16_t* portNum)
+int open_listen(const char* portName, bool reusePort, int backlog,
+        int* listenFd, uint16_t* portNum)
 {
     struct addrinfo* ai = 0;
     if (get_ip_addr_info(&ai, portName) == -1) {
@@ -139,13 +572,31 @@ int open_listen(const char* portName, int* listenFd, uint16_t* portNum)
     }
 
     // Create a socket
-    int listenFdFromSocket
-            = socket(AF_INET, SOCK_STREAM, 0); // 0=default protocol (TCP)
+    // Close-on-exec so the engine doesn't keep the socket (and, with
+    // SO_REUSEPORT, get a share of the connections) once the server exits
+    int listenFdFromSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC,
+            0); // 0=default protocol (TCP)
     if (listenFdFromSocket < 0) {
         // Error creating socket
         return -1;
     }
 
+    // Allow address (port number) to be reused immediately, and by every
+    // shard's socket at once. Must be set before binding.
+    int optVal = 1;
+    if (setsockopt(listenFdFromSocket, SOL_SOCKET, SO_REUSEADDR, &optVal,
+                sizeof(int))
+            < 0) {
+        // Error setting socket option
+        return -1;
+    }
+    if (reusePort
+            && setsockopt(listenFdFromSocket, SOL_SOCKET, SO_REUSEPORT,
+                       &optVal, sizeof(int))
+                    < 0) {
+        return -1;
+    }
+
     // Bind socket to address
     if (bind(listenFdFromSocket, ai->ai_addr, sizeof(struct sockaddr)) < 0) {
         // Bind socket to address
@@ -162,19 +613,10 @@ int open_listen(const char* portName, int* listenFd, uint16_t* portNum)
     }
     *portNum = ntohs(ad.sin_port);
 
-    // Allow address (port number) to be reused immediately
-    int optVal = 1;
-    if (setsockopt(listenFdFromSocket, SOL_SOCKET, SO_REUSEADDR, &optVal,
-                sizeof(int))
-            < 0) {
-        // Error setting socket option
-        return -1;
-    }
-
     // Indicate willingness to listen on socket - connections can now be queued.
-    // Up to 10 connection requests can queue (Reality on moss is that this
-    // queue length parameter is ignored)
-    if (listen(listenFdFromSocket, queueLength) < 0) {
+    // Up to backlog connection requests can queue (the kernel caps it at
+    // net.core.somaxconn), enough to ride out every client reconnecting at once
+    if (listen(listenFdFromSocket, backlog) < 0) {
         // Error listening
         return -1;
     }
@@ -196,20 +638,165 @@ char* capitalise(char* buffer, int len)
 }
 
 struct Client;
+struct Resources;
+
+// A running engine process
+typedef struct Engine {
+    FILE* toEngineStream;
+    UciReader* fromEngine;
+    // Search run for a computer move or best move hint
+    const char* goCmd;
+    // Budget the engine's hash and threads come from, NULL if none, the
+    // engine's number in it and the budget generation its share was set for
+    EngineBudget* budget;
+    int budgetEngine;
+    unsigned long budgetGeneration;
+} Engine;
+
+// Engine settings for a difficulty level of computer opponent. Lower levels
+// play weaker and get shorter searches and fewer resources.
+typedef struct EngineLevel {
+    // UCI "Skill Level", 0 to 20
+    int skill;
+    int threads;
+    int hashMb;
+    const char* goCmd;
+    // Share of an engine budget, relative to fullStrengthWeight
+    int weight;
+} EngineLevel;
+
+// Number of difficulty levels, "start computer <colour> <level>" taking 1 up
+// to this
+enum { numEngineLevels = 4 };
+EngineLevel const engineLevels[numEngineLevels] = {
+        {.skill = 0,
+                .threads = 1,
+                .hashMb = 16,
+                .goCmd = "go depth 1\n",
+                .weight = 1},
+        {.skill = 6,
+                .threads = 1,
+                .hashMb = 16,
+                .goCmd = "go movetime 100 depth 5\n",
+                .weight = 1},
+        {.skill = 13,
+                .threads = 1,
+                .hashMb = 32,
+                .goCmd = "go movetime 250 depth 10\n",
+                .weight = 2},
+        {.skill = 20,
+                .threads = 2,
+                .hashMb = 128,
+                .goCmd = "go movetime 1000 depth 20\n",
+                .weight = 8}};
+// Engine budget weight of a shard's own (full strength) engine
+int const fullStrengthWeight = 4;
+// Most engines a shard runs for clients: its own and one per level (self-play
+// engines come on top)
+int const enginesPerShard = 1 + numEngineLevels;
+
+// Human seat kept for the player who dropped out of it to resume with a token
+typedef struct HeldSeat {
+    Timer timer;
+    struct Game* game;
+    int seat;
+    // Session token of the player, 0 if the seat isn't held
+    unsigned long token;
+    // When the player's time to come back is up (monotonic seconds)
+    long deadline;
+    // Player's rating, kept for the connection they come back on
+    int rating;
+} HeldSeat;
 
 // State of a game
 typedef struct Game {
     bool assigned;
     bool inProgress;
-    // 0th is white player, 1th is black
+    // Unique id of the game (kept when restored from the journal)
+    long id;
+    // 0th is white player, 1th is black. NULL for the computer or for a human
+    // seat with nobody in it (after a restart)
     struct Client* players[2];
+    // Whether each seat (white, black) is played by a human
+    bool humanSeats[2];
     // 0 if white, 1 if black
     uint8_t turn;
     // FEN board state
     char* fenBoardState;
+    // FEN board state the game started from
+    char* startFen;
+    // Moves made so far
+    PgnMove* moves;
+    int numMoves;
+    int moveCapacity;
+    // Current position, and the key of every position so far (the start
+    // position's first, room for moveCapacity + 1) for spotting repetitions
+    Position position;
+    uint64_t* positionKeys;
+    // Legal moves in the current position, NULL if not known yet
+    UciMoves* legalMoves;
+    // Difficulty level of the computer opponent, 0 for full strength (the
+    // shard's own engine)
+    int level;
+    // Clients watching the game
+    struct Client** spectators;
+    int numSpectators;
+    int spectatorCapacity;
+    // Resources (game array, engine, journal) the game belongs to
+    struct Resources* resources;
+    // Each seat (white, black), held if its player dropped out
+    HeldSeat held[2];
+    // Rating of each seat's player (white, black) when the game started
+    int ratings[2];
+    // Whether the server plays both sides itself (--selfplay)
+    bool selfPlay;
+    // Records of the game in the journal since it was last compacted
+    long journalRecords;
 } Game;
 
-// State of a client
+// A connection to a client program. One connection can play several games at
+// once, each game being played by a separate Client (one per game tag).
+typedef struct Connection {
+    // Messages to the client are queued here and sent by the outbox's thread,
+    // NULL if the connection was handed over by another worker process
+    Outbox* outbox;
+    // Commands from the client run on the worker pool, in order, via this
+    Strand* strand;
+    // Clients (one per game tag) using this connection, the first is untagged
+    struct Client** clients;
+    int numClients;
+    int clientCapacity;
+    // Shard the connection's clients are in
+    struct Resources* resources;
+    // Shard to move the connection to, then run the current line again there,
+    // or -1 to stay
+    int moveTo;
+    // Set while running a line again after moving, so it isn't moved again
+    bool moved;
+    // Prefork: worker process the connection was handed to (its lines are
+    // passed on there) and the id it was handed over with, or -1
+    int downstreamWorker;
+    long downstreamId;
+    // Prefork: worker process that handed the connection over (output is
+    // passed back there) and the id it used, or -1 if we have the socket
+    int upstreamWorker;
+    long upstreamId;
+    // Idle timeout: the connection is disconnected if no line is read by the
+    // deadline (monotonic seconds). Timers is NULL if there is no timeout.
+    TimerWheel* idleTimers;
+    Timer idleTimer;
+    int idleSeconds;
+    long idleDeadline;
+    // Token the client can resume its games with if the connection drops, 0
+    // if it hasn't asked for one ("session")
+    unsigned long sessionToken;
+    // Elo rating of the player, shared by all of the connection's game tags
+    int rating;
+    // Counter lines are given tickets from as they are read (see flight.h)
+    unsigned long* lineTickets;
+} Connection;
+
+// State of a client (one player seat on a connection)
 typedef struct Client {
     // True if this struct corresponds to an actual connected client
     bool assigned;
@@ -222,812 +809,3212 @@ typedef struct Client {
     // Priority in queue, lower number = connected first
     long priority;
     bool waitingForHuman;
-    FILE* toClientStream;
-    FILE* fromClientStream;
+    // Place in the shard's lobby while waiting for a human, and when it
+    // started waiting (monotonic seconds)
+    LobbyEntry lobbyEntry;
+    long waitingSince;
+    // Connection this client plays through (shared with the connection's other
+    // game tags)
+    Connection* connection;
+    // Game tag given with "game <tag> ..." commands, or untaggedGame
+    long tag;
+    // Game being watched (as a spectator), NULL if not watching
+    Game* watching;
+    // Index of this client in the watched game's spectators
+    int spectatorIndex;
 } Client;
 
+// Every shard of the server. Each shard is a Resources with its own listener,
+// game and client arrays, engine and workers. A connection stays in the shard
+// that accepted it unless it needs a game or opponent in another one.
+typedef struct Shards {
+    int numShards;
+    struct Resources** shards;
+    // Number of clients waiting for a human opponent, for each shard and
+    // colour (index shard * numColours + colour), so a client with nobody to
+    // play in its own shard can find one in another. In shared memory when the
+    // shards are worker processes.
+    pthread_mutex_t* waitingLock;
+    long* waiting;
+    // Connections handed between worker processes, NULL if not preforked
+    struct Peers* peers;
+    // Hash and threads shared by every shard's engines, NULL if not limited
+    EngineBudget* budget;
+    // Last ticket given to a line read (see flight.h)
+    unsigned long lineTickets;
+} Shards;
+
+// Connections handed between prefork workers. The worker that accepted a
+// connection keeps its socket: it passes lines on to the worker the connection
+// was handed to, and sends the output that worker passes back.
+typedef struct Peers {
+    Prefork* prefork;
+    // Which worker this is, and its shard
+    int self;
+    struct Resources* resources;
+    pthread_mutex_t lock;
+    // Connections this worker handed off, by id (lock held)
+    IdMap* handedOff;
+    // Connections handed to this worker, by peer_key() (receiving thread only)
+    IdMap* remote;
+    // Id given to the next connection handed off
+    long nextId;
+} Peers;
+
+// Kinds of message prefork workers send each other about a connection
+typedef enum PeerMessageType {
+    // Take over a connection: text is its clients (see hand_off_connection())
+    // then a line to run for it
+    PEER_HANDOFF,
+    // Line read from a connection handed to the receiver
+    PEER_LINE,
+    // A connection handed to the receiver closed (or the sender doesn't know
+    // it, having been restarted)
+    PEER_CLOSED,
+    // Output to send to a connection the receiver handed off
+    PEER_OUTPUT,
+    // The sender doesn't know a connection the receiver handed it (it was
+    // restarted), so the receiver should disconnect it
+    PEER_UNKNOWN,
+    // From the master: the worker in from was restarted, drop every
+    // connection handed to or from it
+    PEER_RESTARTED
+} PeerMessageType;
+
+// Message between prefork workers
+typedef struct PeerMessage {
+    PeerMessageType type;
+    // Worker sending the message
+    int from;
+    // Id the connection was handed off with
+    long id;
+    // Game tag the output is for (PEER_OUTPUT only)
+    long tag;
+    // Null-terminated line/output/hand-off details
+    char text[];
+} PeerMessage;
+
 typedef struct Resources {
     Game* games;
     Client* clients;
     sem_t* dataSemaphore;
-    FILE* toEngineStream;
-    FILE* fromEngineStream;
+    // Engine for analysis (legality, boards, hints) and full strength games
+    Engine engine;
+    // Engine for each difficulty level, NULL until a game at the level starts
+    Engine* levelEngines[numEngineLevels];
+    // Cores the shard's engines run on, NULL if not placed
+    const cpu_set_t* engineCores;
+    // Priority given to the next client created
+    long nextPriority;
+    // Id given to the next game started
+    long nextGameId;
+    // Journal games are recorded in, NULL if not journalling, its file, and
+    // the records in it since it was last compacted, in all and of games that
+    // have since ended
+    Journal* journal;
+    char* journalPath;
+    long journalRecords;
+    long endedJournalRecords;
+    // Archive finished games are written to, NULL if not archiving
+    Archive* archive;
+    // Self-play games' PGN is written to stdout through this, NULL if there
+    // are no self-play games
+    Archive* selfPlayOutput;
+    // Worker threads that run clients' commands
+    WorkPool* pool;
+    // Every shard, and which one this is
+    Shards* shards;
+    int shardIndex;
+    // How outboxes of the shard's connections send
+    const OutboxOptions* outboxOptions;
+    // Idle timeouts of connections the shard accepts, NULL if none
+    TimerWheel* idleTimers;
+    int idleSeconds;
+    // Timers of held seats, and how long seats are held (seconds), NULL and 0
+    // if seats aren't held
+    TimerWheel* graceTimers;
+    int graceSeconds;
+    // Clients waiting for a human opponent, by rating and colour wanted, and
+    // the timer that widens how far apart waiting clients can be matched
+    Lobby* lobby;
+    Timer matchTimer;
+    // Number of clients in the client array (assigned)
+    int numClients;
+    // Engine results shared by lines waiting for the same query, and the
+    // ticket of the line running, 0 if none
+    Flights* flights;
+    unsigned long lineTicket;
 } Resources;
 
-// Data passed into client-managing thread function
-typedef struct ThreadData {
-    // Socket fd from accepted connection
-    int acceptedSocketFd;
+// One of a shard's self-play engines, with the self-play games it moves in
+// turn on its own thread
+typedef struct SelfPlayer {
     Resources* resources;
-} ThreadData;
+    Engine engine;
+    Game** games;
+    int numGames;
+    // rand_r() state random opening moves are chosen with
+    unsigned int seed;
+} SelfPlayer;
+
+// A line from a client, waiting to be acted on by the worker pool
+typedef struct LineTask {
+    Connection* connection;
+    char* line;
+    // Ticket of the line, queries answered from when it was read being ones
+    // it waited for
+    unsigned long ticket;
+} LineTask;
 
 // Ways a game can end
-typedef enum GameResult { RESIGNATION, CHECKMATE, STALEMATE } GameResult;
+typedef enum GameResult {
+    RESIGNATION,
+    CHECKMATE,
+    STALEMATE,
+    // Self-play game drawn for going on too long
+    ADJUDICATION,
+    // Draws by rule: the same position a third time, fifty moves by each side
+    // without a capture or pawn move, or too little material to mate
+    REPETITION,
+    FIFTY_MOVES,
+    INSUFFICIENT_MATERIAL
+} GameResult;
 
 /**
- * @brief Close a client's comms streams, deassign them (so now a new client can
- * take this space in the array)
+ * @brief Send a message about a connection to another prefork worker
  *
- * @param client client to remove
+ * @param peers this worker's handed over connections
+ * @param worker worker to send to
+ * @param type kind of message
+ * @param id id the connection was handed off with
+ * @param tag game tag the text is for (PEER_OUTPUT only)
+ * @param text line, output or hand-off details
  */
-void remove_client(Client* client)
+void peer_send(Peers* peers, int worker, PeerMessageType type, long id,
+        long tag, const char* text)
 {
-    fclose(client->toClientStream);
-    fclose(client->fromClientStream);
-    client->assigned = false;
+    size_t size = sizeof(PeerMessage) + strlen(text) + 1;
+    PeerMessage* message = (PeerMessage*)malloc(size);
+    message->type = type;
+    message->from = peers->self;
+    message->id = id;
+    message->tag = tag;
+    strcpy(message->text, text);
+    prefork_send(peers->prefork, worker, message, size);
+    free(message);
 }
 
 /**
- * @brief Get the name of a game result (checkmate, resignation, stalemate)
+ * @brief Queue a (possibly shared) message to a client, prefixed with the
+ * client's game tag if it has one
  *
- * @param dest write the name here
- * @param result how the game ended
+ * @param client client to send to
+ * @param message message to send
+ * @return -1 if the client's connection has failed, 0 on success
  */
-void get_result_name(char* dest, GameResult result)
+int send_message(Client* client, Message* message)
 {
-    switch (result) {
-    case RESIGNATION:
-        strcpy(dest, "resignation");
-        break;
-    case CHECKMATE:
-        strcpy(dest, "checkmate");
-        break;
-    case STALEMATE:
-        strcpy(dest, "stalemate");
-        break;
-    default:
-        // Shouldn't get here
-        break;
+    Connection* connection = client->connection;
+    if (!connection->outbox) {
+        // The worker that handed the connection over has its socket
+        peer_send(connection->resources->shards->peers,
+                connection->upstreamWorker, PEER_OUTPUT,
+                connection->upstreamId, client->tag, message_text(message));
+        return 0;
     }
+    return outbox_push(connection->outbox, client->tag, message);
 }
 
 /**
- * @brief End a game
+ * @brief Write a message to a client, prefixed with the client's game tag if
+ * it has one
  *
- * @param game game to end
- * @param client losing client (resigner or loser) or null for stalemate
- * @param result how the game ended
+ * @param client client to write to
+ * @param msg msg to write, newline-terminated
+ * @return -1 on error, 0 on success
  */
-void end_game(Game* game, Client* client, GameResult result)
+int send_to_client(Client* client, char* msg)
 {
-    // Find winner
-    Colour winningColour = COLOUR_UNSPECIFIED;
-    for (int i = 0; i < numPlayers; i++) {
-        if (game->players[i] == client) {
-            winningColour = (Colour)(!i);
-            break;
-        }
-    }
-    // winning colour shouldn't still be UNSPECIFIED
-    char winnerName[smallerBufferSize];
-    if (result == STALEMATE) {
-        strcpy(winnerName, "");
-    } else if (winningColour == COLOUR_WHITE) {
-        strcpy(winnerName, " white");
-    } else {
-        strcpy(winnerName, " black");
-    }
-
-    // Get the "how" part
-    char howEnded[smallerBufferSize];
-    get_result_name(howEnded, result);
-
-    // Send game over msg
-    char gameOverMsg[smallerBufferSize];
-    snprintf(gameOverMsg, smallerBufferSize, "gameover %s%s\n", howEnded,
-            winnerName);
-    for (int i = 0; i < numPlayers; i++) {
-        Client* player = game->players[i];
-        if (!player) {
-            continue; // no msg to computer
-        }
-        if (player->lastGameFen) {
-            free(player->lastGameFen);
-        }
-        player->lastGameFen = strdup(game->fenBoardState);
-        player->game = NULL;
-        if (try_to_write(player->toClientStream, gameOverMsg) == -1) {
-            remove_client(player);
-            // No need to end the game as well, it is over alr
-        }
-    }
-
-    game->inProgress = false;
+    Message* message = message_create(msg);
+    int result = send_message(client, message);
+    message_unref(message);
+    return result;
 }
 
 /**
- * @brief Reap engine child process, print engine failure msg
+ * @brief Send a message to everyone watching a game. Each spectator's copy is
+ * only queued here, so this doesn't wait on any spectator's connection.
  *
+ * @param game game being watched
+ * @param message message to send
  */
-void engine_failure(void)
+void send_to_spectators(Game* game, Message* message)
 {
-    // todo proper message from server, messages to clients
-    wait(NULL);
-    warn_bug((char*)"engine failure\n");
+    for (int i = 0; i < game->numSpectators; i++) {
+        // Failed spectators are removed by their own connection's thread
+        send_message(game->spectators[i], message);
+    }
 }
 
 /**
- * @brief SIGPIPE handler for engine failure
+ * @brief Add a client to a game's spectators
  *
- * @param errorCode unused, signal error code (but only SIGPIPE is handled)
+ * @param client client to start watching
+ * @param game game to watch
  */
-void engine_failure_handler(int errorCode __attribute__((unused)))
+void add_spectator(Client* client, Game* game)
 {
-    engine_failure();
+    if (game->numSpectators == game->spectatorCapacity) {
+        game->spectatorCapacity
+                = game->spectatorCapacity ? game->spectatorCapacity * 2 : 1;
+        game->spectators = (Client**)realloc(game->spectators,
+                game->spectatorCapacity * sizeof(Client*));
+    }
+    client->spectatorIndex = game->numSpectators;
+    game->spectators[game->numSpectators++] = client;
+    client->watching = game;
 }
 
 /**
- * @brief Start new game in Stockfish
+ * @brief Stop a client watching the game it is watching, if any
  *
- * @param resources shared thread resources
+ * @param client client to stop watching
  */
-void engine_new_game(Resources* resources)
+void remove_spectator(Client* client)
 {
-    if (try_to_write(resources->toEngineStream, (char*)"ucinewgame\nisready\n")
-            == -1) {
-        engine_failure();
-    }
-    char buffer[maxBufferSize];
-    char* readResult
-            = fgets(buffer, maxBufferSize, resources->fromEngineStream);
-    if (readResult == NULL || strcmp(buffer, "readyok\n") != 0) {
-        engine_failure();
+    Game* game = client->watching;
+    if (!game) {
+        return;
     }
+    // Move the last spectator into the gap
+    Client* last = game->spectators[--game->numSpectators];
+    game->spectators[client->spectatorIndex] = last;
+    last->spectatorIndex = client->spectatorIndex;
+    client->watching = NULL;
 }
 
 /**
- * @brief Set position in stockfish without making move
+ * @brief Get the time from the monotonic clock
  *
- * @param fen fen string for position setting
- * @param resources shared thread resources
+ * @return seconds since some fixed point
  */
-void set_position_no_move(char* fen, Resources* resources)
+long monotonic_seconds(void)
 {
-    engine_new_game(resources);
-    char posCmd[maxBufferSize];
-    snprintf(posCmd, maxBufferSize, "position fen %s\n", fen);
-    if (try_to_write(resources->toEngineStream, posCmd) == -1) {
-        engine_failure();
-    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)now.tv_sec;
 }
 
 /**
- * @brief Get best move from engine
+ * @brief Set whether a client is waiting for a human opponent, keeping the
+ * shard's lobby and the count of waiting clients other shards look at up to
+ * date. The client's colour mustn't change while it is waiting.
  *
- * @param dest write the best move here
- * @param game game to get move for
- * @param resources shared thread resources
+ * @param client client to update
+ * @param waiting whether it is now waiting
  */
-void best_move(char* dest, Game* game, Resources* resources)
+void set_waiting(Client* client, bool waiting)
 {
-    set_position_no_move(game->fenBoardState, resources);
-    if (try_to_write(
-                resources->toEngineStream, (char*)"go movetime 500 depth 15\n")
-            == -1) {
-        engine_failure();
+    if (client->waitingForHuman == waiting) {
+        return;
     }
-    ChessMoves* move
-            = read_stockfish_bestmove_output(resources->fromEngineStream);
-    if (move == NULL) {
-        engine_failure();
+    client->waitingForHuman = waiting;
+    Resources* resources = client->connection->resources;
+    if (waiting) {
+        client->waitingSince = monotonic_seconds();
+        lobby_add(resources->lobby, &client->lobbyEntry, client->colour,
+                client->connection->rating, client->priority);
+    } else {
+        lobby_remove(resources->lobby, &client->lobbyEntry);
+    }
+    Shards* shards = resources->shards;
+    if (shards->numShards == 1) {
+        return; // nobody else to look
     }
-    snprintf(dest, maxBufferSize, "%s", move->moves[0]);
-    free_chess_moves(move);
+    shared_mutex_lock(shards->waitingLock);
+    shards->waiting[resources->shardIndex * numColours + client->colour]
+            += waiting ? 1 : -1;
+    pthread_mutex_unlock(shards->waitingLock);
 }
 
 /**
- * @brief Check if game against computer (check non-null players)
+ * @brief Deassign a client (so now a new client can take this space in the
+ * array). The client's connection is closed separately, once its reading
+ * thread finishes.
  *
- * @param game game to check players for
- * @return true if against computer
- * @return false if human vs human
+ * @param client client to remove
  */
-bool game_is_against_computer(Game* game)
+void remove_client(Client* client)
 {
-    if (game->players[0] == NULL && game->players[1] == NULL) {
-        warn_bug((char*)"no human players found\n");
+    set_waiting(client, false);
+    remove_spectator(client);
+    client->connection->resources->numClients--;
+    client->assigned = false;
+    client->connection = NULL;
+}
+
+/**
+ * @brief Get the name of a game result (checkmate, resignation, stalemate)
+ *
+ * @param dest write the name here
+ * @param result how the game ended
+ */
+void get_result_name(char* dest, GameResult result)
+{
+    switch (result) {
+    case RESIGNATION:
+        strcpy(dest, "resignation");
+        break;
+    case CHECKMATE:
+        strcpy(dest, "checkmate");
+        break;
+    case STALEMATE:
+        strcpy(dest, "stalemate");
+        break;
+    case ADJUDICATION:
+        strcpy(dest, "adjudication");
+        break;
+    case REPETITION:
+        strcpy(dest, "repetition");
+        break;
+    case FIFTY_MOVES:
+        strcpy(dest, "fiftymoves");
+        break;
+    case INSUFFICIENT_MATERIAL:
+        strcpy(dest, "insufficientmaterial");
+        break;
+    default:
+        // Shouldn't get here
+        break;
+    }
+}
+
+/**
+ * @brief Check whether a game result is a draw
+ *
+ * @param result how the game ended
+ * @return true if neither side won
+ */
+bool is_draw(GameResult result)
+{
+    return result != RESIGNATION && result != CHECKMATE;
+}
+
+/**
+ * @brief Get the journal a game is recorded in. Self-play games aren't
+ * recorded, as nobody could resume them.
+ *
+ * @param game game to record
+ * @return the journal, NULL if the game isn't journalled
+ */
+Journal* game_journal(Game* game)
+{
+    return game->selfPlay ? NULL : game->resources->journal;
+}
+
+/**
+ * @brief Get a game's index in the game array
+ *
+ * @param game game to find index of
+ * @return index of game
+ */
+uint32_t game_slot(Game* game)
+{
+    return (uint32_t)(game - game->resources->games);
+}
+
+/**
+ * @brief Append a record about a game to the journal, counting it towards the
+ * game's and the journal's records
+ *
+ * @param game game the record is for, journalled
+ * @param type kind of record
+ * @param flags record-specific flags
+ * @param payload null-terminated payload, or NULL for none
+ */
+void journal_game_record(Game* game, JournalRecordType type, uint8_t flags,
+        const char* payload)
+{
+    journal_append(game->resources->journal, type, game_slot(game),
+            (uint32_t)game->id, flags, payload);
+    game->journalRecords++;
+    game->resources->journalRecords++;
+}
+
+/**
+ * @brief Record the session token of the player of a human seat in the
+ * journal, if journalling and they have one, so only they can resume the seat
+ * after a restart
+ *
+ * @param game game the seat is in
+ * @param seat seat (colour) of the player
+ */
+void journal_seat_owner(Game* game, int seat)
+{
+    Journal* journal = game_journal(game);
+    Client* player = game->players[seat];
+    unsigned long token = player ? player->connection->sessionToken
+                                 : game->held[seat].token;
+    int rating = player ? player->connection->rating : game->held[seat].rating;
+    if (!journal || !game->humanSeats[seat] || !token) {
+        return;
+    }
+    char payload[smallerBufferSize];
+    snprintf(payload, smallerBufferSize, "%0*lx %d", sessionTokenDigits,
+            token, rating);
+    journal_game_record(game, JOURNAL_SEAT, (uint8_t)seat, payload);
+}
+
+/**
+ * @brief Record the start of a game in the journal, if journalling
+ *
+ * @param game game started, with its seats set
+ */
+void journal_game_started(Game* game)
+{
+    Journal* journal = game_journal(game);
+    if (!journal) {
+        return;
+    }
+    // Flag bit i is set if seat i (white, black) is played by a human, the
+    // bits above them hold the computer's level
+    uint8_t flags = (uint8_t)(game->level << numPlayers);
+    for (int i = 0; i < numPlayers; i++) {
+        if (game->humanSeats[i]) {
+            flags |= (uint8_t)(1 << i);
+        }
+    }
+    journal_game_record(game, JOURNAL_START, flags, game->startFen);
+    for (int seat = 0; seat < numPlayers; seat++) {
+        journal_seat_owner(game, seat);
+    }
+}
+
+/**
+ * @brief Record a move in the journal, if journalling
+ *
+ * @param game game moved in
+ * @param moveIndex index of the move in the game's moves
+ * @param fen FEN after the move, or "-" if not needed to restore the game
+ * (a later move's record has it)
+ */
+void journal_game_moved(Game* game, int moveIndex, char* fen)
+{
+    Journal* journal = game_journal(game);
+    if (!journal) {
+        return;
+    }
+    PgnMove* move = &game->moves[moveIndex];
+    char payload[maxBufferSize];
+    snprintf(payload, maxBufferSize, "%s %s %s", move->uci, fen, move->san);
+    journal_game_record(game, JOURNAL_MOVE, 0, payload);
+}
+
+/**
+ * @brief Start a game's position history (with no moves) from a FEN
+ *
+ * @param game game to start
+ * @param fen FEN of the start position
+ */
+void start_position(Game* game, const char* fen)
+{
+    position_from_fen(&game->position, fen);
+    game->positionKeys = (uint64_t*)realloc(game->positionKeys,
+            (game->moveCapacity + 1) * sizeof(uint64_t));
+    game->positionKeys[0] = game->position.key;
+}
+
+/**
+ * @brief Add a move to a game's move history, and make it in the game's
+ * position
+ *
+ * @param game game moved in
+ * @param uci move in UCI notation
+ * @param san move in SAN notation
+ */
+void add_move(Game* game, const char* uci, const char* san)
+{
+    if (game->numMoves == game->moveCapacity) {
+        game->moveCapacity = game->moveCapacity ? game->moveCapacity * 2 : 1;
+        game->moves = (PgnMove*)realloc(
+                game->moves, game->moveCapacity * sizeof(PgnMove));
+        game->positionKeys = (uint64_t*)realloc(game->positionKeys,
+                (game->moveCapacity + 1) * sizeof(uint64_t));
+    }
+    PgnMove* move = &game->moves[game->numMoves++];
+    snprintf(move->uci, uciMoveSize, "%s", uci);
+    snprintf(move->san, sanMoveSize, "%s", san);
+    position_move(&game->position, uci);
+    game->positionKeys[game->numMoves] = game->position.key;
+}
+
+/**
+ * @brief Get the PGN result of a game ("1-0", "0-1", "1/2-1/2")
+ *
+ * @param result how the game ended
+ * @param winningColour colour of the winner (ignored for draws)
+ * @return the PGN result
+ */
+const char* get_pgn_result(GameResult result, Colour winningColour)
+{
+    if (is_draw(result)) {
+        return "1/2-1/2";
+    }
+    return winningColour == COLOUR_WHITE ? "1-0" : "0-1";
+}
+
+/**
+ * @brief Format a finished game as PGN
+ *
+ * @param game game that ended
+ * @param result how the game ended
+ * @param winningColour colour of the winner (ignored for draws)
+ * @return malloc'd PGN text
+ */
+char* game_pgn(Game* game, GameResult result, Colour winningColour)
+{
+    char playerNames[numPlayers][smallerBufferSize];
+    for (int i = 0; i < numPlayers; i++) {
+        get_opponent_name(playerNames[i],
+                game->humanSeats[i] ? OPPONENT_HUMAN : OPPONENT_COM);
+    }
+    char howEnded[smallerBufferSize];
+    get_result_name(howEnded, result);
+    PgnHeader header = {.gameId = game->id,
+            .white = playerNames[COLOUR_WHITE],
+            .black = playerNames[COLOUR_BLACK],
+            .startFen = strcmp(game->startFen, initialFen) ? game->startFen
+                                                           : NULL,
+            .result = get_pgn_result(result, winningColour),
+            .termination = howEnded};
+    return pgn_format(&header, game->moves, game->numMoves);
+}
+
+/**
+ * @brief Queue a finished game to be written to a PGN archive
+ *
+ * @param archive archive to write to, NULL if none (the game isn't written)
+ * @param game game that ended
+ * @param result how the game ended
+ * @param winningColour colour of the winner (ignored for draws)
+ */
+void archive_game(
+        Archive* archive, Game* game, GameResult result, Colour winningColour)
+{
+    if (!archive) {
+        return;
+    }
+    char* pgn = game_pgn(game, result, winningColour);
+    if (!archive_add(archive, pgn)) {
+        free(pgn);
+        fprintf(stderr, "uqchessserver: archive behind, game %ld dropped\n",
+                game->id);
+        fflush(stderr);
+    }
+}
+
+/**
+ * @brief Stop holding a seat for the player who dropped out of it, if it is
+ * held
+ *
+ * @param held seat to release
+ */
+void release_held_seat(HeldSeat* held)
+{
+    if (held->token) {
+        timer_stop(held->game->resources->graceTimers, &held->timer);
+        held->token = 0;
+    }
+}
+
+/**
+ * @brief Replace the journal with a compacted one: the start and seat records
+ * and moves (only the last with its FEN) of each game in progress. It is
+ * written and synced aside, then renamed over the old one so a crash part way
+ * leaves the old journal intact.
+ *
+ * @param resources shard resources, journalPath set, the journal being
+ * replaced (closed once it has been) or NULL if not opened yet
+ * @return 0 if replaced, -1 if the new journal couldn't be written (the old
+ * one is kept)
+ */
+int compact_journal(Resources* resources)
+{
+    char* path = resources->journalPath;
+    char tmpPath[strlen(path) + strlen(journalTmpSuffix) + 1];
+    sprintf(tmpPath, "%s%s", path, journalTmpSuffix);
+    Journal* oldJournal = resources->journal;
+    resources->journal = journal_open(tmpPath);
+    if (!resources->journal) {
+        resources->journal = oldJournal;
+        return -1;
+    }
+    resources->journalRecords = 0;
+    resources->endedJournalRecords = 0;
+    for (long i = 0; i < maxBufferSize; i++) {
+        Game* game = &resources->games[i];
+        if (!game->assigned || !game_journal(game)) {
+            continue;
+        }
+        // Moves are kept for the archive, only the last one needs its FEN
+        game->journalRecords = 0;
+        journal_game_started(game);
+        for (int move = 0; move < game->numMoves; move++) {
+            journal_game_moved(game, move,
+                    move == game->numMoves - 1 ? game->fenBoardState
+                                               : (char*)"-");
+        }
+    }
+    if (journal_sync(resources->journal) == -1
+            || journal_rename(tmpPath, path) == -1) {
+        journal_close(resources->journal);
+        resources->journal = oldJournal;
+        return -1;
+    }
+    if (oldJournal) {
+        journal_close(oldJournal);
+    }
+    return 0;
+}
+
+/**
+ * @brief Compact the journal if enough of it is records of games that have
+ * ended
+ *
+ * @param resources shard resources, journalling
+ */
+void check_journal_size(Resources* resources)
+{
+    if (resources->endedJournalRecords < journalCompactMinRecords
+            || resources->endedJournalRecords * 2
+                    < resources->journalRecords) {
+        return;
+    }
+    if (compact_journal(resources) == -1) {
+        fprintf(stderr, "uqchessserver: can't compact journal\n");
+        fflush(stderr);
+    }
+}
+
+/**
+ * @brief Free a game's space in the game array so it can be used again
+ *
+ * @param game game to release
+ */
+void release_game(Game* game)
+{
+    bool journalled = game_journal(game) != NULL;
+    if (journalled) {
+        journal_game_record(game, JOURNAL_END, 0, NULL);
+        game->resources->endedJournalRecords += game->journalRecords;
+    }
+    free(game->fenBoardState);
+    game->fenBoardState = NULL;
+    free(game->startFen);
+    game->startFen = NULL;
+    free(game->moves);
+    game->moves = NULL;
+    game->numMoves = 0;
+    game->moveCapacity = 0;
+    free(game->positionKeys);
+    game->positionKeys = NULL;
+    free(game->legalMoves);
+    game->legalMoves = NULL;
+    for (int i = 0; i < game->numSpectators; i++) {
+        game->spectators[i]->watching = NULL;
+    }
+    free(game->spectators);
+    game->spectators = NULL;
+    game->numSpectators = 0;
+    game->spectatorCapacity = 0;
+    for (int i = 0; i < numPlayers; i++) {
+        game->players[i] = NULL;
+        game->humanSeats[i] = false;
+        release_held_seat(&game->held[i]);
+    }
+    game->inProgress = false;
+    game->assigned = false;
+    if (journalled) {
+        check_journal_size(game->resources);
+    }
+}
+
+/**
+ * @brief Update the ratings of a game's players from its result. Only games
+ * between humans are rated, and only players still connected are updated.
+ *
+ * @param game game ending
+ * @param winningColour colour that won (unused for draws)
+ * @param result how the game ended
+ */
+void rate_players(Game* game, Colour winningColour, GameResult result)
+{
+    if (!game->humanSeats[COLOUR_WHITE] || !game->humanSeats[COLOUR_BLACK]) {
+        return;
+    }
+    for (int seat = COLOUR_WHITE; seat < numPlayers; seat++) {
+        // Elo scores a win as 1, a draw as half a win
+        double score = winningColour == (Colour)seat ? 1.0 : 0.0;
+        if (is_draw(result)) {
+            score = 0.5;
+        }
+        int change = lobby_rating_change(
+                game->ratings[seat], game->ratings[!seat], score);
+        if (game->players[seat]) {
+            game->players[seat]->connection->rating += change;
+        }
+    }
+}
+
+/**
+ * @brief End a game, given which colour won
+ *
+ * @param game game to end
+ * @param winningColour colour that won (unused for draws)
+ * @param result how the game ended
+ */
+void end_game_won_by(Game* game, Colour winningColour, GameResult result)
+{
+    rate_players(game, winningColour, result);
+    char winnerName[smallerBufferSize];
+    if (is_draw(result)) {
+        strcpy(winnerName, "");
+    } else if (winningColour == COLOUR_WHITE) {
+        strcpy(winnerName, " white");
+    } else {
+        strcpy(winnerName, " black");
+    }
+
+    // Get the "how" part
+    char howEnded[smallerBufferSize];
+    get_result_name(howEnded, result);
+
+    // Send game over msg
+    char gameOverMsg[smallerBufferSize];
+    snprintf(gameOverMsg, smallerBufferSize, "gameover %s%s\n", howEnded,
+            winnerName);
+    Message* gameOver = message_create(gameOverMsg);
+    for (int i = 0; i < numPlayers; i++) {
+        Client* player = game->players[i];
+        if (!player) {
+            continue; // no msg to computer
+        }
+        if (player->lastGameFen) {
+            free(player->lastGameFen);
+        }
+        player->lastGameFen = strdup(game->fenBoardState);
+        player->game = NULL;
+        // If this fails the client's thread will see the connection close and
+        // remove them. No need to end the game as well, it is over alr
+        send_message(player, gameOver);
+    }
+    for (int i = 0; i < game->numSpectators; i++) {
+        Client* spectator = game->spectators[i];
+        free(spectator->lastGameFen);
+        spectator->lastGameFen = strdup(game->fenBoardState);
+    }
+    send_to_spectators(game, gameOver);
+    message_unref(gameOver);
+
+    archive_game(game->resources->archive, game, result, winningColour);
+    if (game->selfPlay) {
+        archive_game(game->resources->selfPlayOutput, game, result,
+                winningColour);
+    }
+    release_game(game);
+}
+
+/**
+ * @brief End a game
+ *
+ * @param game game to end
+ * @param client losing client (resigner or loser) or null for stalemate
+ * @param result how the game ended
+ */
+void end_game(Game* game, Client* client, GameResult result)
+{
+    // Find winner
+    Colour winningColour = COLOUR_UNSPECIFIED;
+    for (int i = 0; i < numPlayers; i++) {
+        if (game->players[i] == client) {
+            winningColour = (Colour)(!i);
+            break;
+        }
+    }
+    // winning colour shouldn't still be UNSPECIFIED
+    end_game_won_by(game, winningColour, result);
+}
+
+/**
+ * @brief Reap engine child process, print engine failure msg
+ *
+ */
+void engine_failure(void)
+{
+    // todo proper message from server, messages to clients
+    wait(NULL);
+    warn_bug((char*)"engine failure\n");
+}
+
+/**
+ * @brief SIGPIPE handler for engine failure
+ *
+ * @param errorCode unused, signal error code (but only SIGPIPE is handled)
+ */
+void engine_failure_handler(int errorCode __attribute__((unused)))
+{
+    engine_failure();
+}
+
+/**
+ * @brief Give an engine its share of its budget, if the share has changed
+ * since it was last given
+ *
+ * @param engine engine to update
+ */
+void apply_engine_budget(Engine* engine)
+{
+    if (!engine->budget
+            || budget_generation(engine->budget) == engine->budgetGeneration) {
+        return;
+    }
+    int hashMb;
+    int threads;
+    engine->budgetGeneration
+            = budget_share(engine->budget, engine->budgetEngine, &hashMb,
+                    &threads);
+    char optionsCmd[maxBufferSize];
+    int len = 0;
+    if (threads) {
+        len += snprintf(optionsCmd + len, maxBufferSize - len,
+                "setoption name Threads value %d\n", threads);
+    }
+    if (hashMb) {
+        len += snprintf(optionsCmd + len, maxBufferSize - len,
+                "setoption name Hash value %d\n", hashMb);
+    }
+    if (len && try_to_write(engine->toEngineStream, optionsCmd) == -1) {
+        engine_failure();
+    }
+}
+
+/**
+ * @brief Add an engine to the shards' engine budget, if there is one. It
+ * takes its share before its next game.
+ *
+ * @param engine engine to add
+ * @param weight engine's weight in the budget
+ * @param resources resources of the shard the engine belongs to
+ */
+void join_engine_budget(Engine* engine, int weight, Resources* resources)
+{
+    EngineBudget* budget = resources->shards->budget;
+    if (!budget) {
+        return;
+    }
+    engine->budgetEngine = budget_add(budget, resources->shardIndex, weight);
+    if (engine->budgetEngine == -1) {
+        return; // budget full, the engine keeps its own settings
+    }
+    engine->budget = budget;
+    if (budget_check_overcommit(budget)) {
+        warn_engines_overcommitted();
+    }
+}
+
+/**
+ * @brief Start new game in Stockfish, first updating its hash and threads if
+ * its share of the engine budget changed (the isready waits for that)
+ *
+ * @param engine engine to use
+ */
+void engine_new_game(Engine* engine)
+{
+    apply_engine_budget(engine);
+    if (try_to_write(engine->toEngineStream, (char*)"ucinewgame\nisready\n")
+            == -1) {
+        engine_failure();
+    }
+    if (uci_wait_for(engine->fromEngine, "readyok") == -1) {
+        engine_failure();
+    }
+}
+
+/**
+ * @brief Set position in stockfish without making move
+ *
+ * @param fen fen string for position setting
+ * @param engine engine to use
+ */
+void set_position_no_move(char* fen, Engine* engine)
+{
+    engine_new_game(engine);
+    char posCmd[maxBufferSize];
+    snprintf(posCmd, maxBufferSize, "position fen %s\n", fen);
+    if (try_to_write(engine->toEngineStream, posCmd) == -1) {
+        engine_failure();
+    }
+}
+
+void start_engine(Engine* engine, const cpu_set_t* cores);
+
+/**
+ * @brief Get the engine that plays a game's computer side, starting it if it
+ * is the first game at the game's level
+ *
+ * @param game game to get engine for
+ * @return the engine
+ */
+Engine* game_engine(Game* game)
+{
+    Resources* resources = game->resources;
+    if (game->level == 0) {
+        return &resources->engine;
+    }
+    Engine** engine = &resources->levelEngines[game->level - 1];
+    if (!*engine) {
+        const EngineLevel* level = &engineLevels[game->level - 1];
+        *engine = (Engine*)malloc(sizeof(Engine));
+        start_engine(*engine, resources->engineCores);
+        (*engine)->goCmd = level->goCmd;
+        char setupCmd[maxBufferSize];
+        snprintf(setupCmd, maxBufferSize,
+                "setoption name Skill Level value %d\n"
+                "setoption name Threads value %d\n"
+                "setoption name Hash value %d\n",
+                level->skill, level->threads, level->hashMb);
+        if (try_to_write((*engine)->toEngineStream, setupCmd) == -1) {
+            engine_failure();
+        }
+        join_engine_budget(*engine, level->weight, resources);
+    }
+    return *engine;
+}
+
+/**
+ * @brief Search a position, keeping the best few variations (MultiPV)
+ *
+ * @param search put the search's result here
+ * @param fen position to search
+ * @param numPvs number of variations wanted, 1 to uciMaxPvs
+ * @param engine engine to search with
+ */
+void engine_search(UciSearch* search, char* fen, int numPvs, Engine* engine)
+{
+    set_position_no_move(fen, engine);
+    char goCmd[maxBufferSize];
+    if (numPvs > 1) {
+        snprintf(goCmd, maxBufferSize, "setoption name MultiPV value %d\n%s",
+                numPvs, engine->goCmd);
+    } else {
+        snprintf(goCmd, maxBufferSize, "%s", engine->goCmd);
+    }
+    if (try_to_write(engine->toEngineStream, goCmd) == -1
+            || uci_read_bestmove(engine->fromEngine, search) == -1) {
+        engine_failure();
+    }
+    // ucinewgame keeps options, other searches only want the best variation
+    if (numPvs > 1
+            && try_to_write(engine->toEngineStream,
+                       (char*)"setoption name MultiPV value 1\n")
+                    == -1) {
+        engine_failure();
+    }
+}
+
+// Kinds of engine query shared between lines waiting for them
+typedef enum EngineQuery {
+    SEARCH_QUERY,
+    MOVES_QUERY,
+    BOARD_QUERY,
+    numEngineQueries
+} EngineQuery;
+
+/**
+ * @brief Get the key an engine query is looked up by: the position's Zobrist
+ * hash combined with what is asked about it and the halfmove clock (which the
+ * hash leaves out, but a search can depend on through the fifty-move rule)
+ *
+ * @param fen position asked about
+ * @param kind what is asked
+ * @param numPvs number of variations searched for (SEARCH_QUERY only)
+ * @return the key
+ */
+uint64_t engine_query(const char* fen, EngineQuery kind, int numPvs)
+{
+    Position position;
+    position_from_fen(&position, fen);
+    // A different number to mix in for each clock, kind and number of PVs
+    uint64_t asked = (uint64_t)position.halfMoves * numEngineQueries + kind;
+    asked = asked * (uciMaxPvs + 1) + (uint64_t)numPvs;
+    return position.key ^ ((asked + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+/**
+ * @brief Search a position with one of a shard's engines, sharing the result
+ * with lines waiting for the same search
+ *
+ * @param search put the search's result here
+ * @param fen position to search
+ * @param numPvs number of variations wanted, 1 to uciMaxPvs
+ * @param engine engine to search with
+ * @param resources resources of the shard the engine belongs to
+ */
+void shared_search(UciSearch* search, char* fen, int numPvs, Engine* engine,
+        Resources* resources)
+{
+    uint64_t query = engine_query(fen, SEARCH_QUERY, numPvs);
+    if (flights_join(resources->flights, engine, query, resources->lineTicket,
+                search, sizeof(UciSearch))) {
+        return;
+    }
+    engine_search(search, fen, numPvs, engine);
+    flights_land(resources->flights, engine, query, search, sizeof(UciSearch));
+}
+
+/**
+ * @brief Get best move from engine
+ *
+ * @param dest write the best move here
+ * @param game game to get move for
+ * @param engine engine to search with
+ */
+void best_move(char* dest, Game* game, Engine* engine)
+{
+    UciSearch search;
+    shared_search(&search, game->fenBoardState, 1, engine, game->resources);
+    snprintf(dest, maxBufferSize, "%s", search.bestMove);
+}
+
+/**
+ * @brief Check if game against computer (check non-null players)
+ *
+ * @param game game to check players for
+ * @return true if against computer
+ * @return false if human vs human
+ */
+bool game_is_against_computer(Game* game)
+{
+    if (!game->humanSeats[0] && !game->humanSeats[1]) {
+        warn_bug((char*)"no human players found\n");
+    }
+    if (game->humanSeats[0] && game->humanSeats[1]) {
+        // Both players are humans
+        return false;
+    }
+    return true;
+}
+
+void computer_move(Game* game, Resources* resources);
+
+/**
+ * @brief Check whether a client's seat will be held for it when its
+ * connection closes, so its game needn't end when sending to it fails
+ *
+ * @param client client to check
+ * @return true if it has a session token and seats are held
+ */
+bool can_hold_seat(Client* client)
+{
+    return client->connection->sessionToken
+            && client->connection->resources->graceTimers;
+}
+
+/**
+ * @brief Write to client stream, end game if they disconnected (unless their
+ * seat will be held for them)
+ *
+ * @param client client to write to
+ * @param msg msg to write
+ * @return -1 if game ended, 0 otherwise
+ */
+int write_to_client(Client* client, char* msg)
+{
+    if (send_to_client(client, msg) == -1 && !can_hold_seat(client)) {
+        if (client->game && client->game->inProgress) {
+            end_game(client->game, client, RESIGNATION);
+        }
+        // Client removed by its own thread once it sees the connection close
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the legal moves in the engine's current position
+ *
+ * @param moves put the legal moves here
+ * @param engine engine to use, already in the position
+ */
+void legal_moves(UciMoves* moves, Engine* engine)
+{
+    if (try_to_write(engine->toEngineStream, (char*)goPerft1) == -1
+            || uci_read_perft(engine->fromEngine, moves) == -1) {
+        engine_failure();
+    }
+}
+
+/**
+ * @brief Get the legal moves in a position with the shard's engine, sharing
+ * them with lines waiting for the same position's moves
+ *
+ * @param moves put the legal moves here
+ * @param fen position to get the moves of
+ * @param positioned whether the engine is already in the position
+ * @param resources shard resources
+ */
+void shared_legal_moves(
+        UciMoves* moves, char* fen, bool positioned, Resources* resources)
+{
+    Engine* engine = &resources->engine;
+    uint64_t query = engine_query(fen, MOVES_QUERY, 0);
+    if (flights_join(resources->flights, engine, query, resources->lineTicket,
+                moves, sizeof(UciMoves))) {
+        return;
+    }
+    if (!positioned) {
+        set_position_no_move(fen, engine);
+    }
+    legal_moves(moves, engine);
+    flights_land(resources->flights, engine, query, moves, sizeof(UciMoves));
+}
+
+/**
+ * @brief Add a move to a game's history (in SAN as well as UCI) and remember
+ * the legal moves in the position it led to
+ *
+ * @param game game moved in
+ * @param fenBefore FEN of the position the move was made from
+ * @param move move in UCI notation
+ * @param check whether the move gives check
+ * @param nextMoves legal moves after the move, copied into the game
+ */
+void record_move(Game* game, char* fenBefore, char* move, bool check,
+        const UciMoves* nextMoves)
+{
+    char san[sanMoveSize];
+    uci_to_san(san, fenBefore, move, game->legalMoves, check,
+            check && nextMoves->numMoves == 0);
+    add_move(game, move, san);
+    if (!game->legalMoves) {
+        game->legalMoves = (UciMoves*)malloc(sizeof(UciMoves));
+    }
+    game->legalMoves->numMoves = nextMoves->numMoves;
+    memcpy(game->legalMoves->moves, nextMoves->moves,
+            nextMoves->numMoves * sizeof(nextMoves->moves[0]));
+}
+
+/**
+ * @brief Tell a game's players and spectators that the player to move is in
+ * check
+ *
+ * @param game game in check
+ */
+void send_check(Game* game)
+{
+    Message* check = message_create("check\n");
+    for (int i = 0; i < numPlayers; i++) {
+        if (game->players[i]) {
+            send_message(game->players[i], check);
+        }
+    }
+    send_to_spectators(game, check);
+    message_unref(check);
+}
+
+/**
+ * @brief Check whether a game's position is drawn by rule: repeated a third
+ * time, fifty moves without a capture or pawn move, or neither side able to
+ * mate
+ *
+ * @param game game to check
+ * @param result write which rule draws it here
+ * @return true if drawn
+ */
+bool drawn_by_rule(Game* game, GameResult* result)
+{
+    const Position* position = &game->position;
+    if (position_repetitions(game->positionKeys, game->numMoves + 1,
+                position->halfMoves)
+            >= 3) {
+        *result = REPETITION;
+    } else if (position->halfMoves >= fiftyMoveHalfMoves) {
+        *result = FIFTY_MOVES;
+    } else if (position_insufficient_material(position)) {
+        *result = INSUFFICIENT_MATERIAL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Act on an accepted move
+ *
+ * @param move move to make in alphanumeric notation
+ * @param game game where move was made
+ * @param movingClient client making move
+ * @param opponent move's opponent
+ * @param resources shared client resources
+ * @param position position after the move, as read from Stockfish d output
+ */
+void move_accepted(char* move, Game* game, Client* movingClient,
+        Client* opponent, Resources* resources, const UciPosition* position)
+{
+    char* fenBefore = game->fenBoardState;
+    game->fenBoardState = strdup(position->fen);
+    bool inCheck = position->inCheck;
+    UciMoves nextMoves;
+    shared_legal_moves(&nextMoves, game->fenBoardState, true, resources);
+    int numNextMoves = nextMoves.numMoves;
+    record_move(game, fenBefore, move, inCheck, &nextMoves);
+    free(fenBefore);
+    journal_game_moved(game, game->numMoves - 1, game->fenBoardState);
+    if (movingClient != NULL) {
+        if (write_to_client(movingClient, (char*)"ok\n") == -1) {
+            return;
+        }
+    }
+    char movedMsg[maxBufferSize];
+    snprintf(movedMsg, maxBufferSize, "moved %s\n", move);
+    // Players get the move before the (possibly many) spectators
+    Message* moved = message_create(movedMsg);
+    int opponentResult = opponent ? send_message(opponent, moved) : 0;
+    send_to_spectators(game, moved);
+    message_unref(moved);
+    if (opponentResult == -1 && !can_hold_seat(opponent)) {
+        end_game(game, opponent, RESIGNATION);
+        return;
+    }
+    // checkmate, stalemate, draws by rule
+    GameResult draw;
+    if (numNextMoves == 0) {
+        if (inCheck) {
+            end_game_won_by(game, (Colour)game->turn, CHECKMATE);
+        } else {
+            end_game(game, NULL, STALEMATE);
+        }
+    } else if (drawn_by_rule(game, &draw)) {
+        end_game(game, NULL, draw);
+    } else if (inCheck) {
+        send_check(game);
+    }
+    // game may be over (and its seats reset) by now
+    game->turn = !(game->turn);
+    if (game->inProgress && movingClient != NULL
+            && game_is_against_computer(game)) {
+        computer_move(game, resources);
+    }
+}
+
+/**
+ * @brief Make a move in a game
+ *
+ * @param game game to move in
+ * @param resources shared thread resources
+ * @param move move to make, alphanumeric
+ */
+void make_move(Game* game, Resources* resources, char* move)
+{
+    Engine* engine = &resources->engine;
+    engine_new_game(engine);
+    char engineCmd[maxBufferSize];
+    snprintf(engineCmd, maxBufferSize, "position fen %s moves %s\nd\n",
+            game->fenBoardState, move);
+    if (try_to_write(engine->toEngineStream, engineCmd) == -1) {
+        engine_failure();
+    }
+    UciPosition position;
+    if (uci_read_position(engine->fromEngine, &position) == -1) {
+        engine_failure();
+    }
+    bool accepted = strcmp(position.fen, game->fenBoardState);
+    Client* movingClient = game->players[game->turn];
+    Client* opponent = game->players[!(game->turn)];
+    if (accepted) {
+        move_accepted(move, game, movingClient, opponent, resources, &position);
+    } else {
+        // try to send move error to human player
+        if (movingClient != NULL) {
+            write_to_client(movingClient, (char*)"error move\n");
+        }
+    }
+}
+
+/**
+ * @brief Make computer's move (use engine best move)
+ *
+ * @param game game to move in
+ * @param resources shared thread resources
+ */
+void computer_move(Game* game, Resources* resources)
+{
+    if (game->humanSeats[game->turn] || !game->humanSeats[!(game->turn)]) {
+        warn_bug(
+                (char*)("tried to make computer move with invalid computer\n"));
+    }
+    char bestMove[maxBufferSize];
+    best_move(bestMove, game, game_engine(game));
+    make_move(game, resources, bestMove);
+}
+
+/**
+ * @brief Send started msg (and the game's id) to a client
+ *
+ * @param colour colour the client is starting as
+ * @param client client to send to
+ */
+void send_started(Colour colour, Client* client)
+{
+    char startedMsg[maxBufferSize];
+    char colourName[maxBufferSize];
+    get_colour_name(colourName, colour);
+    snprintf(startedMsg, maxBufferSize, "started %s\ngameid %ld\n",
+            colourName, client->game->id);
+    write_to_client(client, startedMsg);
+}
+
+/**
+ * @brief Get the engine's drawing of a position, sharing it with lines
+ * waiting for the same drawing
+ *
+ * @param board write the drawing here (uciBoardSize chars)
+ * @param fen position to draw
+ * @param resources shard resources
+ */
+void shared_board(char* board, char* fen, Resources* resources)
+{
+    Engine* engine = &resources->engine;
+    uint64_t query = engine_query(fen, BOARD_QUERY, 0);
+    if (flights_join(resources->flights, engine, query, resources->lineTicket,
+                board, uciBoardSize)) {
+        return;
+    }
+    set_position_no_move(fen, engine);
+    if (try_to_write(engine->toEngineStream, (char*)"d\n") == -1) {
+        engine_failure();
+    }
+    UciPosition position;
+    if (uci_read_position(engine->fromEngine, &position) == -1) {
+        engine_failure();
+    }
+    snprintf(board, uciBoardSize, "%s", position.board);
+    flights_land(resources->flights, engine, query, board, uciBoardSize);
+}
+
+/**
+ * @brief Respond to client "board" cmd
+ *
+ * @param client client asking for board
+ * @param resources engine and client/game array resources
+ * @return -1 if error (no board to show), 0 otherwise
+ */
+int respond_board(Client* client, Resources* resources)
+{
+    char fen[maxBufferSize];
+    bool fenFound = true;
+    if (client->lastGameFen) {
+        strcpy(fen, client->lastGameFen);
+    } else if (client->game && client->game->inProgress) {
+        strcpy(fen, client->game->fenBoardState);
+    } else if (client->watching) {
+        strcpy(fen, client->watching->fenBoardState);
+    } else {
+        fenFound = false;
+    }
+    if (fenFound) {
+        char board[uciBoardSize];
+        shared_board(board, fen, resources);
+        char boardMsg[maxBufferSize];
+        snprintf(boardMsg, maxBufferSize, "startboard\n%sendboard\n", board);
+        write_to_client(client, boardMsg);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief check if colours can play against each other
+ *
+ * @param colour1 colour of one player
+ * @param colour2 colour of another player
+ * @return true if colours can play against each other, false if not
+ */
+bool colours_can_play(Colour colour1, Colour colour2)
+{
+    return colour1 == COLOUR_UNSPECIFIED || colour2 == COLOUR_UNSPECIFIED
+            || (colour1 != colour2);
+}
+
+/**
+ * @brief Find first unassigned game in array, does not assign it
+ *
+ * @param resources shared thread resources
+ * @return first unassigned game
+ */
+Game* get_unassigned_game(Resources* resources)
+{
+    Game* game = resources->games;
+    bool found = false;
+    for (long i = 0; i < maxBufferSize; i++) {
+        if (!(*game).assigned) {
+            found = true;
+            break;
+        }
+        game++;
+    }
+    if (!found) {
+        warn_bug((char*)"Ran out of space in game array\n");
+    }
+    return game;
+}
+
+/**
+ * @brief Initialise a new game, giving it the next game id. Ids are
+ * interleaved between shards, shard i giving ids i + 1, i + 1 + numShards, ...
+ *
+ * @param game game to initialise
+ * @param resources shared thread resources the game belongs to
+ */
+void initialise_game(Game* game, Resources* resources)
+{
+    game->assigned = true;
+    game->id = resources->nextGameId;
+    resources->nextGameId += resources->shards->numShards;
+    game->resources = resources;
+    game->turn = COLOUR_WHITE;
+    game->inProgress = false;
+    game->fenBoardState = strdup(initialFen);
+    game->startFen = strdup(initialFen);
+    game->numMoves = 0;
+    start_position(game, initialFen);
+    game->legalMoves = NULL;
+    game->level = 0;
+    game->ratings[COLOUR_WHITE] = lobbyDefaultRating;
+    game->ratings[COLOUR_BLACK] = lobbyDefaultRating;
+    game->selfPlay = false;
+    game->journalRecords = 0;
+    game->inProgress = true;
+}
+
+/**
+ * @brief Check whether a connection can move to another shard: none of its
+ * clients may be playing or watching a game
+ *
+ * @param connection connection to check
+ * @return true if it can move
+ */
+bool connection_can_move(Connection* connection)
+{
+    if (connection->moved) {
+        return false; // already moved for this line
+    }
+    for (int i = 0; i < connection->numClients; i++) {
+        Client* client = connection->clients[i];
+        if (client->game || client->watching) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Find another shard with a client waiting for a human opponent that
+ * could play a client wanting the given colour
+ *
+ * @param resources shard to look beyond
+ * @param colour colour wanted
+ * @return index of the shard, or -1 if there is none
+ */
+int find_waiting_shard(Resources* resources, Colour colour)
+{
+    Shards* shards = resources->shards;
+    int found = -1;
+    shared_mutex_lock(shards->waitingLock);
+    for (int i = 0; found < 0 && i < shards->numShards; i++) {
+        if (i == resources->shardIndex) {
+            continue;
+        }
+        for (int other = 0; found < 0 && other < numColours; other++) {
+            if (shards->waiting[i * numColours + other] > 0
+                    && colours_can_play(colour, (Colour)other)) {
+                found = i;
+            }
+        }
+    }
+    pthread_mutex_unlock(shards->waitingLock);
+    return found;
+}
+
+/**
+ * @brief Get the colours of waiting humans a human wanting a colour can play
+ *
+ * @param colour colour wanted
+ * @return a bit (1 << colour) for each colour
+ */
+unsigned matching_colours(Colour colour)
+{
+    unsigned colours = 0;
+    for (int other = 0; other < numColours; other++) {
+        if (colours_can_play(colour, (Colour)other)) {
+            colours |= 1u << other;
+        }
+    }
+    return colours;
+}
+
+/**
+ * @brief Find the waiting human rated nearest a human that they can play, the
+ * first to join if several are as near. The further apart their ratings can
+ * be, the longer the human has waited.
+ *
+ * @param human human to find an opponent for
+ * @param resources shared thread resources
+ * @param now time now (monotonic seconds)
+ * @return the opponent, NULL if nobody is near enough
+ */
+Client* find_opponent(Client* human, Resources* resources, long now)
+{
+    int window = matchWindow;
+    if (human->waitingForHuman) {
+        window += matchWidening
+                * (int)((now - human->waitingSince) / matchWideningSeconds);
+    }
+    return (Client*)lobby_find(resources->lobby, human->connection->rating,
+            window, matching_colours(human->colour), &human->lobbyEntry);
+}
+
+/**
+ * @brief Start a game between two humans, one or both of them waiting
+ *
+ * @param human human to play
+ * @param otherHuman human to play them, whose colour can play human's
+ * @param resources shared thread resources
+ */
+void start_human_game(Client* human, Client* otherHuman, Resources* resources)
+{
+    // Set colours of humans
+    set_waiting(human, false);
+    set_waiting(otherHuman, false);
+    if (human->colour != COLOUR_UNSPECIFIED) {
+        otherHuman->colour = (Colour)(!(human->colour));
+    } else if (otherHuman->colour != COLOUR_UNSPECIFIED) {
+        human->colour = (Colour)(!(otherHuman->colour));
+    } else {
+        // This human is white iff they joined first
+        Colour humanColour
+                = (human->priority < otherHuman->priority ? COLOUR_WHITE
+                                                          : COLOUR_BLACK);
+        human->colour = humanColour;
+        otherHuman->colour = (Colour)(!humanColour);
+    }
+
+    // Initialise players/game, send started msg to both
+    Game* game = get_unassigned_game(resources);
+    initialise_game(game, resources);
+    game->players[human->colour] = human;
+    game->players[!(human->colour)] = otherHuman;
+    Client* players[] = {game->players[0], game->players[1]};
+    for (int i = 0; i < numPlayers; i++) {
+        game->humanSeats[i] = true;
+        game->ratings[i] = players[i]->connection->rating;
+        players[i]->game = game;
+    }
+    journal_game_started(game);
+    for (int i = 0; i < numPlayers; i++) {
+        if (players[i]->game) { // game ends if sending to a player fails
+            send_started(players[i]->colour, players[i]);
+        }
+    }
+}
+
+/**
+ * @brief Try to match human with another. If nobody in this shard can play
+ * them but somebody in another shard can, their connection is moved there to
+ * try again. Otherwise they wait.
+ *
+ * @param human human to match, not already waiting
+ * @param resources shared thread resources
+ */
+void try_to_match_human(Client* human, Resources* resources)
+{
+    Client* otherHuman = find_opponent(human, resources, monotonic_seconds());
+    if (!otherHuman) {
+        Connection* connection = human->connection;
+        if (resources->shards->numShards > 1
+                && connection_can_move(connection)) {
+            connection->moveTo = find_waiting_shard(resources, human->colour);
+        }
+        if (connection->moveTo < 0) {
+            set_waiting(human, true); // No match, wait for one
+        }
+        return;
+    }
+    start_human_game(human, otherHuman, resources);
+}
+
+/**
+ * @brief Worker pool task run each time the match window widens: matches
+ * waiting humans who can now play someone further from their rating
+ *
+ * @param data Resources* - the shard
+ */
+void match_waiting_task(void* data)
+{
+    Resources* resources = (Resources*)data;
+    sem_wait(resources->dataSemaphore);
+    long now = monotonic_seconds();
+    Client* human = resources->clients;
+    for (long i = 0; i < maxBufferSize; i++, human++) {
+        if (!human->assigned || !human->waitingForHuman
+                || now - human->waitingSince < matchWideningSeconds) {
+            continue; // window hasn't widened since they were last tried
+        }
+        Client* otherHuman = find_opponent(human, resources, now);
+        if (otherHuman) {
+            start_human_game(human, otherHuman, resources);
+        }
+    }
+    sem_post(resources->dataSemaphore);
+}
+
+/**
+ * @brief Timer callback widening a shard's match window, matching on the
+ * worker pool (the callback can't wait for the shard's lock)
+ *
+ * @param timer the shard's match timer
+ * @param data Resources* - the shard
+ * @return ticks until the window widens again
+ */
+unsigned long match_window_widened(
+        Timer* timer __attribute__((unused)), void* data)
+{
+    Resources* resources = (Resources*)data;
+    pool_submit(resources->pool, match_waiting_task, resources);
+    return (unsigned long)matchWideningSeconds;
+}
+
+/**
+ * @brief Start a game against the computer
+ *
+ * @param client client playing
+ * @param colour colour the client plays
+ * @param level difficulty level of the computer, 0 for full strength
+ * @param resources shared array/engine resources
+ */
+void start_computer_game(
+        Client* client, Colour colour, int level, Resources* resources)
+{
+    Game* game = get_unassigned_game(resources);
+    initialise_game(game, resources);
+    game->level = level;
+    game->players[colour] = client;
+    game->players[!colour] = NULL; // computer
+    game->humanSeats[colour] = true;
+    game->humanSeats[!colour] = false;
+    client->game = game;
+    journal_game_started(game);
+    send_started(colour, client);
+    if (colour == COLOUR_BLACK && game->inProgress) {
+        // Human is black, computer starts off as white
+        computer_move(game, resources);
     }
-    if (game->players[0] != NULL && game->players[1] != NULL) {
-        // Both players are humans
+}
+
+/**
+ * @brief Start a self-play game, one of the shard's self-play engines
+ * playing both sides at full strength
+ *
+ * @param resources shard to play in
+ * @return the game
+ */
+Game* start_self_play_game(Resources* resources)
+{
+    Game* game = get_unassigned_game(resources);
+    initialise_game(game, resources);
+    game->selfPlay = true;
+    for (int i = 0; i < numPlayers; i++) {
+        game->players[i] = NULL;
+        game->humanSeats[i] = false;
+    }
+    return game;
+}
+
+/**
+ * @brief Make a self-play game's move, ending it if it can't go on and
+ * starting a new game in its place if it ended
+ *
+ * @param player self-play engine the game belongs to
+ * @param index index of the game in the engine's games
+ * @param move move to make, in UCI
+ */
+void self_play_move(SelfPlayer* player, int index, char* move)
+{
+    Resources* resources = player->resources;
+    Game* game = player->games[index];
+    int numMoves = game->numMoves;
+    make_move(game, resources, move);
+    // A game with no move made (the engine's move wasn't legal) would never
+    // end either
+    if (game->inProgress
+            && (game->numMoves == numMoves
+                    || game->numMoves >= maxSelfPlayMoves)) {
+        end_game_won_by(game, COLOUR_UNSPECIFIED, ADJUDICATION);
+    }
+    if (!game->inProgress) {
+        player->games[index] = start_self_play_game(resources);
+    }
+}
+
+/**
+ * @brief Choose a self-play game's next move: a random legal move for the
+ * game's first selfPlayRandomMoves moves, the engine's best move after that
+ *
+ * @param dest write the move here
+ * @param fen position to move in
+ * @param numMoves number of moves made in the game so far
+ * @param player self-play engine to search with
+ */
+void choose_self_play_move(
+        char* dest, char* fen, int numMoves, SelfPlayer* player)
+{
+    if (numMoves < selfPlayRandomMoves) {
+        UciMoves moves;
+        set_position_no_move(fen, &player->engine);
+        legal_moves(&moves, &player->engine);
+        if (moves.numMoves) {
+            int move = rand_r(&player->seed) % moves.numMoves;
+            snprintf(dest, maxBufferSize, "%s", moves.moves[move]);
+            return;
+        }
+    }
+    UciSearch search;
+    engine_search(&search, fen, 1, &player->engine);
+    snprintf(dest, maxBufferSize, "%s", search.bestMove);
+}
+
+/**
+ * @brief Thread function of a self-play engine, moving its games in turn. The
+ * shard is locked to read a game's position and make its move, not while the
+ * engine searches, so clients are served and the shard's other self-play
+ * engines search meanwhile.
+ *
+ * @param data SelfPlayer* - the engine and its games
+ * @return never returns
+ */
+void* self_play_thread(void* data)
+{
+    SelfPlayer* player = (SelfPlayer*)data;
+    Resources* resources = player->resources;
+    for (int index = 0;; index = (index + 1) % player->numGames) {
+        sem_wait(resources->dataSemaphore);
+        char* fen = strdup(player->games[index]->fenBoardState);
+        int numMoves = player->games[index]->numMoves;
+        sem_post(resources->dataSemaphore);
+        char move[maxBufferSize];
+        choose_self_play_move(move, fen, numMoves, player);
+        free(fen);
+        sem_wait(resources->dataSemaphore);
+        self_play_move(player, index, move);
+        sem_post(resources->dataSemaphore);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Get how many engines a shard can search with at once, one per core:
+ * its engine cores if placed, else its share of the machine's cores
+ *
+ * @param resources shard to count for
+ * @return number of engines, at least 1
+ */
+int shard_engine_cores(Resources* resources)
+{
+    if (resources->engineCores) {
+        return CPU_COUNT(resources->engineCores);
+    }
+    int cores = pool_num_cores() / resources->shards->numShards;
+    return cores > 0 ? cores : 1;
+}
+
+/**
+ * @brief Start a shard's share of the self-play games, if any, with an engine
+ * for each game up to one per engine core (see shard_engine_cores), each
+ * engine moving its games in turn
+ *
+ * @param numGames self-play games given with --selfplay, 0 if none
+ * @param resources shard to play in, its selfPlayOutput set if there are any
+ */
+void start_self_play(int numGames, Resources* resources)
+{
+    int numShards = resources->shards->numShards;
+    int index = resources->shardIndex;
+    int count = numGames / numShards + (index < numGames % numShards);
+    if (count == 0) {
+        return;
+    }
+    int cores = shard_engine_cores(resources);
+    int numEngines = count < cores ? count : cores;
+    int maxGamesEach = (count + numEngines - 1) / numEngines;
+    SelfPlayer* players = (SelfPlayer*)calloc(numEngines, sizeof(SelfPlayer));
+    for (int i = 0; i < numEngines; i++) {
+        players[i].games = (Game**)malloc(maxGamesEach * sizeof(Game*));
+    }
+    sem_wait(resources->dataSemaphore);
+    for (int i = 0; i < count; i++) {
+        SelfPlayer* player = &players[i % numEngines];
+        player->games[player->numGames++] = start_self_play_game(resources);
+    }
+    sem_post(resources->dataSemaphore);
+    for (int i = 0; i < numEngines; i++) {
+        players[i].resources = resources;
+        // Seeded differently by every engine and run, if the kernel can
+        if (getrandom(&players[i].seed, sizeof(players[i].seed), 0) == -1) {
+            players[i].seed = (unsigned int)i;
+        }
+        start_engine(&players[i].engine, resources->engineCores);
+        join_engine_budget(&players[i].engine, fullStrengthWeight, resources);
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, self_play_thread, &players[i]);
+        pthread_detach(threadId);
+    }
+}
+
+/**
+ * @brief Respond to start message from client ("start <opponent> <colour>",
+ * with the computer's difficulty level after if the opponent is the computer)
+ *
+ * @param client client sending start msg
+ * @param resources shared array/engine resources
+ * @param fields fields from input line
+ * @return true if command valid, false otherwise
+ */
+bool respond_start(Client* client, Resources* resources, char** fields)
+{
+    Opponent opponent;
+    Colour colour;
+    long level = fields[3] ? parse_number(fields[3]) : 0;
+    if (!strcmp(fields[1], "computer")
+            && (!fields[3] || (level >= 1 && level <= numEngineLevels))) {
+        opponent = OPPONENT_COM;
+    } else if (!strcmp(fields[1], "human") && !fields[3]) {
+        opponent = OPPONENT_HUMAN;
+    } else {
+        return false;
+    }
+    if (!strcmp(fields[2], "white")) {
+        colour = COLOUR_WHITE;
+    } else if (!strcmp(fields[2], "black")) {
+        colour = COLOUR_BLACK;
+    } else if (!strcmp(fields[2], "either")) {
+        colour = COLOUR_UNSPECIFIED;
+    } else {
+        return false;
+    }
+
+    // Start new game
+    if (client->game != NULL) {
+        end_game(client->game, client, RESIGNATION);
+    }
+    remove_spectator(client);
+    if (opponent == OPPONENT_COM && colour == COLOUR_UNSPECIFIED) {
+        colour = COLOUR_WHITE;
+    }
+    client->lastGameFen = NULL;
+    set_waiting(client, false);
+    client->colour = colour;
+    switch (opponent) {
+    case OPPONENT_COM:
+        start_computer_game(client, colour, (int)level, resources);
+        return true;
+    case OPPONENT_HUMAN:
+        try_to_match_human(client, resources);
+        return true;
+    default:
+        return true; // shouldn't get here
+    }
+}
+
+/**
+ * @brief Find the game in progress with the given id
+ *
+ * @param resources shared thread resources
+ * @param id id of game to find
+ * @return the game, or NULL if there is no game in progress with that id
+ */
+Game* find_game(Resources* resources, long id)
+{
+    for (long i = 0; i < maxBufferSize; i++) {
+        Game* game = &resources->games[i];
+        if (game->assigned && game->inProgress && game->id == id) {
+            return game;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check whether a game id belongs to another shard. If it does, and
+ * the client's connection can move, the connection is moved there to run the
+ * command again.
+ *
+ * @param client client sending the command
+ * @param id game id given in the command
+ * @return true if the game is in another shard
+ */
+bool game_in_other_shard(Client* client, long id)
+{
+    Connection* connection = client->connection;
+    Shards* shards = connection->resources->shards;
+    int shard = id > 0 ? (int)((id - 1) % shards->numShards) : 0;
+    if (shard == connection->resources->shardIndex || connection->moved) {
         return false;
     }
-    return true;
+    if (connection_can_move(connection)) {
+        connection->moveTo = shard;
+    }
+    return true;
+}
+
+/**
+ * @brief Make up a new session token
+ *
+ * @return the token, never 0
+ */
+unsigned long new_session_token(void)
+{
+    unsigned long token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != (ssize_t)sizeof(token)) {
+            // No randomness from the kernel, fall back to the C library's
+            token = ((unsigned long)random() << sessionTokenHalfBits)
+                    ^ (unsigned long)random();
+        }
+    }
+    return token;
+}
+
+/**
+ * @brief Parse a session token (up to 16 hex digits)
+ *
+ * @param str token as given in a command
+ * @return the token, 0 if it isn't one
+ */
+unsigned long parse_session_token(const char* str)
+{
+    size_t len = strlen(str);
+    if (len == 0 || len > sessionTokenDigits
+            || strspn(str, "0123456789abcdefABCDEF") != len) {
+        return 0;
+    }
+    return strtoul(str, NULL, sessionTokenBase);
+}
+
+/**
+ * @brief Respond to client "session" msg with the connection's session token,
+ * making one up the first time. If the connection drops, the client's games
+ * are held for it to resume with "resume <gameid> <token>".
+ *
+ * @param client client asking
+ */
+void respond_session(Client* client)
+{
+    Connection* connection = client->connection;
+    if (!connection->sessionToken) {
+        connection->sessionToken = new_session_token();
+        for (int i = 0; i < connection->numClients; i++) {
+            Client* player = connection->clients[i];
+            if (player->game) {
+                journal_seat_owner(player->game, player->colour);
+            }
+        }
+    }
+    char sessionMsg[smallerBufferSize];
+    snprintf(sessionMsg, smallerBufferSize, "session %0*lx\n",
+            sessionTokenDigits, connection->sessionToken);
+    write_to_client(client, sessionMsg);
+}
+
+/**
+ * @brief Find the empty human seat of a game held for a session token
+ *
+ * @param game game to look in
+ * @param token session token given, 0 if none (never matches)
+ * @return the seat, or numPlayers if there is none
+ */
+int find_held_seat(Game* game, unsigned long token)
+{
+    for (int seat = COLOUR_WHITE; seat < numPlayers; seat++) {
+        unsigned long heldFor = game->held[seat].token;
+        if (game->humanSeats[seat] && game->players[seat] == NULL
+                && heldFor != 0 && heldFor == token) {
+            return seat;
+        }
+    }
+    return numPlayers;
+}
+
+/**
+ * @brief Respond to client "resume <gameid> <token>" msg, sitting the client
+ * back in the seat held for the session it dropped out of (before a restart
+ * too, for games restored from the journal). Without a token there is no seat
+ * to take.
+ *
+ * @param client client resuming a game
+ * @param resources shared thread resources
+ * @param idStr id of game to resume, as given in the msg
+ * @param tokenStr session token given in the msg, NULL if none
+ * @return errorCommand, errorGame or 0 for no error
+ */
+int respond_resume(
+        Client* client, Resources* resources, char* idStr, char* tokenStr)
+{
+    long id = parse_number(idStr);
+    unsigned long token = tokenStr ? parse_session_token(tokenStr) : 0;
+    if (id < 0 || (tokenStr && !token)) {
+        return errorCommand;
+    }
+    if (game_in_other_shard(client, id)) {
+        return client->connection->moveTo >= 0 ? 0 : errorGame;
+    }
+    Game* game = find_game(resources, id);
+    if (!game) {
+        return errorGame;
+    }
+    int seat = find_held_seat(game, token);
+    if (seat == numPlayers || client->game == game) {
+        // No seat held for the token, or the client would resign the game
+        return errorGame;
+    }
+    if (client->game != NULL) {
+        end_game(client->game, client, RESIGNATION);
+    }
+    remove_spectator(client);
+    if (!client->connection->sessionToken && token) {
+        // Keep the session (and the player's rating) going, so the game can
+        // be resumed again
+        client->connection->sessionToken = token;
+        client->connection->rating = game->held[seat].rating;
+    }
+    release_held_seat(&game->held[seat]);
+    game->players[seat] = client;
+    client->game = game;
+    client->colour = (Colour)seat;
+    free(client->lastGameFen);
+    client->lastGameFen = NULL;
+    set_waiting(client, false);
+    journal_seat_owner(game, seat); // the connection may have its own token
+    char resumedMsg[maxBufferSize];
+    char colourName[maxBufferSize];
+    char turnName[maxBufferSize];
+    get_colour_name(colourName, client->colour);
+    get_colour_name(turnName, (Colour)game->turn);
+    snprintf(resumedMsg, maxBufferSize, "resumed %s %s\n", colourName,
+            turnName);
+    if (write_to_client(client, resumedMsg) == 0
+            && !game->humanSeats[game->turn]) {
+        // Server went down before the computer could reply
+        computer_move(game, resources);
+    }
+    return 0;
+}
+
+/**
+ * @brief Respond to "watch <gameid>", making the client a spectator of the
+ * game with that id (giving up any game it is playing)
+ *
+ * @param client client sending command
+ * @param resources shared thread resources
+ * @param idStr game id given in the command
+ * @return 0 on success, else error code to send client
+ */
+int respond_watch(Client* client, Resources* resources, char* idStr)
+{
+    long id = parse_number(idStr);
+    if (id < 0) {
+        return errorCommand;
+    }
+    if (game_in_other_shard(client, id)) {
+        return client->connection->moveTo >= 0 ? 0 : errorGame;
+    }
+    Game* game = find_game(resources, id);
+    if (!game) {
+        return errorGame;
+    }
+    if (client->game != NULL) {
+        end_game(client->game, client, RESIGNATION);
+    }
+    set_waiting(client, false);
+    remove_spectator(client);
+    add_spectator(client, game);
+    free(client->lastGameFen);
+    client->lastGameFen = NULL;
+    char watchingMsg[smallerBufferSize];
+    snprintf(watchingMsg, smallerBufferSize, "watching %ld\n", game->id);
+    write_to_client(client, watchingMsg);
+    return 0;
+}
+
+/**
+ * @brief Respond to client "hint" msg, assume it is their turn and they are
+ * playing and cmd is valid
+ *
+ * @param client client that asked for hint
+ * @param resources shared thread resources
+ * @param all true if all, false if best
+ */
+void respond_hint(Client* client, Resources* resources, bool all)
+{
+    if (all) {
+        UciMoves moves;
+        shared_legal_moves(
+                &moves, client->game->fenBoardState, false, resources);
+        // Build the whole line first so a game tag only prefixes it once
+        char allMovesMsg[maxBufferSize];
+        int msgLen = snprintf(allMovesMsg, maxBufferSize, "moves");
+        for (long i = 0; i < moves.numMoves; i++) {
+            msgLen += snprintf(allMovesMsg + msgLen, maxBufferSize - msgLen,
+                    " %s", moves.moves[i]);
+        }
+        snprintf(allMovesMsg + msgLen, maxBufferSize - msgLen, "\n");
+        write_to_client(client, allMovesMsg);
+    } else {
+        char bestMove[smallerBufferSize];
+        best_move(bestMove, client->game, &resources->engine);
+        char bestMoveMsg[smallerBufferSize];
+        snprintf(bestMoveMsg, smallerBufferSize, "moves %s\n", bestMove);
+        write_to_client(client, bestMoveMsg);
+    }
+}
+
+/**
+ * @brief Respond to client "hint top <n>" msg with the engine's best n moves
+ * and their scores, e.g. "moves e2e4 cp 35 g1f3 mate 4", all from one search
+ *
+ * @param client client that asked for hint
+ * @param resources shared thread resources
+ * @param countStr number of moves wanted
+ * @return errorCommand, errorGame, errorTurn or 0 for no error
+ */
+int respond_hint_top(Client* client, Resources* resources, char* countStr)
+{
+    long count = parse_number(countStr);
+    if (count < 1 || count > uciMaxPvs) {
+        return errorCommand;
+    }
+    if (!(client->game)) {
+        return errorGame;
+    }
+    if (client->colour != client->game->turn) {
+        return errorTurn;
+    }
+    UciSearch search;
+    shared_search(&search, client->game->fenBoardState, (int)count,
+            &resources->engine, resources);
+    char topMsg[maxBufferSize];
+    int msgLen = snprintf(topMsg, maxBufferSize, "moves");
+    for (int i = 0; i < search.numPvs; i++) {
+        UciPv* pv = &search.pvs[i];
+        msgLen += snprintf(topMsg + msgLen, maxBufferSize - msgLen, " %s %s %d",
+                pv->move, pv->mate ? "mate" : "cp", pv->score);
+    }
+    if (search.numPvs == 0 && search.bestMove[0]) {
+        // Engine didn't report scores
+        msgLen += snprintf(topMsg + msgLen, maxBufferSize - msgLen, " %s",
+                search.bestMove);
+    }
+    snprintf(topMsg + msgLen, maxBufferSize - msgLen, "\n");
+    write_to_client(client, topMsg);
+    return 0;
+}
+
+/**
+ * @brief Resign a client's game if they have one and remove the client from the
+ * array
+ *
+ * @param client
+ */
+void resign_remove_client(Client* client)
+{
+    if (client->game && client->game->inProgress) {
+        // If client disconnects before getting a game, client->game is NULL, no
+        // need to end it.
+        end_game(client->game, client, RESIGNATION);
+    }
+    remove_client(client);
 }
 
-void computer_move(Game* game, Resources* resources);
+/**
+ * @brief Respond to two-word client input
+ *
+ * @param cmd first word of input
+ * @param fields fields from input line
+ * @param client client sending input
+ * @param resources shared thread resources
+ * @return errorCommand, errorGame or errorTurn to indicate error, 0 for no
+ * error
+ */
+int respond_medium_input(
+        char* cmd, char** fields, Client* client, Resources* resources)
+{
+    if (!strcmp(cmd, "move")) {
+        if (!(valid_move_length(strlen(fields[1]))
+                    && str_is_alnum(fields[1]))) {
+            return errorCommand;
+        }
+        if (!(client->game)) {
+            return errorGame;
+        }
+        if (client->colour != client->game->turn) {
+            return errorTurn;
+        }
+        make_move(client->game, resources, fields[1]);
+        return 0;
+    }
+    if (!strcmp(cmd, "hint")) {
+        bool all;
+        if (!strcmp(fields[1], "all")) {
+            all = true;
+        } else if (!strcmp(fields[1], "best")) {
+            all = false;
+        } else {
+            return errorCommand;
+        }
+        if (!(client->game)) {
+            return errorGame;
+        }
+        if (client->colour != client->game->turn) {
+            return errorTurn;
+        }
+        respond_hint(client, resources, all);
+        return 0;
+    }
+    if (!strcmp(cmd, "resume")) {
+        return respond_resume(client, resources, fields[1], NULL);
+    }
+    if (!strcmp(cmd, "watch")) {
+        return respond_watch(client, resources, fields[1]);
+    }
+    return errorCommand;
+}
 
 /**
- * @brief Write to client stream, end game if they disconnected
+ * @brief Respond to one word input from client
  *
- * @param client client to write to
- * @param msg msg to write
- * @return -1 if game ended, 0 otherwise
+ * @param client client giving input
+ * @param resources shared thread resources
+ * @param cmd first (and only) word of input
+ * @return errorCommand, errorMove, errorTurn or 0 for no error
  */
-int write_to_client(Client* client, char* msg)
+int respond_short_input(Client* client, Resources* resources, char* cmd)
 {
-    if (try_to_write(client->toClientStream, msg) == -1) {
+    if (!strcmp(cmd, "board")) {
+        if (respond_board(client, resources) == -1) {
+            return errorGame;
+        }
+        return 0;
+    }
+    if (!strcmp(cmd, "resign")) {
+        if (!(client->game)) {
+            return errorGame;
+        }
         end_game(client->game, client, RESIGNATION);
-        remove_client(client);
-        return -1;
+        return 0;
     }
-    return 0;
+    if (!strcmp(cmd, "session")) {
+        respond_session(client);
+        return 0;
+    }
+    if (!strcmp(cmd, "rating")) {
+        char ratingMsg[smallerBufferSize];
+        snprintf(ratingMsg, smallerBufferSize, "rating %d\n",
+                client->connection->rating);
+        write_to_client(client, ratingMsg);
+        return 0;
+    }
+    return errorCommand;
 }
 
 /**
- * @brief Act on an accepted move
+ * @brief Respond to a command from a client (already split into fields)
  *
- * @param move move to make in alphanumeric notation
- * @param game game where move was made
- * @param movingClient client making move
- * @param opponent move's opponent
- * @param resources shared client resources
- * @param engineGameState game state as read from Stockfish d output
+ * @param client client the command is for
+ * @param resources shared thread resources
+ * @param fields fields of the command
+ * @param numFields number of fields
+ * @return errorCommand, errorGame, errorTurn or 0 for no error
  */
-void move_accepted(char* move, Game* game, Client* movingClient,
-        Client* opponent, Resources* resources,
-        StockfishGameState* engineGameState)
+int respond_command(
+        Client* client, Resources* resources, char** fields, int numFields)
 {
-    free(game->fenBoardState);
-    game->fenBoardState = strdup(engineGameState->fenString);
-    if (movingClient != NULL) {
-        if (write_to_client(movingClient, (char*)"ok\n") == -1) {
-            return;
+    char* cmd = fields[0];
+    if (numFields == shortLine) {
+        return respond_short_input(client, resources, cmd);
+    }
+    if (numFields == mediumLine) {
+        return respond_medium_input(cmd, fields, client, resources);
+    }
+    if ((numFields == longLine || numFields == longLine + 1)
+            && !strcmp(cmd, "start")) {
+        return respond_start(client, resources, fields) ? 0 : errorCommand;
+    }
+    if (numFields == longLine && !strcmp(cmd, "hint")
+            && !strcmp(fields[1], "top")) {
+        return respond_hint_top(client, resources, fields[2]);
+    }
+    if (numFields == longLine && !strcmp(cmd, "resume")) {
+        return respond_resume(client, resources, fields[1], fields[2]);
+    }
+    return errorCommand;
+}
+
+/**
+ * @brief Send the error msg matching an error code to a client
+ *
+ * @param client client to send to
+ * @param error errorCommand, errorGame, errorTurn or 0 (no msg sent)
+ */
+void send_error(Client* client, int error)
+{
+    char* response = NULL;
+    if (error == errorCommand) {
+        response = (char*)"error command\n";
+    } else if (error == errorGame) {
+        response = (char*)"error game\n";
+    } else if (error == errorTurn) {
+        response = (char*)"error turn\n";
+    }
+    if (response) {
+        write_to_client(client, response);
+    }
+}
+
+/**
+ * @brief Find first unassigned client in array and count it as assigned
+ *
+ * @param resources shared thread resources
+ * @return first unassigned client, or NULL if the array is full
+ */
+Client* get_unassigned_client(Resources* resources)
+{
+    for (long i = 0; i < maxBufferSize; i++) {
+        Client* client = &resources->clients[i];
+        if (!client->assigned) {
+            resources->numClients++;
+            return client;
         }
     }
-    char movedMsg[maxBufferSize];
-    snprintf(movedMsg, maxBufferSize, "moved %s\n", move);
-    if (opponent != NULL) {
-        if (write_to_client(opponent, movedMsg) == -1) {
-            return;
+    return NULL;
+}
+
+/**
+ * @brief Find a free space in the client array and set up a new client there,
+ * playing through the given connection
+ *
+ * @param connection connection the client plays through
+ * @param tag game tag of the client, or untaggedGame
+ * @param resources shared thread resources
+ * @return the new client, or NULL if the client array is full
+ */
+Client* add_client(Connection* connection, long tag, Resources* resources)
+{
+    Client* client = get_unassigned_client(resources);
+    if (!client) {
+        return NULL;
+    }
+    client->assigned = true;
+    client->game = NULL; // not playing yet
+    client->lastGameFen = NULL;
+    client->colour = COLOUR_UNSPECIFIED;
+    client->waitingForHuman = false;
+    lobby_entry_init(&client->lobbyEntry, client);
+    client->priority = resources->nextPriority++;
+    client->connection = connection;
+    client->tag = tag;
+    client->watching = NULL;
+    if (connection->numClients == connection->clientCapacity) {
+        connection->clientCapacity *= 2;
+        connection->clients = (Client**)realloc(connection->clients,
+                connection->clientCapacity * sizeof(Client*));
+    }
+    connection->clients[connection->numClients++] = client;
+    return client;
+}
+
+/**
+ * @brief Get the client playing a connection's game with the given tag, adding
+ * a new client if the tag hasn't been used on this connection yet
+ *
+ * @param connection connection the command came from
+ * @param tagStr tag given in "game <tag> ..." command
+ * @param resources shared thread resources
+ * @return the client, or NULL if the tag is invalid or the connection (or
+ * shard) already has too many games
+ */
+Client* get_tagged_client(
+        Connection* connection, char* tagStr, Resources* resources)
+{
+    long tag = parse_number(tagStr);
+    if (tag < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < connection->numClients; i++) {
+        if (connection->clients[i]->tag == tag) {
+            return connection->clients[i];
         }
     }
-    // checkmate, stalemate
-    bool inCheck = (engineGameState->checkers != NULL);
-    if (try_to_write(resources->toEngineStream, (char*)goPerft1) == -1) {
-        engine_failure();
+    if (connection->numClients >= maxTagsPerConnection
+            || resources->numClients
+                    >= maxBufferSize - reservedClientSlots) {
+        return NULL;
     }
-    ChessMoves* nextMoves
-            = read_stockfish_go_perft_1_output(resources->fromEngineStream);
-    if (!nextMoves) {
-        engine_failure();
+    return add_client(connection, tag, resources);
+}
+
+/**
+ * @brief Act on one line from a connection. Lines starting with "game <tag>"
+ * are for the connection's client with that tag, others are for its untagged
+ * client.
+ *
+ * @param connection connection the line came from
+ * @param line line read, newline-terminated
+ * @param resources shared engine/data resources
+ */
+void respond_line(Connection* connection, char* line, Resources* resources)
+{
+    if (connection->numClients == 0
+            && !add_client(connection, untaggedGame, resources)) {
+        // The shard's client array is still full: answer without a client
+        Client refused = {.connection = connection, .tag = untaggedGame};
+        send_to_client(&refused, (char*)"error command\n");
+        return;
     }
-    if (nextMoves->numMoves == 0) {
-        if (inCheck) {
-            end_game(game, opponent, CHECKMATE);
+    Client* client = connection->clients[0]; // untagged
+    int error = 0;
+    if (validate_line(line) == -1) {
+        error = errorCommand;
+    }
+    char** fields = split_by_char(line, ' ', 0);
+    char** cmdFields = fields;
+    int numFields = count_fields(fields);
+    if (!error && !strcmp(fields[0], "game") && numFields > mediumLine) {
+        Client* taggedClient
+                = get_tagged_client(connection, fields[1], resources);
+        if (taggedClient) {
+            client = taggedClient;
+            cmdFields += mediumLine;
+            numFields -= mediumLine;
         } else {
-            end_game(game, NULL, STALEMATE);
-        }
-    } else if (inCheck) {
-        for (int i = 0; i < numPlayers; i++) {
-            if (game->players[i]) {
-                write_to_client(game->players[i], (char*)"check\n");
-            }
+            error = errorCommand;
         }
     }
-    free_chess_moves(nextMoves);
-    // assuming game isn't over yet
-    game->turn = !(game->turn);
-    if (movingClient != NULL && game_is_against_computer(game)
-            && game->inProgress) {
-        computer_move(game, resources);
+    if (!error) {
+        error = respond_command(client, resources, cmdFields, numFields);
     }
+    free(fields);
+    send_error(client, error);
 }
 
 /**
- * @brief Make a move in a game
+ * @brief Move a connection's clients (none playing or watching) to another
+ * shard in this process. Called holding the connection's shard's lock, returns
+ * holding the new shard's lock.
  *
- * @param game game to move in
- * @param resources shared thread resources
- * @param move move to make, alphanumeric
+ * @param connection connection to move
+ * @param to shard to move to
  */
-void make_move(Game* game, Resources* resources, char* move)
+void move_connection(Connection* connection, Resources* to)
 {
-    engine_new_game(resources);
-    char engineCmd[maxBufferSize];
-    snprintf(engineCmd, maxBufferSize, "position fen %s moves %s\nd\n",
-            game->fenBoardState, move);
-    if (try_to_write(resources->toEngineStream, engineCmd) == -1) {
-        engine_failure();
+    Resources* from = connection->resources;
+    Client moving[connection->numClients];
+    for (int i = 0; i < connection->numClients; i++) {
+        Client* client = connection->clients[i];
+        moving[i] = *client;
+        set_waiting(client, false);
+        client->assigned = false;
+        from->numClients--;
     }
-    StockfishGameState* engineGameState
-            = read_stockfish_d_output(resources->fromEngineStream);
-    if (!engineGameState) {
-        engine_failure();
+    sem_post(from->dataSemaphore);
+
+    sem_wait(to->dataSemaphore);
+    connection->resources = to;
+    connection->moveTo = -1;
+    connection->moved = true;
+    int numMoving = connection->numClients;
+    connection->numClients = 0;
+    for (int i = 0; i < numMoving; i++) {
+        Client* client = get_unassigned_client(to);
+        if (!client) {
+            break; // clients that don't fit are dropped, none are playing
+        }
+        *client = moving[i];
+        client->waitingForHuman = false;
+        lobby_entry_init(&client->lobbyEntry, client);
+        client->priority = to->nextPriority++;
+        connection->clients[connection->numClients++] = client;
+        if (moving[i].waitingForHuman) {
+            try_to_match_human(client, to); // wait again in the new shard
+        }
     }
-    bool accepted = strcmp(engineGameState->fenString, game->fenBoardState);
-    Client* movingClient = game->players[game->turn];
-    Client* opponent = game->players[!(game->turn)];
-    if (accepted) {
-        move_accepted(
-                move, game, movingClient, opponent, resources, engineGameState);
+}
+
+/**
+ * @brief Hand a connection's clients (none playing or watching) to the prefork
+ * worker in connection->moveTo, which runs the line again. The connection's
+ * later lines are passed on to that worker. Called holding the connection's
+ * shard's lock.
+ *
+ * @param connection connection to hand off
+ * @param line line to run again
+ */
+void hand_off_connection(Connection* connection, char* line)
+{
+    Peers* peers = connection->resources->shards->peers;
+    // "<number of clients> <session token> <rating>\n", then
+    // "tag colour waiting\n" for each client
+    size_t detailsSize
+            = (connection->numClients + 1) * smallerBufferSize + strlen(line);
+    char* details = (char*)malloc(detailsSize + 1);
+    int len = sprintf(details, "%d %lu %d\n", connection->numClients,
+            connection->sessionToken, connection->rating);
+    for (int i = 0; i < connection->numClients; i++) {
+        Client* client = connection->clients[i];
+        len += sprintf(details + len, "%ld %d %d\n", client->tag,
+                (int)client->colour, (int)client->waitingForHuman);
+        remove_client(client);
+    }
+    strcpy(details + len, line);
+    connection->numClients = 0;
+
+    pthread_mutex_lock(&peers->lock);
+    long id = peers->nextId++;
+    idmap_put(peers->handedOff, id, connection);
+    pthread_mutex_unlock(&peers->lock);
+    connection->downstreamWorker = connection->moveTo;
+    connection->downstreamId = id;
+    connection->moveTo = -1;
+    peer_send(peers, connection->downstreamWorker, PEER_HANDOFF, id,
+            untaggedGame, details);
+    free(details);
+}
+
+/**
+ * @brief Act on one line from a connection. If the line needs another shard,
+ * the connection is moved (or handed off) there and the line run again.
+ *
+ * @param connection connection the line came from
+ * @param line line read
+ * @param ticket ticket the line was given when read
+ */
+void run_line(Connection* connection, char* line, unsigned long ticket)
+{
+    Shards* shards = connection->resources->shards;
+    // Lines are split in place, keep the line to run it again after a move
+    char* copy = shards->numShards > 1 ? strdup(line) : NULL;
+    sem_wait(connection->resources->dataSemaphore);
+    connection->resources->lineTicket = ticket;
+    respond_line(connection, line, connection->resources);
+    connection->resources->lineTicket = 0;
+    if (connection->moveTo >= 0 && shards->shards[connection->moveTo]) {
+        move_connection(connection, shards->shards[connection->moveTo]);
+        connection->resources->lineTicket = ticket;
+        respond_line(connection, copy, connection->resources);
+        connection->resources->lineTicket = 0;
+        connection->moved = false;
+    } else if (connection->moveTo >= 0) {
+        hand_off_connection(connection, copy); // shard is another process
+    }
+    sem_post(connection->resources->dataSemaphore);
+    free(copy);
+}
+
+/**
+ * @brief Worker pool task acting on one line from a connection, or passing it
+ * on if the connection was handed to another worker process
+ *
+ * @param data LineTask* - line and where it came from
+ */
+void line_task(void* data)
+{
+    LineTask* task = (LineTask*)data;
+    Connection* connection = task->connection;
+    if (connection->downstreamWorker >= 0) {
+        peer_send(connection->resources->shards->peers,
+                connection->downstreamWorker, PEER_LINE,
+                connection->downstreamId, untaggedGame, task->line);
     } else {
-        // try to send move error to human player
-        if (movingClient != NULL) {
-            write_to_client(movingClient, (char*)"error move\n");
+        run_line(connection, task->line, task->ticket);
+    }
+    free(task->line);
+    free(task);
+}
+
+/**
+ * @brief Worker pool task adding a new connection's untagged client. If the
+ * shard has no room, it is added when the connection's first line is run.
+ *
+ * @param data Connection* - the connection
+ */
+void connection_opened_task(void* data)
+{
+    Connection* connection = (Connection*)data;
+    sem_wait(connection->resources->dataSemaphore);
+    add_client(connection, untaggedGame, connection->resources);
+    sem_post(connection->resources->dataSemaphore);
+}
+
+/**
+ * @brief Worker pool task run once a held seat's time is up: the player who
+ * dropped out of it resigns, unless they have resumed since
+ *
+ * @param data HeldSeat* - the seat
+ */
+void held_seat_expired_task(void* data)
+{
+    HeldSeat* held = (HeldSeat*)data;
+    Game* game = held->game;
+    Resources* resources = game->resources;
+    sem_wait(resources->dataSemaphore);
+    if (held->token) {
+        long remaining = held->deadline - monotonic_seconds();
+        if (remaining > 0) {
+            // Held again since the timer expired
+            timer_start(resources->graceTimers, &held->timer,
+                    (unsigned long)remaining);
+        } else {
+            held->token = 0;
+            end_game_won_by(game, (Colour)!held->seat, RESIGNATION);
         }
     }
-    free_stockfish_game_state(engineGameState);
+    sem_post(resources->dataSemaphore);
 }
 
 /**
- * @brief Make computer's move (use engine best move)
+ * @brief Timer callback for a held seat, resigning the game on the worker
+ * pool (the callback can't wait for the shard's lock)
  *
- * @param game game to move in
- * @param resources shared thread resources
+ * @param timer the seat's timer
+ * @param data HeldSeat* - the seat
+ * @return 0, the timer isn't restarted
  */
-void computer_move(Game* game, Resources* resources)
+unsigned long held_seat_expired(
+        Timer* timer __attribute__((unused)), void* data)
 {
-    if (!(game->players[game->turn] == NULL
-                && game->players[!(game->turn)] != NULL)) {
-        warn_bug(
-                (char*)("tried to make computer move with invalid computer\n"));
+    HeldSeat* held = (HeldSeat*)data;
+    pool_submit(held->game->resources->pool, held_seat_expired_task, held);
+    return 0;
+}
+
+/**
+ * @brief Hold a client's seat for it to resume, if it is playing and can
+ *
+ * @param client client whose connection closed
+ * @return true if the seat is held, false if the game should be resigned
+ */
+bool hold_seat(Client* client)
+{
+    Game* game = client->game;
+    if (!game || !game->inProgress || !can_hold_seat(client)) {
+        return false;
     }
-    char bestMove[maxBufferSize];
-    best_move(bestMove, game, resources);
-    make_move(game, resources, bestMove);
+    Resources* resources = game->resources;
+    HeldSeat* held = &game->held[client->colour];
+    game->players[client->colour] = NULL;
+    client->game = NULL;
+    held->token = client->connection->sessionToken;
+    held->rating = client->connection->rating;
+    held->deadline = monotonic_seconds() + resources->graceSeconds;
+    timer_start(resources->graceTimers, &held->timer,
+            (unsigned long)resources->graceSeconds);
+    return true;
+}
+
+/**
+ * @brief Worker pool task run after a connection's last command: removes all
+ * of its clients, then frees it. Their games are resigned, or held for them
+ * if the connection has a session token.
+ *
+ * @param data Connection* - the connection
+ */
+void connection_closed_task(void* data)
+{
+    Connection* connection = (Connection*)data;
+    sem_wait(connection->resources->dataSemaphore);
+    for (int i = 0; i < connection->numClients; i++) {
+        Client* client = connection->clients[i];
+        if (hold_seat(client)) {
+            remove_client(client);
+        } else {
+            resign_remove_client(client);
+        }
+    }
+    sem_post(connection->resources->dataSemaphore);
+    if (connection->downstreamWorker >= 0) {
+        Peers* peers = connection->resources->shards->peers;
+        pthread_mutex_lock(&peers->lock);
+        idmap_remove(peers->handedOff, connection->downstreamId);
+        pthread_mutex_unlock(&peers->lock);
+        peer_send(peers, connection->downstreamWorker, PEER_CLOSED,
+                connection->downstreamId, untaggedGame, "");
+    }
+    if (connection->outbox) {
+        // Anything still queued (e.g. gameover) is sent before the socket
+        // closes
+        outbox_close(connection->outbox);
+    }
+    free(connection->clients);
+    free(connection);
+}
+
+/**
+ * @brief Create a connection with no clients yet
+ *
+ * @param outbox outbox to send to the connection's socket through, or NULL if
+ * another worker process has the socket
+ * @param resources resources of the shard the connection starts in
+ * @return the connection
+ */
+Connection* create_connection(Outbox* outbox, Resources* resources)
+{
+    Connection* connection = (Connection*)malloc(sizeof(Connection));
+    connection->outbox = outbox;
+    connection->strand = strand_create(resources->pool);
+    connection->numClients = 0;
+    connection->clientCapacity = 1;
+    connection->clients = (Client**)malloc(sizeof(Client*));
+    connection->resources = resources;
+    connection->moveTo = -1;
+    connection->moved = false;
+    connection->downstreamWorker = -1;
+    connection->downstreamId = 0;
+    connection->upstreamWorker = -1;
+    connection->upstreamId = 0;
+    connection->idleTimers = NULL;
+    connection->idleSeconds = 0;
+    connection->idleDeadline = 0;
+    connection->sessionToken = 0;
+    connection->rating = lobbyDefaultRating;
+    connection->lineTickets = &resources->shards->lineTickets;
+    return connection;
+}
+
+/**
+ * @brief Timer callback for a connection's idle timeout. Disconnects the
+ * connection if it is past its deadline (its clients are then removed as for
+ * any closed connection, resigning their games), otherwise waits for it.
+ *
+ * @param timer the connection's idle timer
+ * @param data Connection* - the connection
+ * @return seconds until the deadline, or 0 once disconnected
+ */
+unsigned long idle_timeout(
+        Timer* timer __attribute__((unused)), void* data)
+{
+    Connection* connection = (Connection*)data;
+    long deadline
+            = __atomic_load_n(&connection->idleDeadline, __ATOMIC_RELAXED);
+    long remaining = deadline - monotonic_seconds();
+    if (remaining > 0) {
+        return (unsigned long)remaining;
+    }
+    outbox_disconnect(connection->outbox);
+    return 0;
 }
 
 /**
- * @brief Send started msg to a client
+ * @brief Turn on TCP keepalive for an accepted socket, so a peer that vanished
+ * without closing the connection is noticed (and the connection closed)
  *
- * @param colour colour the client is starting as
- * @param client client to send to
+ * @param fd socket
  */
-void send_started(Colour colour, Client* client)
+void enable_keepalive(int fd)
 {
-    char startedMsg[maxBufferSize];
-    char colourName[maxBufferSize];
-    get_colour_name(colourName, colour);
-    snprintf(startedMsg, maxBufferSize, "started %s\n", colourName);
-    write_to_client(client, startedMsg);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(int));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepAliveIdle, sizeof(int));
+    setsockopt(
+            fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepAliveInterval, sizeof(int));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepAliveProbes, sizeof(int));
+    // Also give up on data the peer never acknowledges after as long
+    unsigned int userTimeoutMs
+            = (keepAliveIdle + keepAliveInterval * keepAliveProbes) * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeoutMs,
+            sizeof(unsigned int));
 }
 
 /**
- * @brief Respond to client "board" cmd
+ * @brief Network callback for a newly accepted connection
  *
- * @param client client asking for board
- * @param resources engine and client/game array resources
- * @return -1 if error (no board to show), 0 otherwise
+ * @param fd accepted socket
+ * @param data Resources* - resources of the shard that accepted it
+ * @return the new Connection
  */
-int respond_board(Client* client, Resources* resources)
+void* connection_opened(int fd, void* data)
 {
-    char fen[maxBufferSize];
-    bool fenFound = true;
-    if (client->lastGameFen) {
-        strcpy(fen, client->lastGameFen);
-    } else if (client->game && client->game->inProgress) {
-        strcpy(fen, client->game->fenBoardState);
-    } else {
-        fenFound = false;
-    }
-    if (fenFound) {
-        set_position_no_move(fen, resources);
-        if (try_to_write(resources->toEngineStream, (char*)"d\n") == -1) {
-            engine_failure();
-        }
-        StockfishGameState* gameState
-                = read_stockfish_d_output(resources->fromEngineStream);
-        if (!gameState) {
-            engine_failure();
-        }
-        char boardMsg[maxBufferSize];
-        snprintf(boardMsg, maxBufferSize, "startboard\n%sendboard\n",
-                gameState->boardString);
-        write_to_client(client, boardMsg);
-        free_stockfish_game_state(gameState);
-        return 0;
+    // Outbox gets its own fd as the network backend closes fd itself
+    Resources* resources = (Resources*)data;
+    enable_keepalive(fd);
+    Connection* connection = create_connection(
+            outbox_create(dup(fd), resources->outboxOptions), resources);
+    if (resources->idleTimers) {
+        connection->idleTimers = resources->idleTimers;
+        connection->idleSeconds = resources->idleSeconds;
+        connection->idleDeadline
+                = monotonic_seconds() + connection->idleSeconds;
+        timer_init(&connection->idleTimer, idle_timeout, connection);
+        timer_start(connection->idleTimers, &connection->idleTimer,
+                connection->idleSeconds);
     }
-    return -1;
+    strand_submit(connection->strand, connection_opened_task, connection);
+    return connection;
 }
 
 /**
- * @brief check if colours can play against each other
+ * @brief Network callback for a line read from a connection, acted on by the
+ * worker pool after any earlier lines from the connection. A "ping" is
+ * answered at once instead, ahead of any replies still to come to earlier
+ * lines, so clients can time the server without waiting on the engine.
  *
- * @param colour1 colour of one player
- * @param colour2 colour of another player
- * @return true if colours can play against each other, false if not
+ * @param context Connection* - connection the line came from
+ * @param line line read
+ * @param data unused
  */
-bool colours_can_play(Colour colour1, Colour colour2)
+void connection_line(
+        void* context, char* line, void* data __attribute__((unused)))
 {
-    return colour1 == COLOUR_UNSPECIFIED || colour2 == COLOUR_UNSPECIFIED
-            || (colour1 != colour2);
+    Connection* connection = (Connection*)context;
+    if (connection->idleTimers) {
+        // The timer only looks at the deadline when it expires, so this is
+        // all a line costs
+        __atomic_store_n(&connection->idleDeadline,
+                monotonic_seconds() + connection->idleSeconds,
+                __ATOMIC_RELAXED);
+    }
+    if (!strcmp(line, "ping\n")) {
+        Message* pong = message_create("pong\n");
+        outbox_push(connection->outbox, untaggedGame, pong);
+        message_unref(pong);
+        return;
+    }
+    LineTask* task = (LineTask*)malloc(sizeof(LineTask));
+    task->connection = connection;
+    task->line = strdup(line);
+    task->ticket
+            = __atomic_add_fetch(connection->lineTickets, 1, __ATOMIC_ACQ_REL);
+    strand_submit(connection->strand, line_task, task);
 }
 
 /**
- * @brief Find first unassigned game in array, does not assign it
+ * @brief Network callback for a connection closing. Its clients are removed
+ * once commands already read from it are done.
  *
- * @param resources shared thread resources
- * @return first unassigned game
+ * @param context Connection* - connection that closed
+ * @param data unused
  */
-Game* get_unassigned_game(Resources* resources)
+void connection_closed(void* context, void* data __attribute__((unused)))
 {
-    Game* game = resources->games;
-    bool found = false;
-    for (long i = 0; i < maxBufferSize; i++) {
-        if (!(*game).assigned) {
-            found = true;
-            break;
-        }
-        game++;
-    }
-    if (!found) {
-        warn_bug((char*)"Ran out of space in game array\n");
+    Connection* connection = (Connection*)context;
+    if (connection->idleTimers) {
+        timer_stop(connection->idleTimers, &connection->idleTimer);
     }
-    return game;
+    // The task frees the connection, maybe before strand_submit() returns
+    Strand* strand = connection->strand;
+    strand_submit(strand, connection_closed_task, connection);
+    strand_close(strand);
 }
 
 /**
- * @brief Initialise a new game
+ * @brief Get the key a connection handed to this worker is kept under
  *
- * @param game game to initialise
+ * @param worker worker that handed it over
+ * @param id id it was handed over with
+ * @return key in peers->remote
  */
-void initialise_game(Game* game)
+long peer_key(int worker, long id)
 {
-    game->assigned = true;
-    game->turn = COLOUR_WHITE;
-    game->inProgress = false;
-    game->fenBoardState = strdup("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/"
-                                 "RNBQKBNR w KQkq - 0 1");
-    game->inProgress = true;
+    return id * maxShards + worker;
 }
 
 /**
- * @brief Try to match human with another
+ * @brief Worker pool task taking over a connection handed over by another
+ * worker: adds its clients, then runs the line it was handed over for
  *
- * @param human human to match
- * @param resources shared thread resources
- * @param colour colour chosen by human
+ * @param data LineTask* - the new connection, and hand-off details
  */
-void try_to_match_human(Client* human, Resources* resources)
+void handoff_task(void* data)
 {
-    // Find human who joined first
-    human->waitingForHuman = true;
-    bool found = false;
-    Client* otherHuman = resources->clients;
-    Client* humanFirstJoined;
-    long minPriority
-            = otherHuman->priority + 1; // will be set on first iteration
-    for (long i = 0; i < maxBufferSize; i++) {
-        if (otherHuman->assigned && otherHuman->waitingForHuman
-                && colours_can_play(human->colour, otherHuman->colour)
-                && otherHuman->priority < minPriority && otherHuman != human) {
-            found = true;
-            humanFirstJoined = otherHuman;
-            minPriority = otherHuman->priority;
+    LineTask* task = (LineTask*)data;
+    Connection* connection = task->connection;
+    Resources* resources = connection->resources;
+    char* details = task->line;
+    int numClients;
+    int consumed;
+    sscanf(details, "%d %lu %d%n", &numClients, &connection->sessionToken,
+            &connection->rating, &consumed);
+    details += consumed + 1;
+    sem_wait(resources->dataSemaphore);
+    connection->moved = true;
+    for (int i = 0; i < numClients; i++) {
+        long tag;
+        int colour;
+        int waiting;
+        sscanf(details, "%ld %d %d%n", &tag, &colour, &waiting, &consumed);
+        details += consumed + 1;
+        Client* client = add_client(connection, tag, resources);
+        if (!client) {
+            break; // clients that don't fit are dropped, none are playing
+        }
+        client->colour = (Colour)colour;
+        if (waiting) {
+            try_to_match_human(client, resources);
         }
-        otherHuman++;
-    }
-    if (!found) {
-        return; // No match, do nothing for now
-    }
-
-    // Set colours of humans
-    otherHuman = humanFirstJoined;
-    if (human->colour != COLOUR_UNSPECIFIED) {
-        otherHuman->colour = (Colour)(!(human->colour));
-    } else if (otherHuman->colour != COLOUR_UNSPECIFIED) {
-        human->colour = (Colour)(!(otherHuman->colour));
-    } else {
-        // This human is white iff they joined first
-        Colour humanColour
-                = (human->priority < otherHuman->priority ? COLOUR_WHITE
-                                                          : COLOUR_BLACK);
-        human->colour = humanColour;
-        otherHuman->colour = (Colour)(!humanColour);
-    }
-
-    // Initialise players/game, send started msg to both
-    Game* game = get_unassigned_game(resources);
-    initialise_game(game);
-    game->players[human->colour] = human;
-    game->players[!(human->colour)] = otherHuman;
-    for (int i = 0; i < numPlayers; i++) {
-        Client* player = game->players[i];
-        player->game = game;
-        player->waitingForHuman = false;
-        send_started(player->colour, player);
     }
+    respond_line(connection, details, resources);
+    connection->moved = false;
+    sem_post(resources->dataSemaphore);
+    free(task->line);
+    free(task);
 }
 
 /**
- * @brief Respond to start message from client
+ * @brief Take over a connection handed over by another worker
  *
- * @param client client sending start msg
- * @param resources shared array/engine resources
- * @param fields fields from input line
- * @return true if command valid, false otherwise
+ * @param peers this worker's handed over connections
+ * @param message PEER_HANDOFF message
  */
-bool respond_start(Client* client, Resources* resources, char** fields)
+void receive_handoff(Peers* peers, PeerMessage* message)
 {
-    Opponent opponent;
-    Colour colour;
-    if (!strcmp(fields[1], "computer")) {
-        opponent = OPPONENT_COM;
-    } else if (!strcmp(fields[1], "human")) {
-        opponent = OPPONENT_HUMAN;
-    } else {
-        return false;
-    }
-    if (!strcmp(fields[2], "white")) {
-        colour = COLOUR_WHITE;
-    } else if (!strcmp(fields[2], "black")) {
-        colour = COLOUR_BLACK;
-    } else if (!strcmp(fields[2], "either")) {
-        colour = COLOUR_UNSPECIFIED;
-    } else {
-        return false;
-    }
+    Connection* connection = create_connection(NULL, peers->resources);
+    connection->upstreamWorker = message->from;
+    connection->upstreamId = message->id;
+    idmap_put(peers->remote, peer_key(message->from, message->id), connection);
+    LineTask* task = (LineTask*)malloc(sizeof(LineTask));
+    task->connection = connection;
+    task->line = strdup(message->text);
+    task->ticket = 0;
+    strand_submit(connection->strand, handoff_task, task);
+}
 
-    // Start new game
-    if (client->game != NULL) {
-        end_game(client->game, client, RESIGNATION);
-    }
-    if (opponent == OPPONENT_COM && colour == COLOUR_UNSPECIFIED) {
-        colour = COLOUR_WHITE;
+/**
+ * @brief Send output passed back by the worker a connection was handed to
+ *
+ * @param peers this worker's handed over connections
+ * @param message PEER_OUTPUT message
+ */
+void receive_output(Peers* peers, PeerMessage* message)
+{
+    int upstreamWorker = -1;
+    long upstreamId = 0;
+    pthread_mutex_lock(&peers->lock);
+    Connection* connection
+            = (Connection*)idmap_get(peers->handedOff, message->id);
+    if (connection && connection->outbox) {
+        Message* output = message_create(message->text);
+        outbox_push(connection->outbox, message->tag, output);
+        message_unref(output);
+    } else if (connection) {
+        // Handed to us as well, pass it back again
+        upstreamWorker = connection->upstreamWorker;
+        upstreamId = connection->upstreamId;
     }
-    Game* game;
-    client->lastGameFen = NULL;
-    client->colour = colour;
-    switch (opponent) {
-    case OPPONENT_COM:
-        game = get_unassigned_game(resources);
-        initialise_game(game);
-        game->players[colour] = client;
-        game->players[!colour] = NULL; // computer
-        client->game = game;
-        client->waitingForHuman = false;
-        send_started(colour, client);
-        if (colour == COLOUR_BLACK) {
-            // Human is black, computer starts off as white
-            computer_move(game, resources);
-        }
-        return true;
-    case OPPONENT_HUMAN:
-        try_to_match_human(client, resources);
-        return true;
-    default:
-        return true; // shouldn't get here
+    pthread_mutex_unlock(&peers->lock);
+    if (!connection) {
+        // Handed off before this worker was restarted, it's gone
+        peer_send(peers, message->from, PEER_CLOSED, message->id,
+                untaggedGame, "");
+    } else if (upstreamWorker >= 0) {
+        peer_send(peers, upstreamWorker, PEER_OUTPUT, upstreamId,
+                message->tag, message->text);
     }
 }
 
 /**
- * @brief Respond to client "hint" msg, assume it is their turn and they are
- * playing and cmd is valid
+ * @brief Disconnect a handed off connection the worker it was handed to
+ * doesn't know (it was restarted), so its client can reconnect
  *
- * @param client client that asked for hint
- * @param resources shared thread resources
- * @param all true if all, false if best
+ * @param peers this worker's handed over connections
+ * @param message PEER_UNKNOWN message
  */
-void respond_hint(Client* client, Resources* resources, bool all)
+void receive_unknown(Peers* peers, PeerMessage* message)
 {
-    if (all) {
-        set_position_no_move(client->game->fenBoardState, resources);
-        if (try_to_write(resources->toEngineStream, (char*)goPerft1) == -1) {
-            engine_failure();
-        }
-        ChessMoves* moves
-                = read_stockfish_go_perft_1_output(resources->fromEngineStream);
-        write_to_client(client, (char*)"moves");
-        for (long i = 0; i < moves->numMoves; i++) {
-            char allMovesMsg[maxBufferSize];
-            snprintf(allMovesMsg, maxBufferSize, " %s", moves->moves[i]);
-            write_to_client(client, allMovesMsg);
-        }
-        write_to_client(client, (char*)"\n");
-        free_chess_moves(moves);
-    } else {
-        char bestMove[smallerBufferSize];
-        best_move(bestMove, client->game, resources);
-        char bestMoveMsg[smallerBufferSize];
-        snprintf(bestMoveMsg, smallerBufferSize, "moves %s\n", bestMove);
-        write_to_client(client, bestMoveMsg);
+    int upstreamWorker = -1;
+    long upstreamId = 0;
+    pthread_mutex_lock(&peers->lock);
+    Connection* connection
+            = (Connection*)idmap_get(peers->handedOff, message->id);
+    if (connection && connection->outbox) {
+        // Its reader sees end of file and closes it
+        outbox_disconnect(connection->outbox);
+    } else if (connection) {
+        upstreamWorker = connection->upstreamWorker;
+        upstreamId = connection->upstreamId;
+    }
+    pthread_mutex_unlock(&peers->lock);
+    if (upstreamWorker >= 0) {
+        // The worker with the socket disconnects it
+        peer_send(peers, upstreamWorker, PEER_UNKNOWN, upstreamId,
+                untaggedGame, "");
     }
 }
 
+// Search for connections handed to or from a restarted worker
+typedef struct RestartSearch {
+    int worker;
+    // Keys (in peers->remote) of connections handed to us to close
+    long* keys;
+    size_t numKeys;
+    size_t keyCapacity;
+} RestartSearch;
+
 /**
- * @brief Resign a client's game if they have one and remove the client from the
- * array
+ * @brief Add a key to a restart search's connections to close
  *
- * @param client
+ * @param search search to add to
+ * @param key key of the connection in peers->remote
  */
-void resign_remove_client(Client* client)
+void add_restart_key(RestartSearch* search, long key)
 {
-    if (client->game && client->game->inProgress) {
-        // If client disconnects before getting a game, client->game is NULL, no
-        // need to end it.
-        end_game(client->game, client, RESIGNATION);
+    if (search->numKeys == search->keyCapacity) {
+        search->keyCapacity = search->keyCapacity ? 2 * search->keyCapacity : 1;
+        search->keys = (long*)realloc(
+                search->keys, search->keyCapacity * sizeof(long));
     }
-    remove_client(client);
+    search->keys[search->numKeys++] = key;
 }
 
 /**
- * @brief Respond to two-word client input
+ * @brief idmap_for_each() callback for connections handed to us: close those
+ * handed over by the restarted worker
  *
- * @param cmd first word of input
- * @param fields fields from input line
- * @param client client sending input
- * @param resources shared thread resources
- * @return errorCommand, errorGame or errorTurn to indicate error, 0 for no
- * error
+ * @param key connection's key
+ * @param value Connection* - the connection
+ * @param data RestartSearch* - the search
  */
-int respond_medium_input(
-        char* cmd, char** fields, Client* client, Resources* resources)
+void find_handed_from(long key, void* value, void* data)
 {
-    if (!strcmp(cmd, "move")) {
-        if (!(valid_move_length(strlen(fields[1]))
-                    && str_is_alnum(fields[1]))) {
-            return errorCommand;
-        }
-        if (!(client->game)) {
-            return errorGame;
-        }
-        if (client->colour != client->game->turn) {
-            return errorTurn;
-        }
-        make_move(client->game, resources, fields[1]);
-        return 0;
-    }
-    if (!strcmp(cmd, "hint")) {
-        bool all;
-        if (!strcmp(fields[1], "all")) {
-            all = true;
-        } else if (!strcmp(fields[1], "best")) {
-            all = false;
-        } else {
-            return errorCommand;
-        }
-        if (!(client->game)) {
-            return errorGame;
-        }
-        if (client->colour != client->game->turn) {
-            return errorTurn;
-        }
-        respond_hint(client, resources, all);
-        return 0;
+    RestartSearch* search = (RestartSearch*)data;
+    if (((Connection*)value)->upstreamWorker == search->worker) {
+        add_restart_key(search, key);
     }
-    return errorCommand;
 }
 
 /**
- * @brief Respond to one word input from client
+ * @brief idmap_for_each() callback for connections we handed off: disconnect
+ * those handed to the restarted worker, so their clients can reconnect and
+ * resume their games there
  *
- * @param client client giving input
- * @param resources shared thread resources
- * @param cmd first (and only) word of input
- * @return errorCommand, errorMove, errorTurn or 0 for no error
+ * @param id connection's id
+ * @param value Connection* - the connection
+ * @param data RestartSearch* - the search
  */
-int respond_short_input(Client* client, Resources* resources, char* cmd)
+void find_handed_to(long id __attribute__((unused)), void* value, void* data)
 {
-    if (!strcmp(cmd, "board")) {
-        if (respond_board(client, resources) == -1) {
-            return errorGame;
-        }
-        return 0;
+    RestartSearch* search = (RestartSearch*)data;
+    Connection* connection = (Connection*)value;
+    if (connection->downstreamWorker != search->worker) {
+        return;
     }
-    if (!strcmp(cmd, "resign")) {
-        if (!(client->game)) {
-            return errorGame;
-        }
-        end_game(client->game, client, RESIGNATION);
-        return 0;
+    if (connection->outbox) {
+        outbox_disconnect(connection->outbox);
+    } else {
+        // Handed to us as well: close it here, its worker sees it is gone
+        add_restart_key(search,
+                peer_key(connection->upstreamWorker, connection->upstreamId));
     }
-    return errorCommand;
 }
 
 /**
- * @brief Repeatedly act on commands from client
+ * @brief Drop every connection handed to or from a worker that was restarted
  *
- * @param client ptr to cliend data
- * @param resources shared engine/data resources
+ * @param peers this worker's handed over connections
+ * @param worker worker that was restarted
  */
-void client_loop(Client* client, Resources* resources)
+void receive_restarted(Peers* peers, int worker)
 {
-    char buffer[maxBufferSize];
-    char* readResult;
-    while (readResult = fgets(buffer, maxBufferSize, client->fromClientStream),
-            readResult != NULL) {
-        sem_wait(resources->dataSemaphore);
-        if (feof(client->fromClientStream)) {
-            // client closed, ignore partial command entered
-            sem_post(resources->dataSemaphore);
-            break;
-        }
-        int error = 0;
-        if (validate_line(buffer) == -1) {
-            error = errorCommand;
-        }
-        char** fields = split_by_char(buffer, ' ', 0);
-        char* cmd = fields[0];
-        int numFields = count_fields(fields);
-        if (!error) {
-            if (numFields == shortLine) {
-                error = respond_short_input(client, resources, cmd);
-            } else if (numFields == mediumLine) {
-                error = respond_medium_input(cmd, fields, client, resources);
-            } else if (numFields == longLine) {
-                if (!strcmp(cmd, "start")) {
-                    error = respond_start(client, resources, fields)
-                            ? 0
-                            : errorCommand;
-                } else {
-                    error = errorCommand;
-                }
-            } else {
-                error = errorCommand;
-            }
-        }
-        free(fields);
-        char* response = NULL;
-        if (error == errorCommand) {
-            response = (char*)"error command\n";
-        } else if (error == errorGame) {
-            response = (char*)"error game\n";
-        } else if (error == errorTurn) {
-            response = (char*)"error turn\n";
+    RestartSearch search
+            = {.worker = worker, .keys = NULL, .numKeys = 0, .keyCapacity = 0};
+    idmap_for_each(peers->remote, find_handed_from, &search);
+    pthread_mutex_lock(&peers->lock);
+    idmap_for_each(peers->handedOff, find_handed_to, &search);
+    pthread_mutex_unlock(&peers->lock);
+    for (size_t i = 0; i < search.numKeys; i++) {
+        Connection* connection
+                = (Connection*)idmap_remove(peers->remote, search.keys[i]);
+        if (connection) {
+            connection_closed(connection, NULL);
         }
-        if (response) {
-            write_to_client(client, response);
-        }
-        sem_post(resources->dataSemaphore);
     }
-    resign_remove_client(client);
+    free(search.keys);
 }
 
 /**
- * @brief thread function to manage a client
+ * @brief Thread receiving messages about handed over connections from other
+ * prefork workers. Only this thread uses peers->remote.
  *
- * @param dataIn ptr to ThreadData, contains data supplied to thread
- * @return NULL
+ * @param data Peers* - this worker's handed over connections
+ * @return unused, never returns
  */
-void* client_thread(void* dataIn)
+void* peer_thread(void* data)
 {
-    ThreadData threadData = *(ThreadData*)dataIn;
-    Resources* resources = threadData.resources;
-    free(dataIn);
-
-    sem_wait(resources->dataSemaphore);
-
-    Client* client = resources->clients;
-    Client* thisClient;
-    bool found = false;
-    long maxPriority = -1;
-    for (long i = 0; i < maxBufferSize; i++) {
-        if (!(*client).assigned) {
-            if (!found) {
-                thisClient = client;
-                found = true;
+    Peers* peers = (Peers*)data;
+    char* buffer = (char*)malloc(peerBufferSize);
+    while (1) {
+        ssize_t len = prefork_receive(peers->prefork, buffer, peerBufferSize);
+        if (len < (ssize_t)sizeof(PeerMessage)) {
+            continue;
+        }
+        PeerMessage* message = (PeerMessage*)buffer;
+        long key = peer_key(message->from, message->id);
+        Connection* connection = NULL;
+        if (message->type == PEER_HANDOFF) {
+            receive_handoff(peers, message);
+        } else if (message->type == PEER_LINE) {
+            connection = (Connection*)idmap_get(peers->remote, key);
+            if (connection) {
+                connection_line(connection, message->text, NULL);
+            } else {
+                peer_send(peers, message->from, PEER_UNKNOWN, message->id,
+                        untaggedGame, "");
             }
-        } else {
-            if ((*client).priority > maxPriority) {
-                maxPriority = (*client).priority;
+        } else if (message->type == PEER_CLOSED) {
+            connection = (Connection*)idmap_remove(peers->remote, key);
+            if (connection) {
+                connection_closed(connection, NULL);
             }
-        }
-
-        client++;
-    }
-    if (!found) {
-        warn_bug((char*)"Ran out of space in client array\n");
-    }
-
-    thisClient->assigned = true;
-    thisClient->game = NULL; // not playing yet
-    thisClient->lastGameFen = NULL;
-    thisClient->fromClientStream = fdopen(threadData.acceptedSocketFd, "r");
-    thisClient->toClientStream = fdopen(threadData.acceptedSocketFd, "w");
-    thisClient->waitingForHuman = false;
-    if (maxPriority == -1) {
-        thisClient->priority = 1;
-    } else {
-        thisClient->priority = maxPriority + 1;
-    }
-
-    sem_post(resources->dataSemaphore);
-
-    client_loop(thisClient, resources);
+        } else if (message->type == PEER_OUTPUT) {
+            receive_output(peers, message);
+        } else if (message->type == PEER_UNKNOWN) {
+            receive_unknown(peers, message);
+        } else {
+            receive_restarted(peers, message->from);
+        }
+    }
+    return NULL;
+}
 
-    // Ending thread
-    // Client streams closed in remove_client
-    return NULL; // could have called pthread_exit(NULL);
+/**
+ * @brief Set up this prefork worker's handed over connections and start
+ * receiving messages about them
+ *
+ * @param prefork prefork state
+ * @param resources this worker's shard
+ * @return the handed over connections
+ */
+Peers* create_peers(Prefork* prefork, Resources* resources)
+{
+    Peers* peers = (Peers*)malloc(sizeof(Peers));
+    peers->prefork = prefork;
+    peers->self = resources->shardIndex;
+    peers->resources = resources;
+    pthread_mutex_init(&peers->lock, NULL);
+    peers->handedOff = idmap_create();
+    peers->remote = idmap_create();
+    // Other workers may still know ids from before a restart
+    peers->nextId = ((long)prefork_restarts(prefork) << peerIdRestartShift) + 1;
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, peer_thread, peers);
+    pthread_detach(threadId);
+    return peers;
 }
 
 /**
@@ -1043,19 +4030,15 @@ void ignore_sig_pipe(void)
 }
 
 /**
- * @brief Enter loop of accepting connections
+ * @brief Set up the resources shared by one shard's client threads
  *
- * @param fdServer server socket fd
- * @param toEngineStream stream to write to client
- * @param fromEngineStream stream to write from client
+ * @param engine the shard's engine
+ * @param shards every shard
+ * @param shardIndex which shard this is
+ * @return the resources
  */
-void process_connections(
-        int fdServer, FILE* toEngineStream, FILE* fromEngineStream)
+Resources* init_resources(Engine* engine, Shards* shards, int shardIndex)
 {
-    int fd;
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
-
     // Initialise semaphores
     sem_t* dataSemaphore = (sem_t*)malloc(sizeof(sem_t));
     sem_init(dataSemaphore, 0, 1);
@@ -1069,32 +4052,217 @@ void process_connections(
         resources->clients[i].assigned = false;
         resources->games->assigned = false;
     }
-    resources->toEngineStream = toEngineStream;
-    resources->fromEngineStream = fromEngineStream;
-    ignore_sig_pipe();
+    resources->engine = *engine;
+    for (int i = 0; i < numEngineLevels; i++) {
+        resources->levelEngines[i] = NULL;
+    }
+    resources->engineCores = NULL;
+    resources->nextPriority = 1;
+    resources->nextGameId = shardIndex + 1;
+    resources->journal = NULL;
+    resources->journalPath = NULL;
+    resources->journalRecords = 0;
+    resources->endedJournalRecords = 0;
+    resources->archive = NULL;
+    resources->selfPlayOutput = NULL;
+    resources->outboxOptions = NULL;
+    resources->idleTimers = NULL;
+    resources->idleSeconds = 0;
+    resources->graceTimers = NULL;
+    resources->graceSeconds = 0;
+    resources->lobby = lobby_create(numColours);
+    resources->numClients = 0;
+    resources->flights = flights_create(&shards->lineTickets);
+    resources->lineTicket = 0;
+    timer_init(&resources->matchTimer, match_window_widened, resources);
+    for (long i = 0; i < maxBufferSize; i++) {
+        Game* game = &resources->games[i];
+        for (int seat = 0; seat < numPlayers; seat++) {
+            game->held[seat].game = game;
+            game->held[seat].seat = seat;
+            timer_init(&game->held[seat].timer, held_seat_expired,
+                    &game->held[seat]);
+        }
+    }
+    resources->shards = shards;
+    resources->shardIndex = shardIndex;
+    // Commands are CPU work, one worker per core keeps every core busy
+    int numWorkers = pool_num_cores() / shards->numShards;
+    resources->pool = pool_create(numWorkers > 0 ? numWorkers : 1);
+    return resources;
+}
 
-    // Repeatedly accept connections
-    while (1) {
-        fromAddrSize = sizeof(struct sockaddr_in);
-        // Block, waiting for a new connection. (fromAddr will be populated
-        // with address of client)
-        fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
-        if (fd < 0) {
-            // Error accepting connection - just skip
+/**
+ * @brief Set a restored game's board state (and whose turn it is)
+ *
+ * @param game game to update
+ * @param fen FEN board state
+ */
+void set_restored_fen(Game* game, char* fen)
+{
+    free(game->fenBoardState);
+    game->fenBoardState = strdup(fen);
+    game->turn = next_player_from_fen_string(fen) == 'w' ? COLOUR_WHITE
+                                                         : COLOUR_BLACK;
+}
+
+/**
+ * @brief Apply a move record ("uci fen san", fen "-" if left out) to a game
+ * being restored
+ *
+ * @param game game being restored
+ * @param payload move record payload
+ */
+void replay_move(Game* game, char* payload)
+{
+    char* fen = strchr(payload, ' ');
+    char* san = strrchr(payload, ' ');
+    if (!fen || san == fen) {
+        return; // not a move record we understand
+    }
+    *fen++ = '\0';
+    *san++ = '\0';
+    add_move(game, payload, san);
+    if (strcmp(fen, "-")) {
+        set_restored_fen(game, fen);
+    }
+}
+
+/**
+ * @brief Hold a restored game's human seat for the player whose session token
+ * a seat record gives
+ *
+ * @param game game being restored
+ * @param seat seat given as the record's flags
+ * @param payload seat record payload
+ */
+void replay_seat(Game* game, uint8_t seat, char* payload)
+{
+    char* ratingStr;
+    unsigned long token = strtoul(payload, &ratingStr, sessionTokenBase);
+    int rating;
+    if (seat >= numPlayers || !game->humanSeats[seat]
+            || sscanf(ratingStr, "%d", &rating) != 1) {
+        return; // not a seat record we understand
+    }
+    game->held[seat].token = token;
+    game->held[seat].rating = rating;
+}
+
+/**
+ * @brief Apply one journal record to the game array when restoring games. Each
+ * game goes back in the same slot of the array it was journalled from.
+ *
+ * @param type kind of record
+ * @param slot game array index of the record's game
+ * @param gameId id of the record's game
+ * @param flags bit i set if seat i is played by a human (start records), or
+ * the seat (seat records)
+ * @param payload record payload
+ * @param data Resources* - shared thread resources
+ */
+void replay_record(JournalRecordType type, uint32_t slot, uint32_t gameId,
+        uint8_t flags, char* payload, void* data)
+{
+    Resources* resources = (Resources*)data;
+    if (slot >= (uint32_t)maxBufferSize) {
+        return;
+    }
+    Game* game = &resources->games[slot];
+    while (gameId >= resources->nextGameId) {
+        resources->nextGameId += resources->shards->numShards;
+    }
+    if (type == JOURNAL_START) {
+        initialise_game(game, resources);
+        game->id = gameId;
+        set_restored_fen(game, payload);
+        free(game->startFen);
+        game->startFen = strdup(payload);
+        start_position(game, payload);
+        for (int i = 0; i < numPlayers; i++) {
+            game->players[i] = NULL; // nobody seated until they resume
+            game->humanSeats[i] = flags & (1 << i);
+            game->held[i].token = 0; // until a seat record gives it
+        }
+        game->level = flags >> numPlayers;
+        if (game->level > numEngineLevels) {
+            game->level = 0;
+        }
+    } else if (!game->assigned || game->id != gameId) {
+        return; // record for a game we don't know about
+    } else if (type == JOURNAL_MOVE) {
+        replay_move(game, payload);
+    } else if (type == JOURNAL_SEAT) {
+        replay_seat(game, flags, payload);
+    } else {
+        release_game(game);
+    }
+}
+
+/**
+ * @brief Hold a restored game's human seats for their players to resume, as if
+ * they had just dropped out. A player with no session token could never
+ * resume, so resigns.
+ *
+ * @param game game restored
+ */
+void hold_restored_seats(Game* game)
+{
+    Resources* resources = game->resources;
+    for (int seat = 0; seat < numPlayers && game->assigned; seat++) {
+        HeldSeat* held = &game->held[seat];
+        if (!game->humanSeats[seat]) {
             continue;
         }
+        if (!held->token) {
+            end_game_won_by(game, (Colour)!seat, RESIGNATION);
+        } else if (resources->graceTimers) {
+            held->deadline = monotonic_seconds() + resources->graceSeconds;
+            timer_start(resources->graceTimers, &held->timer,
+                    (unsigned long)resources->graceSeconds);
+        }
+    }
+}
 
-        // Create a thread to deal with client
-        ThreadData* threadData = (ThreadData*)malloc(sizeof(ThreadData));
-        threadData->acceptedSocketFd = fd;
-        threadData->resources = resources;
-        pthread_t threadID;
-        pthread_create(&threadID, NULL, client_thread, threadData);
-        pthread_detach(threadID);
+/**
+ * @brief Restore games in progress from the journal, then replace the journal
+ * with a compacted one (each restored game's start record and moves, with
+ * only the latest FEN) and record new games in it.
+ *
+ * @param resources shared thread resources, journal not set yet
+ * @param path journal file
+ */
+void restore_games(Resources* resources, char* path)
+{
+    journal_replay(path, replay_record, resources);
+    for (long i = 0; i < maxBufferSize; i++) {
+        if (resources->games[i].assigned) {
+            hold_restored_seats(&resources->games[i]);
+        }
     }
+    resources->journalPath = strdup(path);
+    if (compact_journal(resources) == -1) {
+        warn_cant_open_journal(path);
+    }
+}
 
-    sem_destroy(dataSemaphore);
-    free(dataSemaphore);
+/**
+ * @brief Enter loop of accepting connections and reading from them
+ *
+ * @param fdServer server socket fd
+ * @param resources shared thread resources
+ * @param net network backend to use and its settings
+ */
+void process_connections(int fdServer, Resources* resources, NetOptions* net)
+{
+    ignore_sig_pipe();
+    NetHandlers handlers = {.opened = connection_opened,
+            .line = connection_line,
+            .closed = connection_closed,
+            .data = resources};
+    net_serve(fdServer, net, &handlers);
+    // Only returns if the backend couldn't be started
+    warn_cant_start_network();
 }
 
 /**
@@ -1114,38 +4282,26 @@ void warn_cant_start_comms(void)
  * @param msg msg to engine, don't add newline
  * @param response msg expected from engine, don't add newline
  * @param toEngineStream stream to engine's stdin
- * @param fromEngineStream stream from engine's stdout
+ * @param fromEngine engine's stdout
  */
 void send_wait(
-        char* msg, char* response, FILE* toEngineStream, FILE* fromEngineStream)
+        char* msg, char* response, FILE* toEngineStream, UciReader* fromEngine)
 {
     if (fprintf(toEngineStream, "%s\n", msg) < 0
-            || fflush(toEngineStream) == EOF) {
+            || fflush(toEngineStream) == EOF
+            || uci_wait_for(fromEngine, response) == -1) {
         wait(NULL);
         warn_cant_start_comms();
     }
-    char buffer[maxBufferSize];
-    char* readResult;
-    while (1) {
-        readResult = fgets(buffer, maxBufferSize, fromEngineStream);
-        if (readResult == NULL || remove_newline(buffer) == -1) {
-            // EOF reading from engine
-            wait(NULL);
-            warn_cant_start_comms();
-        }
-        if (!strcmp(buffer, response)) {
-            break;
-        }
-    }
 }
 
 /**
  * @brief Starts engine (stockfish), get r/w streams
  *
- * @param toEngineStream put the write to engine stream here
- * @param fromEngineStream put the read from engine stream here
+ * @param engine put the engine's streams here, it searches with goSearch
+ * @param cores cores to run the engine on, NULL for wherever this thread runs
  */
-void start_engine(FILE** toEngineStream, FILE** fromEngineStream)
+void start_engine(Engine* engine, const cpu_set_t* cores)
 {
     int serverToEnginePipe[2];
     int engineToServerPipe[2];
@@ -1160,35 +4316,619 @@ void start_engine(FILE** toEngineStream, FILE** fromEngineStream)
         close(serverToEnginePipe[0]);
         dup2(engineToServerPipe[1], STDOUT_FILENO);
         close(engineToServerPipe[1]);
+        if (cores) {
+            sched_setaffinity(0, sizeof(cpu_set_t), cores);
+        }
         execlp("stockfish", "stockfish", NULL);
     }
     // Parent - server
     close(serverToEnginePipe[0]);
     close(engineToServerPipe[1]);
-    *toEngineStream = fdopen(serverToEnginePipe[1], "w");
-    *fromEngineStream = fdopen(engineToServerPipe[0], "r");
-    send_wait((char*)"isready", (char*)"readyok", *toEngineStream,
-            *fromEngineStream);
-    send_wait((char*)"uci", (char*)"uciok", *toEngineStream, *fromEngineStream);
+    engine->toEngineStream = fdopen(serverToEnginePipe[1], "w");
+    engine->fromEngine = uci_reader_create(engineToServerPipe[0]);
+    engine->goCmd = goSearch;
+    engine->budget = NULL;
+    engine->budgetGeneration = 0;
+    send_wait((char*)"isready", (char*)"readyok", engine->toEngineStream,
+            engine->fromEngine);
+    send_wait((char*)"uci", (char*)"uciok", engine->toEngineStream,
+            engine->fromEngine);
 }
 
-int main(int argc, char* argv[])
+/**
+ * @brief Set up the engine budget every shard's engines share, if one was
+ * given
+ *
+ * @param args command-line arguments
+ * @param shards every shard
+ * @param processes true if each shard is a prefork worker process
+ * @return 0 if set up (or not needed), -1 if shared memory couldn't be
+ * allocated
+ */
+int create_engine_budget(Args* args, Shards* shards, bool processes)
 {
-    Args args = get_args(argc, argv);
+    if (!args->engineMemoryMb && !args->engineThreads) {
+        return 0;
+    }
+    shards->budget = budget_create(args->engineMemoryMb, args->engineThreads,
+            shards->numShards * enginesPerShard + args->selfPlayGames,
+            processes);
+    return shards->budget ? 0 : -1;
+}
+
+/**
+ * @brief Set up the shards' shared state, before any shard is started
+ *
+ * @param numShards number of shards
+ * @param processes true if each shard is a prefork worker process, so the
+ * waiting counts must be in shared memory
+ * @return the shards, or NULL if shared memory couldn't be allocated
+ */
+Shards* create_shards(int numShards, bool processes)
+{
+    Shards* shards = (Shards*)malloc(sizeof(Shards));
+    shards->numShards = numShards;
+    shards->shards = (Resources**)calloc(numShards, sizeof(Resources*));
+    shards->peers = NULL;
+    shards->budget = NULL;
+    shards->lineTickets = 0;
+    size_t waitingSize = numShards * numColours * sizeof(long);
+    if (!processes) {
+        shards->waitingLock = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(shards->waitingLock, NULL);
+        shards->waiting = (long*)calloc(1, waitingSize);
+        return shards;
+    }
+    char* memory = (char*)shared_alloc(sizeof(pthread_mutex_t) + waitingSize);
+    if (!memory) {
+        return NULL;
+    }
+    shards->waitingLock = (pthread_mutex_t*)memory;
+    shared_mutex_init(shards->waitingLock);
+    shards->waiting = (long*)(memory + sizeof(pthread_mutex_t));
+    return shards;
+}
+
+/**
+ * @brief Open every shard's listening socket, all on the same port. Exits if
+ * any can't listen.
+ *
+ * @param args command-line arguments
+ * @param numShards number of shards
+ * @param listenFds write each shard's listening socket here
+ * @return the port listened on
+ */
+uint16_t open_listeners(Args* args, int numShards, int* listenFds)
+{
+    uint16_t portNum;
+    char boundPort[smallerBufferSize];
+    for (int i = 0; i < numShards; i++) {
+        // Later shards listen on the port the first got (it may be ephemeral)
+        if (open_listen(i == 0 ? args->portFromCmdLine : boundPort,
+                    numShards > 1, args->backlog, &listenFds[i], &portNum)
+                == -1) {
+            warn_cant_start_listening(args->portFromCmdLine);
+        }
+        snprintf(boundPort, smallerBufferSize, "%u", portNum);
+    }
+    return portNum;
+}
+
+/**
+ * @brief Pin the calling thread to a core. Threads and processes it starts
+ * afterwards (workers, engine, connection threads) are pinned there too.
+ *
+ * @param index core to use, wrapping around if there aren't that many
+ */
+void pin_to_core(int index)
+{
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(index % pool_num_cores(), &cores);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cores);
+}
+
+/**
+ * @brief Pin the calling thread to where a shard's server threads run: the
+ * shard's share of the server cores if placement was asked for, else its own
+ * core if shards were asked for. Threads it starts afterwards run there too.
+ *
+ * @param args command-line arguments
+ * @param numShards number of shards
+ * @param index which shard
+ */
+void place_shard_thread(Args* args, int numShards, int index)
+{
+    if (args->placeCores) {
+        Placement placement;
+        placement_for_shard(&args->engineCores, &args->serverCores, index,
+                numShards, &placement);
+        pthread_setaffinity_np(
+                pthread_self(), sizeof(cpu_set_t), &placement.serverCores);
+    } else if (args->numShards) {
+        pin_to_core(index);
+    }
+}
+
+/**
+ * @brief Start a shard: its engine and workers, and its games restored from
+ * its own journal (the journal file given, with ".<shard>" added if there is
+ * more than one shard)
+ *
+ * @param args command-line arguments
+ * @param shards every shard
+ * @param index which shard to start
+ * @return the shard's resources
+ */
+Resources* start_shard(Args* args, Shards* shards, int index)
+{
+    cpu_set_t* engineCores = NULL;
+    if (args->placeCores) {
+        Placement placement;
+        placement_for_shard(&args->engineCores, &args->serverCores, index,
+                shards->numShards, &placement);
+        engineCores = (cpu_set_t*)malloc(sizeof(cpu_set_t));
+        *engineCores = placement.engineCores;
+    }
+    Engine engine;
+    start_engine(&engine, engineCores);
+    Resources* resources = init_resources(&engine, shards, index);
+    resources->engineCores = engineCores;
+    join_engine_budget(&resources->engine, fullStrengthWeight, resources);
+    resources->outboxOptions = &args->outbox;
+    // One wheel times idle timeouts, held seats and the match window
+    TimerWheel* timers = timer_wheel_create(idleTickMs);
+    resources->idleTimers = args->idleSeconds ? timers : NULL;
+    resources->idleSeconds = args->idleSeconds;
+    resources->graceTimers = args->graceSeconds ? timers : NULL;
+    resources->graceSeconds = args->graceSeconds;
+    timer_start(timers, &resources->matchTimer,
+            (unsigned long)matchWideningSeconds);
+    if (args->journalFile) {
+        char path[strlen(args->journalFile) + smallerBufferSize];
+        if (shards->numShards > 1) {
+            sprintf(path, "%s.%d", args->journalFile, index);
+        } else {
+            strcpy(path, args->journalFile);
+        }
+        restore_games(resources, path);
+    }
+    return resources;
+}
+
+// A shard's listening socket, served by its own thread
+typedef struct ShardThreadData {
     int listenFd;
+    Resources* resources;
+    NetOptions* net;
+} ShardThreadData;
+
+/**
+ * @brief Thread accepting and reading a shard's connections
+ *
+ * @param data ShardThreadData* - the shard to serve
+ * @return unused, never returns
+ */
+void* shard_thread(void* data)
+{
+    ShardThreadData* shard = (ShardThreadData*)data;
+    process_connections(shard->listenFd, shard->resources, shard->net);
+    return NULL;
+}
+
+/**
+ * @brief Serve every shard's connections, each shard on its own thread (the
+ * last on this one), pinned to its own core if shards were asked for
+ *
+ * @param args command-line arguments
+ * @param shards every shard
+ * @param listenFds each shard's listening socket
+ */
+void serve_shards(Args* args, Shards* shards, int* listenFds)
+{
+    int last = shards->numShards - 1;
+    for (int i = 0; i < last; i++) {
+        place_shard_thread(args, shards->numShards, i);
+        ShardThreadData* shard
+                = (ShardThreadData*)malloc(sizeof(ShardThreadData));
+        shard->listenFd = listenFds[i];
+        shard->resources = shards->shards[i];
+        shard->net = &args->net;
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, shard_thread, shard);
+        pthread_detach(threadId);
+    }
+    place_shard_thread(args, shards->numShards, last);
+    process_connections(listenFds[last], shards->shards[last], &args->net);
+}
+
+/**
+ * @brief Raise the open file limit as far as allowed, as each connection uses
+ * two descriptors (reading and sending)
+ */
+void raise_file_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * @brief In low memory mode, print how much memory each idle connection uses
+ * (not counting the kernel's socket buffers)
+ *
+ * @param args command-line arguments
+ */
+void report_connection_footprint(Args* args)
+{
+    if (!args->lowMemory) {
+        return;
+    }
+    size_t footprint = sizeof(Connection) + sizeof(Client*)
+            + strand_footprint() + outbox_footprint(&args->outbox)
+            + net_connection_footprint(&args->net);
+    fprintf(stderr, "uqchessserver: %zu bytes per idle connection\n",
+            footprint);
+    fflush(stderr);
+}
+
+/**
+ * @brief If placement was asked for, print where each shard's engines and
+ * server threads run
+ *
+ * @param args command-line arguments
+ * @param numShards number of shards
+ */
+void report_placement(Args* args, int numShards)
+{
+    if (!args->placeCores) {
+        return;
+    }
+    for (int i = 0; i < numShards; i++) {
+        Placement placement;
+        placement_for_shard(&args->engineCores, &args->serverCores, i,
+                numShards, &placement);
+        char serverCores[maxBufferSize];
+        char engineCores[maxBufferSize];
+        placement_format(serverCores, maxBufferSize, &placement.serverCores);
+        placement_format(engineCores, maxBufferSize, &placement.engineCores);
+        fprintf(stderr,
+                "uqchessserver: shard %d: server cores %s, engine cores %s",
+                i, serverCores, engineCores);
+        if (placement.node >= 0) {
+            fprintf(stderr, ", node %d", placement.node);
+        }
+        fprintf(stderr, "\n");
+    }
+    fflush(stderr);
+}
+
+// State of the prefork master process
+typedef struct Master {
+    Args* args;
     uint16_t portNum;
-    if (open_listen(args.portFromCmdLine, &listenFd, &portNum) == -1) {
-        warn_cant_start_listening(args.portFromCmdLine);
+    Shards* shards;
+    Prefork* prefork;
+} Master;
+
+/**
+ * @brief Prefork callback once every worker has started: prints the port (and
+ * in low memory mode, the memory per connection)
+ *
+ * @param data Master* - master state
+ */
+void workers_started(void* data)
+{
+    Master* master = (Master*)data;
+    fprintf(stderr, "%u\n", master->portNum);
+    fflush(stderr);
+    report_connection_footprint(master->args);
+    report_placement(master->args, master->args->numWorkers);
+}
+
+/**
+ * @brief Prefork callback before a worker that exited is restarted. Its
+ * clients are gone, so none of them are waiting for an opponent any more, and
+ * other workers drop connections handed to or from it.
+ *
+ * @param worker worker being restarted
+ * @param data Master* - master state
+ */
+void worker_restarting(int worker, void* data)
+{
+    Master* master = (Master*)data;
+    Shards* shards = master->shards;
+    fprintf(stderr, "uqchessserver: worker %d exited, restarting\n", worker);
+    fflush(stderr);
+    shared_mutex_lock(shards->waitingLock);
+    memset(&shards->waiting[worker * numColours], 0,
+            numColours * sizeof(long));
+    pthread_mutex_unlock(shards->waitingLock);
+    if (shards->budget) {
+        budget_clear_shard(shards->budget, worker); // its engines are gone
+    }
+    PeerMessage restarted = {.type = PEER_RESTARTED,
+            .from = worker,
+            .id = 0,
+            .tag = untaggedGame};
+    for (int i = 0; i < shards->numShards; i++) {
+        if (i != worker) {
+            prefork_send(master->prefork, i, &restarted, sizeof(PeerMessage));
+        }
+    }
+}
+
+/**
+ * @brief Run a prefork worker process: start its shard (restoring its games
+ * from its journal) and serve connections from the shared listening socket
+ *
+ * @param args command-line arguments
+ * @param shards every shard, this worker's isn't started yet
+ * @param prefork prefork state
+ * @param listenFd listening socket
+ * @param worker which worker this is
+ */
+void run_worker(Args* args, Shards* shards, Prefork* prefork, int listenFd,
+        int worker)
+{
+    place_shard_thread(args, shards->numShards, worker);
+    Resources* resources = start_shard(args, shards, worker);
+    shards->shards[worker] = resources;
+    if (args->archivePrefix) {
+        // Each worker has its own archive files
+        char* prefix = (char*)malloc(
+                strlen(args->archivePrefix) + smallerBufferSize);
+        sprintf(prefix, "%s.%d", args->archivePrefix, worker);
+        resources->archive = archive_open(prefix);
+        if (!resources->archive) {
+            warn_cant_open_archive(prefix);
+        }
+    }
+    if (args->selfPlayGames) {
+        resources->selfPlayOutput = archive_stream(stdout);
+    }
+    start_self_play(args->selfPlayGames, resources);
+    shards->peers = create_peers(prefork, resources);
+    prefork_ready(prefork);
+    process_connections(listenFd, resources, &args->net);
+}
+
+/**
+ * @brief Run in prefork mode: the master process forks the workers, sharing
+ * one listening socket, and restarts any that exit
+ *
+ * @param args command-line arguments
+ */
+void run_prefork(Args* args)
+{
+    int listenFd;
+    Master master;
+    master.args = args;
+    master.portNum = open_listeners(args, 1, &listenFd);
+    master.shards = create_shards(args->numWorkers, true);
+    Prefork* prefork = prefork_create(args->numWorkers);
+    if (!master.shards || !prefork
+            || create_engine_budget(args, master.shards, true) == -1) {
+        warn_cant_start_workers();
+    }
+    master.prefork = prefork;
+    PreforkHandlers handlers = {.started = workers_started,
+            .restarting = worker_restarting,
+            .data = &master};
+    int worker = prefork_run(prefork, &handlers);
+    run_worker(args, master.shards, prefork, listenFd, worker);
+}
+
+/**
+ * @brief Work out a move's SAN, the notation EPD gives best moves in, with
+ * the engine already in the position the move is made from
+ *
+ * @param san write the SAN here (sanMoveSize chars)
+ * @param fen FEN of the position
+ * @param move move in UCI notation
+ * @param engine engine in the position
+ */
+void engine_move_san(char* san, char* fen, const char* move, Engine* engine)
+{
+    UciMoves moves;
+    legal_moves(&moves, engine);
+    char engineCmd[maxBufferSize];
+    snprintf(engineCmd, maxBufferSize, "position fen %s moves %s\nd\n", fen,
+            move);
+    UciPosition position;
+    if (try_to_write(engine->toEngineStream, engineCmd) == -1
+            || uci_read_position(engine->fromEngine, &position) == -1) {
+        engine_failure();
+    }
+    UciMoves nextMoves;
+    legal_moves(&nextMoves, engine);
+    uci_to_san(san, fen, move, &moves, position.inCheck,
+            position.inCheck && nextMoves.numMoves == 0);
+}
+
+/**
+ * @brief Split an EPD line (or a FEN line) into its position and operations
+ *
+ * @param line line to split
+ * @param epd write the position's four EPD fields here (uciFenSize chars)
+ * @param fen write the position as a full FEN here (uciFenSize chars)
+ * @return the operations after the position, NULL if the line doesn't start
+ * with a position
+ */
+const char* split_epd(const char* line, char* epd, char* fen)
+{
+    char board[uciFenSize];
+    char side[uciFenSize];
+    char castling[uciFenSize];
+    char enPassant[uciFenSize];
+    int consumed = 0;
+    if (sscanf(line, "%127s %127s %127s %127s%n", board, side, castling,
+                enPassant, &consumed)
+                    != 4
+            || (strcmp(side, "w") && strcmp(side, "b"))) {
+        return NULL;
+    }
+    int slashes = 0;
+    for (const char* c = board; *c; c++) {
+        slashes += *c == '/';
+    }
+    if (slashes != 7) {
+        return NULL;
+    }
+    // A FEN line has move counters, EPD has operations (or nothing)
+    int halfMoves = 0;
+    int fullMoves = 1;
+    int counted = 0;
+    const char* ops = line + consumed;
+    if (sscanf(ops, " %d %d%n", &halfMoves, &fullMoves, &counted) == 2
+            && (ops[counted] == '\0' || isspace((unsigned char)ops[counted]))) {
+        ops += counted;
+    }
+    if (snprintf(epd, uciFenSize, "%s %s %s %s", board, side, castling,
+                enPassant)
+                    >= uciFenSize
+            || snprintf(fen, uciFenSize, "%s %d %d", epd, halfMoves, fullMoves)
+                    >= uciFenSize) {
+        return NULL; // too long to be a position
+    }
+    return ops;
+}
+
+/**
+ * @brief Batch function finding the best move of a position: writes the
+ * position as EPD with a "bm" operation giving the move, followed by the
+ * line's other operations. Lines that aren't positions (blank lines,
+ * comments) and positions with no moves are copied as they are.
+ *
+ * @param line EPD or FEN line
+ * @param result write the line to output here (batchLineSize chars)
+ * @param worker Engine* - the worker's engine
+ */
+void analyse_position(const char* line, char* result, void* worker)
+{
+    Engine* engine = (Engine*)worker;
+    char epd[uciFenSize];
+    char fen[uciFenSize];
+    const char* ops = split_epd(line, epd, fen);
+    UciSearch search;
+    if (ops) {
+        engine_search(&search, fen, 1, engine);
+    }
+    if (!ops || !search.bestMove[0]) {
+        snprintf(result, batchLineSize, "%s", line);
+        return;
+    }
+    char san[sanMoveSize];
+    engine_move_san(san, fen, search.bestMove, engine);
+    int len = snprintf(result, batchLineSize, "%s bm %s;", epd, san);
+    // Keep the other operations, replacing any best move given
+    char* copy = strdup(ops);
+    char* save = NULL;
+    for (char* op = strtok_r(copy, ";", &save); op && len < batchLineSize;
+            op = strtok_r(NULL, ";", &save)) {
+        op += strspn(op, " \t");
+        if (*op && strncmp(op, "bm ", strlen("bm "))) {
+            len += snprintf(result + len, batchLineSize - len, " %s;", op);
+        }
+    }
+    free(copy);
+}
+
+/**
+ * @brief Run in analysis mode: find the best move of every position in the
+ * --analyse file, with one engine per shard (or per core if --shards isn't
+ * given), writing them to the --out file. Exits when done.
+ *
+ * @param args command-line arguments
+ */
+void run_analysis(Args* args)
+{
+    ignore_sig_pipe();
+    int numEngines = args->numShards ? args->numShards : pool_num_cores();
+    EngineBudget* budget = NULL;
+    if (args->engineMemoryMb || args->engineThreads) {
+        budget = budget_create(
+                args->engineMemoryMb, args->engineThreads, numEngines, false);
+    }
+    Engine* engines = (Engine*)malloc(numEngines * sizeof(Engine));
+    void* workers[numEngines];
+    for (int i = 0; i < numEngines; i++) {
+        Placement placement;
+        if (args->placeCores) {
+            placement_for_shard(&args->engineCores, &args->serverCores, i,
+                    numEngines, &placement);
+        }
+        start_engine(&engines[i],
+                args->placeCores ? &placement.engineCores : NULL);
+        engines[i].budget = budget;
+        if (budget) {
+            engines[i].budgetEngine = budget_add(budget, 0, fullStrengthWeight);
+        }
+        workers[i] = &engines[i];
     }
+    if (budget && budget_check_overcommit(budget)) {
+        warn_engines_overcommitted();
+    }
+    BatchStatus status = batch_run(args->analyseFile, args->analyseOut,
+            analyse_position, workers, numEngines, stderr);
+    if (status == BATCH_CANT_READ) {
+        warn_cant_open_analysis(args->analyseFile);
+    } else if (status == BATCH_CANT_WRITE) {
+        warn_cant_open_analysis(args->analyseOut);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char* argv[])
+{
+    Args args = get_args(argc, argv);
+    if (args.analyseFile) {
+        run_analysis(&args);
+    }
+    if (args.lowMemory) {
+        raise_file_limit();
+    }
+    if (args.numWorkers) {
+        run_prefork(&args);
+    }
+    int numShards = args.numShards ? args.numShards : 1;
+    int listenFds[numShards];
+    uint16_t portNum = open_listeners(&args, numShards, listenFds);
 
-    FILE* toEngineStream = NULL;
-    FILE* fromEngineStream = NULL;
-    start_engine(&toEngineStream, &fromEngineStream);
+    Shards* shards = create_shards(numShards, false);
+    create_engine_budget(&args, shards, false);
+    for (int i = 0; i < numShards; i++) {
+        // So the shard's engine and workers are pinned
+        place_shard_thread(&args, numShards, i);
+        shards->shards[i] = start_shard(&args, shards, i);
+    }
+    if (args.archivePrefix) {
+        // One archive for every shard
+        Archive* archive = archive_open(args.archivePrefix);
+        if (!archive) {
+            warn_cant_open_archive(args.archivePrefix);
+        }
+        for (int i = 0; i < numShards; i++) {
+            shards->shards[i]->archive = archive;
+        }
+    }
+    // One writer for every shard's self-play games
+    Archive* selfPlayOutput
+            = args.selfPlayGames ? archive_stream(stdout) : NULL;
+    for (int i = 0; i < numShards; i++) {
+        shards->shards[i]->selfPlayOutput = selfPlayOutput;
+        start_self_play(args.selfPlayGames, shards->shards[i]);
+    }
 
     fprintf(stderr, "%u\n", portNum);
     fflush(stderr);
+    report_connection_footprint(&args);
+    report_placement(&args, numShards);
 
-    process_connections(listenFd, toEngineStream, fromEngineStream);
+    serve_shards(&args, shards, listenFds);
 
     return 0;
-}
\ No newline at end of file
+}